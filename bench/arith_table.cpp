@@ -0,0 +1,259 @@
+// Table driven check of the arithmetic. Every row is an operator with two constant operands,
+// put into programs that exercise constant folding, constant propagation, branch pruning and,
+// with a variable operand, the strength reduced multiplications and the shift and magic number
+// divisions of the register allocating generator. Each program is compiled with and without the
+// optimizer, run through the register allocating and the stack machine backends, the SSA
+// backend and the bytecode interpreter, and its 64 bit exit value checked against a reference
+// evaluator. A row the evaluator says traps has to die of SIGFPE instead, which is checked in a
+// child process.
+//
+// Usage: helium_arith_table [--verbose]
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../src/optimization.hpp"
+#include "../src/resolve.hpp"
+#include "../src/generation.hpp"
+#include "../src/ir_passes.hpp"
+#include "../src/ir_generation.hpp"
+#include "../src/peephole.hpp"
+#include "../src/assembler.hpp"
+#include "../src/jit.hpp"
+#include "../src/bytecode.hpp"
+#include "../src/interpreter.hpp"
+#include "../src/stats.hpp"
+
+namespace {
+
+    constexpr int64_t min = std::numeric_limits<int64_t>::min();
+    constexpr int64_t max = std::numeric_limits<int64_t>::max();
+
+    struct Row {
+        std::string op;
+        int64_t lhs;
+        int64_t rhs;
+    };
+
+    // The value of lhs op rhs as the language defines it, wrapping on overflow, or nothing if it
+    // traps
+    std::optional<int64_t> reference(const Row& row) {
+        const auto a = static_cast<uint64_t>(row.lhs);
+        const auto b = static_cast<uint64_t>(row.rhs);
+        if (row.op == "+") {
+            return static_cast<int64_t>(a + b);
+        }
+        if (row.op == "-") {
+            return static_cast<int64_t>(a - b);
+        }
+        if (row.op == "*") {
+            return static_cast<int64_t>(a * b);
+        }
+        if (row.op == "/") {
+            if (row.rhs == 0 || (row.lhs == min && row.rhs == -1)) {
+                return {};
+            }
+            return row.lhs / row.rhs;
+        }
+        if (row.op == "==") {
+            return row.lhs == row.rhs;
+        }
+        if (row.op == "!=") {
+            return row.lhs != row.rhs;
+        }
+        if (row.op == "<") {
+            return row.lhs < row.rhs;
+        }
+        if (row.op == "<=") {
+            return row.lhs <= row.rhs;
+        }
+        if (row.op == ">") {
+            return row.lhs > row.rhs;
+        }
+        return row.lhs >= row.rhs;
+    }
+
+    // The language has no negative literals
+    std::string literal(const int64_t value) {
+        if (value == min) {
+            return "(0 - 9223372036854775807 - 1)";
+        }
+        if (value < 0) {
+            return "(0 - " + std::to_string(-value) + ")";
+        }
+        return std::to_string(value);
+    }
+
+    struct Program {
+        std::string shape;
+        std::string src;
+        // the exit value, nothing if it traps
+        std::optional<int64_t> expected;
+    };
+
+    // The programs for a row. With the optimizer, the first three fold to a constant; without it
+    // the last two are the only place the generators see a variable and a constant operand.
+    std::vector<Program> programs(const Row& row) {
+        const std::optional<int64_t> value = reference(row);
+        const std::string lhs = literal(row.lhs);
+        const std::string rhs = literal(row.rhs);
+        std::optional<int64_t> taken;
+        if (value.has_value()) {
+            taken = value.value() != 0 ? 1 : 2;
+        }
+        return {
+            { "fold", "exit(" + lhs + " " + row.op + " " + rhs + ");\n", value },
+            { "propagate", "var a = " + lhs + ";\nvar b = " + rhs + ";\nvar c = a " + row.op + " b;\nexit(c);\n", value },
+            { "prune", "var a = " + lhs + ";\nvar r = 0;\nif (a " + row.op + " " + rhs + ") {\n    r = 1;\n} else {\n    r = 2;\n}\nexit(r);\n", taken },
+            { "const_rhs", "var x = " + lhs + ";\nexit(x " + row.op + " " + rhs + ");\n", value },
+            { "const_lhs", "var y = " + rhs + ";\nexit(" + lhs + " " + row.op + " y);\n", value },
+        };
+    }
+
+    enum class Backend {
+        registers,
+        stack_machine,
+        ssa,
+        bytecode,
+    };
+
+    const char* to_string(const Backend backend) {
+        switch (backend) {
+            case Backend::registers:
+                return "registers";
+            case Backend::stack_machine:
+                return "stack-machine";
+            case Backend::ssa:
+                return "ssa";
+            default:
+                return "bytecode";
+        }
+    }
+
+    // Compiles and runs the program the way the driver does for --run and --interpret
+    int64_t run(const std::string& src, const bool optimize, const Backend backend) {
+        ArenaAllocator arena;
+        Tokenizer tokenizer(src);
+        Parser parser(tokenizer.tokenize(), arena);
+        std::optional<NodeProg> prog = parser.parse_prog();
+        if (optimize) {
+            Optimizer optimizer(prog.value(), arena, tokenizer.symbols());
+            optimizer.optimize_prog();
+        }
+        Resolver resolver(prog.value());
+        const FlatAst ast = resolver.resolve_prog();
+        if (backend == Backend::bytecode) {
+            BytecodeGenerator generator(ast);
+            Interpreter interpreter(generator.gen_prog());
+            return interpreter.run();
+        }
+        std::vector<Instr> instrs;
+        if (backend == Backend::ssa) {
+            IrBuilder builder(ast);
+            IrProgram ir = builder.build();
+            CompileStats stats("arith_table");
+            PassManager pass_manager(stats, {}, optimize ? std::span<const IrPass>(default_ir_passes) : std::span<const IrPass>());
+            pass_manager.run(ir);
+            IrGenerator generator(ir, true);
+            instrs = generator.gen_prog();
+        } else {
+            Generator generator(ast, backend == Backend::stack_machine, true);
+            instrs = generator.gen_prog();
+        }
+        if (optimize) {
+            Peephole peephole;
+            instrs = peephole.run(instrs);
+        }
+        Assembler assembler(instrs);
+        return run_jit(assembler.assemble());
+    }
+
+    // Runs the program in a child, which is expected to die of SIGFPE
+    bool traps(const std::string& src, const bool optimize, const Backend backend) {
+        std::fflush(stdout);
+        const pid_t pid = fork();
+        if (pid == 0) {
+            static_cast<void>(run(src, optimize, backend));
+            _exit(EXIT_SUCCESS);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return WIFSIGNALED(status) && WTERMSIG(status) == SIGFPE;
+    }
+
+    std::vector<Row> make_table() {
+        std::vector<Row> table;
+        // products by the constants the generator strength reduces: 0, -1, powers of two and
+        // 3, 5 or 9 times one, and a few it does not
+        const std::vector<int64_t> factors { 0, 1, -1, 2, 3, 5, 9, 10, 12, 24, 40, 72, 7, -8, 1LL << 40, max, min };
+        const std::vector<int64_t> multiplicands { 0, 1, -1, 13, -13, 1000003, -99999, max, min };
+        for (const int64_t factor : factors) {
+            for (const int64_t x : multiplicands) {
+                table.push_back({ "*", x, factor });
+            }
+        }
+        // quotients by powers of two, whose shift needs a bias for negative dividends, and by
+        // divisors with magic numbers of both signs and with and without the add/sub fixup
+        const std::vector<int64_t> divisors { 1, -1, 2, -2, 3, -3, 5, 6, 7, -7, 10, 16, -16, 641, 1000, 1LL << 62, max, min, 0 };
+        const std::vector<int64_t> dividends { 0, 1, -1, 6, -6, 7, -7, 15, -15, 17, -17, 999999, -999999, max, min, min + 1 };
+        for (const int64_t divisor : divisors) {
+            for (const int64_t x : dividends) {
+                table.push_back({ "/", x, divisor });
+            }
+        }
+        // wrapping sums and differences, and comparisons around the extremes
+        const std::vector<int64_t> operands { 0, 1, -1, 42, max, min };
+        for (const std::string op : { "+", "-", "==", "!=", "<", "<=", ">", ">=" }) {
+            for (const int64_t lhs : operands) {
+                for (const int64_t rhs : operands) {
+                    table.push_back({ op, lhs, rhs });
+                }
+            }
+        }
+        return table;
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    const bool verbose = argc > 1 && std::string(argv[1]) == "--verbose";
+    size_t checks = 0;
+    size_t failures = 0;
+    for (const Row& row : make_table()) {
+        for (const Program& program : programs(row)) {
+            for (const bool optimize : { false, true }) {
+                for (const Backend backend : { Backend::registers, Backend::stack_machine, Backend::ssa, Backend::bytecode }) {
+                    checks++;
+                    bool passed;
+                    std::string got;
+                    if (program.expected.has_value()) {
+                        const int64_t value = run(program.src, optimize, backend);
+                        passed = value == program.expected.value();
+                        got = std::to_string(value);
+                    } else {
+                        passed = traps(program.src, optimize, backend);
+                        got = "no SIGFPE";
+                    }
+                    if (!passed || verbose) {
+                        std::printf("%-6s %s %s %s %-9s %-3s %-13s expected %s, got %s\n", passed ? "ok" : "FAILED",
+                                    literal(row.lhs).c_str(), row.op.c_str(), literal(row.rhs).c_str(),
+                                    program.shape.c_str(), optimize ? "-O1" : "-O0", to_string(backend),
+                                    program.expected.has_value() ? std::to_string(program.expected.value()).c_str() : "SIGFPE",
+                                    passed ? (program.expected.has_value() ? got.c_str() : "SIGFPE") : got.c_str());
+                    }
+                    failures += passed ? 0 : 1;
+                }
+            }
+        }
+    }
+    std::printf("%zu checks, %zu failed\n", checks, failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,216 @@
+// Compiler throughput benchmark. Generates synthetic programs of growing size for a handful of
+// shapes and times Tokenizer::tokenize, Parser::parse_prog and Generator::gen_prog on each of
+// them separately. The scaling column compares the time per unit of input with the previous
+// size of the same workload: around 1.0 is linear, 2.0 means the time per unit doubled along
+// with the input, i.e. quadratic behaviour.
+//
+// Usage: helium_bench [--scale N] [--only <workload>] [--csv]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/resolve.hpp"
+#include "../src/generation.hpp"
+#include "../src/stats.hpp"
+
+namespace {
+
+    struct Workload {
+        std::string name;
+        // the sizes at scale 1, in the unit the generator counts
+        std::vector<size_t> sizes;
+        std::function<std::string(size_t)> generate;
+    };
+
+    // Many short statements over a few variables
+    std::string gen_statements(const size_t count) {
+        std::stringstream src;
+        src << "var a = 1;\nvar b = 2;\nvar c = 3;\n";
+        for (size_t i = 0; i < count; i++) {
+            switch (i % 3) {
+                case 0:
+                    src << "a = b + c * 3;\n";
+                    break;
+                case 1:
+                    src << "b = a - c / 2;\n";
+                    break;
+                default:
+                    src << "c = (a + b) * 2;\n";
+                    break;
+            }
+        }
+        src << "exit(a);\n";
+        return src.str();
+    }
+
+    // One expression with a very long +/* chain
+    std::string gen_chain(const size_t terms) {
+        std::stringstream src;
+        src << "var x = 3;\nvar y = x";
+        for (size_t i = 1; i < terms; i++) {
+            src << (i % 2 == 0 ? " + x" : " * 2");
+        }
+        src << ";\nexit(y);\n";
+        return src.str();
+    }
+
+    // Scopes nested inside each other, each declaring a variable
+    std::string gen_nesting(const size_t depth) {
+        std::stringstream src;
+        src << "var v = 0;\n";
+        for (size_t i = 0; i < depth; i++) {
+            src << "{ var n" << i << " = v + " << i << "; v = n" << i << ";\n";
+        }
+        for (size_t i = 0; i < depth; i++) {
+            src << "}\n";
+        }
+        src << "exit(v);\n";
+        return src.str();
+    }
+
+    // A single if with a long elif ladder
+    std::string gen_elif(const size_t arms) {
+        std::stringstream src;
+        src << "var x = 7;\nvar r = 0;\nif (x - 0) { r = 1; }\n";
+        for (size_t i = 1; i < arms; i++) {
+            src << "elif (x - " << i << ") { r = " << i << "; }\n";
+        }
+        src << "else { r = 2; }\nexit(r);\n";
+        return src.str();
+    }
+
+    // Thousands of live variables, each built from the ones before it
+    std::string gen_vars(const size_t count) {
+        std::stringstream src;
+        src << "var v0 = 1;\n";
+        for (size_t i = 1; i < count; i++) {
+            src << "var v" << i << " = v" << i - 1 << " + v" << i / 2 << ";\n";
+        }
+        src << "exit(v" << count - 1 << ");\n";
+        return src.str();
+    }
+
+    struct Result {
+        size_t size = 0;
+        size_t tokens = 0;
+        uint64_t nodes = 0;
+        size_t instructions = 0;
+        double tokenize_s = 0;
+        double parse_s = 0;
+        double generate_s = 0;
+    };
+
+    template <typename Fn>
+    double seconds(Fn&& fn) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    Result measure(const Workload& workload, const size_t size) {
+        Result result { .size = size };
+        const std::string src = workload.generate(size);
+
+        TokenList tokens;
+        result.tokenize_s = seconds([&] {
+            Tokenizer tokenizer(src);
+            tokens = tokenizer.tokenize();
+        });
+        result.tokens = tokens.size();
+
+        ArenaAllocator arena;
+        Parser parser(std::move(tokens), arena);
+        std::optional<NodeProg> prog;
+        result.parse_s = seconds([&] { prog = parser.parse_prog(); });
+
+        CompileStats stats(workload.name);
+        stats.count_ast(prog.value());
+        for (const auto& [name, value] : stats.counters()) {
+            result.nodes += value;
+        }
+
+        std::vector<Instr> instrs;
+        // name resolution is timed with generation, which did it before it became a pass
+        result.generate_s = seconds([&] {
+            Resolver resolver(prog.value());
+            const FlatAst ast = resolver.resolve_prog();
+            Generator generator(ast);
+            instrs = generator.gen_prog();
+        });
+        result.instructions = instrs.size();
+        return result;
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t scale = 1;
+    std::string only;
+    bool csv = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc) {
+            scale = std::stoul(argv[++i]);
+        } else if (arg == "--only" && i + 1 < argc) {
+            only = argv[++i];
+        } else if (arg == "--csv") {
+            csv = true;
+        } else {
+            std::cerr << "Usage: helium_bench [--scale N] [--only <workload>] [--csv]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const std::vector<Workload> workloads {
+        { "statements", { 125'000, 250'000, 500'000, 1'000'000 }, gen_statements },
+        { "chain", { 10'000, 20'000, 40'000, 80'000 }, gen_chain },
+        { "nesting", { 250, 500, 1'000, 2'000 }, gen_nesting },
+        { "elif", { 1'000, 2'000, 4'000, 8'000 }, gen_elif },
+        { "vars", { 1'000, 2'000, 4'000, 8'000 }, gen_vars },
+    };
+
+    if (csv) {
+        std::cout << "workload,size,tokens,nodes,instructions,tokenize_s,parse_s,generate_s\n";
+    } else {
+        std::printf("%-10s %9s %10s %10s %10s | %11s %6s | %11s %6s | %11s %6s\n", "workload", "size", "tokens", "nodes",
+                    "instrs", "tokens/s", "scale", "nodes/s", "scale", "instrs/s", "scale");
+    }
+    for (const Workload& workload : workloads) {
+        if (!only.empty() && workload.name != only) {
+            continue;
+        }
+        std::optional<Result> previous;
+        for (const size_t base_size : workload.sizes) {
+            const Result result = measure(workload, base_size * scale);
+            if (csv) {
+                std::cout << workload.name << "," << result.size << "," << result.tokens << "," << result.nodes << ","
+                          << result.instructions << "," << result.tokenize_s << "," << result.parse_s << ","
+                          << result.generate_s << "\n";
+            } else {
+                // time per unit relative to the previous size
+                const auto growth = [&](const double time, const double units, const double prev_time, const double prev_units) {
+                    return previous.has_value() ? (time / units) / (prev_time / prev_units) : 1.0;
+                };
+                std::printf("%-10s %9zu %10zu %10llu %10zu | %11.3e %6.2f | %11.3e %6.2f | %11.3e %6.2f\n",
+                            workload.name.c_str(), result.size, result.tokens, static_cast<unsigned long long>(result.nodes),
+                            result.instructions,
+                            static_cast<double>(result.tokens) / result.tokenize_s,
+                            growth(result.tokenize_s, result.tokens, previous ? previous->tokenize_s : 0, previous ? previous->tokens : 0),
+                            static_cast<double>(result.nodes) / result.parse_s,
+                            growth(result.parse_s, result.nodes, previous ? previous->parse_s : 0, previous ? previous->nodes : 0),
+                            static_cast<double>(result.instructions) / result.generate_s,
+                            growth(result.generate_s, result.instructions, previous ? previous->generate_s : 0, previous ? previous->instructions : 0));
+                std::fflush(stdout);
+            }
+            previous = result;
+        }
+    }
+    return EXIT_SUCCESS;
+}
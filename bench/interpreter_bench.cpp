@@ -0,0 +1,117 @@
+// Compares how fast the bytecode interpreter runs a program against the native code for the
+// same program, called in process through a JitBuffer so neither side pays for process startup.
+//
+// Usage: helium_interpreter_bench [statements] [runs]
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "../src/resolve.hpp"
+#include "../src/generation.hpp"
+#include "../src/assembler.hpp"
+#include "../src/jit.hpp"
+#include "../src/interpreter.hpp"
+
+namespace {
+
+    // Straight line arithmetic over a handful of variables with the occasional if/else. The
+    // optimizer is not run, as it would fold the whole program down to its exit value.
+    std::string make_workload(const size_t statements) {
+        constexpr size_t var_count = 16;
+        std::mt19937 rng(42);
+        const auto var = [&] { return std::string("v").append(std::to_string(rng() % var_count)); };
+        const auto lit = [&] { return std::to_string(rng() % 100 + 1); };
+
+        std::stringstream src;
+        for (size_t i = 0; i < var_count; i++) {
+            src << "var v" << i << " = " << i + 1 << ";\n";
+        }
+        for (size_t i = 0; i < statements; i++) {
+            switch (rng() % 6) {
+                case 0:
+                    src << var() << " = " << var() << " + " << var() << " * " << lit() << ";\n";
+                    break;
+                case 1:
+                    src << var() << " = " << var() << " - " << var() << ";\n";
+                    break;
+                case 2:
+                    src << var() << " = " << var() << " / " << lit() << " + " << var() << ";\n";
+                    break;
+                case 3:
+                    src << var() << " = (" << var() << " + " << lit() << ") * (" << var() << " - " << lit() << ");\n";
+                    break;
+                case 4:
+                    src << "if (" << var() << " - " << var() << ") { " << var() << " = " << var() << " + 1; } else { "
+                        << var() << " = " << var() << " * 3; }\n";
+                    break;
+                default:
+                    src << var() << " = " << var() << " * " << var() << " / " << lit() << ";\n";
+                    break;
+            }
+        }
+        src << "exit(v0);\n";
+        return src.str();
+    }
+
+    FlatAst parse_and_resolve(const std::string& src) {
+        ArenaAllocator arena;
+        Tokenizer tokenizer(src);
+        Parser parser(tokenizer.tokenize(), arena);
+        std::optional<NodeProg> prog = parser.parse_prog();
+        if (!prog.has_value()) {
+            std::cerr << "Workload did not parse" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        Resolver resolver(prog.value());
+        return resolver.resolve_prog();
+    }
+
+    template <typename Fn>
+    double time_runs(const size_t runs, Fn&& fn) {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < runs; i++) {
+            fn();
+        }
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / static_cast<double>(runs);
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    const size_t statements = argc > 1 ? std::stoul(argv[1]) : 4000;
+    const size_t runs = argc > 2 ? std::stoul(argv[2]) : 2000;
+
+    const std::string src = make_workload(statements);
+    const FlatAst ast = parse_and_resolve(src);
+
+    BytecodeGenerator bc_generator(ast);
+    const BcProgram bytecode = bc_generator.gen_prog();
+    Interpreter interpreter(bytecode);
+
+    Generator generator(ast, false, true);
+    const std::vector<Instr> instrs = generator.gen_prog();
+    Assembler assembler(instrs);
+    const JitBuffer native(assembler.assemble());
+
+    if (interpreter.run() != native.run()) {
+        std::cerr << "Interpreter and native code disagree" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    volatile int64_t sink = 0;
+    const double interpreted_ns = time_runs(runs, [&] { sink = interpreter.run(); });
+    const double native_ns = time_runs(runs, [&] { sink = native.run(); });
+
+    std::cout << "workload:    " << statements << " statements, " << bytecode.code.size() << " bytecode instructions, "
+              << instrs.size() << " x86 instructions\n";
+    std::cout << "interpreter: " << interpreted_ns << " ns/run, "
+              << static_cast<double>(bytecode.code.size()) / interpreted_ns * 1e3 << " M bytecode instructions/s (static count)\n";
+    std::cout << "native:      " << native_ns << " ns/run\n";
+    std::cout << "slowdown:    " << interpreted_ns / native_ns << "x" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+// Checks the parallel tokenizer against the serial one. Generates random inputs out of tokens,
+// blanks, newlines, ;; and ;* comments (unterminated ones included) and the odd character that
+// does not start a token, and tokenizes each of them in one piece and split into chunks of a
+// few bytes on several threads, with every scanner the CPU supports. Both have to produce the
+// same tokens with the same lines and symbols, or fail with the same error. The chunks are tiny
+// so that comments, newlines and errors land on chunk boundaries and chunks start inside
+// comments as often as possible.
+//
+// Usage: helium_lex_stress [--inputs N] [--seed S]
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/tokenization.hpp"
+
+namespace {
+
+    struct Lexed {
+        TokenList tokens;
+        Interner symbols;
+        std::optional<std::string> error{};
+    };
+
+    Lexed lex(const std::string& src, const ScanIsa isa, const size_t threads, const size_t min_chunk_bytes) {
+        Tokenizer tokenizer(src);
+        Lexed lexed;
+        try {
+            lexed.tokens = tokenizer.tokenize(isa, threads, min_chunk_bytes);
+        } catch (const CompileError& error) {
+            lexed.error = error.what();
+        }
+        lexed.symbols = std::move(tokenizer.symbols());
+        return lexed;
+    }
+
+    std::string make_input(std::mt19937& rng) {
+        static const std::vector<std::string> pieces {
+            "exit", "var", "if", "elif", "else", "while", "fn", "return", "x", "y1", "abc", "_t", "exit2",
+            "0", "7", "42", "9223372036854775807",
+            "(", ")", "{", "}", ",", ";", "=", "==", "!=", "!", "<", "<=", ">", ">=", "&&", "||", "+", "-", "*", "/",
+            " ", "  ", "\t", "\n", "\n\n", "\r\n",
+            ";; a comment\n", ";;\n", ";* a comment *;", ";* over\nseveral\nlines *;", ";**;", ";* ; * *;",
+        };
+        std::string src;
+        const size_t count = rng() % 120;
+        for (size_t i = 0; i < count; i++) {
+            switch (rng() % 200) {
+                case 0:
+                    // runs to the end of the input
+                    src += ";* unterminated\n";
+                    break;
+                case 1:
+                    src += rng() % 2 == 0 ? "$" : "&";
+                    break;
+                default:
+                    src += pieces[rng() % pieces.size()];
+                    break;
+            }
+        }
+        return src;
+    }
+
+    // What differs between the two, empty if nothing does
+    std::string compare(const Lexed& serial, const Lexed& chunked) {
+        if (serial.error != chunked.error) {
+            return "error \"" + serial.error.value_or("none") + "\" vs \"" + chunked.error.value_or("none") + "\"";
+        }
+        if (serial.error.has_value()) {
+            return {};
+        }
+        if (serial.tokens.size() != chunked.tokens.size()) {
+            return std::to_string(serial.tokens.size()) + " tokens vs " + std::to_string(chunked.tokens.size());
+        }
+        for (size_t i = 0; i < serial.tokens.size(); i++) {
+            const Token& a = serial.tokens[i];
+            const Token& b = chunked.tokens[i];
+            if (a.type != b.type || a.line != b.line || a.value != b.value || a.symbol != b.symbol) {
+                return "token " + std::to_string(i) + ": " + to_string(a.type) + " line " + std::to_string(a.line) + " vs " +
+                       to_string(b.type) + " line " + std::to_string(b.line);
+            }
+            if (a.type == TokenType::ident && serial.symbols.name(a.symbol) != chunked.symbols.name(b.symbol)) {
+                return "symbol of token " + std::to_string(i);
+            }
+        }
+        return {};
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t inputs = 20'000;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--inputs" && i + 1 < argc) {
+            inputs = std::stoul(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else {
+            std::cerr << "Usage: helium_lex_stress [--inputs N] [--seed S]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<ScanIsa> isas { ScanIsa::scalar };
+#if defined(__x86_64__)
+    isas.push_back(ScanIsa::sse2);
+    if (detect_scan_isa() == ScanIsa::avx2) {
+        isas.push_back(ScanIsa::avx2);
+    }
+#endif
+
+    std::mt19937 rng(seed);
+    size_t checks = 0;
+    size_t failures = 0;
+    for (size_t input = 0; input < inputs; input++) {
+        const std::string src = make_input(rng);
+        const size_t min_chunk_bytes = rng() % 20 + 1;
+        const size_t threads = rng() % 8 + 2;
+        for (const ScanIsa isa : isas) {
+            checks++;
+            const std::string difference = compare(lex(src, isa, 1, min_chunk_bytes), lex(src, isa, threads, min_chunk_bytes));
+            if (!difference.empty()) {
+                failures++;
+                std::printf("FAILED input %zu, scanner %d, %zu byte chunks on %zu threads: %s\n", input, static_cast<int>(isa),
+                            min_chunk_bytes, threads, difference.c_str());
+            }
+        }
+    }
+    std::printf("%zu checks, %zu failed\n", checks, failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
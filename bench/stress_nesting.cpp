@@ -0,0 +1,278 @@
+// Deep nesting stress test. Generates programs nested a million levels deep in each of the ways
+// the language allows and puts them through every phase of the compiler: tokenizing, parsing,
+// the AST statistics, the optimizer, both native code generators, the assembler and the
+// bytecode generator. None of them may recurse per level of nesting, so this runs on the
+// default native stack; time and memory should grow linearly with the depth.
+//
+// The programs need constant stack space at runtime with the register allocating backend, so
+// its code is run in process and, like the bytecode, checked against the expected exit value.
+// The tail_calls shape recurses depth times instead of nesting, which only runs in constant
+// stack space if the self tail call becomes a jump, and loop_nest runs its innermost of three
+// loops depth times; both are also run through the SSA form and its backend, whose code for the
+// nested shapes is too large to hold at this depth.
+//
+// Usage: helium_stress [--depth N] [--only <shape>]
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/optimization.hpp"
+#include "../src/resolve.hpp"
+#include "../src/generation.hpp"
+#include "../src/ir_passes.hpp"
+#include "../src/ir_generation.hpp"
+#include "../src/assembler.hpp"
+#include "../src/jit.hpp"
+#include "../src/bytecode.hpp"
+#include "../src/interpreter.hpp"
+#include "../src/stats.hpp"
+
+namespace {
+
+    struct Shape {
+        std::string name;
+        std::function<std::string(size_t)> generate;
+        // exit value of the generated program, before truncation to 8 bits
+        std::function<uint64_t(size_t)> expected;
+        // also checked with the SSA backend
+        bool ssa = false;
+    };
+
+    // A single variable inside depth parentheses
+    std::string gen_parens(const size_t depth) {
+        return "var x = 5;\nexit(" + std::string(depth, '(') + "x" + std::string(depth, ')') + ");\n";
+    }
+
+    // A left leaning chain of depth operators, ((x + 1) - 1) + 1 ... without any parentheses
+    std::string gen_chain(const size_t depth) {
+        std::stringstream src;
+        src << "var x = 5;\nexit(x";
+        for (size_t i = 0; i < depth; i++) {
+            src << (i % 2 == 0 ? " + 1" : " - 1");
+        }
+        src << ");\n";
+        return src.str();
+    }
+
+    // Operators nested in parentheses, (((x * 1) + 1) * 1) ...
+    std::string gen_paren_chain(const size_t depth) {
+        std::stringstream src;
+        src << "var x = 5;\nexit(" << std::string(depth, '(') << "x";
+        for (size_t i = 0; i < depth; i++) {
+            src << (i % 2 == 0 ? " * 1)" : " + 1)");
+        }
+        src << ");\n";
+        return src.str();
+    }
+
+    // Scopes inside each other, each incrementing a variable
+    std::string gen_scopes(const size_t depth) {
+        std::stringstream src;
+        src << "var v = 0;\n";
+        for (size_t i = 0; i < depth; i++) {
+            src << "{ v = v + 1;\n";
+        }
+        src << std::string(depth, '}') << "\nexit(v);\n";
+        return src.str();
+    }
+
+    // Ifs inside each other, each taken and incrementing a variable
+    std::string gen_ifs(const size_t depth) {
+        std::stringstream src;
+        src << "var v = 1;\n";
+        for (size_t i = 0; i < depth; i++) {
+            src << "if (v) { v = v + 1;\n";
+        }
+        src << std::string(depth, '}') << "\nexit(v);\n";
+        return src.str();
+    }
+
+    // One if with depth elif arms, none of which is taken
+    std::string gen_elifs(const size_t depth) {
+        std::stringstream src;
+        src << "var z = 0;\nvar r = 0;\nif (z) { r = 1; }\n";
+        for (size_t i = 1; i <= depth; i++) {
+            src << "elif (z) { r = r + " << i << "; }\n";
+        }
+        src << "else { r = 42; }\nexit(r);\n";
+        return src.str();
+    }
+
+    // Loops inside each other, each running once: it counts the variable up to its own level,
+    // runs the loops inside it and then resets the variable to its level, which ends it
+    std::string gen_whiles(const size_t depth) {
+        std::stringstream src;
+        src << "var v = 0;\n";
+        for (size_t i = 1; i <= depth; i++) {
+            src << "while (v - " << i << ") { v = v + 1;\n";
+        }
+        for (size_t i = depth; i >= 1; i--) {
+            src << "v = " << i << "; }\n";
+        }
+        src << "exit(v);\n";
+        return src.str();
+    }
+
+    // Calls nested in each other's arguments, inc(inc(inc(x)))
+    std::string gen_calls(const size_t depth) {
+        std::string src = "fn inc(a) { return a + 1; }\nvar x = 5;\nexit(";
+        for (size_t i = 0; i < depth; i++) {
+            src += "inc(";
+        }
+        return src + "x" + std::string(depth, ')') + ");\n";
+    }
+
+    // Three loops inside each other, the innermost running depth times and counting its non-zero
+    // iterations through an if and through &&. The latch of each outer loop comes before the
+    // loops inside it in creation order, which the SSA backend once took for the end of the loop
+    // and reused the slots of the outer counters inside.
+    std::string gen_loop_nest(const size_t depth) {
+        return "var a = 0;\nvar n = 0;\nwhile (a < 2) {\n    var b = 0;\n    while (b < 3) {\n        var c = 0;\n        while (c < " +
+               std::to_string(depth) + ") {\n            var y = 0;\n            if (c) { y = 1; }\n            n = n + y + (c && 1);\n"
+               "            c = c + 1;\n        }\n        b = b + 1;\n    }\n    a = a + 1;\n}\nexit(n + a);\n";
+    }
+
+    // A function summing 1 to depth by returning a call of itself
+    std::string gen_tail_calls(const size_t depth) {
+        return "fn s(n, a) {\n    if (n) {\n        return s(n - 1, a + n);\n    }\n    return a;\n}\nexit(s(" +
+               std::to_string(depth) + ", 0));\n";
+    }
+
+    template <typename Fn>
+    double seconds(Fn&& fn) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    long peak_rss_mb() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss / 1024;
+    }
+
+    // Compiles the program with and without the optimizer and returns whether every backend
+    // produced the expected exit value
+    bool stress(const Shape& shape, const size_t depth) {
+        const std::string src = shape.generate(depth);
+        const auto expected = static_cast<int64_t>(shape.expected(depth) & 0xFF);
+        bool ok = true;
+        // reused for both runs, like the driver does across inputs
+        ArenaAllocator arena;
+        for (const bool optimize : { false, true }) {
+            double parse_s = 0;
+            double optimize_s = 0;
+            double generate_s = 0;
+            double bytecode_s = 0;
+            int64_t native = 0;
+            std::optional<int64_t> ssa{};
+            int64_t interpreted = 0;
+            const double total_s = seconds([&] {
+                Tokenizer tokenizer(src);
+                TokenList tokens = tokenizer.tokenize();
+                arena.reset();
+                Parser parser(std::move(tokens), arena);
+                std::optional<NodeProg> prog;
+                parse_s = seconds([&] { prog = parser.parse_prog(); });
+                CompileStats stats(shape.name);
+                stats.count_ast(prog.value());
+                if (optimize) {
+                    optimize_s = seconds([&] {
+                        Optimizer optimizer(prog.value(), arena, tokenizer.symbols());
+                        optimizer.optimize_prog();
+                    });
+                }
+                FlatAst ast;
+                generate_s = seconds([&] {
+                    Resolver resolver(prog.value());
+                    ast = resolver.resolve_prog();
+                    Generator stack_generator(ast, true);
+                    const std::vector<Instr> stack_instrs = stack_generator.gen_prog();
+                    Assembler stack_assembler(stack_instrs);
+                    static_cast<void>(stack_assembler.assemble());
+
+                    Generator generator(ast, false, true);
+                    const std::vector<Instr> instrs = generator.gen_prog();
+                    Assembler assembler(instrs);
+                    native = run_jit(assembler.assemble()) & 0xFF;
+                    if (!shape.ssa) {
+                        return;
+                    }
+
+                    IrBuilder builder(ast);
+                    IrProgram ir = builder.build();
+                    PassManager pass_manager(stats, {}, optimize ? std::span<const IrPass>(default_ir_passes) : std::span<const IrPass>());
+                    pass_manager.run(ir);
+                    IrGenerator ssa_generator(ir, true);
+                    const std::vector<Instr> ssa_instrs = ssa_generator.gen_prog();
+                    Assembler ssa_assembler(ssa_instrs);
+                    ssa = run_jit(ssa_assembler.assemble()) & 0xFF;
+                });
+                bytecode_s = seconds([&] {
+                    BytecodeGenerator generator(ast);
+                    Interpreter interpreter(generator.gen_prog());
+                    interpreted = interpreter.run() & 0xFF;
+                });
+            });
+            const bool passed = native == expected && ssa.value_or(expected) == expected && interpreted == expected;
+            ok = ok && passed;
+            std::printf("%-12s %9zu %-4s %6s | parse %7.3fs  optimize %7.3fs  native %7.3fs  bytecode %7.3fs  total %7.3fs | peak %5ld MiB\n",
+                        shape.name.c_str(), depth, optimize ? "-O1" : "-O0", passed ? "ok" : "FAILED", parse_s,
+                        optimize_s, generate_s, bytecode_s, total_s, peak_rss_mb());
+            if (!passed) {
+                std::printf("  expected %lld, native %lld, ssa %lld, bytecode %lld\n", static_cast<long long>(expected),
+                            static_cast<long long>(native), static_cast<long long>(ssa.value_or(expected)), static_cast<long long>(interpreted));
+            }
+            std::fflush(stdout);
+        }
+        return ok;
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t depth = 1'000'000;
+    std::string only;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--depth" && i + 1 < argc) {
+            depth = std::stoul(argv[++i]);
+        } else if (arg == "--only" && i + 1 < argc) {
+            only = argv[++i];
+        } else {
+            std::cerr << "Usage: helium_stress [--depth N] [--only <shape>]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const std::vector<Shape> shapes {
+        { "parens", gen_parens, [](size_t) { return 5; } },
+        { "chain", gen_chain, [](const size_t n) { return 5 + n % 2; } },
+        { "paren_chain", gen_paren_chain, [](const size_t n) { return 5 + n / 2; } },
+        { "scopes", gen_scopes, [](const size_t n) { return n; } },
+        { "ifs", gen_ifs, [](const size_t n) { return n + 1; } },
+        { "elifs", gen_elifs, [](size_t) { return 42; } },
+        { "whiles", gen_whiles, [](size_t) { return 1; } },
+        { "calls", gen_calls, [](const size_t n) { return 5 + n; } },
+        { "loop_nest", gen_loop_nest, [](const size_t n) { return n == 0 ? 2 : 12 * (n - 1) + 2; }, true },
+        { "tail_calls", gen_tail_calls, [](const size_t n) { return static_cast<uint64_t>(n) * (n + 1) / 2; }, true },
+    };
+
+    bool ok = true;
+    for (const Shape& shape : shapes) {
+        if (!only.empty() && shape.name != only) {
+            continue;
+        }
+        ok = stress(shape, depth) && ok;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,15 +1,41 @@
 #pragma once
 
+#include <sys/mman.h>
+
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
+// Bump allocator for the AST. Memory comes in chunks mapped from the OS, each one twice the
+// size of the one before (or as large as a single request needs), so the arena grows with the
+// program instead of failing on big inputs, and pages of a chunk that are never touched cost
+// nothing. Objects that are not trivially destructible, like the nodes holding a std::vector,
+// get their destructor registered and run when the arena is reset or destroyed. reset() keeps
+// the largest chunk, so an arena reused for the next compilation usually needs no new memory.
 class ArenaAllocator final {
 public:
-    explicit ArenaAllocator(const std::size_t max_num_bytes)
-            : m_size { max_num_bytes }
-            , m_buffer { new std::byte[max_num_bytes] }
-            , m_offset { m_buffer }
+    struct Stats {
+        // bytes handed out, including the padding for alignment
+        std::size_t used;
+        // bytes of all chunks
+        std::size_t reserved;
+        std::size_t chunks;
+        // objects whose destructor runs on reset
+        std::size_t destructors;
+    };
+
+    static constexpr std::size_t default_first_chunk_bytes = 64 * 1024;
+
+    // Chunks of at least huge_page_bytes are backed by transparent huge pages if huge_pages is
+    // set, which saves TLB misses when walking a large AST
+    explicit ArenaAllocator(const std::size_t first_chunk_bytes = default_first_chunk_bytes, const bool huge_pages = false)
+            : m_next_chunk_bytes { std::max<std::size_t>(first_chunk_bytes, min_chunk_bytes) }
+            , m_huge_pages { huge_pages }
     {
     }
 
@@ -17,52 +43,192 @@ public:
     ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
     ArenaAllocator(ArenaAllocator&& other) noexcept
-            : m_size { std::exchange(other.m_size, 0) }
-            , m_buffer { std::exchange(other.m_buffer, nullptr) }
+            : m_chunks { std::move(other.m_chunks) }
             , m_offset { std::exchange(other.m_offset, nullptr) }
+            , m_end { std::exchange(other.m_end, nullptr) }
+            , m_used_before { std::exchange(other.m_used_before, 0) }
+            , m_next_chunk_bytes { other.m_next_chunk_bytes }
+            , m_huge_pages { other.m_huge_pages }
+            , m_destructors { std::exchange(other.m_destructors, nullptr) }
+            , m_destructor_count { std::exchange(other.m_destructor_count, 0) }
     {
+        other.m_chunks.clear();
     }
 
     ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
     {
-        std::swap(m_size, other.m_size);
-        std::swap(m_buffer, other.m_buffer);
+        std::swap(m_chunks, other.m_chunks);
         std::swap(m_offset, other.m_offset);
+        std::swap(m_end, other.m_end);
+        std::swap(m_used_before, other.m_used_before);
+        std::swap(m_next_chunk_bytes, other.m_next_chunk_bytes);
+        std::swap(m_huge_pages, other.m_huge_pages);
+        std::swap(m_destructors, other.m_destructors);
+        std::swap(m_destructor_count, other.m_destructor_count);
         return *this;
     }
 
     template <typename T>
     [[nodiscard]] T* alloc()
     {
-        std::size_t remaining_num_bytes = m_size - static_cast<std::size_t>(m_offset - m_buffer);
-        auto pointer = static_cast<void*>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
-        if (aligned_address == nullptr) {
-            throw std::bad_alloc {};
-        }
-        m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
-        return static_cast<T*>(aligned_address);
+        return static_cast<T*>(alloc_bytes(sizeof(T), alignof(T)));
+    }
+
+    // Uninitialised storage for count objects of type T
+    template <typename T>
+    [[nodiscard]] T* alloc_array(const std::size_t count)
+    {
+        return static_cast<T*>(alloc_bytes(sizeof(T) * count, alignof(T)));
     }
 
     template <typename T, typename... Args>
     [[nodiscard]] T* emplace(Args&&... args)
     {
         const auto allocated_memory = alloc<T>();
-        return new (allocated_memory) T { std::forward<Args>(args)... };
+        T* object = new (allocated_memory) T { std::forward<Args>(args)... };
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            m_destructors = new (alloc<Destructor>()) Destructor {
+                .destroy = [](void* p) { static_cast<T*>(p)->~T(); },
+                .object = object,
+                .next = m_destructors
+            };
+            m_destructor_count++;
+        }
+        return object;
+    }
+
+    // Destroys everything allocated so far and starts over in the largest chunk, giving the
+    // others back to the OS
+    void reset()
+    {
+        run_destructors();
+        if (m_chunks.empty()) {
+            return;
+        }
+        const auto largest = std::ranges::max_element(m_chunks, {}, &Chunk::size);
+        std::swap(*largest, m_chunks.front());
+        for (std::size_t i = 1; i < m_chunks.size(); i++) {
+            unmap(m_chunks[i]);
+        }
+        m_chunks.resize(1);
+        m_offset = m_chunks.front().data;
+        m_end = m_chunks.front().data + m_chunks.front().size;
+        m_used_before = 0;
+    }
+
+    [[nodiscard]] std::size_t used() const
+    {
+        return m_used_before + (m_chunks.empty() ? 0 : static_cast<std::size_t>(m_offset - m_chunks.back().data));
+    }
+
+    [[nodiscard]] std::size_t capacity() const
+    {
+        std::size_t bytes = 0;
+        for (const Chunk& chunk : m_chunks) {
+            bytes += chunk.size;
+        }
+        return bytes;
+    }
+
+    [[nodiscard]] Stats stats() const
+    {
+        return { .used = used(), .reserved = capacity(), .chunks = m_chunks.size(), .destructors = m_destructor_count };
     }
 
     ~ArenaAllocator()
     {
-        // No destructors are called for the stored objects. Thus, memory
-        // leaks are possible (e.g. when storing std::vector objects or
-        // other non-trivially destructable objects in the allocator).
-        // Although this could be changed, it would come with additional
-        // runtime overhead and therefore is not implemented.
-        delete[] m_buffer;
+        run_destructors();
+        for (const Chunk& chunk : m_chunks) {
+            unmap(chunk);
+        }
     }
 
 private:
-    std::size_t m_size;
-    std::byte* m_buffer;
-    std::byte* m_offset;
-};
\ No newline at end of file
+    static constexpr std::size_t min_chunk_bytes = 4096;
+    static constexpr std::size_t huge_page_bytes = 2 * 1024 * 1024;
+
+    struct Chunk {
+        std::byte* data;
+        std::size_t size;
+        // bytes mapped for the chunk, which start at base
+        std::byte* base;
+        std::size_t mapped;
+    };
+
+    // Kept in the arena itself as a list, newest first
+    struct Destructor {
+        void (*destroy)(void*);
+        void* object;
+        Destructor* next;
+    };
+
+    [[nodiscard]] void* alloc_bytes(const std::size_t size, const std::size_t align)
+    {
+        auto address = reinterpret_cast<std::uintptr_t>(m_offset);
+        address = (address + align - 1) & ~(align - 1);
+        if (m_offset == nullptr || address + size > reinterpret_cast<std::uintptr_t>(m_end)) {
+            return alloc_in_new_chunk(size, align);
+        }
+        m_offset = reinterpret_cast<std::byte*>(address + size);
+        return reinterpret_cast<void*>(address);
+    }
+
+    void* alloc_in_new_chunk(const std::size_t size, const std::size_t align)
+    {
+        // the chunk start is page aligned, which is enough for any type
+        std::size_t chunk_bytes = m_next_chunk_bytes;
+        while (chunk_bytes < size + align) {
+            chunk_bytes *= 2;
+        }
+        if (!m_chunks.empty()) {
+            m_used_before += static_cast<std::size_t>(m_offset - m_chunks.back().data);
+        }
+        m_chunks.push_back(map(chunk_bytes));
+        m_next_chunk_bytes = chunk_bytes * 2;
+        m_offset = m_chunks.back().data;
+        m_end = m_chunks.back().data + m_chunks.back().size;
+        return alloc_bytes(size, align);
+    }
+
+    [[nodiscard]] Chunk map(const std::size_t size) const
+    {
+        const bool huge = m_huge_pages && size >= huge_page_bytes;
+        // huge pages need a huge page aligned address, which mmap does not promise
+        const std::size_t mapped = huge ? size + huge_page_bytes : size;
+        void* base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            throw std::bad_alloc {};
+        }
+        auto* data = static_cast<std::byte*>(base);
+        if (huge) {
+            const auto address = reinterpret_cast<std::uintptr_t>(base);
+            data = reinterpret_cast<std::byte*>((address + huge_page_bytes - 1) & ~(huge_page_bytes - 1));
+            madvise(data, size, MADV_HUGEPAGE);
+        }
+        return { .data = data, .size = size, .base = static_cast<std::byte*>(base), .mapped = mapped };
+    }
+
+    static void unmap(const Chunk& chunk)
+    {
+        munmap(chunk.base, chunk.mapped);
+    }
+
+    void run_destructors()
+    {
+        for (const Destructor* destructor = m_destructors; destructor != nullptr; destructor = destructor->next) {
+            destructor->destroy(destructor->object);
+        }
+        m_destructors = nullptr;
+        m_destructor_count = 0;
+    }
+
+    std::vector<Chunk> m_chunks {};
+    std::byte* m_offset = nullptr;
+    std::byte* m_end = nullptr;
+    // bytes used in the chunks before the current one
+    std::size_t m_used_before = 0;
+    std::size_t m_next_chunk_bytes;
+    bool m_huge_pages;
+    Destructor* m_destructors = nullptr;
+    std::size_t m_destructor_count = 0;
+};
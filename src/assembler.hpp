@@ -0,0 +1,371 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "./assembly.hpp"
+
+// Encodes the instruction list straight to x86-64 machine code, picking the same short forms
+// nasm does (imm8 arithmetic, 32 bit moves of small immediates, short jumps where they reach).
+class Assembler {
+public:
+    explicit Assembler(const std::vector<Instr>& instrs) : m_instrs(instrs) {
+
+    }
+
+    // Returns the code; label_offset() is valid afterwards
+    [[nodiscard]] std::vector<uint8_t> assemble() {
+        // Everything but jumps has a fixed size, so encode it once up front
+        std::vector<std::vector<uint8_t>> encoded(m_instrs.size());
+        size_t label_count = 0;
+        for (size_t i = 0; i < m_instrs.size(); i++) {
+            const Instr& instr = m_instrs[i];
+            if (instr.op == Op::label) {
+                label_count = std::max(label_count, std::get<Label>(instr.dst).id + 1);
+            } else if (!is_jump(instr.op)) {
+                encode(instr, encoded[i]);
+            }
+        }
+
+        // Branch relaxation: start with every jump short and widen the ones that do not reach
+        // until nothing changes. Jumps only ever grow, so this terminates. Calls have no short form.
+        std::vector<bool> near(m_instrs.size(), false);
+        for (size_t i = 0; i < m_instrs.size(); i++) {
+            near[i] = m_instrs[i].op == Op::call;
+        }
+        std::vector<size_t> offsets(m_instrs.size());
+        m_label_offsets.assign(label_count, 0);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            size_t offset = 0;
+            for (size_t i = 0; i < m_instrs.size(); i++) {
+                offsets[i] = offset;
+                if (m_instrs[i].op == Op::label) {
+                    m_label_offsets[std::get<Label>(m_instrs[i].dst).id] = offset;
+                }
+                offset += is_jump(m_instrs[i].op) ? jump_size(m_instrs[i].op, near[i]) : encoded[i].size();
+            }
+            for (size_t i = 0; i < m_instrs.size(); i++) {
+                if (!is_jump(m_instrs[i].op) || near[i]) {
+                    continue;
+                }
+                const int64_t rel = jump_rel(i, offsets[i], false);
+                if (rel < std::numeric_limits<int8_t>::min() || rel > std::numeric_limits<int8_t>::max()) {
+                    near[i] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<uint8_t> code;
+        for (size_t i = 0; i < m_instrs.size(); i++) {
+            if (is_jump(m_instrs[i].op)) {
+                encode_jump(m_instrs[i], near[i], jump_rel(i, offsets[i], near[i]), code);
+            } else {
+                code.insert(code.end(), encoded[i].begin(), encoded[i].end());
+            }
+        }
+        return code;
+    }
+
+    [[nodiscard]] size_t label_offset(const Label label) const {
+        return m_label_offsets.at(label.id);
+    }
+
+private:
+
+    static bool is_jump(const Op op) {
+        return op == Op::jmp || op == Op::jcc || op == Op::call;
+    }
+
+    static size_t jump_size(const Op op, const bool near) {
+        if (!near) {
+            return 2;
+        }
+        return op == Op::jcc ? 6 : 5;
+    }
+
+    // Displacement from the end of the jump at index i to its target
+    [[nodiscard]] int64_t jump_rel(const size_t i, const size_t offset, const bool near) const {
+        const size_t target = m_label_offsets.at(std::get<Label>(m_instrs[i].dst).id);
+        return static_cast<int64_t>(target) - static_cast<int64_t>(offset + jump_size(m_instrs[i].op, near));
+    }
+
+    static uint8_t code(const Reg reg) {
+        return static_cast<uint8_t>(reg);
+    }
+
+    static bool fits_int8(const int64_t value) {
+        return value >= std::numeric_limits<int8_t>::min() && value <= std::numeric_limits<int8_t>::max();
+    }
+
+    static bool fits_int32(const int64_t value) {
+        return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+    }
+
+    static void emit_imm(std::vector<uint8_t>& out, const uint64_t value, const size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    // REX prefix for a reg field and an r/m operand; left out when it carries no information
+    static void emit_rex(std::vector<uint8_t>& out, const bool wide, const uint8_t reg, const Operand& rm) {
+        uint8_t rex = 0x40;
+        if (wide) {
+            rex |= 0x08;
+        }
+        if (reg & 8) {
+            rex |= 0x04;
+        }
+        if (const auto mem = std::get_if<Mem>(&rm)) {
+            if (mem->index.has_value() && (code(mem->index.value()) & 8)) {
+                rex |= 0x02;
+            }
+            if (code(mem->base) & 8) {
+                rex |= 0x01;
+            }
+        } else if (const auto rm_reg = std::get_if<Reg>(&rm)) {
+            if (code(*rm_reg) & 8) {
+                rex |= 0x01;
+            }
+        }
+        if (rex != 0x40) {
+            out.push_back(rex);
+        }
+    }
+
+    static void emit_modrm(std::vector<uint8_t>& out, const uint8_t reg, const Operand& rm) {
+        if (const auto rm_reg = std::get_if<Reg>(&rm)) {
+            out.push_back(0xC0 | (reg & 7) << 3 | (code(*rm_reg) & 7));
+            return;
+        }
+        const Mem& mem = std::get<Mem>(rm);
+        const uint8_t base = code(mem.base) & 7;
+        // rbp and r13 as base have no disp-less form
+        uint8_t mod = 2;
+        if (mem.disp == 0 && base != 5) {
+            mod = 0;
+        } else if (fits_int8(mem.disp)) {
+            mod = 1;
+        }
+        // rsp and r12 as base, as well as any index, need a SIB byte
+        if (mem.index.has_value() || base == 4) {
+            out.push_back(mod << 6 | (reg & 7) << 3 | 4);
+            uint8_t scale = 0;
+            while ((1 << scale) < mem.scale) {
+                scale++;
+            }
+            const uint8_t index = mem.index.has_value() ? code(mem.index.value()) & 7 : 4;
+            out.push_back(scale << 6 | index << 3 | base);
+        } else {
+            out.push_back(mod << 6 | (reg & 7) << 3 | base);
+        }
+        if (mod == 1) {
+            emit_imm(out, mem.disp, 1);
+        } else if (mod == 2) {
+            emit_imm(out, mem.disp, 4);
+        }
+    }
+
+    // REX.W opcode /reg with an r/m operand
+    static void emit_rm(std::vector<uint8_t>& out, const std::initializer_list<uint8_t> opcode, const uint8_t reg, const Operand& rm, const bool wide = true) {
+        emit_rex(out, wide, reg, rm);
+        out.insert(out.end(), opcode);
+        emit_modrm(out, reg, rm);
+    }
+
+    // add/sub/xor style two operand arithmetic: r/m,reg and reg,r/m forms plus the group 1
+    // immediate form with the given /ext
+    static void emit_alu(std::vector<uint8_t>& out, const Instr& instr, const uint8_t rm_reg, const uint8_t reg_rm, const uint8_t ext) {
+        if (const auto imm = std::get_if<int64_t>(&instr.src)) {
+            assert(fits_int32(*imm));
+            if (fits_int8(*imm)) {
+                emit_rm(out, { 0x83 }, ext, instr.dst);
+                emit_imm(out, *imm, 1);
+            } else {
+                emit_rm(out, { 0x81 }, ext, instr.dst);
+                emit_imm(out, *imm, 4);
+            }
+        } else if (const auto src = std::get_if<Reg>(&instr.src)) {
+            emit_rm(out, { rm_reg }, code(*src), instr.dst);
+        } else {
+            emit_rm(out, { reg_rm }, code(std::get<Reg>(instr.dst)), instr.src);
+        }
+    }
+
+    static void encode_mov(const Instr& instr, std::vector<uint8_t>& out) {
+        if (const auto imm = std::get_if<int64_t>(&instr.src)) {
+            if (const auto dst = std::get_if<Reg>(&instr.dst)) {
+                const uint8_t reg = code(*dst);
+                if (*imm >= 0 && *imm <= std::numeric_limits<uint32_t>::max()) {
+                    // writing the 32 bit register zero extends into the full one
+                    if (reg & 8) {
+                        out.push_back(0x41);
+                    }
+                    out.push_back(0xB8 + (reg & 7));
+                    emit_imm(out, *imm, 4);
+                } else if (fits_int32(*imm)) {
+                    emit_rm(out, { 0xC7 }, 0, *dst);
+                    emit_imm(out, *imm, 4);
+                } else {
+                    out.push_back(reg & 8 ? 0x49 : 0x48);
+                    out.push_back(0xB8 + (reg & 7));
+                    emit_imm(out, *imm, 8);
+                }
+                return;
+            }
+            assert(fits_int32(*imm));
+            emit_rm(out, { 0xC7 }, 0, instr.dst);
+            emit_imm(out, *imm, 4);
+            return;
+        }
+        if (const auto src = std::get_if<Reg>(&instr.src)) {
+            emit_rm(out, { 0x89 }, code(*src), instr.dst);
+        } else {
+            emit_rm(out, { 0x8B }, code(std::get<Reg>(instr.dst)), instr.src);
+        }
+    }
+
+    static void encode_shift(const Instr& instr, const uint8_t ext, std::vector<uint8_t>& out) {
+        const int64_t count = std::get<int64_t>(instr.src);
+        if (count == 1) {
+            emit_rm(out, { 0xD1 }, ext, instr.dst);
+        } else {
+            emit_rm(out, { 0xC1 }, ext, instr.dst);
+            emit_imm(out, count, 1);
+        }
+    }
+
+    static void encode(const Instr& instr, std::vector<uint8_t>& out) {
+        switch (instr.op) {
+            case Op::mov:
+                encode_mov(instr, out);
+                break;
+            case Op::push:
+                if (const auto reg = std::get_if<Reg>(&instr.dst)) {
+                    if (code(*reg) & 8) {
+                        out.push_back(0x41);
+                    }
+                    out.push_back(0x50 + (code(*reg) & 7));
+                } else {
+                    emit_rm(out, { 0xFF }, 6, instr.dst, false);
+                }
+                break;
+            case Op::pop: {
+                const Reg reg = std::get<Reg>(instr.dst);
+                if (code(reg) & 8) {
+                    out.push_back(0x41);
+                }
+                out.push_back(0x58 + (code(reg) & 7));
+                break;
+            }
+            case Op::add:
+                emit_alu(out, instr, 0x01, 0x03, 0);
+                break;
+            case Op::sub:
+                emit_alu(out, instr, 0x29, 0x2B, 5);
+                break;
+            case Op::xor_:
+                // zeroing the 32 bit register clears the full one and saves the REX.W
+                if (const auto dst = std::get_if<Reg>(&instr.dst), src = std::get_if<Reg>(&instr.src);
+                    dst != nullptr && src != nullptr && *dst == *src) {
+                    emit_rm(out, { 0x31 }, code(*dst), *dst, false);
+                    break;
+                }
+                emit_alu(out, instr, 0x31, 0x33, 6);
+                break;
+            case Op::test:
+                emit_rm(out, { 0x85 }, code(std::get<Reg>(instr.src)), instr.dst);
+                break;
+            case Op::cmp:
+                emit_alu(out, instr, 0x39, 0x3B, 7);
+                break;
+            case Op::setcc: {
+                // without a REX prefix, the byte registers 4 to 7 would be ah, ch, dh and bh
+                const Reg dst = std::get<Reg>(instr.dst);
+                if (code(dst) >= 4) {
+                    out.push_back(code(dst) & 8 ? 0x41 : 0x40);
+                }
+                out.insert(out.end(), { 0x0F, static_cast<uint8_t>(0x90 + static_cast<uint8_t>(instr.cond)) });
+                emit_modrm(out, 0, dst);
+                break;
+            }
+            case Op::movzx:
+                emit_rm(out, { 0x0F, 0xB6 }, code(std::get<Reg>(instr.dst)), instr.src);
+                break;
+            case Op::imul:
+                if (std::holds_alternative<std::monostate>(instr.src)) {
+                    emit_rm(out, { 0xF7 }, 5, instr.dst);
+                } else if (const auto imm = std::get_if<int64_t>(&instr.src)) {
+                    const uint8_t reg = code(std::get<Reg>(instr.dst));
+                    if (fits_int8(*imm)) {
+                        emit_rm(out, { 0x6B }, reg, instr.dst);
+                        emit_imm(out, *imm, 1);
+                    } else {
+                        emit_rm(out, { 0x69 }, reg, instr.dst);
+                        emit_imm(out, *imm, 4);
+                    }
+                } else {
+                    emit_rm(out, { 0x0F, 0xAF }, code(std::get<Reg>(instr.dst)), instr.src);
+                }
+                break;
+            case Op::idiv:
+                emit_rm(out, { 0xF7 }, 7, instr.dst);
+                break;
+            case Op::neg:
+                emit_rm(out, { 0xF7 }, 3, instr.dst);
+                break;
+            case Op::cqo:
+                out.insert(out.end(), { 0x48, 0x99 });
+                break;
+            case Op::shl:
+                encode_shift(instr, 4, out);
+                break;
+            case Op::shr:
+                encode_shift(instr, 5, out);
+                break;
+            case Op::sar:
+                encode_shift(instr, 7, out);
+                break;
+            case Op::lea:
+                emit_rm(out, { 0x8D }, code(std::get<Reg>(instr.dst)), instr.src);
+                break;
+            case Op::syscall:
+                out.insert(out.end(), { 0x0F, 0x05 });
+                break;
+            case Op::ret:
+                out.push_back(0xC3);
+                break;
+            case Op::jmp:
+            case Op::jcc:
+            case Op::call:
+            case Op::label:
+                assert(false); // handled by assemble
+                break;
+        }
+    }
+
+    static void encode_jump(const Instr& instr, const bool near, const int64_t rel, std::vector<uint8_t>& out) {
+        const auto cond = static_cast<uint8_t>(instr.cond);
+        if (!near) {
+            out.push_back(instr.op == Op::jmp ? 0xEB : 0x70 + cond);
+            emit_imm(out, rel, 1);
+            return;
+        }
+        if (instr.op == Op::call) {
+            out.push_back(0xE8);
+        } else if (instr.op == Op::jmp) {
+            out.push_back(0xE9);
+        } else {
+            out.insert(out.end(), { 0x0F, static_cast<uint8_t>(0x80 + cond) });
+        }
+        emit_imm(out, rel, 4);
+    }
+
+    const std::vector<Instr>& m_instrs;
+    std::vector<size_t> m_label_offsets{};
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "./text_sink.hpp"
+
+// Structured form of the x86-64 instructions the Generator emits. It is either printed as nasm
+// source (write_nasm) or encoded straight to machine code by the Assembler.
+
+// Ordered by their encoding
+enum class Reg : uint8_t {
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15
+};
+
+inline std::string_view to_string(const Reg reg) {
+    static constexpr const char* names[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+    };
+    return names[static_cast<uint8_t>(reg)];
+}
+
+// Name of the low byte of the register, which setcc writes and movzx reads
+inline std::string_view to_byte_string(const Reg reg) {
+    static constexpr const char* names[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+    };
+    return names[static_cast<uint8_t>(reg)];
+}
+
+// [base + index * scale + disp], always 64 bits wide
+struct Mem {
+    Reg base;
+    int32_t disp = 0;
+    std::optional<Reg> index{};
+    uint8_t scale = 1;
+};
+
+struct Label {
+    size_t id;
+};
+
+using Operand = std::variant<std::monostate, Reg, int64_t, Mem, Label>;
+
+// Condition codes, ordered by their encoding
+enum class Cond : uint8_t {
+    o,
+    no,
+    b,
+    ae,
+    z,
+    nz,
+    be,
+    a,
+    s,
+    ns,
+    p,
+    np,
+    l,
+    ge,
+    le,
+    g
+};
+
+inline std::string_view to_string(const Cond cond) {
+    static constexpr const char* names[] = {
+        "o", "no", "b", "ae", "z", "nz", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"
+    };
+    return names[static_cast<uint8_t>(cond)];
+}
+
+// The condition that holds exactly when cond does not; they differ in the lowest bit
+inline Cond negate(const Cond cond) {
+    return static_cast<Cond>(static_cast<uint8_t>(cond) ^ 1);
+}
+
+enum class Op {
+    mov,
+    push,
+    pop,
+    add,
+    sub,
+    imul,
+    idiv,
+    cqo,
+    neg,
+    shl,
+    shr,
+    sar,
+    lea,
+    xor_,
+    test,
+    cmp,
+    // sets the low byte of dst to whether cond holds
+    setcc,
+    // zero extends the low byte of src into dst
+    movzx,
+    jmp,
+    jcc,
+    call,
+    syscall,
+    ret,
+    label
+};
+
+inline std::string_view to_string(const Op op) {
+    switch (op) {
+        case Op::mov:
+            return "mov";
+        case Op::push:
+            return "push";
+        case Op::pop:
+            return "pop";
+        case Op::add:
+            return "add";
+        case Op::sub:
+            return "sub";
+        case Op::imul:
+            return "imul";
+        case Op::idiv:
+            return "idiv";
+        case Op::cqo:
+            return "cqo";
+        case Op::neg:
+            return "neg";
+        case Op::shl:
+            return "shl";
+        case Op::shr:
+            return "shr";
+        case Op::sar:
+            return "sar";
+        case Op::lea:
+            return "lea";
+        case Op::xor_:
+            return "xor";
+        case Op::test:
+            return "test";
+        case Op::cmp:
+            return "cmp";
+        case Op::setcc:
+            return "set";
+        case Op::movzx:
+            return "movzx";
+        case Op::jmp:
+            return "jmp";
+        case Op::jcc:
+            return "j";
+        case Op::call:
+            return "call";
+        case Op::syscall:
+            return "syscall";
+        case Op::ret:
+            return "ret";
+        case Op::label:
+            return "label";
+    }
+    return {};
+}
+
+struct Instr {
+    Op op;
+    Operand dst{};
+    Operand src{};
+    Cond cond = Cond::z;
+};
+
+template <typename Sink>
+void write_nasm(Sink& sink, const Operand& operand, const bool sized = true) {
+    struct OperandVisitor {
+        Sink& sink;
+        bool sized;
+
+        void operator()(const std::monostate) const {
+        }
+
+        void operator()(const Reg reg) const {
+            sink.append(to_string(reg));
+        }
+
+        void operator()(const int64_t imm) const {
+            sink.append_int(imm);
+        }
+
+        void operator()(const Mem& mem) const {
+            sink.append(sized ? "QWORD [" : "[");
+            sink.append(to_string(mem.base));
+            if (mem.index.has_value()) {
+                sink.append(" + ");
+                sink.append(to_string(mem.index.value()));
+                sink.append('*');
+                sink.append_int(mem.scale);
+            }
+            if (mem.disp < 0) {
+                sink.append(" - ");
+                sink.append_int(-static_cast<int64_t>(mem.disp));
+            } else if (mem.disp > 0 || !mem.index.has_value()) {
+                sink.append(" + ");
+                sink.append_int(mem.disp);
+            }
+            sink.append(']');
+        }
+
+        void operator()(const Label label) const {
+            sink.append("label");
+            sink.append_int(static_cast<int64_t>(label.id));
+        }
+    };
+
+    std::visit(OperandVisitor { .sink = sink, .sized = sized }, operand);
+}
+
+// Writes the program as nasm source, one instruction at a time
+template <typename Sink>
+void write_nasm(Sink& sink, const std::vector<Instr>& instrs) {
+    sink.append("global _start\n_start:\n");
+    for (const Instr& instr : instrs) {
+        if (instr.op == Op::label) {
+            write_nasm(sink, instr.dst);
+            sink.append(":\n");
+            continue;
+        }
+        sink.append("    ");
+        sink.append(to_string(instr.op));
+        if (instr.op == Op::jcc || instr.op == Op::setcc) {
+            sink.append(to_string(instr.cond));
+        }
+        if (instr.op == Op::setcc) {
+            sink.append(' ');
+            sink.append(to_byte_string(std::get<Reg>(instr.dst)));
+        } else if (!std::holds_alternative<std::monostate>(instr.dst)) {
+            sink.append(' ');
+            write_nasm(sink, instr.dst);
+        }
+        if (instr.op == Op::movzx) {
+            sink.append(", ");
+            sink.append(to_byte_string(std::get<Reg>(instr.src)));
+        } else if (!std::holds_alternative<std::monostate>(instr.src)) {
+            sink.append(", ");
+            write_nasm(sink, instr.src, instr.op != Op::lea);
+        }
+        sink.append('\n');
+    }
+}
+
+inline std::string to_nasm(const Operand& operand, const bool sized = true) {
+    StringSink sink;
+    write_nasm(sink, operand, sized);
+    return sink.take();
+}
+
+inline std::string to_nasm(const std::vector<Instr>& instrs) {
+    StringSink sink;
+    write_nasm(sink, instrs);
+    return sink.take();
+}
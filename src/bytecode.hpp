@@ -0,0 +1,676 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "./compile_error.hpp"
+#include "./flat_ast.hpp"
+
+// Register based bytecode for the interpreter backend (see interpreter.hpp). Every variable
+// and intermediate value lives in a numbered 64 bit register of the frame.
+
+enum class BcOp : uint8_t {
+    load_imm,   // dst = rhs
+    load_const, // dst = constants[rhs]
+    mov,        // dst = lhs
+    add,        // dst = lhs + rhs
+    sub,        // dst = lhs - rhs
+    mul,        // dst = lhs * rhs
+    div,        // dst = lhs / rhs
+    add_imm,    // dst = lhs + imm
+    sub_imm,    // dst = lhs - imm
+    mul_imm,    // dst = lhs * imm
+    div_imm,    // dst = lhs / imm
+    eq,         // dst = lhs == rhs, 1 or 0, and so on for the other comparisons
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    to_bool,    // dst = lhs != 0
+    jz,         // if lhs == 0 jump to rhs
+    jnz,        // if lhs != 0 jump to rhs
+    jeq,        // if lhs == dst jump to rhs, and so on: a comparison fused with the branch on it
+    jne,
+    jlt,
+    jle,
+    jgt,
+    jge,
+    jmp,        // jump to rhs
+    exit,       // exit with lhs
+    call,       // dst = functions[rhs](registers lhs...), whose frame starts at register lhs
+    ret         // return lhs to the caller
+};
+
+// 12 bytes; rhs is a register, an immediate, a constant index or an instruction index
+// depending on the op, and dst the second operand of the compare and branch ops
+struct BcInstr {
+    BcOp op;
+    uint16_t dst = 0;
+    uint16_t lhs = 0;
+    int32_t rhs = 0;
+};
+
+// The parameters are the first registers of the frame
+struct BcFunction {
+    size_t entry;
+    size_t frame_size;
+};
+
+struct BcProgram {
+    std::vector<BcInstr> code;
+    std::vector<int64_t> constants;
+    size_t frame_size = 0;
+    std::vector<BcFunction> functions;
+};
+
+// Lowers the AST to bytecode. Variables get a register for the lifetime of their scope,
+// temporaries are stacked on top of them and released as soon as they have been consumed.
+class BytecodeGenerator {
+public:
+    explicit BytecodeGenerator(const FlatAst& ast)
+        : m_ast(ast) {
+
+    }
+
+    // Evaluates expr and returns the register holding its value. If dst is given the value
+    // is placed there, otherwise variables are read from their own register without a copy.
+    // Operators and calls wait on an explicit stack until their operands have been evaluated, so
+    // deeply nested expressions do not exhaust the native stack.
+    uint16_t gen_expr(ExprRef expr, std::optional<uint16_t> dst = {}) {
+        std::vector<Pending> pending;
+        while (true) {
+            const ExprKind kind = m_ast.expr_kind(expr);
+            if (FlatAst::is_bin_op(kind)) {
+                pending.push_back({ .expr = expr, .dst = dst, .mark = m_next_reg });
+                const auto imm = imm_operands(expr);
+                expr = imm.has_value() ? imm->first : m_ast.lhs(expr);
+                dst.reset();
+                continue;
+            }
+            uint16_t reg;
+            if (kind == ExprKind::call) {
+                // the arguments go to consecutive registers above everything live, which become
+                // the start of the callee's frame. A fresh destination is not live yet.
+                const bool fresh = dst.has_value() && static_cast<size_t>(dst.value()) + 1 == m_next_reg &&
+                                   (m_vars.empty() || m_vars.back().reg != dst.value());
+                pending.push_back({ .expr = expr, .dst = dst, .mark = m_next_reg, .call = true,
+                                    .base = fresh ? dst.value() : m_next_reg });
+                if (next_arg(pending.back(), expr, dst)) {
+                    continue;
+                }
+                reg = gen_call(pending.back());
+                pending.pop_back();
+            } else {
+                reg = gen_term(expr, dst);
+            }
+            while (!pending.empty()) {
+                Pending& top = pending.back();
+                if (top.call) {
+                    if (next_arg(top, expr, dst)) {
+                        break;
+                    }
+                    reg = gen_call(top);
+                    pending.pop_back();
+                    continue;
+                }
+                const ExprKind top_kind = m_ast.expr_kind(top.expr);
+                if ((top_kind == ExprKind::and_ || top_kind == ExprKind::or_) && !top.skip.has_value()) {
+                    gen_logic_head(top, reg);
+                    expr = m_ast.rhs(top.expr);
+                    dst = top.logic_reg;
+                    break;
+                }
+                if (top.skip.has_value()) {
+                    reg = gen_logic_tail(top, reg);
+                    pending.pop_back();
+                    continue;
+                }
+                const auto imm = imm_operands(top.expr);
+                if (!imm.has_value() && !top.lhs_reg.has_value()) {
+                    top.lhs_reg = reg;
+                    expr = m_ast.rhs(top.expr);
+                    dst.reset();
+                    break;
+                }
+                // both operands are evaluated before the result register is claimed, so the
+                // result may reuse the register of a temporary operand
+                m_next_reg = top.mark;
+                const uint16_t result = top.dst.has_value() ? top.dst.value() : alloc_reg();
+                if (imm.has_value()) {
+                    emit({ .op = imm_form(bin_op(m_ast.expr_kind(top.expr))), .dst = result, .lhs = reg, .rhs = imm->second });
+                } else {
+                    emit({ .op = bin_op(m_ast.expr_kind(top.expr)), .dst = result, .lhs = top.lhs_reg.value(), .rhs = reg });
+                }
+                reg = result;
+                pending.pop_back();
+            }
+            if (pending.empty()) {
+                return reg;
+            }
+        }
+    }
+
+    // Loads a literal or variable; calls are handled by gen_expr, which evaluates the arguments
+    uint16_t gen_term(const ExprRef expr, const std::optional<uint16_t> dst) {
+        if (m_ast.expr_kind(expr) == ExprKind::int_lit) {
+            const uint16_t reg = dst.has_value() ? dst.value() : alloc_reg();
+            gen_load(reg, m_ast.literal(expr));
+            return reg;
+        }
+        assert(m_ast.expr_kind(expr) == ExprKind::ident);
+        const uint16_t reg = m_vars[m_ast.slot(expr)].reg;
+        if (dst.has_value() && dst.value() != reg) {
+            emit({ .op = BcOp::mov, .dst = dst.value(), .lhs = reg });
+            return dst.value();
+        }
+        return reg;
+    }
+
+    // An operator or call of gen_expr waiting for its operands
+    struct Pending {
+        ExprRef expr;
+        std::optional<uint16_t> dst;
+        // first register free for the operands, and so for the result
+        size_t mark;
+        std::optional<uint16_t> lhs_reg{};
+        bool call = false;
+        // register of the first argument, and the number of arguments evaluated so far
+        size_t base = 0;
+        size_t done = 0;
+        // of a && or || once its left operand is done: where it goes if that decides the
+        // result, and the temporary the result is built in
+        std::optional<size_t> skip{};
+        uint16_t logic_reg = 0;
+    };
+
+    // Puts the left operand of a && or || in reg, as 0 or 1, into a temporary for the result
+    // and jumps to the end if that decides it. The result is not written to dst before the right
+    // operand has been evaluated, which may still read the variable dst belongs to.
+    void gen_logic_head(Pending& pending, const uint16_t reg) {
+        const ExprKind kind = m_ast.expr_kind(pending.expr);
+        m_next_reg = pending.mark;
+        pending.logic_reg = alloc_reg();
+        if (!is_boolean(m_ast.lhs(pending.expr))) {
+            emit({ .op = BcOp::to_bool, .dst = pending.logic_reg, .lhs = reg });
+        } else if (reg != pending.logic_reg) {
+            emit({ .op = BcOp::mov, .dst = pending.logic_reg, .lhs = reg });
+        }
+        pending.skip = create_label();
+        emit({ .op = kind == ExprKind::and_ ? BcOp::jz : BcOp::jnz, .lhs = pending.logic_reg, .rhs = static_cast<int32_t>(pending.skip.value()) });
+    }
+
+    // Turns the right operand of a && or ||, evaluated into the temporary of the result, into 0
+    // or 1 and returns the register holding the result
+    uint16_t gen_logic_tail(const Pending& pending, const uint16_t reg) {
+        if (!is_boolean(m_ast.rhs(pending.expr))) {
+            emit({ .op = BcOp::to_bool, .dst = pending.logic_reg, .lhs = reg });
+        } else if (reg != pending.logic_reg) {
+            emit({ .op = BcOp::mov, .dst = pending.logic_reg, .lhs = reg });
+        }
+        place_label(pending.skip.value());
+        m_next_reg = pending.mark;
+        if (pending.dst.has_value()) {
+            emit({ .op = BcOp::mov, .dst = pending.dst.value(), .lhs = pending.logic_reg });
+            return pending.dst.value();
+        }
+        return alloc_reg();
+    }
+
+    // Whether the value of expr is always 0 or 1
+    [[nodiscard]] bool is_boolean(const ExprRef expr) const {
+        const ExprKind kind = m_ast.expr_kind(expr);
+        return FlatAst::is_comparison(kind) || kind == ExprKind::and_ || kind == ExprKind::or_;
+    }
+
+    // Sets up expr and dst for the next argument of the call in pending, if there is one left
+    bool next_arg(Pending& pending, ExprRef& expr, std::optional<uint16_t>& dst) {
+        if (pending.done == m_ast.args(pending.expr).size()) {
+            return false;
+        }
+        // everything above the arguments evaluated so far is free
+        m_next_reg = pending.base + pending.done;
+        dst = alloc_reg();
+        expr = m_ast.args(pending.expr)[pending.done++];
+        return true;
+    }
+
+    uint16_t gen_call(const Pending& pending) {
+        m_next_reg = pending.mark;
+        const uint16_t result = pending.dst.has_value() ? pending.dst.value() : alloc_reg();
+        emit({ .op = BcOp::call, .dst = result, .lhs = static_cast<uint16_t>(pending.base), .rhs = static_cast<int32_t>(m_ast.callee(pending.expr)) });
+        return result;
+    }
+
+    static BcOp bin_op(const ExprKind kind) {
+        switch (kind) {
+            case ExprKind::add:
+                return BcOp::add;
+            case ExprKind::sub:
+                return BcOp::sub;
+            case ExprKind::mul:
+                return BcOp::mul;
+            case ExprKind::div:
+                return BcOp::div;
+            case ExprKind::eq:
+                return BcOp::eq;
+            case ExprKind::ne:
+                return BcOp::ne;
+            case ExprKind::lt:
+                return BcOp::lt;
+            case ExprKind::le:
+                return BcOp::le;
+            case ExprKind::gt:
+                return BcOp::gt;
+            default:
+                return BcOp::ge;
+        }
+    }
+
+    // The compare and branch op for a comparison
+    static BcOp jump_op(const ExprKind kind) {
+        return static_cast<BcOp>(static_cast<uint8_t>(BcOp::jeq) + (static_cast<uint8_t>(bin_op(kind)) - static_cast<uint8_t>(BcOp::eq)));
+    }
+
+    // The compare and branch op that jumps exactly when op does not
+    static BcOp negate_jump(const BcOp op) {
+        switch (op) {
+            case BcOp::jeq:
+                return BcOp::jne;
+            case BcOp::jne:
+                return BcOp::jeq;
+            case BcOp::jlt:
+                return BcOp::jge;
+            case BcOp::jle:
+                return BcOp::jgt;
+            case BcOp::jgt:
+                return BcOp::jle;
+            default:
+                return BcOp::jlt;
+        }
+    }
+
+    // The operand to evaluate and the immediate to combine it with, if the operator has an
+    // immediate form for these operands. Addition and multiplication take a small constant on
+    // either side; comparisons have no immediate form.
+    [[nodiscard]] std::optional<std::pair<ExprRef, int32_t>> imm_operands(const ExprRef bin_expr) const {
+        const ExprRef lhs = m_ast.lhs(bin_expr);
+        const ExprRef rhs = m_ast.rhs(bin_expr);
+        const ExprKind kind = m_ast.expr_kind(bin_expr);
+        if (kind > ExprKind::div) {
+            return {};
+        }
+        if (const auto value = imm_value(rhs)) {
+            return std::pair { lhs, value.value() };
+        }
+        const bool commutes = kind == ExprKind::add || kind == ExprKind::mul;
+        if (const auto value = imm_value(lhs); value.has_value() && commutes) {
+            return std::pair { rhs, value.value() };
+        }
+        return {};
+    }
+
+    // Opens the scope; its statements are generated by gen_stmt
+    void gen_scope(const std::span<const StmtRef> stmts) {
+        begin_scope();
+        m_work.push_back(ScopeWork { .stmts = stmts });
+    }
+
+    // Generates the condition of an elif and queues its arm and the rest of the chain for
+    // gen_stmt, or opens the scope of an else
+    void gen_else(const StmtRef stmt, const size_t end_label) {
+        if (m_ast.stmt_kind(stmt) == StmtKind::scope) {
+            gen_scope(m_ast.body(stmt));
+            return;
+        }
+        const size_t label = create_label();
+        gen_branch(m_ast.stmt_expr(stmt), false, label);
+        if (const StmtRef else_stmt = m_ast.else_stmt(stmt); else_stmt != no_node) {
+            m_work.push_back(ElseWork { .stmt = else_stmt, .end_label = end_label });
+        }
+        m_work.push_back(LabelWork { .jump = end_label, .label = label });
+        gen_scope(m_ast.body(stmt));
+    }
+
+    // Generates stmt and everything nested in it. Nested scopes and if arms are queued on an
+    // explicit work stack rather than generated recursively.
+    void gen_stmt(const StmtRef stmt) {
+        const size_t base = m_work.size();
+        gen_stmt_head(stmt);
+        while (m_work.size() > base) {
+            if (const auto scope_work = std::get_if<ScopeWork>(&m_work.back())) {
+                if (scope_work->next == scope_work->stmts.size()) {
+                    m_work.pop_back();
+                    end_scope();
+                } else {
+                    gen_stmt_head(scope_work->stmts[scope_work->next++]);
+                }
+                continue;
+            }
+            const Work work = m_work.back();
+            m_work.pop_back();
+            if (const auto else_work = std::get_if<ElseWork>(&work)) {
+                gen_else(else_work->stmt, else_work->end_label);
+            } else if (const auto loop_work = std::get_if<LoopWork>(&work)) {
+                place_label(loop_work->test);
+                gen_branch(loop_work->expr, true, loop_work->top);
+            } else {
+                const auto& label_work = std::get<LabelWork>(work);
+                if (label_work.jump.has_value()) {
+                    emit({ .op = BcOp::jmp, .rhs = static_cast<int32_t>(label_work.jump.value()) });
+                }
+                place_label(label_work.label);
+            }
+        }
+    }
+
+    // Generates a statement up to the statements nested in it, which are queued on m_work
+    void gen_stmt_head(const StmtRef stmt) {
+        const ExprRef expr = m_ast.stmt_expr(stmt);
+        switch (m_ast.stmt_kind(stmt)) {
+            case StmtKind::exit: {
+                const size_t mark = m_next_reg;
+                const uint16_t reg = gen_expr(expr);
+                m_next_reg = mark;
+                emit({ .op = BcOp::exit, .lhs = reg });
+                break;
+            }
+            case StmtKind::var: {
+                // no temporaries are live between statements, so the next register is the
+                // variable's own and the value can be computed straight into it
+                const uint16_t reg = alloc_reg();
+                gen_expr(expr, reg);
+                m_vars.push_back({ .reg = reg });
+                break;
+            }
+            case StmtKind::assign:
+                gen_expr(expr, m_vars[m_ast.assign_slot(stmt)].reg);
+                break;
+            case StmtKind::scope:
+                gen_scope(m_ast.body(stmt));
+                break;
+            case StmtKind::if_: {
+                const size_t label = create_label();
+                gen_branch(expr, false, label);
+                // queued in reverse: the scope, then the elif/else chain if any, then the end label
+                if (const StmtRef else_stmt = m_ast.else_stmt(stmt); else_stmt != no_node) {
+                    const size_t end_label = create_label();
+                    m_work.push_back(LabelWork { .label = end_label });
+                    m_work.push_back(ElseWork { .stmt = else_stmt, .end_label = end_label });
+                    m_work.push_back(LabelWork { .jump = end_label, .label = label });
+                } else {
+                    m_work.push_back(LabelWork { .label = label });
+                }
+                gen_scope(m_ast.body(stmt));
+                break;
+            }
+            // Bottom tested like the native code, see Generator
+            case StmtKind::while_: {
+                const size_t top = create_label();
+                const size_t test = create_label();
+                emit({ .op = BcOp::jmp, .rhs = static_cast<int32_t>(test) });
+                place_label(top);
+                m_work.push_back(LoopWork { .expr = expr, .top = top, .test = test });
+                gen_scope(m_ast.body(stmt));
+                break;
+            }
+            case StmtKind::return_: {
+                const size_t mark = m_next_reg;
+                if (m_ast.expr_kind(expr) != ExprKind::call || m_ast.callee(expr) != m_function) {
+                    const uint16_t reg = gen_expr(expr);
+                    m_next_reg = mark;
+                    emit({ .op = BcOp::ret, .lhs = reg });
+                    break;
+                }
+                // a tail call of the function itself replaces the parameters and starts over
+                const std::span<const ExprRef> args = m_ast.args(expr);
+                for (const ExprRef arg : args) {
+                    gen_expr(arg, alloc_reg());
+                }
+                for (size_t i = 0; i < args.size(); i++) {
+                    emit({ .op = BcOp::mov, .dst = static_cast<uint16_t>(i), .lhs = static_cast<uint16_t>(mark + i) });
+                }
+                m_next_reg = mark;
+                emit({ .op = BcOp::jmp, .rhs = static_cast<int32_t>(m_function_labels[m_function]) });
+                break;
+            }
+        }
+    }
+
+    // Generates the function at its label, with the parameters in the first registers
+    void gen_function(const size_t index) {
+        const FlatFunction& function = m_ast.functions[index];
+        m_function = index;
+        m_vars.clear();
+        m_next_reg = 0;
+        m_frame_size = 0;
+        place_label(m_function_labels[index]);
+        for (size_t i = 0; i < function.param_count; i++) {
+            m_vars.push_back({ .reg = alloc_reg() });
+        }
+        const std::span<const StmtRef> body = m_ast.list(function.body);
+        for (const StmtRef stmt : body) {
+            gen_stmt(stmt);
+        }
+        if (body.empty() || m_ast.stmt_kind(body.back()) != StmtKind::return_) {
+            const uint16_t reg = alloc_reg();
+            emit({ .op = BcOp::load_imm, .dst = reg, .rhs = 0 });
+            emit({ .op = BcOp::ret, .lhs = reg });
+        }
+        m_output.functions[index].frame_size = m_frame_size;
+    }
+
+    [[nodiscard]] BcProgram gen_prog() {
+        for (size_t i = 0; i < m_ast.functions.size(); i++) {
+            m_function_labels.push_back(create_label());
+        }
+        const std::span<const StmtRef> stmts = m_ast.list(m_ast.main);
+        for (const StmtRef stmt : stmts) {
+            gen_stmt(stmt);
+        }
+        if (stmts.empty() || m_ast.stmt_kind(stmts.back()) != StmtKind::exit) {
+            const uint16_t reg = alloc_reg();
+            emit({ .op = BcOp::load_imm, .dst = reg, .rhs = 0 });
+            emit({ .op = BcOp::exit, .lhs = reg });
+        }
+        m_output.frame_size = m_frame_size;
+        m_output.functions.resize(m_ast.functions.size());
+        for (size_t i = 0; i < m_ast.functions.size(); i++) {
+            gen_function(i);
+        }
+
+        // jumps refer to labels until every label has been placed
+        for (BcInstr& instr : m_output.code) {
+            if (instr.op >= BcOp::jz && instr.op <= BcOp::jmp) {
+                instr.rhs = static_cast<int32_t>(m_labels[instr.rhs]);
+            }
+        }
+        for (size_t i = 0; i < m_ast.functions.size(); i++) {
+            m_output.functions[i].entry = m_labels[m_function_labels[i]];
+        }
+        return std::move(m_output);
+    }
+
+private:
+
+    void emit(const BcInstr& instr) {
+        m_output.code.push_back(instr);
+    }
+
+    void gen_load(const uint16_t reg, const int64_t value) {
+        if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+            emit({ .op = BcOp::load_imm, .dst = reg, .rhs = static_cast<int32_t>(value) });
+            return;
+        }
+        auto it = std::ranges::find(m_output.constants, value);
+        if (it == m_output.constants.end()) {
+            m_output.constants.push_back(value);
+            it = std::prev(m_output.constants.end());
+        }
+        emit({ .op = BcOp::load_const, .dst = reg, .rhs = static_cast<int32_t>(it - m_output.constants.begin()) });
+    }
+
+    // Jumps to label if expr is non-zero when jump_if is set, or if it is zero when it is not,
+    // and falls through otherwise. A comparison becomes one compare and branch op and && and ||
+    // branch on each operand in turn, like Generator::gen_branch does.
+    void gen_branch(const ExprRef expr, const bool jump_if, const size_t label) {
+        struct Branch {
+            ExprRef expr;
+            bool jump_if;
+            size_t label;
+        };
+        // a label (as a size_t) is placed once everything above it is done
+        std::vector<std::variant<Branch, size_t>> pending { Branch { .expr = expr, .jump_if = jump_if, .label = label } };
+        while (!pending.empty()) {
+            const auto item = pending.back();
+            pending.pop_back();
+            if (const auto place = std::get_if<size_t>(&item)) {
+                place_label(*place);
+                continue;
+            }
+            const Branch branch = std::get<Branch>(item);
+            const ExprKind kind = m_ast.expr_kind(branch.expr);
+            const ExprRef lhs = m_ast.lhs(branch.expr);
+            const ExprRef rhs = m_ast.rhs(branch.expr);
+            const auto target = static_cast<int32_t>(branch.label);
+            if (kind == ExprKind::and_ || kind == ExprKind::or_) {
+                const bool decides = kind == ExprKind::or_;
+                if (branch.jump_if == decides) {
+                    pending.push_back(Branch { .expr = rhs, .jump_if = branch.jump_if, .label = branch.label });
+                    pending.push_back(Branch { .expr = lhs, .jump_if = branch.jump_if, .label = branch.label });
+                } else {
+                    const size_t skip = create_label();
+                    pending.push_back(skip);
+                    pending.push_back(Branch { .expr = rhs, .jump_if = branch.jump_if, .label = branch.label });
+                    pending.push_back(Branch { .expr = lhs, .jump_if = decides, .label = skip });
+                }
+                continue;
+            }
+            if ((kind == ExprKind::eq || kind == ExprKind::ne) && m_ast.expr_kind(rhs) == ExprKind::int_lit && m_ast.literal(rhs) == 0) {
+                pending.push_back(Branch { .expr = lhs, .jump_if = branch.jump_if == (kind == ExprKind::ne), .label = branch.label });
+                continue;
+            }
+            if (kind == ExprKind::int_lit) {
+                if ((m_ast.literal(branch.expr) != 0) == branch.jump_if) {
+                    emit({ .op = BcOp::jmp, .rhs = target });
+                }
+                continue;
+            }
+            const size_t mark = m_next_reg;
+            if (FlatAst::is_comparison(kind)) {
+                const uint16_t lhs_reg = gen_expr(lhs);
+                const uint16_t rhs_reg = gen_expr(rhs);
+                m_next_reg = mark;
+                const BcOp op = jump_op(kind);
+                emit({ .op = branch.jump_if ? op : negate_jump(op), .dst = rhs_reg, .lhs = lhs_reg, .rhs = target });
+                continue;
+            }
+            const uint16_t reg = gen_expr(branch.expr);
+            m_next_reg = mark;
+            emit({ .op = branch.jump_if ? BcOp::jnz : BcOp::jz, .lhs = reg, .rhs = target });
+        }
+    }
+
+    size_t create_label() {
+        m_labels.push_back(0);
+        return m_labels.size() - 1;
+    }
+
+    void place_label(const size_t label) {
+        m_labels[label] = m_output.code.size();
+    }
+
+    uint16_t alloc_reg() {
+        if (m_next_reg > std::numeric_limits<uint16_t>::max()) {
+            throw CompileError("Too many live values for the bytecode backend");
+        }
+        m_frame_size = std::max(m_frame_size, m_next_reg + 1);
+        return static_cast<uint16_t>(m_next_reg++);
+    }
+
+    void begin_scope() {
+        m_scopes.push_back(m_vars.size());
+    }
+
+    void end_scope() {
+        m_vars.resize(m_scopes.back());
+        m_next_reg = m_vars.empty() ? 0 : m_vars.back().reg + 1;
+        m_scopes.pop_back();
+    }
+
+    static BcOp imm_form(const BcOp op) {
+        switch (op) {
+            case BcOp::add:
+                return BcOp::add_imm;
+            case BcOp::sub:
+                return BcOp::sub_imm;
+            case BcOp::mul:
+                return BcOp::mul_imm;
+            default:
+                return BcOp::div_imm;
+        }
+    }
+
+    // Value of expr if it is an integer literal that fits the instruction's immediate
+    [[nodiscard]] std::optional<int32_t> imm_value(const ExprRef expr) const {
+        if (m_ast.expr_kind(expr) != ExprKind::int_lit) {
+            return {};
+        }
+        const int64_t value = m_ast.literal(expr);
+        if (value < std::numeric_limits<int32_t>::min() || value > std::numeric_limits<int32_t>::max()) {
+            return {};
+        }
+        return static_cast<int32_t>(value);
+    }
+
+    struct Var {
+        uint16_t reg;
+    };
+
+    // Statements of an open scope, of which next is generated next; the scope ends after the last
+    struct ScopeWork {
+        std::span<const StmtRef> stmts;
+        size_t next = 0;
+    };
+
+    // The elif/else chain following an arm of an if
+    struct ElseWork {
+        StmtRef stmt;
+        size_t end_label;
+    };
+
+    // Places label, after a jump to jump if set
+    struct LabelWork {
+        std::optional<size_t> jump{};
+        size_t label;
+    };
+
+    // The test of a while loop, placed after its body: jumps back to top while expr holds
+    struct LoopWork {
+        ExprRef expr;
+        size_t top;
+        size_t test;
+    };
+
+    using Work = std::variant<ScopeWork, ElseWork, LabelWork, LoopWork>;
+
+    const FlatAst& m_ast;
+    BcProgram m_output{};
+    std::vector<Var> m_vars{};
+    std::vector<size_t> m_scopes{};
+    std::vector<size_t> m_labels{};
+    std::vector<Work> m_work{};
+    size_t m_next_reg = 0;
+    // of the program or function being generated
+    size_t m_frame_size = 0;
+    std::vector<size_t> m_function_labels{};
+    size_t m_function = 0;
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./compile_error.hpp"
+#include "./sha256.hpp"
+
+// Bumped whenever the generated code changes in a way the executable's own identity (see
+// CompileCache::key) would not reflect
+constexpr const char* helium_version = "0.2.0";
+
+// Persistent content addressed cache of compiled executables, shared by all helium processes
+// using the same directory. An entry is named after the hash of everything that determines
+// the output: the source, the compiler and the flags, so a hit can skip compilation entirely.
+//
+// Entries are written under a temporary name and renamed into place, so a reader never sees a
+// partial file. Everything touching the index of the cache (lookups, insertion, eviction and
+// the hit/miss counters) happens under an flock on the lock file. Hits refresh the
+// modification time of the entry, which eviction uses to drop the least recently used
+// entries once the cache grows beyond its size limit.
+class CompileCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    explicit CompileCache(std::filesystem::path dir, const uint64_t max_bytes = default_max_bytes)
+        : m_dir(std::move(dir)),
+          m_max_bytes(max_bytes) {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+        m_lock_fd = open((m_dir / "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_lock_fd < 0) {
+            throw CompileError("Could not open the compilation cache in " + m_dir.string());
+        }
+    }
+
+    CompileCache(const CompileCache&) = delete;
+    CompileCache& operator=(const CompileCache&) = delete;
+
+    ~CompileCache() {
+        close(m_lock_fd);
+    }
+
+    // $HELIUM_CACHE_DIR, else $XDG_CACHE_HOME/helium, else ~/.cache/helium
+    [[nodiscard]] static std::filesystem::path default_dir() {
+        if (const char* dir = std::getenv("HELIUM_CACHE_DIR"); dir != nullptr && *dir != '\0') {
+            return dir;
+        }
+        if (const char* dir = std::getenv("XDG_CACHE_HOME"); dir != nullptr && *dir != '\0') {
+            return std::filesystem::path(dir) / "helium";
+        }
+        if (const char* home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+            return std::filesystem::path(home) / ".cache" / "helium";
+        }
+        return std::filesystem::temp_directory_path() / "helium-cache";
+    }
+
+    // $HELIUM_CACHE_SIZE in bytes, else 64 MiB
+    [[nodiscard]] static uint64_t default_max_size() {
+        if (const char* size = std::getenv("HELIUM_CACHE_SIZE"); size != nullptr && *size != '\0') {
+            return std::strtoull(size, nullptr, 10);
+        }
+        return default_max_bytes;
+    }
+
+    // The compiler is identified by its version and the size and modification time of its own
+    // executable, so rebuilding helium invalidates everything it cached before
+    [[nodiscard]] static std::string key(const std::string_view src, const std::string& flags) {
+        Sha256 sha;
+        sha.update(helium_version);
+        sha.update(std::string_view("\0", 1));
+        struct stat self{};
+        if (stat("/proc/self/exe", &self) == 0) {
+            sha.update(std::to_string(self.st_size) + ":" + std::to_string(self.st_mtim.tv_sec) + "." +
+                       std::to_string(self.st_mtim.tv_nsec));
+        }
+        sha.update(std::string_view("\0", 1));
+        sha.update(flags);
+        sha.update(std::string_view("\0", 1));
+        sha.update(src);
+        return sha.hex_digest();
+    }
+
+    // Copies the cached executable (and, with asm_path, the assembly) for key to the given
+    // paths. Returns whether there was a complete entry.
+    bool fetch(const std::string& key, const std::filesystem::path& exe_path, const std::optional<std::filesystem::path>& asm_path) {
+        const Lock lock(m_lock_fd);
+        const std::filesystem::path exe_entry = m_dir / (key + ".out");
+        const std::filesystem::path asm_entry = m_dir / (key + ".asm");
+        std::error_code ec;
+        const bool found = std::filesystem::exists(exe_entry, ec) &&
+                           (!asm_path.has_value() || std::filesystem::exists(asm_entry, ec));
+        Stats stats = read_stats();
+        if (!found) {
+            stats.misses++;
+            write_stats(stats);
+            return false;
+        }
+        if (!copy_out(exe_entry, exe_path) || (asm_path.has_value() && !copy_out(asm_entry, asm_path.value()))) {
+            stats.misses++;
+            write_stats(stats);
+            return false;
+        }
+        std::filesystem::permissions(exe_path, std::filesystem::perms(0755), ec);
+        // the modification time doubles as the last use for eviction
+        const auto now = std::filesystem::file_time_type::clock::now();
+        std::filesystem::last_write_time(exe_entry, now, ec);
+        stats.hits++;
+        write_stats(stats);
+        return true;
+    }
+
+    // Adds the freshly compiled outputs under key and evicts least recently used entries until
+    // the cache fits its size limit again
+    void store(const std::string& key, const std::filesystem::path& exe_path, const std::optional<std::filesystem::path>& asm_path) {
+        // copied under a name unique to this process and thread first, so only the renames
+        // need the lock
+        const std::string tmp_suffix = ".tmp" + std::to_string(getpid()) + "-" +
+                                       std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        const std::filesystem::path exe_tmp = m_dir / (key + ".out" + tmp_suffix);
+        const std::filesystem::path asm_tmp = m_dir / (key + ".asm" + tmp_suffix);
+        std::error_code ec;
+        if (!std::filesystem::copy_file(exe_path, exe_tmp, std::filesystem::copy_options::overwrite_existing, ec) ||
+            (asm_path.has_value() && !std::filesystem::copy_file(asm_path.value(), asm_tmp, std::filesystem::copy_options::overwrite_existing, ec))) {
+            // the cache is only an optimization, failing to fill it is not an error
+            std::filesystem::remove(exe_tmp, ec);
+            std::filesystem::remove(asm_tmp, ec);
+            return;
+        }
+
+        const Lock lock(m_lock_fd);
+        // the assembly goes first, an entry is complete once its executable is in place
+        if (asm_path.has_value()) {
+            std::filesystem::rename(asm_tmp, m_dir / (key + ".asm"), ec);
+        }
+        std::filesystem::rename(exe_tmp, m_dir / (key + ".out"), ec);
+        evict();
+    }
+
+    [[nodiscard]] Stats stats() {
+        const Lock lock(m_lock_fd);
+        Stats stats = read_stats();
+        for (const Entry& entry : entries()) {
+            stats.entries++;
+            stats.bytes += entry.bytes;
+        }
+        return stats;
+    }
+
+private:
+    static constexpr uint64_t default_max_bytes = 64ull * 1024 * 1024;
+
+    class Lock {
+    public:
+        explicit Lock(const int fd) : m_fd(fd) {
+            flock(m_fd, LOCK_EX);
+        }
+
+        Lock(const Lock&) = delete;
+        Lock& operator=(const Lock&) = delete;
+
+        ~Lock() {
+            flock(m_fd, LOCK_UN);
+        }
+
+    private:
+        int m_fd;
+    };
+
+    struct Entry {
+        std::string key;
+        std::filesystem::file_time_type last_use;
+        uint64_t bytes;
+    };
+
+    // Complete entries, i.e. those with an executable; the size includes the assembly
+    [[nodiscard]] std::vector<Entry> entries() const {
+        std::vector<Entry> entries;
+        std::error_code ec;
+        for (const auto& file : std::filesystem::directory_iterator(m_dir, ec)) {
+            if (file.path().extension() != ".out") {
+                continue;
+            }
+            const std::string key = file.path().stem().string();
+            uint64_t bytes = file.file_size(ec);
+            const std::filesystem::path asm_entry = m_dir / (key + ".asm");
+            if (std::filesystem::exists(asm_entry, ec)) {
+                bytes += std::filesystem::file_size(asm_entry, ec);
+            }
+            entries.push_back({ .key = key, .last_use = file.last_write_time(ec), .bytes = bytes });
+        }
+        return entries;
+    }
+
+    void evict() const {
+        std::vector<Entry> entries = this->entries();
+        uint64_t total = 0;
+        for (const Entry& entry : entries) {
+            total += entry.bytes;
+        }
+        std::ranges::sort(entries, {}, &Entry::last_use);
+        std::error_code ec;
+        for (const Entry& entry : entries) {
+            if (total <= m_max_bytes) {
+                break;
+            }
+            std::filesystem::remove(m_dir / (entry.key + ".out"), ec);
+            std::filesystem::remove(m_dir / (entry.key + ".asm"), ec);
+            total -= entry.bytes;
+        }
+    }
+
+    static bool copy_out(const std::filesystem::path& from, const std::filesystem::path& to) {
+        std::error_code ec;
+        return std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+    }
+
+    [[nodiscard]] Stats read_stats() const {
+        Stats stats;
+        std::ifstream file(m_dir / "stats");
+        file >> stats.hits >> stats.misses;
+        return stats;
+    }
+
+    void write_stats(const Stats& stats) const {
+        const std::filesystem::path tmp = m_dir / ("stats.tmp" + std::to_string(getpid()));
+        {
+            std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+            file << stats.hits << " " << stats.misses << "\n";
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, m_dir / "stats", ec);
+    }
+
+    std::filesystem::path m_dir;
+    uint64_t m_max_bytes;
+    int m_lock_fd;
+};
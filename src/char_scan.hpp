@@ -0,0 +1,260 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// What the tokenizer does with a byte it finds at the start of a token
+enum class CharClass : uint8_t {
+    invalid,
+    blank,
+    alpha,
+    digit,
+    // ';' starts a statement terminator or a comment
+    semi,
+    punct
+};
+
+inline constexpr std::array<CharClass, 256> char_classes = [] {
+    std::array<CharClass, 256> classes{};
+    for (const unsigned char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) {
+        classes[c] = CharClass::blank;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        classes[c] = CharClass::alpha;
+        classes[c - 'a' + 'A'] = CharClass::alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        classes[c] = CharClass::digit;
+    }
+    classes[';'] = CharClass::semi;
+    for (const unsigned char c : { '(', ')', ',', '=', '*', '/', '+', '-', '{', '}', '!', '<', '>', '&', '|' }) {
+        classes[c] = CharClass::punct;
+    }
+    return classes;
+}();
+
+[[nodiscard]] inline CharClass char_class(const char c) {
+    return char_classes[static_cast<unsigned char>(c)];
+}
+
+// Finds the end of runs of one kind of character. Each function takes the first byte to look at
+// and the end of the input and returns the first byte that is not part of the run (or end). The
+// blank and comment scanners also add the newlines they pass to lines.
+struct ScalarScan {
+    [[nodiscard]] static const char* ident_end(const char* p, const char* end) {
+        while (p < end && (char_class(*p) == CharClass::alpha || char_class(*p) == CharClass::digit)) {
+            p++;
+        }
+        return p;
+    }
+
+    [[nodiscard]] static const char* digits_end(const char* p, const char* end) {
+        while (p < end && char_class(*p) == CharClass::digit) {
+            p++;
+        }
+        return p;
+    }
+
+    [[nodiscard]] static const char* blank_end(const char* p, const char* end, int& lines) {
+        while (p < end && char_class(*p) == CharClass::blank) {
+            lines += *p == '\n';
+            p++;
+        }
+        return p;
+    }
+
+    // the '\n' ending a ;; comment
+    [[nodiscard]] static const char* line_end(const char* p, const char* end) {
+        while (p < end && *p != '\n') {
+            p++;
+        }
+        return p;
+    }
+
+    // the "*;" ending a ;* comment
+    [[nodiscard]] static const char* block_comment_end(const char* p, const char* end, int& lines) {
+        while (p < end && !(*p == '*' && p + 1 < end && p[1] == ';')) {
+            lines += *p == '\n';
+            p++;
+        }
+        return p;
+    }
+};
+
+#if defined(__x86_64__)
+
+// Classify a block of bytes at once: bit i of a mask is set if byte i of the block at p is of
+// the class. Range checks are done as signed compares after moving the range to the bottom of
+// the signed bytes.
+struct Sse2Blocks {
+    static constexpr ptrdiff_t width = 16;
+
+    [[nodiscard]] static __m128i load(const char* p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    }
+
+    [[nodiscard]] static __m128i in_range(const __m128i v, const char lo, const char count) {
+        const __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(static_cast<char>(-128 - lo)));
+        return _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-128 + count)));
+    }
+
+    [[nodiscard]] static uint32_t mask(const __m128i v) {
+        return static_cast<uint32_t>(_mm_movemask_epi8(v));
+    }
+
+    [[nodiscard]] static uint32_t alnum(const char* p) {
+        const __m128i v = load(p);
+        return mask(_mm_or_si128(in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26), in_range(v, '0', 10)));
+    }
+
+    [[nodiscard]] static uint32_t digit(const char* p) {
+        return mask(in_range(load(p), '0', 10));
+    }
+
+    [[nodiscard]] static uint32_t blank(const char* p) {
+        const __m128i v = load(p);
+        return mask(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range(v, '\t', 5)));
+    }
+
+    [[nodiscard]] static uint32_t newline(const char* p) {
+        return mask(_mm_cmpeq_epi8(load(p), _mm_set1_epi8('\n')));
+    }
+
+    // a '*' followed by a ';', which reads one byte past the block
+    [[nodiscard]] static uint32_t comment_close(const char* p) {
+        const __m128i star = _mm_cmpeq_epi8(load(p), _mm_set1_epi8('*'));
+        const __m128i semi = _mm_cmpeq_epi8(load(p + 1), _mm_set1_epi8(';'));
+        return mask(_mm_and_si128(star, semi));
+    }
+};
+
+struct Avx2Blocks {
+    static constexpr ptrdiff_t width = 32;
+
+    [[gnu::target("avx2"), gnu::always_inline, nodiscard]] static __m256i load(const char* p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    }
+
+    [[gnu::target("avx2"), gnu::always_inline, nodiscard]] static __m256i in_range(const __m256i v, const char lo, const char count) {
+        const __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(static_cast<char>(-128 - lo)));
+        return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(-128 + count)), shifted);
+    }
+
+    [[gnu::target("avx2"), gnu::always_inline, nodiscard]] static uint32_t mask(const __m256i v) {
+        return static_cast<uint32_t>(_mm256_movemask_epi8(v));
+    }
+
+    [[gnu::target("avx2"), nodiscard]] static uint32_t alnum(const char* p) {
+        const __m256i v = load(p);
+        return mask(_mm256_or_si256(in_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 26), in_range(v, '0', 10)));
+    }
+
+    [[gnu::target("avx2"), nodiscard]] static uint32_t digit(const char* p) {
+        return mask(in_range(load(p), '0', 10));
+    }
+
+    [[gnu::target("avx2"), nodiscard]] static uint32_t blank(const char* p) {
+        const __m256i v = load(p);
+        return mask(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range(v, '\t', 5)));
+    }
+
+    [[gnu::target("avx2"), nodiscard]] static uint32_t newline(const char* p) {
+        return mask(_mm256_cmpeq_epi8(load(p), _mm256_set1_epi8('\n')));
+    }
+
+    [[gnu::target("avx2"), nodiscard]] static uint32_t comment_close(const char* p) {
+        const __m256i star = _mm256_cmpeq_epi8(load(p), _mm256_set1_epi8('*'));
+        const __m256i semi = _mm256_cmpeq_epi8(load(p + 1), _mm256_set1_epi8(';'));
+        return mask(_mm256_and_si256(star, semi));
+    }
+};
+
+// The scanners of ScalarScan a block at a time. Only whole blocks are loaded and the scalar
+// scanner finishes the rest, so nothing past end is read.
+template <typename Blocks>
+struct SimdScan {
+    static constexpr uint32_t all = Blocks::width == 32 ? 0xFFFFFFFF : (1u << Blocks::width) - 1;
+
+    [[gnu::always_inline, nodiscard]] static const char* ident_end(const char* p, const char* end) {
+        for (; end - p >= Blocks::width; p += Blocks::width) {
+            if (const uint32_t stop = ~Blocks::alnum(p) & all) {
+                return p + std::countr_zero(stop);
+            }
+        }
+        return ScalarScan::ident_end(p, end);
+    }
+
+    [[gnu::always_inline, nodiscard]] static const char* digits_end(const char* p, const char* end) {
+        for (; end - p >= Blocks::width; p += Blocks::width) {
+            if (const uint32_t stop = ~Blocks::digit(p) & all) {
+                return p + std::countr_zero(stop);
+            }
+        }
+        return ScalarScan::digits_end(p, end);
+    }
+
+    [[gnu::always_inline, nodiscard]] static const char* blank_end(const char* p, const char* end, int& lines) {
+        for (; end - p >= Blocks::width; p += Blocks::width) {
+            const uint32_t stop = ~Blocks::blank(p) & all;
+            lines += std::popcount(before(Blocks::newline(p), stop));
+            if (stop != 0) {
+                return p + std::countr_zero(stop);
+            }
+        }
+        return ScalarScan::blank_end(p, end, lines);
+    }
+
+    [[gnu::always_inline, nodiscard]] static const char* line_end(const char* p, const char* end) {
+        for (; end - p >= Blocks::width; p += Blocks::width) {
+            if (const uint32_t stop = Blocks::newline(p)) {
+                return p + std::countr_zero(stop);
+            }
+        }
+        return ScalarScan::line_end(p, end);
+    }
+
+    [[gnu::always_inline, nodiscard]] static const char* block_comment_end(const char* p, const char* end, int& lines) {
+        for (; end - p > Blocks::width; p += Blocks::width) {
+            const uint32_t stop = Blocks::comment_close(p);
+            lines += std::popcount(before(Blocks::newline(p), stop));
+            if (stop != 0) {
+                return p + std::countr_zero(stop);
+            }
+        }
+        return ScalarScan::block_comment_end(p, end, lines);
+    }
+
+private:
+
+    // the bits of mask below the lowest bit of stop, or all of them without a stop
+    static uint32_t before(const uint32_t mask, const uint32_t stop) {
+        return stop == 0 ? mask : mask & ((stop & -stop) - 1);
+    }
+};
+
+using Sse2Scan = SimdScan<Sse2Blocks>;
+using Avx2Scan = SimdScan<Avx2Blocks>;
+
+#endif
+
+// The widest scanners the CPU running us supports
+enum class ScanIsa {
+    scalar,
+    sse2,
+    avx2
+};
+
+[[nodiscard]] inline ScanIsa detect_scan_isa() {
+#if defined(__x86_64__)
+    static const ScanIsa isa = __builtin_cpu_supports("avx2") ? ScanIsa::avx2 : ScanIsa::sse2;
+    return isa;
+#else
+    return ScanIsa::scalar;
+#endif
+}
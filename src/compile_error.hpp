@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdexcept>
+
+// An error in one input: a syntax error, an undeclared name, a source that cannot be read or an
+// output that cannot be written. It is thrown rather than exiting on the spot, so that the
+// driver reports it against the input it came from and a batch finishes its other inputs.
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <elf.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "./compile_error.hpp"
+
+// Writes a minimal static ELF64 executable: the ELF header, a single read+execute PT_LOAD
+// segment mapping the whole file, and the code directly behind the program header.
+inline void write_elf(const std::string& path, const std::vector<uint8_t>& code) {
+    constexpr uint64_t base_addr = 0x400000;
+    constexpr uint64_t code_offset = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+
+    Elf64_Ehdr ehdr{};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = base_addr + code_offset;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 1;
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+
+    Elf64_Phdr phdr{};
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = PF_R | PF_X;
+    phdr.p_offset = 0;
+    phdr.p_vaddr = base_addr;
+    phdr.p_paddr = base_addr;
+    phdr.p_filesz = code_offset + code.size();
+    phdr.p_memsz = phdr.p_filesz;
+    phdr.p_align = 0x1000;
+
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file) {
+            throw CompileError("Could not open " + path + " for writing");
+        }
+        file.write(reinterpret_cast<const char*>(&ehdr), sizeof(ehdr));
+        file.write(reinterpret_cast<const char*>(&phdr), sizeof(phdr));
+        file.write(reinterpret_cast<const char*>(code.data()), static_cast<std::streamsize>(code.size()));
+        file.close();
+        if (!file) {
+            throw CompileError("Could not write " + path);
+        }
+    }
+    if (chmod(path.c_str(), 0755) != 0) {
+        throw CompileError("Could not make " + path + " executable");
+    }
+}
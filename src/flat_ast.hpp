@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Indices of expressions, statements and lists in a FlatAst
+using ExprRef = uint32_t;
+using StmtRef = uint32_t;
+using ListRef = uint32_t;
+
+inline constexpr uint32_t no_node = UINT32_MAX;
+
+enum class ExprKind : uint8_t {
+    int_lit, // the value, low half in a, high half in b
+    ident,   // the slot of the variable in a
+    call,    // the index of the function in a, the list of arguments in b
+    add,     // a + b
+    sub,     // a - b
+    mul,     // a * b
+    div,     // a / b
+    eq,      // a == b, and so on for the other comparisons: 1 or 0
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    and_,    // a && b, b only evaluated if a is not 0
+    or_      // a || b, b only evaluated if a is 0
+};
+
+enum class StmtKind : uint8_t {
+    exit,    // exit(a)
+    var,     // the next slot = a
+    assign,  // slot b = a
+    scope,   // the list of statements b
+    if_,     // if (a) b, with c the statement of the elif (an if_) or else (a scope) following it, or no_node
+    while_,  // while (a) b
+    return_  // return a
+};
+
+struct FlatFunction {
+    uint32_t param_count;
+    ListRef body;
+};
+
+// The program as Resolver lowers it for the generators: every name is resolved, parentheses are
+// gone, and every node is a record of a kind and up to three 32 bit operands referring to other
+// nodes by index. The records are stored column by column in arrays, in the order the generators
+// visit them, so a walk over the program reads memory front to back in a few tight streams
+// instead of chasing a pointer for every node of the tree.
+struct FlatAst {
+    std::vector<ExprKind> expr_kinds;
+    std::vector<uint32_t> expr_a;
+    std::vector<uint32_t> expr_b;
+    std::vector<StmtKind> stmt_kinds;
+    std::vector<uint32_t> stmt_a;
+    std::vector<uint32_t> stmt_b;
+    std::vector<uint32_t> stmt_c;
+    // the lists of statements and of call arguments, each a count followed by that many refs
+    std::vector<uint32_t> lists;
+    std::vector<FlatFunction> functions;
+    ListRef main = 0;
+
+    [[nodiscard]] ExprKind expr_kind(const ExprRef expr) const {
+        return expr_kinds[expr];
+    }
+
+    [[nodiscard]] ExprRef lhs(const ExprRef expr) const {
+        return expr_a[expr];
+    }
+
+    [[nodiscard]] ExprRef rhs(const ExprRef expr) const {
+        return expr_b[expr];
+    }
+
+    [[nodiscard]] int64_t literal(const ExprRef expr) const {
+        return static_cast<int64_t>(static_cast<uint64_t>(expr_b[expr]) << 32 | expr_a[expr]);
+    }
+
+    [[nodiscard]] uint32_t slot(const ExprRef expr) const {
+        return expr_a[expr];
+    }
+
+    [[nodiscard]] uint32_t callee(const ExprRef expr) const {
+        return expr_a[expr];
+    }
+
+    [[nodiscard]] std::span<const ExprRef> args(const ExprRef expr) const {
+        return list(expr_b[expr]);
+    }
+
+    [[nodiscard]] static bool is_bin_op(const ExprKind kind) {
+        return kind >= ExprKind::add;
+    }
+
+    [[nodiscard]] static bool is_comparison(const ExprKind kind) {
+        return kind >= ExprKind::eq && kind <= ExprKind::ge;
+    }
+
+    [[nodiscard]] StmtKind stmt_kind(const StmtRef stmt) const {
+        return stmt_kinds[stmt];
+    }
+
+    // the expression of an exit, var, assign, if, while or return
+    [[nodiscard]] ExprRef stmt_expr(const StmtRef stmt) const {
+        return stmt_a[stmt];
+    }
+
+    // the statements of a scope, if or while
+    [[nodiscard]] std::span<const StmtRef> body(const StmtRef stmt) const {
+        return list(stmt_b[stmt]);
+    }
+
+    [[nodiscard]] uint32_t assign_slot(const StmtRef stmt) const {
+        return stmt_b[stmt];
+    }
+
+    [[nodiscard]] StmtRef else_stmt(const StmtRef stmt) const {
+        return stmt_c[stmt];
+    }
+
+    [[nodiscard]] std::span<const uint32_t> list(const ListRef list) const {
+        return { lists.data() + list + 1, lists[list] };
+    }
+
+    // Memory taken by the nodes, for --stats
+    [[nodiscard]] size_t bytes() const {
+        return expr_kinds.size() * (sizeof(ExprKind) + 2 * sizeof(uint32_t)) +
+               stmt_kinds.size() * (sizeof(StmtKind) + 3 * sizeof(uint32_t)) +
+               lists.size() * sizeof(uint32_t) + functions.size() * sizeof(FlatFunction);
+    }
+};
@@ -1,266 +1,1390 @@
 #pragma once
 
+#include <array>
 #include <string>
+#include <sstream>
+#include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <bit>
+#include <limits>
+#include <span>
 
-#include "./parser.hpp"
+#include "./flat_ast.hpp"
+#include "./assembly.hpp"
 
 class Generator {
 public:
-    explicit Generator(NodeProg prog) : m_prog(std::move(prog)) {
+    // With jit set, the code is generated to be called in process (see jit.hpp) rather than as
+    // the entry point of an executable: exit returns its value to the caller instead of ending the
+    // process, and the callee saved registers the allocator hands out are preserved.
+    explicit Generator(const FlatAst& ast, const bool stack_machine = false, const bool jit = false)
+        : m_ast(ast),
+          m_stack_machine(stack_machine),
+          m_jit(jit) {
 
     }
 
-    void gen_term(const NodeTerm* term) {
-        struct TermVisitor {
-            Generator& gen;
+    // Pushes the value of a literal, variable or call without arguments
+    void gen_term(const ExprRef expr) {
+        switch (m_ast.expr_kind(expr)) {
+            case ExprKind::int_lit:
+                emit(Op::mov, Reg::rax, m_ast.literal(expr));
+                push(Reg::rax);
+                break;
+            case ExprKind::ident:
+                push(var_operand(m_vars[m_ast.slot(expr)]));
+                break;
+            default:
+                gen_call(expr);
+                break;
+        }
+    }
+
+    // Pushes the result of the call, whose arguments have already been pushed by gen_expr
+    void gen_call(const ExprRef call) {
+        for (size_t i = m_ast.args(call).size(); i-- > 0;) {
+            pop(arg_regs[i]);
+        }
+        emit(Op::call, m_function_labels[m_ast.callee(call)]);
+        push(Reg::rax);
+    }
+
+    // Combines the two values on top of the stack, the right operand on top
+    void gen_bin_expr(const ExprRef bin_expr) {
+        pop(Reg::rbx);
+        pop(Reg::rax);
+        switch (const ExprKind kind = m_ast.expr_kind(bin_expr)) {
+            case ExprKind::add:
+                emit(Op::add, Reg::rax, Reg::rbx);
+                break;
+            case ExprKind::sub:
+                emit(Op::sub, Reg::rax, Reg::rbx);
+                break;
+            case ExprKind::mul:
+                emit(Op::imul, Reg::rax, Reg::rbx);
+                break;
+            case ExprKind::eq:
+            case ExprKind::ne:
+            case ExprKind::lt:
+            case ExprKind::le:
+            case ExprKind::gt:
+            case ExprKind::ge:
+                emit(Op::cmp, Reg::rax, Reg::rbx);
+                emit_set(compare_cond(kind), Reg::rax);
+                break;
+            default:
+                emit(Op::cqo);
+                emit(Op::idiv, Reg::rbx);
+                break;
+        }
+        push(Reg::rax);
+    }
 
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
+    // Of a && or || whose left operand is on top of the stack: jumps to skip with the result in
+    // its place if the left operand decides it, otherwise drops it for the right one to be pushed
+    void gen_logic_head(const ExprRef expr, const Label skip) {
+        const ExprKind kind = m_ast.expr_kind(expr);
+        pop(Reg::rax);
+        emit(Op::test, Reg::rax, Reg::rax);
+        if (kind == ExprKind::or_ && !is_boolean(m_ast.lhs(expr))) {
+            emit_set(Cond::nz, Reg::rax);
+        }
+        push(Reg::rax);
+        emit_jcc(kind == ExprKind::and_ ? Cond::z : Cond::nz, skip);
+        pop(Reg::rax);
+    }
+
+    // Replaces the right operand of a && or || on top of the stack by the result
+    void gen_logic_tail(const ExprRef expr, const Label skip) {
+        if (!is_boolean(m_ast.rhs(expr))) {
+            pop(Reg::rax);
+            emit(Op::test, Reg::rax, Reg::rax);
+            emit_set(Cond::nz, Reg::rax);
+            push(Reg::rax);
+        }
+        emit_label(skip);
+    }
+
+    // Pushes the value of expr. Operands and arguments are pushed from left to right; operators
+    // and calls wait on an explicit stack until all of theirs are, so deeply nested expressions do
+    // not exhaust the native stack.
+    void gen_expr(ExprRef expr) {
+        struct Pending {
+            ExprRef expr;
+            // operands pushed so far
+            size_t done = 1;
+            // where a && or || goes once the left operand decides it
+            Label skip{};
+        };
+        std::vector<Pending> pending;
+        while (true) {
+            const ExprKind kind = m_ast.expr_kind(expr);
+            if (FlatAst::is_bin_op(kind)) {
+                pending.push_back({ .expr = expr });
+                expr = m_ast.lhs(expr);
+                continue;
+            }
+            if (kind == ExprKind::call && !m_ast.args(expr).empty()) {
+                pending.push_back({ .expr = expr });
+                expr = m_ast.args(expr).front();
+                continue;
             }
+            gen_term(expr);
+            while (!pending.empty()) {
+                Pending& top = pending.back();
+                const ExprKind kind = m_ast.expr_kind(top.expr);
+                const bool call = kind == ExprKind::call;
+                const bool logic = kind == ExprKind::and_ || kind == ExprKind::or_;
+                if (!call && top.done == 1) {
+                    top.done++;
+                    if (logic) {
+                        top.skip = create_label();
+                        gen_logic_head(top.expr, top.skip);
+                    }
+                    expr = m_ast.rhs(top.expr);
+                    break;
+                }
+                if (call && top.done < m_ast.args(top.expr).size()) {
+                    expr = m_ast.args(top.expr)[top.done++];
+                    break;
+                }
+                if (call) {
+                    gen_call(top.expr);
+                } else if (logic) {
+                    gen_logic_tail(top.expr, top.skip);
+                } else {
+                    gen_bin_expr(top.expr);
+                }
+                pending.pop_back();
+            }
+            if (pending.empty()) {
+                return;
+            }
+        }
+    }
 
-            void operator()(const NodeTermIdent* term_ident) const {
-                const auto it = std::ranges::find_if(std::as_const(gen.m_vars), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
+    // Register allocated counterparts of gen_term/gen_bin_expr/gen_expr. The result is left in a
+    // temporary register (see alloc_temp) whose id is returned; the caller must free it.
 
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+    size_t gen_term_reg(const ExprRef expr) {
+        const size_t temp = alloc_temp();
+        if (m_ast.expr_kind(expr) == ExprKind::int_lit) {
+            emit(Op::mov, temp_reg(temp), m_ast.literal(expr));
+        } else {
+            // calls are handled by gen_expr_reg, which evaluates the arguments
+            assert(m_ast.expr_kind(expr) == ExprKind::ident);
+            const Reg reg = temp_reg(temp);
+            emit(Op::mov, reg, var_operand(m_vars[m_ast.slot(expr)]));
+        }
+        return temp;
+    }
+
+    // Applies the operator to its first operand, already in the temporary first, and to the
+    // second one: in the temporary second if second_operand asked for it, otherwise used directly
+    size_t gen_bin_expr_reg(const ExprRef bin_expr, const size_t first, const std::optional<size_t> second) {
+        const ExprRef lhs = m_ast.lhs(bin_expr);
+        const ExprRef rhs = m_ast.rhs(bin_expr);
+        switch (m_ast.expr_kind(bin_expr)) {
+            case ExprKind::add:
+                return gen_arith_reg(Op::add, first, second, rhs);
+            case ExprKind::sub:
+                return gen_arith_reg(Op::sub, first, second, rhs);
+            case ExprKind::mul:
+                if (const auto value = const_value(rhs)) {
+                    return gen_mul_const(first, value.value());
+                }
+                if (const auto value = const_value(lhs)) {
+                    return gen_mul_const(first, value.value());
                 }
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << ((gen.m_stack_size - it->stack_loc - 1) * 8) << "]";
-                gen.push(offset.str());
+                // the two operand imul neither needs rax nor clobbers rdx
+                return gen_arith_reg(Op::imul, first, second, rhs);
+            case ExprKind::eq:
+            case ExprKind::ne:
+            case ExprKind::lt:
+            case ExprKind::le:
+            case ExprKind::gt:
+            case ExprKind::ge:
+                gen_arith_reg(Op::cmp, first, second, rhs);
+                emit_set(compare_cond(m_ast.expr_kind(bin_expr)), temp_reg(first));
+                return first;
+            default:
+                break;
+        }
+        if (const auto value = const_value(rhs); value.has_value() && !traps_as_divisor(value.value())) {
+            return gen_div_const(first, value.value());
+        }
+        Operand divisor;
+        if (second.has_value()) {
+            divisor = temp_reg(second.value());
+        }
+        const Reg reg = temp_reg(first);
+        if (!second.has_value()) {
+            // resolved only now as reloading lhs may have moved rsp
+            divisor = gen_operand(rhs, false).value();
+        }
+        emit(Op::mov, Reg::rax, reg);
+        emit(Op::cqo);
+        emit(Op::idiv, divisor);
+        emit(Op::mov, reg, Reg::rax);
+        if (second.has_value()) {
+            free_temp(second.value());
+        }
+        return first;
+    }
+
+    // Whether dividing by the literal can trap, for 0 always and for -1 on INT64_MIN. Such a
+    // division is left to idiv like one by a variable, so it traps at runtime as in every
+    // other backend.
+    [[nodiscard]] static bool traps_as_divisor(const int64_t divisor) {
+        return divisor == 0 || divisor == -1;
+    }
+
+    // The operand of bin_expr that is evaluated first: the non-constant one of a multiplication
+    // by a constant, the left one otherwise
+    [[nodiscard]] ExprRef first_operand(const ExprRef bin_expr) const {
+        const ExprRef lhs = m_ast.lhs(bin_expr);
+        const ExprRef rhs = m_ast.rhs(bin_expr);
+        if (m_ast.expr_kind(bin_expr) == ExprKind::mul && !const_value(rhs).has_value() &&
+            const_value(lhs).has_value()) {
+            return rhs;
+        }
+        return lhs;
+    }
+
+    // The operand of bin_expr that needs a temporary of its own once the first operand has been
+    // evaluated, if any (no_node otherwise); constants and variables are used as they are
+    [[nodiscard]] ExprRef second_operand(const ExprRef bin_expr) const {
+        const ExprRef lhs = m_ast.lhs(bin_expr);
+        const ExprRef rhs = m_ast.rhs(bin_expr);
+        const ExprKind kind = m_ast.expr_kind(bin_expr);
+        if (kind == ExprKind::mul && (const_value(rhs).has_value() || const_value(lhs).has_value())) {
+            return no_node;
+        }
+        if (kind == ExprKind::div) {
+            if (const auto value = const_value(rhs); value.has_value() && !traps_as_divisor(value.value())) {
+                return no_node;
             }
+            return gen_operand(rhs, false).has_value() ? no_node : rhs;
+        }
+        return gen_operand(rhs).has_value() ? no_node : rhs;
+    }
 
-            void operator()(const NodeTermParen* term_paren) const {
-                gen.gen_expr(term_paren->expr);
+    // Operators and calls wait on an explicit stack until their operands have been evaluated, so
+    // deeply nested expressions do not exhaust the native stack
+    size_t gen_expr_reg(ExprRef expr) {
+        std::vector<PendingReg> pending;
+        while (true) {
+            const ExprKind kind = m_ast.expr_kind(expr);
+            if (FlatAst::is_bin_op(kind)) {
+                pending.push_back({ .expr = expr });
+                expr = first_operand(expr);
+                continue;
+            }
+            size_t temp;
+            if (kind == ExprKind::call) {
+                pending.push_back({ .expr = expr, .call = true });
+                if (next_arg(pending.back(), expr)) {
+                    continue;
+                }
+                temp = gen_call_reg(pending.back().expr, pending.back().args);
+                pending.pop_back();
+            } else {
+                temp = gen_term_reg(expr);
+            }
+            // hand the value up until an operator or call still needs another operand
+            while (!pending.empty()) {
+                PendingReg& top = pending.back();
+                const ExprKind top_kind = m_ast.expr_kind(top.expr);
+                if (top.call) {
+                    top.args.emplace_back(temp);
+                    if (next_arg(top, expr)) {
+                        break;
+                    }
+                    temp = gen_call_reg(top.expr, top.args);
+                } else if (top.skip.has_value()) {
+                    temp = gen_logic_tail_reg(top, temp);
+                } else if (top_kind == ExprKind::and_ || top_kind == ExprKind::or_) {
+                    gen_logic_head_reg(top, temp);
+                    expr = m_ast.rhs(top.expr);
+                    break;
+                } else if (top.first.has_value()) {
+                    temp = gen_bin_expr_reg(top.expr, top.first.value(), temp);
+                } else if (const ExprRef second = second_operand(top.expr); second != no_node) {
+                    top.first = temp;
+                    expr = second;
+                    break;
+                } else {
+                    temp = gen_bin_expr_reg(top.expr, temp, {});
+                }
+                pending.pop_back();
             }
+            if (pending.empty()) {
+                return temp;
+            }
+        }
+    }
 
-        };
+    // An operator or call of gen_expr_reg waiting for its operands
+    struct PendingReg {
+        ExprRef expr;
+        bool call = false;
+        std::optional<size_t> first{};
+        // the temporaries of the arguments evaluated so far, none for those used directly
+        std::vector<std::optional<size_t>> args{};
+        // of a && or || once its left operand is done: where it goes if that decides the result,
+        // and the register the result ends up in either way
+        std::optional<Label> skip{};
+        Reg result = Reg::rax;
+    };
 
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
+    // Tests the left operand of a && or || in temp and jumps to the end with the result in its
+    // register if that decides it. The right operand may not be evaluated, so the temporaries
+    // around are moved to the stack first: then their places are the same either way.
+    void gen_logic_head_reg(PendingReg& pending, const size_t temp) {
+        const ExprKind kind = m_ast.expr_kind(pending.expr);
+        const Reg reg = temp_reg(temp);
+        for (Temp& other : m_temps) {
+            if (other.id != temp && !other.spilled) {
+                other.stack_loc = m_stack_size;
+                push(other.reg);
+                other.spilled = true;
+                m_free_regs.push_back(other.reg);
+            }
+        }
+        emit(Op::test, reg, reg);
+        if (kind == ExprKind::or_ && !is_boolean(m_ast.lhs(pending.expr))) {
+            emit_set(Cond::nz, reg);
+        }
+        pending.skip = create_label();
+        pending.result = reg;
+        emit_jcc(kind == ExprKind::and_ ? Cond::z : Cond::nz, pending.skip.value());
+        free_temp(temp);
     }
 
-    void gen_bin_expr(const NodeBinExpr* bin_expr) {
-        struct BinExprVisitor {
-            Generator& gen;
+    // Moves the right operand of a && or || in temp, as 0 or 1, to the register of the result and
+    // returns the temporary holding it. That register is free by now unless it is temp's own, as
+    // the temporaries around are all on the stack.
+    size_t gen_logic_tail_reg(const PendingReg& pending, const size_t temp) {
+        const Reg reg = temp_reg(temp);
+        if (!is_boolean(m_ast.rhs(pending.expr))) {
+            emit(Op::test, reg, reg);
+            m_instrs.push_back({ .op = Op::setcc, .dst = reg, .cond = Cond::nz });
+            emit(Op::movzx, pending.result, reg);
+        } else if (reg != pending.result) {
+            emit(Op::mov, pending.result, reg);
+        }
+        free_temp(temp);
+        emit_label(pending.skip.value());
+        std::erase(m_free_regs, pending.result);
+        m_temps.push_back({ .id = m_temp_count++, .reg = pending.result });
+        return m_temps.back().id;
+    }
 
-            void operator()(const NodeBinExprAdd* add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
+    // Skips the arguments of the call in pending that can be used directly. Returns whether
+    // there is one left to evaluate, which is then stored in expr.
+    bool next_arg(PendingReg& pending, ExprRef& expr) const {
+        const std::span<const ExprRef> args = m_ast.args(pending.expr);
+        while (pending.args.size() < args.size()) {
+            if (!gen_operand(args[pending.args.size()]).has_value()) {
+                expr = args[pending.args.size()];
+                return true;
             }
+            pending.args.emplace_back();
+        }
+        return false;
+    }
 
-            void operator()(const NodeBinExprSub* sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
+    // Calls the function with the arguments in arg_regs and returns the temporary holding the
+    // result. The caller saved registers holding variables and temporaries other than the
+    // arguments are pushed around the call; the arguments die with it.
+    size_t gen_call_reg(const ExprRef call, const std::vector<std::optional<size_t>>& args) {
+        std::vector<Reg> saved;
+        for (const Var& var : m_vars) {
+            if (var.reg.has_value() && is_caller_saved(var.reg.value())) {
+                saved.push_back(var.reg.value());
             }
+        }
+        for (const Temp& temp : m_temps) {
+            if (!temp.spilled && is_caller_saved(temp.reg) &&
+                std::ranges::find(args, std::optional { temp.id }) == args.end()) {
+                saved.push_back(temp.reg);
+            }
+        }
+        for (const Reg reg : saved) {
+            push(reg);
+        }
+        std::vector<Move> moves;
+        for (size_t i = 0; i < args.size(); i++) {
+            const Operand src = args[i].has_value() ? temp_operand(args[i].value()) : gen_operand(m_ast.args(call)[i]).value();
+            moves.push_back({ .dst = arg_regs[i], .src = src });
+        }
+        gen_parallel_move(std::move(moves));
+        emit(Op::call, m_function_labels[m_ast.callee(call)]);
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            pop(*it);
+        }
+        if (const size_t spilled = forget_temps(args); spilled > 0) {
+            emit(Op::add, Reg::rsp, static_cast<int64_t>(spilled * 8));
+            m_stack_size -= spilled;
+        }
+        const size_t result = alloc_temp();
+        emit(Op::mov, temp_reg(result), Reg::rax);
+        return result;
+    }
 
-            void operator()(const NodeBinExprMulti* multi) const {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
+    // Forgets the temporaries without reloading the spilled ones, which have to be the topmost
+    // values on the stack. Returns how many of them are, for the caller to drop.
+    [[nodiscard]] size_t forget_temps(const std::vector<std::optional<size_t>>& temps) {
+        size_t spilled = 0;
+        for (const std::optional<size_t>& id : temps) {
+            if (!id.has_value()) {
+                continue;
             }
+            Temp& temp = find_temp(id.value());
+            if (temp.spilled) {
+                spilled++;
+                temp.spilled = false;
+            } else {
+                m_free_regs.push_back(temp.reg);
+            }
+            release_temp(id.value());
+        }
+        return spilled;
+    }
+
+    struct Move {
+        Reg dst;
+        Operand src;
+    };
+
+    [[nodiscard]] static bool reads(const Operand& operand, const Reg reg) {
+        if (const auto src = std::get_if<Reg>(&operand)) {
+            return *src == reg;
+        }
+        if (const auto mem = std::get_if<Mem>(&operand)) {
+            return mem->base == reg || mem->index == reg;
+        }
+        return false;
+    }
 
-            void operator()(const NodeBinExprDiv* div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
+    // Moves every source to its destination as if all at once. A cycle of registers is broken by
+    // parking one of them in rax.
+    void gen_parallel_move(std::vector<Move> moves) {
+        std::erase_if(moves, [](const Move& move) { return reads(move.src, move.dst) && std::holds_alternative<Reg>(move.src); });
+        while (!moves.empty()) {
+            const auto ready = std::ranges::find_if(moves, [&](const Move& move) {
+                return std::ranges::none_of(moves, [&](const Move& other) { return reads(other.src, move.dst); });
+            });
+            if (ready != moves.end()) {
+                emit(Op::mov, ready->dst, ready->src);
+                moves.erase(ready);
+                continue;
             }
-        };
+            const Reg parked = moves.front().dst;
+            emit(Op::mov, Reg::rax, parked);
+            for (Move& move : moves) {
+                if (reads(move.src, parked)) {
+                    move.src = Reg::rax;
+                }
+            }
+        }
+    }
 
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
+    // Returns an operand that can be used directly as a source, without going through a temporary,
+    // if the expression is a variable or (when allow_imm is set) an integer literal that fits into imm32
+    [[nodiscard]] std::optional<Operand> gen_operand(const ExprRef expr, const bool allow_imm = true) const {
+        switch (m_ast.expr_kind(expr)) {
+            case ExprKind::ident:
+                return var_operand(m_vars[m_ast.slot(expr)]);
+            case ExprKind::int_lit:
+                if (const int64_t value = m_ast.literal(expr); allow_imm && fits_imm32(value)) {
+                    return value;
+                }
+                return {};
+            default:
+                return {};
+        }
+    }
 
+    // Value of expr if it is an integer literal
+    [[nodiscard]] std::optional<int64_t> const_value(const ExprRef expr) const {
+        if (m_ast.expr_kind(expr) == ExprKind::int_lit) {
+            return m_ast.literal(expr);
+        }
+        return {};
     }
 
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            Generator& gen;
+    [[nodiscard]] static bool fits_imm32(const int64_t value) {
+        return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+    }
 
-            void operator()(const NodeTerm* term) const {
-                gen.gen_term(term);
+    // Multiplication by a constant. Powers of two become shifts and factors of 3, 5 or 9 times a
+    // power of two a lea and a shift; everything else goes through imul. The other operand is
+    // already in temp.
+    size_t gen_mul_const(const size_t temp, const int64_t factor) {
+        const Reg reg = temp_reg(temp);
+        if (factor == 0) {
+            emit(Op::xor_, reg, reg);
+            return temp;
+        }
+        const uint64_t magnitude = factor < 0 ? -static_cast<uint64_t>(factor) : factor;
+        const int shift = std::countr_zero(magnitude);
+        const uint64_t odd = magnitude >> shift;
+        if (odd != 1 && odd != 3 && odd != 5 && odd != 9) {
+            if (fits_imm32(factor)) {
+                emit(Op::imul, reg, factor);
+            } else {
+                emit(Op::mov, Reg::rax, factor);
+                emit(Op::imul, reg, Reg::rax);
             }
+            return temp;
+        }
+        if (odd != 1) {
+            emit(Op::lea, reg, Mem { .base = reg, .index = reg, .scale = static_cast<uint8_t>(odd - 1) });
+        }
+        if (shift > 0) {
+            emit(Op::shl, reg, shift);
+        }
+        if (factor < 0) {
+            emit(Op::neg, reg);
+        }
+        return temp;
+    }
 
-            void operator()(const NodeBinExpr* bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
+    // Signed division by a constant other than 0 and -1, truncating towards zero like idiv. Powers of two
+    // are a shift with a rounding bias for negative dividends, every other divisor is a
+    // multiplication by its fixed point reciprocal (Hacker's Delight, chapter 10). The dividend
+    // is already in temp.
+    size_t gen_div_const(const size_t temp, const int64_t divisor) {
+        const Reg reg = temp_reg(temp);
+        if (divisor == 1) {
+            return temp;
+        }
+        const uint64_t magnitude = divisor < 0 ? -static_cast<uint64_t>(divisor) : divisor;
+        if (std::has_single_bit(magnitude)) {
+            const int shift = std::countr_zero(magnitude);
+            emit(Op::mov, Reg::rax, reg);
+            emit(Op::sar, Reg::rax, 63);
+            emit(Op::shr, Reg::rax, 64 - shift);
+            emit(Op::add, Reg::rax, reg);
+            emit(Op::sar, Reg::rax, shift);
+            emit(Op::mov, reg, Reg::rax);
+            if (divisor < 0) {
+                emit(Op::neg, reg);
             }
-        };
+            return temp;
+        }
+        const auto [multiplier, shift] = signed_magic(divisor);
+        emit(Op::mov, Reg::rax, multiplier);
+        emit(Op::imul, reg);
+        if (divisor > 0 && multiplier < 0) {
+            emit(Op::add, Reg::rdx, reg);
+        } else if (divisor < 0 && multiplier > 0) {
+            emit(Op::sub, Reg::rdx, reg);
+        }
+        if (shift > 0) {
+            emit(Op::sar, Reg::rdx, shift);
+        }
+        emit(Op::mov, Reg::rax, Reg::rdx);
+        emit(Op::shr, Reg::rax, 63);
+        emit(Op::add, Reg::rdx, Reg::rax);
+        emit(Op::mov, reg, Reg::rdx);
+        return temp;
+    }
+
+    struct Magic {
+        int64_t multiplier;
+        int shift;
+    };
 
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
+    // Magic multiplier and shift for signed division by divisor, |divisor| >= 2
+    [[nodiscard]] static Magic signed_magic(const int64_t divisor) {
+        constexpr uint64_t two63 = 1ull << 63;
+        const uint64_t ad = divisor < 0 ? -static_cast<uint64_t>(divisor) : divisor;
+        const uint64_t t = two63 + (static_cast<uint64_t>(divisor) >> 63);
+        const uint64_t anc = t - 1 - t % ad;
+        int p = 63;
+        uint64_t q1 = two63 / anc;
+        uint64_t r1 = two63 - q1 * anc;
+        uint64_t q2 = two63 / ad;
+        uint64_t r2 = two63 - q2 * ad;
+        uint64_t delta;
+        do {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        const auto multiplier = static_cast<int64_t>(q2 + 1);
+        return { .multiplier = divisor < 0 ? -multiplier : multiplier, .shift = p - 64 };
     }
 
-    void gen_scope(const NodeScope* scope) {
-        begin_scope();
-        for (const NodeStmt* stmt: scope->stmts) {
-            gen_stmt(stmt);
+    // Combines the temporary lhs in place with rhs, which is either in the temporary rhs_temp or
+    // usable directly (see gen_operand)
+    size_t gen_arith_reg(const Op op, const size_t lhs, const std::optional<size_t> rhs_temp, const ExprRef rhs) {
+        if (!rhs_temp.has_value()) {
+            const Reg reg = temp_reg(lhs);
+            emit(op, reg, gen_operand(rhs).value());
+            return lhs;
         }
-        end_scope();
+        const Reg rhs_reg = temp_reg(rhs_temp.value());
+        const Reg lhs_reg = temp_reg(lhs);
+        emit(op, lhs_reg, rhs_reg);
+        free_temp(rhs_temp.value());
+        return lhs;
     }
 
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label) {
-        struct PredVisitor {
-            Generator& gen;
-            const std::string& end_label;
-
-            void operator()(const NodeIfPredElif* elif) const {
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
-                if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
-                }
+    // Moves the value of expr into dst, which is resolved only after the expression has been evaluated
+    template <typename Dst>
+    void gen_mov_expr(const Dst& dst, const ExprRef expr) {
+        if (const auto operand = gen_operand(expr)) {
+            const Operand dst_operand = dst();
+            if (std::holds_alternative<Mem>(dst_operand) && std::holds_alternative<Mem>(operand.value())) {
+                emit(Op::mov, Reg::rax, operand.value());
+                emit(Op::mov, dst_operand, Reg::rax);
+            } else {
+                emit(Op::mov, dst_operand, operand.value());
             }
+            return;
+        }
+        const size_t temp = gen_expr_reg(expr);
+        const Reg reg = temp_reg(temp);
+        emit(Op::mov, dst(), reg);
+        free_temp(temp);
+    }
 
-            void operator()(const NodeIfPredElse* else_) const {
-                gen.gen_scope(else_->scope);
-            }
+    // Jumps to target if expr is non-zero when jump_if is set, or if it is zero when it is not,
+    // and falls through otherwise. A comparison becomes a cmp and a jcc, and && and || branch on
+    // each operand in turn, so none of them materializes its value. The operands of && and ||
+    // wait on an explicit stack, so deeply nested conditions do not exhaust the native stack.
+    void gen_branch(const ExprRef expr, const bool jump_if, const Label target) {
+        struct Branch {
+            ExprRef expr;
+            bool jump_if;
+            Label target;
         };
+        // a label is placed once everything above it is done
+        std::vector<std::variant<Branch, Label>> pending { Branch { .expr = expr, .jump_if = jump_if, .target = target } };
+        while (!pending.empty()) {
+            const auto item = pending.back();
+            pending.pop_back();
+            if (const auto label = std::get_if<Label>(&item)) {
+                emit_label(*label);
+                continue;
+            }
+            const Branch branch = std::get<Branch>(item);
+            const ExprKind kind = m_ast.expr_kind(branch.expr);
+            const ExprRef lhs = m_ast.lhs(branch.expr);
+            const ExprRef rhs = m_ast.rhs(branch.expr);
+            if (kind == ExprKind::and_ || kind == ExprKind::or_) {
+                // the left operand decides a && once it is 0 and a || once it is not
+                const bool decides = kind == ExprKind::or_;
+                if (branch.jump_if == decides) {
+                    pending.push_back(Branch { .expr = rhs, .jump_if = branch.jump_if, .target = branch.target });
+                    pending.push_back(Branch { .expr = lhs, .jump_if = branch.jump_if, .target = branch.target });
+                } else {
+                    const Label skip = create_label();
+                    pending.push_back(skip);
+                    pending.push_back(Branch { .expr = rhs, .jump_if = branch.jump_if, .target = branch.target });
+                    pending.push_back(Branch { .expr = lhs, .jump_if = decides, .target = skip });
+                }
+                continue;
+            }
+            // e == 0 (which !e is) and e != 0 branch on e itself
+            if ((kind == ExprKind::eq || kind == ExprKind::ne) && const_value(rhs) == 0) {
+                pending.push_back(Branch { .expr = lhs, .jump_if = branch.jump_if == (kind == ExprKind::ne), .target = branch.target });
+                continue;
+            }
+            if (const auto value = const_value(branch.expr)) {
+                if ((value.value() != 0) == branch.jump_if) {
+                    emit(Op::jmp, branch.target);
+                }
+                continue;
+            }
+            const Cond cond = FlatAst::is_comparison(kind) ? gen_cmp(branch.expr) : gen_test(branch.expr);
+            emit_jcc(branch.jump_if ? cond : negate(cond), branch.target);
+        }
+    }
+
+    // Evaluates the operands of the comparison and compares them, returning the condition under
+    // which it holds
+    Cond gen_cmp(const ExprRef expr) {
+        ExprRef lhs = m_ast.lhs(expr);
+        ExprRef rhs = m_ast.rhs(expr);
+        Cond cond = compare_cond(m_ast.expr_kind(expr));
+        if (m_stack_machine) {
+            gen_expr(lhs);
+            gen_expr(rhs);
+            pop(Reg::rbx);
+            pop(Reg::rax);
+            emit(Op::cmp, Reg::rax, Reg::rbx);
+            return cond;
+        }
+        // a constant goes to the right, where it can be an immediate
+        if (const_value(lhs).has_value() && !const_value(rhs).has_value()) {
+            std::swap(lhs, rhs);
+            cond = mirror(cond);
+        }
+        const std::optional<size_t> lhs_temp = gen_operand(lhs, false).has_value() ? std::nullopt : std::optional { gen_expr_reg(lhs) };
+        const std::optional<size_t> rhs_temp = gen_operand(rhs).has_value() ? std::nullopt : std::optional { gen_expr_reg(rhs) };
+        // resolved only now as reloading lhs may have moved rsp
+        Operand left = lhs_temp.has_value() ? Operand(temp_reg(lhs_temp.value())) : gen_operand(lhs, false).value();
+        const Operand right = rhs_temp.has_value() ? Operand(temp_reg(rhs_temp.value())) : gen_operand(rhs).value();
+        if (std::holds_alternative<Mem>(left) && std::holds_alternative<Mem>(right)) {
+            emit(Op::mov, Reg::rax, left);
+            left = Reg::rax;
+        }
+        const auto imm = std::get_if<int64_t>(&right);
+        if (const auto reg = std::get_if<Reg>(&left); reg != nullptr && imm != nullptr && *imm == 0) {
+            emit(Op::test, *reg, *reg);
+        } else {
+            emit(Op::cmp, left, right);
+        }
+        if (rhs_temp.has_value()) {
+            free_temp(rhs_temp.value());
+        }
+        if (lhs_temp.has_value()) {
+            free_temp(lhs_temp.value());
+        }
+        return cond;
+    }
+
+    // Evaluates expr and tests it, returning the condition under which it is not zero
+    Cond gen_test(const ExprRef expr) {
+        if (m_stack_machine) {
+            gen_expr(expr);
+            pop(Reg::rax);
+            emit(Op::test, Reg::rax, Reg::rax);
+            return Cond::nz;
+        }
+        if (const auto operand = gen_operand(expr, false); operand.has_value() && std::holds_alternative<Reg>(operand.value())) {
+            emit(Op::test, operand.value(), operand.value());
+            return Cond::nz;
+        }
+        const size_t temp = gen_expr_reg(expr);
+        const Reg reg = temp_reg(temp);
+        emit(Op::test, reg, reg);
+        free_temp(temp);
+        return Cond::nz;
+    }
 
-        PredVisitor visitor { .gen = *this, .end_label = end_label };
-        std::visit(visitor, pred->var);
+    // Whether the value of expr is always 0 or 1
+    [[nodiscard]] bool is_boolean(const ExprRef expr) const {
+        const ExprKind kind = m_ast.expr_kind(expr);
+        return FlatAst::is_comparison(kind) || kind == ExprKind::and_ || kind == ExprKind::or_;
     }
 
-    void gen_stmt(const NodeStmt* stmt) {
-        struct StmtVisitor {
-            Generator& gen;
+    // The condition under which the comparison holds after a cmp of its operands
+    [[nodiscard]] static Cond compare_cond(const ExprKind kind) {
+        switch (kind) {
+            case ExprKind::eq:
+                return Cond::z;
+            case ExprKind::ne:
+                return Cond::nz;
+            case ExprKind::lt:
+                return Cond::l;
+            case ExprKind::le:
+                return Cond::le;
+            case ExprKind::gt:
+                return Cond::g;
+            default:
+                return Cond::ge;
+        }
+    }
 
-            void operator()(const NodeStmtExit* stmt_exit) const {
+    // The condition that holds for the operands the other way around
+    [[nodiscard]] static Cond mirror(const Cond cond) {
+        switch (cond) {
+            case Cond::l:
+                return Cond::g;
+            case Cond::le:
+                return Cond::ge;
+            case Cond::g:
+                return Cond::l;
+            case Cond::ge:
+                return Cond::le;
+            default:
+                return cond;
+        }
+    }
 
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-            }
+    // Opens the scope; its statements are generated by gen_stmt
+    void gen_scope(const std::span<const StmtRef> stmts) {
+        begin_scope();
+        m_work.push_back(ScopeWork { .stmts = stmts });
+    }
+
+    // Generates the condition of an elif and queues its arm and the rest of the chain for
+    // gen_stmt, or opens the scope of an else
+    void gen_else(const StmtRef stmt, const Label end_label) {
+        if (m_ast.stmt_kind(stmt) == StmtKind::scope) {
+            gen_scope(m_ast.body(stmt));
+            return;
+        }
+        const Label label = create_label();
+        gen_branch(m_ast.stmt_expr(stmt), false, label);
+        if (const StmtRef else_stmt = m_ast.else_stmt(stmt); else_stmt != no_node) {
+            m_work.push_back(ElseWork { .stmt = else_stmt, .end_label = end_label });
+        }
+        m_work.push_back(LabelWork { .jump = end_label, .label = label });
+        gen_scope(m_ast.body(stmt));
+    }
 
-            void operator()(const NodeStmtVar* stmt_var) const {
-                if (std::ranges::find_if(std::as_const(gen.m_vars), [&](const Var& var) {
-                    return var.name == stmt_var->ident.value.value();
-                }) != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already declared: " << stmt_var->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+    // Generates stmt and everything nested in it. Nested scopes and if arms are queued on an
+    // explicit work stack rather than generated recursively, so the nesting depth is only bounded
+    // by memory.
+    void gen_stmt(const StmtRef stmt) {
+        const size_t base = m_work.size();
+        gen_stmt_head(stmt);
+        while (m_work.size() > base) {
+            if (const auto scope_work = std::get_if<ScopeWork>(&m_work.back())) {
+                if (scope_work->next == scope_work->stmts.size()) {
+                    m_work.pop_back();
+                    end_scope();
+                } else {
+                    gen_stmt_head(scope_work->stmts[scope_work->next++]);
+                }
+                continue;
+            }
+            const Work work = m_work.back();
+            m_work.pop_back();
+            if (const auto else_work = std::get_if<ElseWork>(&work)) {
+                gen_else(else_work->stmt, else_work->end_label);
+            } else if (const auto loop_work = std::get_if<LoopWork>(&work)) {
+                emit_label(loop_work->test);
+                gen_branch(loop_work->expr, true, loop_work->top);
+            } else {
+                const auto& label_work = std::get<LabelWork>(work);
+                if (label_work.jump.has_value()) {
+                    emit(Op::jmp, label_work.jump.value());
                 }
+                emit_label(label_work.label);
+            }
+        }
+    }
 
-                gen.m_vars.push_back({.name = stmt_var->ident.value.value(), .stack_loc  = gen.m_stack_size});
-                gen.gen_expr(stmt_var->expr);
+    // Generates a statement up to the statements nested in it, which are queued on m_work
+    void gen_stmt_head(const StmtRef stmt) {
+        const ExprRef expr = m_ast.stmt_expr(stmt);
+        switch (m_ast.stmt_kind(stmt)) {
+            case StmtKind::exit: {
+                const Reg value_reg = exit_value_reg();
+                if (m_stack_machine) {
+                    gen_expr(expr);
+                    pop(value_reg);
+                } else {
+                    gen_mov_expr([&] { return value_reg; }, expr);
+                }
+                gen_exit();
+                break;
             }
+            case StmtKind::var: {
+                if (m_stack_machine) {
+                    gen_expr(expr);
+                    pop(Reg::rax);
+                    m_vars.push_back({ .stack_loc = m_vars.size() });
+                    emit(Op::mov, var_operand(m_vars.back()), Reg::rax);
+                    break;
+                }
 
-            void operator()(const NodeStmtAssign* stmt_assign) const {
-                const auto it = std::ranges::find_if(gen.m_vars, [&](const Var& var ) {
-                    return var.name == stmt_assign->ident.value.value();
-                });
-                if (it == gen.m_vars.end()) {
-                    std::cerr << "Undeclared identifier " << stmt_assign->ident.value.value() << " found" << std::endl;
-                    exit(EXIT_FAILURE);
+                // Variables get a register in declaration order and give it back when their scope ends.
+                // Lifetimes nest with the scopes, so this is a linear scan over the live intervals; once
+                // the variable share of the pool is used up, the variable is spilled to its frame slot
+                const size_t temp = gen_expr_reg(expr);
+                const Reg reg = temp_reg(temp);
+                if (m_var_reg_count < max_var_regs) {
+                    release_temp(temp);
+                    m_var_reg_count++;
+                    m_vars.push_back({ .stack_loc = 0, .reg = reg });
+                } else {
+                    m_vars.push_back({ .stack_loc = m_vars.size() - max_var_regs });
+                    emit(Op::mov, var_operand(m_vars.back()), reg);
+                    free_temp(temp);
                 }
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << ((gen.m_stack_size - it->stack_loc - 1) * 8) << "], rax\n";
-            }
-
-            void operator()(const NodeScope* scope) const {
-                gen.gen_scope(scope);
-            }
-
-            void operator()(const NodeStmtIf* stmt_if) const {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
+                break;
+            }
+            case StmtKind::assign: {
+                const Var& var = m_vars[m_ast.assign_slot(stmt)];
+                if (!m_stack_machine) {
+                    gen_mov_expr([&] { return var_operand(var); }, expr);
+                    break;
+                }
+                gen_expr(expr);
+                pop(Reg::rax);
+                emit(Op::mov, var_operand(var), Reg::rax);
+                break;
+            }
+            case StmtKind::scope:
+                gen_scope(m_ast.body(stmt));
+                break;
+            case StmtKind::if_: {
+                const Label label = create_label();
+                gen_branch(expr, false, label);
+                // queued in reverse: the scope, then the elif/else chain if any, then the end label
+                if (const StmtRef else_stmt = m_ast.else_stmt(stmt); else_stmt != no_node) {
+                    const Label end_label = create_label();
+                    m_work.push_back(LabelWork { .label = end_label });
+                    m_work.push_back(ElseWork { .stmt = else_stmt, .end_label = end_label });
+                    m_work.push_back(LabelWork { .jump = end_label, .label = label });
                 } else {
-                    gen.m_output << label << ":\n";
+                    m_work.push_back(LabelWork { .label = label });
                 }
+                gen_scope(m_ast.body(stmt));
+                break;
             }
-        };
+            // Bottom tested: the condition is checked once on entry by jumping to the test below
+            // the body, after that every iteration ends in the single conditional jump back to top
+            case StmtKind::while_: {
+                const Label top = create_label();
+                const Label test = create_label();
+                emit(Op::jmp, test);
+                emit_label(top);
+                m_work.push_back(LoopWork { .expr = expr, .top = top, .test = test });
+                gen_scope(m_ast.body(stmt));
+                break;
+            }
+            case StmtKind::return_:
+                if (is_self_call(expr)) {
+                    gen_tail_call(expr);
+                    break;
+                }
+                if (m_stack_machine) {
+                    gen_expr(expr);
+                    pop(Reg::rax);
+                } else {
+                    gen_mov_expr([] { return Reg::rax; }, expr);
+                }
+                if (m_stack_size > 0) {
+                    emit(Op::add, Reg::rsp, static_cast<int64_t>(m_stack_size * 8));
+                }
+                emit(Op::jmp, m_function->epilogue);
+                break;
+        }
+    }
+
+    // Whether expr is a call of the function being generated, which can then be a jump
+    [[nodiscard]] bool is_self_call(const ExprRef expr) const {
+        return m_ast.expr_kind(expr) == ExprKind::call && m_ast.callee(expr) == m_function->index;
+    }
+
+    // Tail call of the function being generated: the arguments replace the parameters and the
+    // body starts over without growing the stack
+    void gen_tail_call(const ExprRef call) {
+        const std::span<const ExprRef> call_args = m_ast.args(call);
+        const size_t param_count = call_args.size();
+        if (m_stack_machine) {
+            for (const ExprRef arg : call_args) {
+                gen_expr(arg);
+            }
+            for (size_t i = param_count; i-- > 0;) {
+                pop(Reg::rax);
+                emit(Op::mov, var_operand(m_vars[i]), Reg::rax);
+            }
+        } else {
+            std::vector<std::optional<size_t>> args;
+            for (const ExprRef arg : call_args) {
+                args.push_back(gen_operand(arg).has_value() ? std::nullopt : std::optional { gen_expr_reg(arg) });
+            }
+            std::vector<Move> moves;
+            for (size_t i = 0; i < param_count; i++) {
+                const Operand src = args[i].has_value() ? temp_operand(args[i].value()) : gen_operand(call_args[i]).value();
+                moves.push_back({ .dst = m_vars[i].reg.value(), .src = src });
+            }
+            gen_parallel_move(std::move(moves));
+            // the spilled arguments go with the rest of what was pushed
+            const size_t spilled = forget_temps(args);
+            emit_tail_jump();
+            m_stack_size -= spilled;
+            return;
+        }
+        emit_tail_jump();
+    }
 
-        StmtVisitor visitor{.gen = *this};
-        std::visit(visitor, stmt->var);
+    // Drops everything pushed above the frame and jumps back to the body
+    void emit_tail_jump() {
+        if (m_stack_size > m_frame_size) {
+            emit(Op::add, Reg::rsp, static_cast<int64_t>((m_stack_size - m_frame_size) * 8));
+        }
+        emit(Op::jmp, m_function->body);
     }
 
-    [[nodiscard]] std::string gen_prog() {
-        m_output << "global _start\n_start:\n";
+    // Generates the function at its label. Following the SysV calling convention the arguments
+    // arrive in arg_regs, the result is returned in rax and the callee saved registers the body
+    // uses are preserved.
+    void gen_function(const size_t index) {
+        const FlatFunction& function = m_ast.functions[index];
+        m_vars.clear();
+        m_scopes.clear();
+        m_temps.clear();
+        m_free_regs.assign(pool.begin(), pool.end());
+        m_var_reg_count = 0;
+        m_function = { .index = index, .body = create_label(), .epilogue = create_label() };
+        emit_label(m_function_labels[index]);
+        const size_t start = m_instrs.size();
+        const std::span<const StmtRef> body = m_ast.list(function.body);
+        begin_frame(body, function.param_count);
+        begin_scope();
+        for (size_t i = 0; i < function.param_count; i++) {
+            if (m_stack_machine) {
+                m_vars.push_back({ .stack_loc = i });
+                emit(Op::mov, var_operand(m_vars.back()), arg_regs[i]);
+                continue;
+            }
+            // parameters stay in the register they arrive in if it is in the pool
+            m_vars.push_back({ .stack_loc = 0 });
+            if (const auto it = std::ranges::find(m_free_regs, arg_regs[i]); it != m_free_regs.end()) {
+                m_vars.back().reg = arg_regs[i];
+                m_free_regs.erase(it);
+                m_var_reg_count++;
+            }
+        }
+        for (size_t i = 0; i < m_vars.size(); i++) {
+            if (!m_stack_machine && !m_vars[i].reg.has_value()) {
+                m_vars[i].reg = m_free_regs.back();
+                m_free_regs.pop_back();
+                m_var_reg_count++;
+                emit(Op::mov, m_vars[i].reg.value(), arg_regs[i]);
+            }
+        }
+        emit_label(m_function->body);
+        for (const StmtRef stmt : body) {
+            gen_stmt(stmt);
+        }
+        if (body.empty() || m_ast.stmt_kind(body.back()) != StmtKind::return_) {
+            emit(Op::mov, Reg::rax, 0);
+            if (m_frame_size > 0) {
+                emit(Op::add, Reg::rsp, static_cast<int64_t>(m_frame_size * 8));
+            }
+        }
+        end_scope();
+        emit_label(m_function->epilogue);
+
+        std::vector<Reg> saved;
+        for (const Reg reg : callee_saved) {
+            if (reg != Reg::rbp && std::any_of(m_instrs.begin() + static_cast<std::ptrdiff_t>(start), m_instrs.end(), [&](const Instr& instr) {
+                return instr.op != Op::push && instr.op != Op::pop && (reads(instr.dst, reg) || reads(instr.src, reg));
+            })) {
+                saved.push_back(reg);
+            }
+        }
+        std::vector<Instr> prologue;
+        for (const Reg reg : saved) {
+            prologue.push_back({ .op = Op::push, .dst = reg });
+        }
+        m_instrs.insert(m_instrs.begin() + static_cast<std::ptrdiff_t>(start), prologue.begin(), prologue.end());
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            emit(Op::pop, *it);
+        }
+        emit(Op::ret);
+        m_function.reset();
+    }
 
-        for (const NodeStmt* stmt: m_prog.stmts) {
+    [[nodiscard]] std::vector<Instr> gen_prog() {
+        for (size_t i = 0; i < m_ast.functions.size(); i++) {
+            m_function_labels.push_back(create_label());
+        }
+        if (m_jit) {
+            for (const Reg reg : callee_saved) {
+                emit(Op::push, reg);
+            }
+            emit(Op::mov, Reg::rbp, Reg::rsp);
+        }
+        const std::span<const StmtRef> stmts = m_ast.list(m_ast.main);
+        begin_frame(stmts, 0);
+        for (const StmtRef stmt : stmts) {
             gen_stmt(stmt);
         }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
+        // the implicit exit is dead if the program already ends in one
+        if (stmts.empty() || m_ast.stmt_kind(stmts.back()) != StmtKind::exit) {
+            emit(Op::mov, exit_value_reg(), 0);
+            gen_exit();
+        }
+        for (size_t i = 0; i < m_ast.functions.size(); i++) {
+            gen_function(i);
+        }
+        return std::move(m_instrs);
+    }
+
+    // Register the exit value has to be in for gen_exit
+    [[nodiscard]] Reg exit_value_reg() const {
+        return m_jit ? Reg::rax : Reg::rdi;
+    }
+
+    // Ends the program with the value in exit_value_reg(): an exit syscall, or when jitting, a
+    // return to the host through the frame set up in gen_prog
+    void gen_exit() {
+        if (m_jit) {
+            emit(Op::mov, Reg::rsp, Reg::rbp);
+            for (auto it = callee_saved.rbegin(); it != callee_saved.rend(); ++it) {
+                emit(Op::pop, *it);
+            }
+            emit(Op::ret);
+            return;
+        }
+        emit(Op::mov, Reg::rax, 60);
+        emit(Op::syscall);
     }
 
 private:
 
-    void push(const std::string& reg) {
-        m_output << "    push " << reg << "\n";
+    void emit(const Op op, const Operand& dst = {}, const Operand& src = {}) {
+        m_instrs.push_back({ .op = op, .dst = dst, .src = src });
+    }
+
+    void emit_jcc(const Cond cond, const Label label) {
+        m_instrs.push_back({ .op = Op::jcc, .dst = label, .cond = cond });
+    }
+
+    // Sets reg to 1 if cond holds and to 0 otherwise, leaving the flags as they are
+    void emit_set(const Cond cond, const Reg reg) {
+        m_instrs.push_back({ .op = Op::setcc, .dst = reg, .cond = cond });
+        emit(Op::movzx, reg, reg);
+    }
+
+    void emit_label(const Label label) {
+        m_instrs.push_back({ .op = Op::label, .dst = label });
+    }
+
+    void push(const Operand& operand) {
+        emit(Op::push, operand);
         m_stack_size++;
     }
 
-    void pop(const std::string& reg) {
-        m_output << "    pop " << reg << "\n";
+    void pop(const Reg reg) {
+        emit(Op::pop, reg);
         m_stack_size--;
     }
 
+    // Reserves the frame of body, which starts with live variables, with a single sub rsp
+    void begin_frame(const std::span<const StmtRef> body, const size_t live) {
+        m_frame_size = frame_size(body, live);
+        m_stack_size = m_frame_size;
+        if (m_frame_size > 0) {
+            emit(Op::sub, Reg::rsp, static_cast<int64_t>(m_frame_size * 8));
+        }
+    }
+
+    // The number of frame slots the variables of body need, when it starts with live variables.
+    // A variable without a register takes the slot above those of the variables live at its
+    // declaration, so scopes that are not nested in each other share their slots and the frame
+    // is as deep as the most variables ever live at once.
+    [[nodiscard]] size_t frame_size(const std::span<const StmtRef> body, const size_t live) const {
+        struct Open {
+            std::span<const StmtRef> stmts;
+            size_t next = 0;
+            size_t live;
+        };
+        std::vector<Open> open { { .stmts = body, .live = live } };
+        size_t max_live = live;
+        while (!open.empty()) {
+            Open& top = open.back();
+            if (top.next == top.stmts.size()) {
+                open.pop_back();
+                continue;
+            }
+            const StmtRef stmt = top.stmts[top.next++];
+            const size_t outer = top.live;
+            switch (m_ast.stmt_kind(stmt)) {
+                case StmtKind::var:
+                    top.live++;
+                    max_live = std::max(max_live, top.live);
+                    break;
+                case StmtKind::scope:
+                case StmtKind::while_:
+                    open.push_back({ .stmts = m_ast.body(stmt), .live = outer });
+                    break;
+                case StmtKind::if_:
+                    // the arms of the chain, the else being a bare scope
+                    for (StmtRef arm = stmt; arm != no_node; arm = m_ast.stmt_kind(arm) == StmtKind::scope ? no_node : m_ast.else_stmt(arm)) {
+                        open.push_back({ .stmts = m_ast.body(arm), .live = outer });
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (m_stack_machine) {
+            return max_live;
+        }
+        return max_live > max_var_regs ? max_live - max_var_regs : 0;
+    }
+
     void begin_scope() {
         m_scopes.push_back(m_vars.size());
     }
 
+    // The variables of the scope die, their frame slots are free for the next scope to use
     void end_scope() {
-        const size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-
-        for (int i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+        for (size_t i = m_scopes.back(); i < m_vars.size(); i++) {
+            if (m_vars[i].reg.has_value()) {
+                m_free_regs.push_back(m_vars[i].reg.value());
+                m_var_reg_count--;
+            }
         }
+        m_vars.resize(m_scopes.back());
         m_scopes.pop_back();
     }
 
-    std::string create_label() {
-        return "label" + std::to_string(m_label_count++);
+    // Hands out a temporary register. If the pool is exhausted, the oldest temporary that still
+    // holds a register is pushed to the stack. Temporaries are consumed in LIFO order, so spilled
+    // ones are always reloaded (see temp_reg) in the reverse order of spilling, straight off the top
+    // of the stack.
+    size_t alloc_temp() {
+        if (m_free_regs.empty()) {
+            const auto it = std::ranges::find_if(m_temps, [](const Temp& temp) { return !temp.spilled; });
+            assert(it != m_temps.end());
+            it->stack_loc = m_stack_size;
+            push(it->reg);
+            it->spilled = true;
+            m_free_regs.push_back(it->reg);
+        }
+        m_temps.push_back({.id = m_temp_count++, .reg = m_free_regs.back()});
+        m_free_regs.pop_back();
+        return m_temps.back().id;
+    }
+
+    Reg temp_reg(const size_t id) {
+        Temp& temp = find_temp(id);
+        if (temp.spilled) {
+            assert(!m_free_regs.empty());
+            temp.reg = m_free_regs.back();
+            m_free_regs.pop_back();
+            temp.spilled = false;
+            pop(temp.reg);
+        }
+        return temp.reg;
+    }
+
+    void free_temp(const size_t id) {
+        m_free_regs.push_back(temp_reg(id));
+        release_temp(id);
+    }
+
+    // Forgets the temporary without returning its register to the pool
+    void release_temp(const size_t id) {
+        const auto it = std::ranges::find_if(m_temps, [&](const Temp& temp) { return temp.id == id; });
+        assert(it != m_temps.end() && !it->spilled);
+        m_temps.erase(it);
+    }
+
+    Label create_label() {
+        return Label { m_label_count++ };
     }
 
     struct Var {
-        std::string name;
+        // the frame slot if it has no register
         size_t stack_loc;
+        std::optional<Reg> reg{};
+    };
+
+    // Statements of an open scope, of which next is generated next; the scope ends after the last
+    struct ScopeWork {
+        std::span<const StmtRef> stmts;
+        size_t next = 0;
+    };
+
+    // The elif/else chain following an arm of an if
+    struct ElseWork {
+        StmtRef stmt;
+        Label end_label;
+    };
+
+    // Places label, after a jump to jump if set
+    struct LabelWork {
+        std::optional<Label> jump{};
+        Label label;
+    };
+
+    // The test of a while loop, placed after its body: jumps back to top while expr holds
+    struct LoopWork {
+        ExprRef expr;
+        Label top;
+        Label test;
+    };
+
+    using Work = std::variant<ScopeWork, ElseWork, LabelWork, LoopWork>;
+
+    struct Temp {
+        size_t id;
+        Reg reg;
+        bool spilled = false;
+        // where it was pushed to if spilled
+        size_t stack_loc = 0;
+    };
+
+    [[nodiscard]] Operand var_operand(const Var& var) const {
+        if (var.reg.has_value()) {
+            return var.reg.value();
+        }
+        return Mem { .base = Reg::rsp, .disp = static_cast<int32_t>((m_stack_size - var.stack_loc - 1) * 8) };
+    }
+
+    // The temporary as a source operand, without reloading it if it is spilled
+    [[nodiscard]] Operand temp_operand(const size_t id) {
+        const Temp& temp = find_temp(id);
+        if (!temp.spilled) {
+            return temp.reg;
+        }
+        return Mem { .base = Reg::rsp, .disp = static_cast<int32_t>((m_stack_size - temp.stack_loc - 1) * 8) };
+    }
+
+    [[nodiscard]] static bool is_caller_saved(const Reg reg) {
+        return std::ranges::find(callee_saved, reg) == callee_saved.end();
+    }
+
+    Temp& find_temp(const size_t id) {
+        const auto it = std::ranges::find_if(m_temps, [&](const Temp& temp) { return temp.id == id; });
+        assert(it != m_temps.end());
+        return *it;
+    }
+
+    // rax and rdx are kept free for mul/div and the exit syscall, rsp and rbp are never allocated.
+    // At most max_var_regs of the pool go to variables so expressions always have room to work in.
+    static constexpr size_t max_var_regs = 8;
+    // Saved around jitted code; rbp holds the stack pointer to unwind to on exit
+    static constexpr std::array callee_saved = { Reg::rbx, Reg::rbp, Reg::r12, Reg::r13, Reg::r14, Reg::r15 };
+    // Allocated from the back
+    static constexpr std::array pool = {
+        Reg::r15, Reg::r14, Reg::r13, Reg::r12, Reg::r11, Reg::r10, Reg::r9, Reg::r8,
+        Reg::rdi, Reg::rsi, Reg::rcx, Reg::rbx
     };
+    // Where the arguments of a call are passed, in order
+    static constexpr std::array<Reg, max_params> arg_regs = { Reg::rdi, Reg::rsi, Reg::rdx, Reg::rcx, Reg::r8, Reg::r9 };
 
-    const NodeProg m_prog;
-    std::stringstream m_output;
+    const FlatAst& m_ast;
+    const bool m_stack_machine;
+    const bool m_jit;
+    std::vector<Reg> m_free_regs { pool.begin(), pool.end() };
+    std::vector<Temp> m_temps{};
+    size_t m_temp_count = 0;
+    size_t m_var_reg_count = 0;
+    std::vector<Instr> m_instrs{};
+    // the slots of the frame, which are at the bottom of the m_stack_size values on the stack
+    size_t m_frame_size = 0;
     size_t m_stack_size = 0;
     std::vector<Var> m_vars{};
     std::vector<size_t> m_scopes{};
-    int m_label_count = 0;
+    std::vector<Work> m_work{};
+    size_t m_label_count = 0;
+    std::vector<Label> m_function_labels{};
+
+    // The function being generated, where a return or tail call jumps to
+    struct Function {
+        size_t index;
+        Label body;
+        Label epilogue;
+    };
+    std::optional<Function> m_function{};
 };
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Allocations made through operator new. They are counted by the replacement operator new in
+// main.cpp; in any other program they stay zero. Every thread counts its own, and ThreadPool
+// adds what a job allocated to the counters of the thread that submitted it, so a phase that
+// hands work to a pool is charged for it. Those adds come from other threads, hence the atomics.
+struct HeapCounters {
+    struct Snapshot {
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+    };
+
+    std::atomic<uint64_t> allocations = 0;
+    std::atomic<uint64_t> bytes = 0;
+
+    void add(const uint64_t allocation_count, const uint64_t byte_count) {
+        allocations.fetch_add(allocation_count, std::memory_order_relaxed);
+        bytes.fetch_add(byte_count, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] Snapshot snapshot() const {
+        return { .allocations = allocations.load(std::memory_order_relaxed), .bytes = bytes.load(std::memory_order_relaxed) };
+    }
+};
+
+inline thread_local HeapCounters heap_counters{};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+// Dense id of an interned name. Equal names have equal symbols, so later phases compare names
+// and index tables by symbol instead of by string.
+using Symbol = uint32_t;
+
+// Hands out symbols for names, in the order they are first seen. The names are not copied: they
+// have to outlive the interner, like the source the tokens point into.
+class Interner {
+public:
+    Symbol intern(const std::string_view name) {
+        if ((m_names.size() + 1) * 2 > m_slots.size()) {
+            grow();
+        }
+        const size_t mask = m_slots.size() - 1;
+        for (size_t i = std::hash<std::string_view>{}(name) & mask;; i = (i + 1) & mask) {
+            if (m_slots[i] == empty) {
+                m_slots[i] = static_cast<Symbol>(m_names.size());
+                m_names.push_back(name);
+                return m_slots[i];
+            }
+            if (m_names[m_slots[i]] == name) {
+                return m_slots[i];
+            }
+        }
+    }
+
+    [[nodiscard]] std::string_view name(const Symbol symbol) const {
+        return m_names[symbol];
+    }
+
+    // one more than the largest symbol handed out
+    [[nodiscard]] size_t size() const {
+        return m_names.size();
+    }
+
+private:
+    static constexpr Symbol empty = UINT32_MAX;
+
+    // Open addressing with linear probing, kept at most half full
+    void grow() {
+        m_slots.assign(std::max<size_t>(m_slots.size() * 2, 64), empty);
+        const size_t mask = m_slots.size() - 1;
+        for (Symbol symbol = 0; symbol < m_names.size(); symbol++) {
+            size_t i = std::hash<std::string_view>{}(m_names[symbol]) & mask;
+            while (m_slots[i] != empty) {
+                i = (i + 1) & mask;
+            }
+            m_slots[i] = symbol;
+        }
+    }
+
+    std::vector<Symbol> m_slots{};
+    std::vector<std::string_view> m_names{};
+};
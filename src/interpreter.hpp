@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "./bytecode.hpp"
+
+// Direct threaded interpreter for BcProgram. On construction every instruction is rewritten
+// to carry the address of its handler (GCC/Clang labels as values), so dispatching is a single
+// indirect jump at the end of each handler instead of a trip through a central switch.
+class Interpreter {
+public:
+    explicit Interpreter(BcProgram program)
+        : m_constants(std::move(program.constants)),
+          m_frame_size(program.frame_size),
+          m_functions(std::move(program.functions)) {
+        m_code.reserve(program.code.size());
+        for (const BcInstr& instr : program.code) {
+            m_code.push_back({ .handler = nullptr, .dst = instr.dst, .lhs = instr.lhs, .rhs = instr.rhs, .op = instr.op });
+        }
+        execute(true);
+    }
+
+    // Runs the program and returns the value it exits with. Division by zero and overflowing
+    // division raise SIGFPE, like idiv does in the native code.
+    [[nodiscard]] int64_t run() {
+        return execute(false);
+    }
+
+private:
+
+    struct Threaded {
+        const void* handler;
+        uint16_t dst;
+        uint16_t lhs;
+        int32_t rhs;
+        BcOp op;
+    };
+
+    struct CallFrame {
+        const Threaded* ret;
+        size_t base;
+        uint16_t dst;
+    };
+
+    // With link set, only fills in the handler addresses, which are not visible outside
+    int64_t execute(const bool link) {
+        // indexed by BcOp
+        static const void* const handlers[] = {
+            &&op_load_imm, &&op_load_const, &&op_mov, &&op_add, &&op_sub, &&op_mul, &&op_div,
+            &&op_add_imm, &&op_sub_imm, &&op_mul_imm, &&op_div_imm, &&op_eq, &&op_ne, &&op_lt, &&op_le, &&op_gt, &&op_ge,
+            &&op_to_bool, &&op_jz, &&op_jnz, &&op_jeq, &&op_jne, &&op_jlt, &&op_jle, &&op_jgt, &&op_jge, &&op_jmp,
+            &&op_exit, &&op_call, &&op_ret
+        };
+        if (link) {
+            for (Threaded& instr : m_code) {
+                instr.handler = handlers[static_cast<uint8_t>(instr.op)];
+            }
+            return 0;
+        }
+
+        // the frames of active calls are windows into one register stack: a callee's frame starts
+        // at the register holding its first argument
+        std::vector<int64_t> stack(m_frame_size);
+        size_t base = 0;
+        int64_t* regs = stack.data();
+        std::vector<CallFrame> calls;
+        const Threaded* ip = m_code.data();
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() ip++; DISPATCH()
+
+        DISPATCH();
+
+    op_load_imm:
+        regs[ip->dst] = ip->rhs;
+        NEXT();
+    op_load_const:
+        regs[ip->dst] = m_constants[ip->rhs];
+        NEXT();
+    op_mov:
+        regs[ip->dst] = regs[ip->lhs];
+        NEXT();
+    op_add:
+        regs[ip->dst] = wrap(static_cast<uint64_t>(regs[ip->lhs]) + static_cast<uint64_t>(regs[ip->rhs]));
+        NEXT();
+    op_sub:
+        regs[ip->dst] = wrap(static_cast<uint64_t>(regs[ip->lhs]) - static_cast<uint64_t>(regs[ip->rhs]));
+        NEXT();
+    op_mul:
+        regs[ip->dst] = wrap(static_cast<uint64_t>(regs[ip->lhs]) * static_cast<uint64_t>(regs[ip->rhs]));
+        NEXT();
+    op_div:
+        regs[ip->dst] = divide(regs[ip->lhs], regs[ip->rhs]);
+        NEXT();
+    op_add_imm:
+        regs[ip->dst] = wrap(static_cast<uint64_t>(regs[ip->lhs]) + static_cast<uint64_t>(ip->rhs));
+        NEXT();
+    op_sub_imm:
+        regs[ip->dst] = wrap(static_cast<uint64_t>(regs[ip->lhs]) - static_cast<uint64_t>(ip->rhs));
+        NEXT();
+    op_mul_imm:
+        regs[ip->dst] = wrap(static_cast<uint64_t>(regs[ip->lhs]) * static_cast<uint64_t>(ip->rhs));
+        NEXT();
+    op_div_imm:
+        regs[ip->dst] = divide(regs[ip->lhs], ip->rhs);
+        NEXT();
+    op_eq:
+        regs[ip->dst] = regs[ip->lhs] == regs[ip->rhs];
+        NEXT();
+    op_ne:
+        regs[ip->dst] = regs[ip->lhs] != regs[ip->rhs];
+        NEXT();
+    op_lt:
+        regs[ip->dst] = regs[ip->lhs] < regs[ip->rhs];
+        NEXT();
+    op_le:
+        regs[ip->dst] = regs[ip->lhs] <= regs[ip->rhs];
+        NEXT();
+    op_gt:
+        regs[ip->dst] = regs[ip->lhs] > regs[ip->rhs];
+        NEXT();
+    op_ge:
+        regs[ip->dst] = regs[ip->lhs] >= regs[ip->rhs];
+        NEXT();
+    op_to_bool:
+        regs[ip->dst] = regs[ip->lhs] != 0;
+        NEXT();
+    op_jz:
+        if (regs[ip->lhs] == 0) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jnz:
+        if (regs[ip->lhs] != 0) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jeq:
+        if (regs[ip->lhs] == regs[ip->dst]) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jne:
+        if (regs[ip->lhs] != regs[ip->dst]) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jlt:
+        if (regs[ip->lhs] < regs[ip->dst]) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jle:
+        if (regs[ip->lhs] <= regs[ip->dst]) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jgt:
+        if (regs[ip->lhs] > regs[ip->dst]) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jge:
+        if (regs[ip->lhs] >= regs[ip->dst]) {
+            ip = m_code.data() + ip->rhs;
+            DISPATCH();
+        }
+        NEXT();
+    op_jmp:
+        ip = m_code.data() + ip->rhs;
+        DISPATCH();
+    op_exit:
+        return regs[ip->lhs];
+    op_call: {
+        const BcFunction& function = m_functions[ip->rhs];
+        calls.push_back({ .ret = ip + 1, .base = base, .dst = ip->dst });
+        base += ip->lhs;
+        if (base + function.frame_size > stack.size()) {
+            stack.resize(std::max(2 * stack.size(), base + function.frame_size));
+        }
+        regs = stack.data() + base;
+        ip = m_code.data() + function.entry;
+        DISPATCH();
+    }
+    op_ret: {
+        const int64_t value = regs[ip->lhs];
+        const CallFrame frame = calls.back();
+        calls.pop_back();
+        base = frame.base;
+        regs = stack.data() + base;
+        regs[frame.dst] = value;
+        ip = frame.ret;
+        DISPATCH();
+    }
+
+#undef NEXT
+#undef DISPATCH
+    }
+
+    static int64_t wrap(const uint64_t value) {
+        return static_cast<int64_t>(value);
+    }
+
+    static int64_t divide(const int64_t lhs, const int64_t rhs) {
+        if (rhs == 0 || (lhs == std::numeric_limits<int64_t>::min() && rhs == -1)) {
+            std::raise(SIGFPE);
+            // only reached if SIGFPE is ignored
+            exit(EXIT_FAILURE);
+        }
+        return lhs / rhs;
+    }
+
+    std::vector<Threaded> m_code;
+    const std::vector<int64_t> m_constants;
+    const size_t m_frame_size;
+    const std::vector<BcFunction> m_functions;
+};
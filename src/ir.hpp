@@ -0,0 +1,701 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "./flat_ast.hpp"
+
+// Mid-level SSA form of the program for the --ssa pipeline: every function is a graph of basic
+// blocks whose values are defined exactly once, with phi nodes where control flow joins. The
+// passes in ir_passes.hpp rewrite it and IrGenerator lowers it to instructions.
+
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+
+inline constexpr uint32_t no_value = UINT32_MAX;
+
+enum class IrOp : uint8_t {
+    const_, // imm
+    param,  // the parameter imm
+    copy,   // args[0]
+    add,    // args[0] + args[1]
+    sub,    // args[0] - args[1]
+    mul,    // args[0] * args[1]
+    div,    // args[0] / args[1]
+    eq,     // args[0] == args[1], 1 or 0, and so on for the other comparisons
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    call,   // the function imm applied to args
+    phi     // args[i] when the block is entered from its preds[i]
+};
+
+struct IrValue {
+    IrOp op;
+    BlockId block;
+    int64_t imm = 0;
+    std::vector<ValueId> args{};
+};
+
+enum class IrTermKind : uint8_t {
+    jmp,  // to targets[0]
+    br,   // to targets[0] if value is not zero, to targets[1] otherwise
+    ret,  // return value
+    exit  // end the program with value
+};
+
+struct IrTerm {
+    IrTermKind kind = IrTermKind::jmp;
+    ValueId value = no_value;
+    // where a jmp or br continues
+    std::array<BlockId, 2> targets{};
+};
+
+struct IrBlock {
+    // in order, the phis first
+    std::vector<ValueId> values{};
+    std::vector<BlockId> preds{};
+    IrTerm term{};
+    // unreachable and removed
+    bool dead = false;
+};
+
+// The entry is blocks[0]
+struct IrFunction {
+    std::string name;
+    uint32_t param_count = 0;
+    std::vector<IrValue> values{};
+    std::vector<IrBlock> blocks{};
+
+    [[nodiscard]] std::span<const BlockId> successors(const BlockId block) const {
+        const IrTerm& term = blocks[block].term;
+        switch (term.kind) {
+            case IrTermKind::jmp:
+                return { term.targets.data(), 1 };
+            case IrTermKind::br:
+                return term.targets;
+            default:
+                return {};
+        }
+    }
+
+    // Index of pred in the predecessors of block
+    [[nodiscard]] size_t pred_index(const BlockId block, const BlockId pred) const {
+        const std::vector<BlockId>& preds = blocks[block].preds;
+        size_t i = 0;
+        while (preds[i] != pred) {
+            i++;
+        }
+        return i;
+    }
+
+    [[nodiscard]] bool has_side_effects(const ValueId value) const;
+};
+
+// Whether dropping value could change what the program does: calls, and divisions that may trap
+inline bool IrFunction::has_side_effects(const ValueId value) const {
+    const IrValue& ir_value = values[value];
+    if (ir_value.op == IrOp::call) {
+        return true;
+    }
+    if (ir_value.op != IrOp::div) {
+        return false;
+    }
+    const IrValue& divisor = values[ir_value.args[1]];
+    return divisor.op != IrOp::const_ || divisor.imm == 0 || divisor.imm == -1;
+}
+
+struct IrProgram {
+    IrFunction main;
+    std::vector<IrFunction> functions{};
+
+    [[nodiscard]] size_t value_count() const {
+        size_t count = 0;
+        for (const IrFunction* function : all()) {
+            for (const IrBlock& block : function->blocks) {
+                count += block.values.size();
+            }
+        }
+        return count;
+    }
+
+    [[nodiscard]] std::vector<IrFunction*> all() {
+        std::vector<IrFunction*> result { &main };
+        for (IrFunction& function : functions) {
+            result.push_back(&function);
+        }
+        return result;
+    }
+
+    [[nodiscard]] std::vector<const IrFunction*> all() const {
+        std::vector<const IrFunction*> result { &main };
+        for (const IrFunction& function : functions) {
+            result.push_back(&function);
+        }
+        return result;
+    }
+};
+
+inline std::string_view to_string(const IrOp op) {
+    static constexpr const char* names[] = { "const", "param", "copy", "add", "sub", "mul", "div", "eq", "ne", "lt", "le", "gt", "ge", "call", "phi" };
+    return names[static_cast<uint8_t>(op)];
+}
+
+inline void print_ir(std::ostream& out, const IrFunction& function) {
+    out << function.name << "(" << function.param_count << "):\n";
+    for (BlockId b = 0; b < function.blocks.size(); b++) {
+        const IrBlock& block = function.blocks[b];
+        if (block.dead) {
+            continue;
+        }
+        out << "  b" << b << ":";
+        if (!block.preds.empty()) {
+            out << " ; preds";
+            for (const BlockId pred : block.preds) {
+                out << " b" << pred;
+            }
+        }
+        out << "\n";
+        for (const ValueId v : block.values) {
+            const IrValue& value = function.values[v];
+            out << "    v" << v << " = " << to_string(value.op);
+            if (value.op == IrOp::const_ || value.op == IrOp::param) {
+                out << " " << value.imm;
+            } else if (value.op == IrOp::call) {
+                out << " fn" << value.imm;
+            }
+            for (size_t i = 0; i < value.args.size(); i++) {
+                out << (i == 0 && value.op != IrOp::call ? " " : ", ") << "v" << value.args[i];
+                if (value.op == IrOp::phi) {
+                    out << " b" << block.preds[i];
+                }
+            }
+            out << "\n";
+        }
+        const IrTerm& term = block.term;
+        switch (term.kind) {
+            case IrTermKind::jmp:
+                out << "    jmp b" << term.targets[0] << "\n";
+                break;
+            case IrTermKind::br:
+                out << "    br v" << term.value << ", b" << term.targets[0] << ", b" << term.targets[1] << "\n";
+                break;
+            case IrTermKind::ret:
+                out << "    ret v" << term.value << "\n";
+                break;
+            case IrTermKind::exit:
+                out << "    exit v" << term.value << "\n";
+                break;
+        }
+    }
+}
+
+inline void print_ir(std::ostream& out, const IrProgram& program) {
+    for (const IrFunction* function : program.all()) {
+        print_ir(out, *function);
+    }
+}
+
+// Builds the SSA form from the FlatAst. The control flow is structured, so the phis are placed
+// while walking it: at the join of an if for every variable an arm assigned, and at the head of
+// a while for every variable its body assigns. A && or || branches around its right operand
+// and joins with a phi of its result. Variables are tracked by slot with a log of the
+// definitions they had, so leaving an arm restores the state before it in time proportional to
+// the assignments made inside.
+class IrBuilder {
+public:
+    explicit IrBuilder(const FlatAst& ast)
+        : m_ast(ast) {
+
+    }
+
+    [[nodiscard]] IrProgram build() {
+        IrProgram program { .main = build_function("main", 0, m_ast.main, true) };
+        for (size_t i = 0; i < m_ast.functions.size(); i++) {
+            const FlatFunction& function = m_ast.functions[i];
+            program.functions.push_back(build_function("fn" + std::to_string(i), function.param_count, function.body, false));
+        }
+        return program;
+    }
+
+private:
+    // Statements of an open scope, of which next is built next
+    struct ScopeWork {
+        std::span<const StmtRef> stmts;
+        size_t next = 0;
+        // the variables visible before the scope
+        uint32_t var_count;
+    };
+
+    // The then arm of stmt has been built
+    struct ThenWork {
+        StmtRef stmt;
+        BlockId cond_block;
+        size_t mark;
+        uint32_t visible;
+    };
+
+    // The else arm has been built, then_end and then_defs are where the then arm ended
+    struct ElseWork {
+        BlockId then_end;
+        std::vector<std::pair<uint32_t, ValueId>> then_defs;
+        size_t mark;
+        uint32_t visible;
+    };
+
+    // The body of the loop at header has been built
+    struct LoopWork {
+        BlockId header;
+        std::vector<std::pair<uint32_t, ValueId>> phis;
+        size_t mark;
+        BlockId exit;
+    };
+
+    using Work = std::variant<ScopeWork, ThenWork, ElseWork, LoopWork>;
+
+    IrFunction build_function(std::string name, const uint32_t param_count, const ListRef body, const bool main) {
+        m_function = IrFunction { .name = std::move(name), .param_count = param_count };
+        m_defs.clear();
+        m_log.clear();
+        m_block = add_block({});
+        for (uint32_t i = 0; i < param_count; i++) {
+            m_defs.push_back(add_value(IrOp::param, i));
+        }
+        m_var_count = param_count;
+        find_loop_slots(body, param_count);
+        for (const StmtRef stmt : m_ast.list(body)) {
+            build_stmt(stmt);
+        }
+        // the implicit exit of the program or return of a function
+        const ValueId zero = add_value(IrOp::const_, 0);
+        m_function.blocks[m_block].term = { .kind = main ? IrTermKind::exit : IrTermKind::ret, .value = zero };
+        return std::move(m_function);
+    }
+
+    BlockId add_block(std::vector<BlockId> preds) {
+        m_function.blocks.push_back({ .preds = std::move(preds) });
+        return static_cast<BlockId>(m_function.blocks.size() - 1);
+    }
+
+    ValueId add_value(const IrOp op, const int64_t imm = 0, std::vector<ValueId> args = {}) {
+        const auto value = static_cast<ValueId>(m_function.values.size());
+        m_function.values.push_back({ .op = op, .block = m_block, .imm = imm, .args = std::move(args) });
+        m_function.blocks[m_block].values.push_back(value);
+        return value;
+    }
+
+    // Ends the current block. What follows is unreachable and goes to a block of its own.
+    void terminate(const IrTermKind kind, const ValueId value) {
+        m_function.blocks[m_block].term = { .kind = kind, .value = value };
+        m_block = add_block({});
+    }
+
+    void jump(const BlockId from, const BlockId to) {
+        m_function.blocks[from].term = { .kind = IrTermKind::jmp, .targets = { to, 0 } };
+    }
+
+    void define(const uint32_t slot, const ValueId value) {
+        if (slot >= m_defs.size()) {
+            m_defs.resize(slot + 1, no_value);
+        }
+        m_log.emplace_back(slot, m_defs[slot]);
+        m_defs[slot] = value;
+    }
+
+    // Forgets the definitions made since mark
+    void undo(const size_t mark) {
+        while (m_log.size() > mark) {
+            m_defs[m_log.back().first] = m_log.back().second;
+            m_log.pop_back();
+        }
+    }
+
+    // The current definitions of the variables below visible that were defined since mark
+    std::vector<std::pair<uint32_t, ValueId>> defined_since(const size_t mark, const uint32_t visible) {
+        std::vector<std::pair<uint32_t, ValueId>> defs;
+        m_stamp++;
+        for (size_t i = mark; i < m_log.size(); i++) {
+            const uint32_t slot = m_log[i].first;
+            if (slot < visible && stamp(slot)) {
+                defs.emplace_back(slot, m_defs[slot]);
+            }
+        }
+        return defs;
+    }
+
+    // Marks slot with the current stamp, returns whether it was not yet
+    bool stamp(const uint32_t slot) {
+        if (slot >= m_stamps.size()) {
+            m_stamps.resize(slot + 1, 0);
+        }
+        if (m_stamps[slot] == m_stamp) {
+            return false;
+        }
+        m_stamps[slot] = m_stamp;
+        return true;
+    }
+
+    // Continues in join, entered from the end of the then arm (preds[0]) and of the else arm
+    // (preds[1]). The current definitions are those before the if.
+    void merge(const BlockId join, const std::vector<std::pair<uint32_t, ValueId>>& then_defs,
+               const std::vector<std::pair<uint32_t, ValueId>>& else_defs) {
+        m_block = join;
+        std::vector<std::pair<uint32_t, ValueId>> merged;
+        for (const auto& [slot, value] : then_defs) {
+            merged.emplace_back(slot, no_value);
+        }
+        for (const auto& [slot, value] : else_defs) {
+            merged.emplace_back(slot, no_value);
+        }
+        m_stamp++;
+        for (auto& [slot, then_value] : merged) {
+            if (!stamp(slot)) {
+                continue;
+            }
+            then_value = find_def(then_defs, slot);
+            const ValueId else_value = find_def(else_defs, slot);
+            if (then_value != else_value) {
+                define(slot, add_value(IrOp::phi, 0, { then_value, else_value }));
+            }
+        }
+    }
+
+    [[nodiscard]] ValueId find_def(const std::vector<std::pair<uint32_t, ValueId>>& defs, const uint32_t slot) const {
+        for (const auto& [def_slot, value] : defs) {
+            if (def_slot == slot) {
+                return value;
+            }
+        }
+        return m_defs[slot];
+    }
+
+    // Finds, for every while in body, the variables declared before it that its body assigns,
+    // which get a phi at its header. The statements are walked once with an explicit stack of
+    // the open bodies, each collecting the slots assigned in it and handing those still visible
+    // outside it to the body around it when it ends.
+    void find_loop_slots(const ListRef body, const uint32_t param_count) {
+        struct Frame {
+            std::span<const StmtRef> stmts;
+            size_t next = 0;
+            // the variables visible before the body, and declared in it so far
+            uint32_t var_count;
+            uint32_t vars = 0;
+            // the while of the body, or no_node
+            StmtRef loop = no_node;
+            std::vector<uint32_t> assigned{};
+        };
+        m_loop_slots.clear();
+        std::vector<Frame> frames;
+        frames.push_back({ .stmts = m_ast.list(body), .var_count = param_count });
+        while (true) {
+            Frame& frame = frames.back();
+            if (frame.next == frame.stmts.size()) {
+                std::ranges::sort(frame.assigned);
+                const auto [first, last] = std::ranges::unique(frame.assigned);
+                frame.assigned.erase(first, last);
+                std::erase_if(frame.assigned, [&](const uint32_t slot) { return slot >= frame.var_count; });
+                if (frames.size() == 1) {
+                    return;
+                }
+                Frame& outer = frames[frames.size() - 2];
+                outer.assigned.insert(outer.assigned.end(), frame.assigned.begin(), frame.assigned.end());
+                if (frame.loop != no_node) {
+                    m_loop_slots.emplace(frame.loop, std::move(frame.assigned));
+                }
+                frames.pop_back();
+                continue;
+            }
+            const StmtRef stmt = frame.stmts[frame.next++];
+            const uint32_t var_count = frame.var_count + frame.vars;
+            switch (m_ast.stmt_kind(stmt)) {
+                case StmtKind::var:
+                    frame.vars++;
+                    break;
+                case StmtKind::assign:
+                    frame.assigned.push_back(m_ast.assign_slot(stmt));
+                    break;
+                case StmtKind::scope:
+                    frames.push_back({ .stmts = m_ast.body(stmt), .var_count = var_count });
+                    break;
+                case StmtKind::while_:
+                    frames.push_back({ .stmts = m_ast.body(stmt), .var_count = var_count, .loop = stmt });
+                    break;
+                case StmtKind::if_: {
+                    const StmtRef else_stmt = m_ast.else_stmt(stmt);
+                    // an elif is walked as a body of just that if
+                    if (else_stmt != no_node) {
+                        frames.push_back({ .stmts = m_ast.stmt_kind(else_stmt) == StmtKind::scope ? m_ast.body(else_stmt) : std::span(&m_ast.stmt_c[stmt], 1),
+                                           .var_count = var_count });
+                    }
+                    frames.push_back({ .stmts = m_ast.body(stmt), .var_count = var_count });
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Evaluates the operands before the operators and the arguments before the calls, with the
+    // operators and calls waiting on an explicit stack
+    ValueId build_expr(ExprRef expr) {
+        struct Pending {
+            ExprRef expr;
+            size_t done = 1;
+            // of a && or ||: the block branching on the left operand, and the result if that
+            // decides it
+            BlockId cond_block = 0;
+            ValueId decided = no_value;
+        };
+        std::vector<Pending> pending;
+        std::vector<ValueId> operands;
+        while (true) {
+            const ExprKind kind = m_ast.expr_kind(expr);
+            if (FlatAst::is_bin_op(kind)) {
+                pending.push_back({ .expr = expr });
+                expr = m_ast.lhs(expr);
+                continue;
+            }
+            if (kind == ExprKind::call && !m_ast.args(expr).empty()) {
+                pending.push_back({ .expr = expr });
+                expr = m_ast.args(expr).front();
+                continue;
+            }
+            if (kind == ExprKind::int_lit) {
+                operands.push_back(add_value(IrOp::const_, m_ast.literal(expr)));
+            } else if (kind == ExprKind::ident) {
+                operands.push_back(m_defs[m_ast.slot(expr)]);
+            } else {
+                operands.push_back(add_value(IrOp::call, m_ast.callee(expr)));
+            }
+            while (!pending.empty()) {
+                Pending& top = pending.back();
+                const ExprKind top_kind = m_ast.expr_kind(top.expr);
+                const bool logic = top_kind == ExprKind::and_ || top_kind == ExprKind::or_;
+                if (top_kind != ExprKind::call && top.done == 1) {
+                    top.done++;
+                    if (logic) {
+                        const ValueId lhs = operands.back();
+                        operands.pop_back();
+                        top.decided = add_value(IrOp::const_, top_kind == ExprKind::or_ ? 1 : 0);
+                        top.cond_block = m_block;
+                        const BlockId rhs_block = add_block({ m_block });
+                        // the join is not there yet, its target is filled in once it is
+                        const std::array<BlockId, 2> targets = top_kind == ExprKind::and_ ? std::array<BlockId, 2> { rhs_block, 0 } : std::array<BlockId, 2> { 0, rhs_block };
+                        m_function.blocks[m_block].term = { .kind = IrTermKind::br, .value = lhs, .targets = targets };
+                        m_block = rhs_block;
+                    }
+                    expr = m_ast.rhs(top.expr);
+                    break;
+                }
+                if (logic) {
+                    ValueId rhs = operands.back();
+                    operands.pop_back();
+                    const ExprKind rhs_kind = m_ast.expr_kind(m_ast.rhs(top.expr));
+                    if (!FlatAst::is_comparison(rhs_kind) && rhs_kind != ExprKind::and_ && rhs_kind != ExprKind::or_) {
+                        rhs = add_value(IrOp::ne, 0, { rhs, add_value(IrOp::const_, 0) });
+                    }
+                    const BlockId rhs_end = m_block;
+                    const BlockId join = add_block({ top.cond_block, rhs_end });
+                    m_function.blocks[top.cond_block].term.targets[top_kind == ExprKind::and_ ? 1 : 0] = join;
+                    jump(rhs_end, join);
+                    m_block = join;
+                    operands.push_back(add_value(IrOp::phi, 0, { top.decided, rhs }));
+                    pending.pop_back();
+                    continue;
+                }
+                if (top_kind == ExprKind::call && top.done < m_ast.args(top.expr).size()) {
+                    expr = m_ast.args(top.expr)[top.done++];
+                    break;
+                }
+                const size_t count = top_kind == ExprKind::call ? m_ast.args(top.expr).size() : 2;
+                std::vector<ValueId> args(operands.end() - static_cast<std::ptrdiff_t>(count), operands.end());
+                operands.resize(operands.size() - count);
+                if (top_kind == ExprKind::call) {
+                    operands.push_back(add_value(IrOp::call, m_ast.callee(top.expr), std::move(args)));
+                } else {
+                    operands.push_back(add_value(bin_op(top_kind), 0, std::move(args)));
+                }
+                pending.pop_back();
+            }
+            if (pending.empty()) {
+                return operands.back();
+            }
+        }
+    }
+
+    static IrOp bin_op(const ExprKind kind) {
+        switch (kind) {
+            case ExprKind::add:
+                return IrOp::add;
+            case ExprKind::sub:
+                return IrOp::sub;
+            case ExprKind::mul:
+                return IrOp::mul;
+            case ExprKind::div:
+                return IrOp::div;
+            case ExprKind::eq:
+                return IrOp::eq;
+            case ExprKind::ne:
+                return IrOp::ne;
+            case ExprKind::lt:
+                return IrOp::lt;
+            case ExprKind::le:
+                return IrOp::le;
+            case ExprKind::gt:
+                return IrOp::gt;
+            default:
+                return IrOp::ge;
+        }
+    }
+
+    void open_scope(const std::span<const StmtRef> stmts) {
+        m_work.push_back(ScopeWork { .stmts = stmts, .var_count = m_var_count });
+    }
+
+    // Builds stmt and everything nested in it, with nested statements queued on m_work
+    void build_stmt(const StmtRef stmt) {
+        build_stmt_head(stmt);
+        while (!m_work.empty()) {
+            if (const auto scope_work = std::get_if<ScopeWork>(&m_work.back())) {
+                if (scope_work->next == scope_work->stmts.size()) {
+                    m_var_count = scope_work->var_count;
+                    m_work.pop_back();
+                } else {
+                    build_stmt_head(scope_work->stmts[scope_work->next++]);
+                }
+                continue;
+            }
+            Work work = std::move(m_work.back());
+            m_work.pop_back();
+            if (const auto then_work = std::get_if<ThenWork>(&work)) {
+                finish_then(*then_work);
+            } else if (const auto else_work = std::get_if<ElseWork>(&work)) {
+                const BlockId else_end = m_block;
+                const auto else_defs = defined_since(else_work->mark, else_work->visible);
+                undo(else_work->mark);
+                const BlockId join = add_block({ else_work->then_end, else_end });
+                jump(else_work->then_end, join);
+                jump(else_end, join);
+                merge(join, else_work->then_defs, else_defs);
+            } else {
+                finish_loop(std::get<LoopWork>(work));
+            }
+        }
+    }
+
+    void finish_then(const ThenWork& work) {
+        const BlockId then_end = m_block;
+        auto then_defs = defined_since(work.mark, work.visible);
+        undo(work.mark);
+        const StmtRef else_stmt = m_ast.else_stmt(work.stmt);
+        if (else_stmt == no_node) {
+            const BlockId join = add_block({ then_end, work.cond_block });
+            m_function.blocks[work.cond_block].term.targets[1] = join;
+            jump(then_end, join);
+            merge(join, then_defs, {});
+            return;
+        }
+        const BlockId else_block = add_block({ work.cond_block });
+        m_function.blocks[work.cond_block].term.targets[1] = else_block;
+        m_block = else_block;
+        m_work.push_back(ElseWork { .then_end = then_end, .then_defs = std::move(then_defs), .mark = m_log.size(), .visible = work.visible });
+        if (m_ast.stmt_kind(else_stmt) == StmtKind::scope) {
+            open_scope(m_ast.body(else_stmt));
+        } else {
+            build_stmt_head(else_stmt);
+        }
+    }
+
+    void finish_loop(const LoopWork& work) {
+        const BlockId body_end = m_block;
+        jump(body_end, work.header);
+        m_function.blocks[work.header].preds.push_back(body_end);
+        for (const auto& [slot, phi] : work.phis) {
+            m_function.values[phi].args.push_back(m_defs[slot]);
+        }
+        undo(work.mark);
+        m_block = work.exit;
+    }
+
+    // Builds a statement up to the statements nested in it, which are queued on m_work
+    void build_stmt_head(const StmtRef stmt) {
+        const ExprRef expr = m_ast.stmt_expr(stmt);
+        switch (m_ast.stmt_kind(stmt)) {
+            case StmtKind::exit:
+                terminate(IrTermKind::exit, build_expr(expr));
+                break;
+            case StmtKind::return_:
+                terminate(IrTermKind::ret, build_expr(expr));
+                break;
+            case StmtKind::var: {
+                const ValueId value = add_value(IrOp::copy, 0, { build_expr(expr) });
+                define(m_var_count++, value);
+                break;
+            }
+            case StmtKind::assign:
+                define(m_ast.assign_slot(stmt), add_value(IrOp::copy, 0, { build_expr(expr) }));
+                break;
+            case StmtKind::scope:
+                open_scope(m_ast.body(stmt));
+                break;
+            case StmtKind::if_: {
+                const ValueId cond = build_expr(expr);
+                const BlockId cond_block = m_block;
+                const BlockId then_block = add_block({ cond_block });
+                m_function.blocks[cond_block].term = { .kind = IrTermKind::br, .value = cond, .targets = { then_block, 0 } };
+                m_block = then_block;
+                m_work.push_back(ThenWork { .stmt = stmt, .cond_block = cond_block, .mark = m_log.size(), .visible = m_var_count });
+                open_scope(m_ast.body(stmt));
+                break;
+            }
+            // the condition is tested in the header, which the body jumps back to
+            case StmtKind::while_: {
+                const std::vector<uint32_t>& slots = m_loop_slots.at(stmt);
+                const BlockId header = add_block({ m_block });
+                jump(m_block, header);
+                m_block = header;
+                std::vector<std::pair<uint32_t, ValueId>> phis;
+                for (const uint32_t slot : slots) {
+                    const ValueId phi = add_value(IrOp::phi, 0, { m_defs[slot] });
+                    define(slot, phi);
+                    phis.emplace_back(slot, phi);
+                }
+                const ValueId cond = build_expr(expr);
+                // a && or || leaves the condition in a block of its own
+                const BlockId cond_block = m_block;
+                const BlockId body = add_block({ cond_block });
+                const BlockId exit = add_block({ cond_block });
+                m_function.blocks[cond_block].term = { .kind = IrTermKind::br, .value = cond, .targets = { body, exit } };
+                m_block = body;
+                m_work.push_back(LoopWork { .header = header, .phis = std::move(phis), .mark = m_log.size(), .exit = exit });
+                open_scope(m_ast.body(stmt));
+                break;
+            }
+        }
+    }
+
+    const FlatAst& m_ast;
+    IrFunction m_function{};
+    BlockId m_block = 0;
+    // the value of each variable at the current point, by slot
+    std::vector<ValueId> m_defs{};
+    // the slot and previous value of every definition, for undo
+    std::vector<std::pair<uint32_t, ValueId>> m_log{};
+    uint32_t m_var_count = 0;
+    std::vector<Work> m_work{};
+    std::vector<uint32_t> m_stamps{};
+    uint32_t m_stamp = 0;
+    // the slots that get a phi at the header of each while
+    std::unordered_map<StmtRef, std::vector<uint32_t>> m_loop_slots{};
+};
@@ -0,0 +1,546 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <vector>
+
+#include "./ir.hpp"
+#include "./assembly.hpp"
+
+// Generates code from the SSA form for --ssa. Every value that survived the passes gets a slot in
+// the frame of its function, reserved with a single sub rsp at the entry, and the operations go
+// through rax, rcx and rdx. The phis of a block are filled in at the end of each of
+// its predecessors, through the stack where one of them reads another. A comparison that only
+// decides the branch right after it is left in the flags for the jcc, and a function returning
+// a call of itself jumps back to its entry instead.
+class IrGenerator {
+public:
+    // jit as for Generator
+    explicit IrGenerator(const IrProgram& program, const bool jit = false)
+        : m_program(program),
+          m_jit(jit) {
+
+    }
+
+    [[nodiscard]] std::vector<Instr> gen_prog() {
+        for (size_t i = 0; i < m_program.functions.size(); i++) {
+            m_function_labels.push_back(create_label());
+        }
+        if (m_jit) {
+            for (const Reg reg : callee_saved) {
+                emit(Op::push, reg);
+            }
+            emit(Op::mov, Reg::rbp, Reg::rsp);
+        }
+        gen_function(m_program.main, {});
+        for (size_t i = 0; i < m_program.functions.size(); i++) {
+            emit_label(m_function_labels[i]);
+            gen_function(m_program.functions[i], i);
+        }
+        return std::move(m_instrs);
+    }
+
+private:
+    // index is that of the function in the program, none for main
+    void gen_function(const IrFunction& function, const std::optional<size_t> index) {
+        m_function = &function;
+        m_index = index;
+        assign_slots(function);
+        find_fused(function);
+        m_block_labels.clear();
+        for (size_t i = 0; i < function.blocks.size(); i++) {
+            m_block_labels.push_back(create_label());
+        }
+        if (m_frame_size > 0) {
+            emit(Op::sub, Reg::rsp, static_cast<int64_t>(m_frame_size * 8));
+        }
+        m_entry = create_label();
+        emit_label(m_entry);
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            if (!function.blocks[b].dead) {
+                gen_block(b);
+            }
+        }
+    }
+
+    // Linear scan over the live intervals of the values, with the blocks laid out in reverse
+    // postorder (see layout_blocks): a slot is handed to the value starting next once the interval
+    // of its last value has ended. A value reads its arguments at twice its position and is stored
+    // right after, so it can take the slot of an argument it reads last. The end of a block, which
+    // reads the value of its terminator and fills in the phis of its successors, is at twice its
+    // own position; a phi lives from the end of its first predecessor. In that layout a block comes
+    // after its dominators and only back edges lead to an earlier block, so a value only lives
+    // past its interval when it is live into a loop, which keeps it until the last block of the
+    // loop.
+    void assign_slots(const IrFunction& function) {
+        const size_t count = function.values.size();
+        // the unreachable blocks go last; they are in no loop
+        const std::vector<BlockId> reachable = layout_blocks(function);
+        std::vector<BlockId> layout = reachable;
+        std::vector<bool> laid_out(function.blocks.size(), false);
+        for (const BlockId b : reachable) {
+            laid_out[b] = true;
+        }
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            if (!laid_out[b]) {
+                layout.push_back(b);
+            }
+        }
+        std::vector<size_t> block_begin(function.blocks.size(), 0);
+        std::vector<size_t> block_end(function.blocks.size(), 0);
+        std::vector<size_t> start(count, 0);
+        std::vector<size_t> end(count, 0);
+        size_t position = 0;
+        for (const BlockId b : layout) {
+            block_begin[b] = 2 * position;
+            for (const ValueId v : function.blocks[b].values) {
+                start[v] = 2 * position + 1;
+                end[v] = start[v];
+                position++;
+            }
+            block_end[b] = 2 * position;
+            position++;
+        }
+        for (const BlockId b : layout) {
+            const IrBlock& block = function.blocks[b];
+            for (const ValueId v : block.values) {
+                const IrValue& value = function.values[v];
+                if (value.op != IrOp::phi) {
+                    for (const ValueId arg : value.args) {
+                        end[arg] = std::max(end[arg], start[v] - 1);
+                    }
+                    continue;
+                }
+                for (size_t i = 0; i < value.args.size(); i++) {
+                    const size_t at = block_end[block.preds[i]];
+                    start[v] = std::min(start[v], at);
+                    end[value.args[i]] = std::max(end[value.args[i]], at);
+                }
+            }
+            if (!block.dead && block.term.kind != IrTermKind::jmp) {
+                end[block.term.value] = std::max(end[block.term.value], block_end[b]);
+            }
+        }
+        std::vector<std::pair<size_t, size_t>> loops = find_loops(function, reachable, block_begin, block_end);
+        extend_into_loops(loops, start, end);
+
+        std::vector<ValueId> order(count);
+        for (ValueId v = 0; v < count; v++) {
+            order[v] = v;
+        }
+        std::ranges::sort(order, [&](const ValueId a, const ValueId b) { return start[a] < start[b]; });
+        // the slots in use, by the end of the interval holding them, the earliest on top
+        std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, std::greater<>> active;
+        std::vector<size_t> free;
+        m_slots.assign(count, 0);
+        m_frame_size = 0;
+        for (const ValueId v : order) {
+            while (!active.empty() && active.top().first < start[v]) {
+                free.push_back(active.top().second);
+                active.pop();
+            }
+            if (free.empty()) {
+                m_slots[v] = m_frame_size++;
+            } else {
+                m_slots[v] = free.back();
+                free.pop_back();
+            }
+            active.emplace(end[v], m_slots[v]);
+        }
+    }
+
+    // The blocks reachable from the entry in reverse postorder. The depth first search keeps its own stack, as the nesting of the program is unbounded.
+    static std::vector<BlockId> layout_blocks(const IrFunction& function) {
+        const size_t block_count = function.blocks.size();
+        std::vector<BlockId> postorder;
+        postorder.reserve(block_count);
+        std::vector<bool> visited(block_count, false);
+        // a block with the number of its successors visited so far
+        std::vector<std::pair<BlockId, size_t>> stack { { 0, 0 } };
+        visited[0] = true;
+        while (!stack.empty()) {
+            auto& [block, next] = stack.back();
+            const std::span<const BlockId> succs = function.blocks[block].dead ? std::span<const BlockId>() : function.successors(block);
+            if (next == succs.size()) {
+                postorder.push_back(block);
+                stack.pop_back();
+                continue;
+            }
+            const BlockId succ = succs[next++];
+            if (!visited[succ]) {
+                visited[succ] = true;
+                stack.emplace_back(succ, 0);
+            }
+        }
+        return { postorder.rbegin(), postorder.rend() };
+    }
+
+    // The loops, as the beginning of the header and the end of the last block of the loop in the
+    // layout. The loop of a header is every block that reaches one of its back edges without
+    // going through the header. The headers are taken innermost first, and the loops found are
+    // merged into their headers with a union find, so every block is walked once per loop it is
+    // the header or directly in.
+    static std::vector<std::pair<size_t, size_t>> find_loops(const IrFunction& function, const std::vector<BlockId>& reachable,
+                                                             const std::vector<size_t>& block_begin, const std::vector<size_t>& block_end) {
+        const size_t block_count = function.blocks.size();
+        constexpr size_t unreached = std::numeric_limits<size_t>::max();
+        std::vector<size_t> order(block_count, unreached);
+        for (size_t i = 0; i < reachable.size(); i++) {
+            order[reachable[i]] = i;
+        }
+        // the loop header a block has been merged into, itself if none
+        std::vector<BlockId> parent(block_count);
+        for (BlockId b = 0; b < block_count; b++) {
+            parent[b] = b;
+        }
+        const auto find = [&](BlockId b) {
+            while (parent[b] != b) {
+                parent[b] = parent[parent[b]];
+                b = parent[b];
+            }
+            return b;
+        };
+        // the end of the loop of a header, or of the block itself
+        std::vector<size_t> extent(block_end);
+        std::vector<BlockId> mark(block_count, std::numeric_limits<BlockId>::max());
+        std::vector<BlockId> pending;
+        std::vector<BlockId> body;
+        std::vector<std::pair<size_t, size_t>> loops;
+        for (size_t i = reachable.size(); i-- > 0;) {
+            const BlockId header = reachable[i];
+            for (const BlockId pred : function.blocks[header].preds) {
+                if (order[pred] >= i && order[pred] != unreached) {
+                    pending.push_back(find(pred));
+                }
+            }
+            if (pending.empty()) {
+                continue;
+            }
+            size_t loop_end = block_end[header];
+            while (!pending.empty()) {
+                const BlockId b = pending.back();
+                pending.pop_back();
+                if (b == header || mark[b] == header) {
+                    continue;
+                }
+                mark[b] = header;
+                body.push_back(b);
+                loop_end = std::max(loop_end, extent[b]);
+                for (const BlockId pred : function.blocks[b].preds) {
+                    if (order[pred] == unreached) {
+                        continue;
+                    }
+                    const BlockId outer = find(pred);
+                    if (outer != header && mark[outer] != header) {
+                        pending.push_back(outer);
+                    }
+                }
+            }
+            for (const BlockId b : body) {
+                parent[b] = header;
+            }
+            body.clear();
+            extent[header] = loop_end;
+            loops.emplace_back(block_begin[header], loop_end);
+        }
+        return loops;
+    }
+
+    // Keeps every value that is live at the header of a loop, having been defined before it,
+    // live until the last block of the loop. The loops nest, so the outermost loop with its header in
+    // the interval of a value is the one that matters, found as the range maximum of the loop
+    // ends over a segment tree of the headers.
+    static void extend_into_loops(std::vector<std::pair<size_t, size_t>>& loops, const std::vector<size_t>& start, std::vector<size_t>& end) {
+        if (loops.empty()) {
+            return;
+        }
+        std::ranges::sort(loops);
+        const size_t n = loops.size();
+        std::vector<size_t> tree(2 * n, 0);
+        for (size_t i = 0; i < n; i++) {
+            tree[n + i] = loops[i].second;
+        }
+        for (size_t i = n; i-- > 1;) {
+            tree[i] = std::max(tree[2 * i], tree[2 * i + 1]);
+        }
+        for (size_t v = 0; v < start.size(); v++) {
+            // the loops with their header in (start, end]
+            auto lo = static_cast<size_t>(std::ranges::upper_bound(loops, std::pair { start[v], std::numeric_limits<size_t>::max() }) - loops.begin());
+            auto hi = static_cast<size_t>(std::ranges::upper_bound(loops, std::pair { end[v], std::numeric_limits<size_t>::max() }) - loops.begin());
+            size_t loop_end = 0;
+            for (lo += n, hi += n; lo < hi; lo /= 2, hi /= 2) {
+                if (lo & 1) {
+                    loop_end = std::max(loop_end, tree[lo++]);
+                }
+                if (hi & 1) {
+                    loop_end = std::max(loop_end, tree[--hi]);
+                }
+            }
+            end[v] = std::max(end[v], loop_end);
+        }
+    }
+
+    // Marks the comparisons that are the last value of their block and whose only use is the
+    // branch ending it, and likewise the calls of the function itself that it returns
+    void find_fused(const IrFunction& function) {
+        std::vector<size_t> uses(function.values.size(), 0);
+        for (const IrBlock& block : function.blocks) {
+            for (const ValueId v : block.values) {
+                for (const ValueId arg : function.values[v].args) {
+                    uses[arg]++;
+                }
+            }
+            if (!block.dead && block.term.kind != IrTermKind::jmp) {
+                uses[block.term.value]++;
+            }
+        }
+        m_fused.assign(function.values.size(), false);
+        m_tail_calls.assign(function.values.size(), false);
+        for (const IrBlock& block : function.blocks) {
+            if (block.dead || block.term.kind == IrTermKind::jmp || block.values.empty()) {
+                continue;
+            }
+            const ValueId v = block.values.back();
+            const IrValue& value = function.values[v];
+            if (v != block.term.value || uses[v] != 1) {
+                continue;
+            }
+            if (block.term.kind == IrTermKind::br) {
+                m_fused[v] = is_comparison(value.op);
+            } else if (block.term.kind == IrTermKind::ret) {
+                m_tail_calls[v] = value.op == IrOp::call && m_index.has_value() && static_cast<size_t>(value.imm) == m_index.value();
+            }
+        }
+    }
+
+    void gen_block(const BlockId b) {
+        const IrBlock& block = m_function->blocks[b];
+        emit_label(m_block_labels[b]);
+        for (const ValueId v : block.values) {
+            gen_value(v);
+        }
+        const IrTerm& term = block.term;
+        switch (term.kind) {
+            case IrTermKind::jmp:
+                gen_phi_moves(b, term.targets[0]);
+                emit(Op::jmp, m_block_labels[term.targets[0]]);
+                break;
+            case IrTermKind::br: {
+                // each edge gets its own phi moves, so the one to the else block goes through a
+                // stub of its own
+                const Label else_edge = create_label();
+                if (m_fused[term.value]) {
+                    emit_jcc(negate(compare_cond(m_function->values[term.value].op)), else_edge);
+                } else {
+                    emit(Op::mov, Reg::rax, slot(term.value));
+                    emit(Op::test, Reg::rax, Reg::rax);
+                    emit_jcc(Cond::z, else_edge);
+                }
+                gen_phi_moves(b, term.targets[0]);
+                emit(Op::jmp, m_block_labels[term.targets[0]]);
+                emit_label(else_edge);
+                gen_phi_moves(b, term.targets[1]);
+                emit(Op::jmp, m_block_labels[term.targets[1]]);
+                break;
+            }
+            case IrTermKind::ret:
+                if (m_tail_calls[term.value]) {
+                    // the call already jumped back to the entry
+                    break;
+                }
+                emit(Op::mov, Reg::rax, slot(term.value));
+                if (m_frame_size > 0) {
+                    emit(Op::add, Reg::rsp, static_cast<int64_t>(m_frame_size * 8));
+                }
+                emit(Op::ret);
+                break;
+            case IrTermKind::exit:
+                emit(Op::mov, exit_value_reg(), slot(term.value));
+                gen_exit();
+                break;
+        }
+    }
+
+    void gen_value(const ValueId v) {
+        const IrValue& value = m_function->values[v];
+        switch (value.op) {
+            case IrOp::phi:
+                // filled in by the predecessors
+                return;
+            case IrOp::const_:
+                emit(Op::mov, Reg::rax, value.imm);
+                break;
+            case IrOp::param:
+                emit(Op::mov, slot(v), arg_regs[static_cast<size_t>(value.imm)]);
+                return;
+            case IrOp::copy:
+                emit(Op::mov, Reg::rax, slot(value.args[0]));
+                break;
+            case IrOp::call:
+                // the arguments are all in the frame, so moving them one by one never overwrites
+                // one that is still to be moved
+                for (size_t i = 0; i < value.args.size(); i++) {
+                    emit(Op::mov, arg_regs[i], slot(value.args[i]));
+                }
+                if (m_tail_calls[v]) {
+                    // the parameters take the arguments at the entry, the frame stays as it is
+                    emit(Op::jmp, m_entry);
+                    return;
+                }
+                emit(Op::call, m_function_labels[static_cast<size_t>(value.imm)]);
+                break;
+            case IrOp::add:
+            case IrOp::sub:
+            case IrOp::mul:
+                emit(Op::mov, Reg::rax, slot(value.args[0]));
+                emit(Op::mov, Reg::rcx, slot(value.args[1]));
+                emit(value.op == IrOp::add ? Op::add : value.op == IrOp::sub ? Op::sub : Op::imul, Reg::rax, Reg::rcx);
+                break;
+            case IrOp::div:
+                emit(Op::mov, Reg::rax, slot(value.args[0]));
+                emit(Op::mov, Reg::rcx, slot(value.args[1]));
+                emit(Op::cqo);
+                emit(Op::idiv, Reg::rcx);
+                break;
+            default:
+                emit(Op::mov, Reg::rax, slot(value.args[0]));
+                emit(Op::cmp, Reg::rax, slot(value.args[1]));
+                if (m_fused[v]) {
+                    // the branch jumps on the flags
+                    return;
+                }
+                m_instrs.push_back({ .op = Op::setcc, .dst = Reg::rax, .cond = compare_cond(value.op) });
+                emit(Op::movzx, Reg::rax, Reg::rax);
+                break;
+        }
+        emit(Op::mov, slot(v), Reg::rax);
+    }
+
+    [[nodiscard]] static bool is_comparison(const IrOp op) {
+        return op >= IrOp::eq && op <= IrOp::ge;
+    }
+
+    // The condition the cmp of a comparison sets
+    [[nodiscard]] static Cond compare_cond(const IrOp op) {
+        switch (op) {
+            case IrOp::eq:
+                return Cond::z;
+            case IrOp::ne:
+                return Cond::nz;
+            case IrOp::lt:
+                return Cond::l;
+            case IrOp::le:
+                return Cond::le;
+            case IrOp::gt:
+                return Cond::g;
+            default:
+                return Cond::ge;
+        }
+    }
+
+    // Gives the phis of to their values for the edge from, as a parallel copy: if any phi is read
+    // by another, all the values are pushed first and then popped into place
+    void gen_phi_moves(const BlockId from, const BlockId to) {
+        const IrBlock& block = m_function->blocks[to];
+        const size_t pred = m_function->pred_index(to, from);
+        std::vector<std::pair<ValueId, ValueId>> moves;
+        bool overlap = false;
+        for (const ValueId v : block.values) {
+            const IrValue& value = m_function->values[v];
+            if (value.op != IrOp::phi) {
+                break;
+            }
+            const ValueId src = value.args[pred];
+            if (src == v) {
+                continue;
+            }
+            overlap = overlap || (m_function->values[src].op == IrOp::phi && m_function->values[src].block == to);
+            moves.emplace_back(v, src);
+        }
+        if (!overlap) {
+            for (const auto& [dst, src] : moves) {
+                emit(Op::mov, Reg::rax, slot(src));
+                emit(Op::mov, slot(dst), Reg::rax);
+            }
+            return;
+        }
+        for (const auto& [dst, src] : moves) {
+            emit(Op::push, slot(src));
+            m_pushed++;
+        }
+        for (auto it = moves.rbegin(); it != moves.rend(); ++it) {
+            emit(Op::pop, Reg::rax);
+            m_pushed--;
+            emit(Op::mov, slot(it->first), Reg::rax);
+        }
+    }
+
+    // The frame slot of a value, allowing for what gen_phi_moves has pushed
+    [[nodiscard]] Mem slot(const ValueId v) const {
+        return Mem { .base = Reg::rsp, .disp = static_cast<int32_t>((m_slots[v] + m_pushed) * 8) };
+    }
+
+    // As Generator::exit_value_reg
+    [[nodiscard]] Reg exit_value_reg() const {
+        return m_jit ? Reg::rax : Reg::rdi;
+    }
+
+    // As Generator::gen_exit
+    void gen_exit() {
+        if (m_jit) {
+            emit(Op::mov, Reg::rsp, Reg::rbp);
+            for (auto it = callee_saved.rbegin(); it != callee_saved.rend(); ++it) {
+                emit(Op::pop, *it);
+            }
+            emit(Op::ret);
+            return;
+        }
+        emit(Op::mov, Reg::rax, 60);
+        emit(Op::syscall);
+    }
+
+    void emit(const Op op, const Operand& dst = {}, const Operand& src = {}) {
+        m_instrs.push_back({ .op = op, .dst = dst, .src = src });
+    }
+
+    void emit_jcc(const Cond cond, const Label label) {
+        m_instrs.push_back({ .op = Op::jcc, .dst = label, .cond = cond });
+    }
+
+    void emit_label(const Label label) {
+        m_instrs.push_back({ .op = Op::label, .dst = label });
+    }
+
+    Label create_label() {
+        return Label { m_label_count++ };
+    }
+
+    // Saved around jitted code; rbp holds the stack pointer to unwind to on exit
+    static constexpr std::array callee_saved = { Reg::rbx, Reg::rbp, Reg::r12, Reg::r13, Reg::r14, Reg::r15 };
+    // Where the arguments of a call are passed, in order
+    static constexpr std::array arg_regs = { Reg::rdi, Reg::rsi, Reg::rdx, Reg::rcx, Reg::r8, Reg::r9 };
+
+    const IrProgram& m_program;
+    const bool m_jit;
+    std::vector<Instr> m_instrs{};
+    size_t m_label_count = 0;
+    std::vector<Label> m_function_labels{};
+    const IrFunction* m_function = nullptr;
+    std::optional<size_t> m_index{};
+    // where a tail call of the function jumps to, past the reservation of its frame
+    Label m_entry{};
+    std::vector<Label> m_block_labels{};
+    // the slot of each value, counted in 8 byte words from rsp
+    std::vector<size_t> m_slots{};
+    size_t m_frame_size = 0;
+    size_t m_pushed = 0;
+    // the comparisons left in the flags for the branch after them
+    std::vector<bool> m_fused{};
+    // the calls of the function itself that it returns, made as a jump to m_entry
+    std::vector<bool> m_tail_calls{};
+};
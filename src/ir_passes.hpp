@@ -0,0 +1,435 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./ir.hpp"
+#include "./stats.hpp"
+
+// A transformation of one function in SSA form. Passes are run by PassManager in the order of
+// its table, each over every function.
+struct IrPass {
+    std::string_view name;
+    void (*run)(IrFunction& function);
+};
+
+namespace ir_passes {
+
+    // The values using each value, by value, with a value listed once per use
+    [[nodiscard]] inline std::vector<std::vector<ValueId>> value_users(const IrFunction& function) {
+        std::vector<std::vector<ValueId>> users(function.values.size());
+        for (const IrBlock& block : function.blocks) {
+            if (block.dead) {
+                continue;
+            }
+            for (const ValueId value : block.values) {
+                for (const ValueId arg : function.values[value].args) {
+                    users[arg].push_back(value);
+                }
+            }
+        }
+        return users;
+    }
+
+    // The blocks whose terminator uses each value, by value
+    [[nodiscard]] inline std::vector<std::vector<BlockId>> term_users(const IrFunction& function) {
+        std::vector<std::vector<BlockId>> users(function.values.size());
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            const IrBlock& block = function.blocks[b];
+            if (!block.dead && block.term.kind != IrTermKind::jmp) {
+                users[block.term.value].push_back(b);
+            }
+        }
+        return users;
+    }
+
+    // Removes the values a pass turned into copies or dropped from the lists of their blocks
+    inline void sweep(IrFunction& function, const std::vector<bool>& removed) {
+        for (IrBlock& block : function.blocks) {
+            std::erase_if(block.values, [&](const ValueId value) { return removed[value]; });
+        }
+    }
+
+    // Replaces every use of a copy with what it copies, and every phi whose arguments are all the
+    // same value, itself aside, with that value. Replacing one phi can make another one trivial,
+    // as with the phis of nested loops, so this repeats until nothing changes.
+    inline void copy_prop(IrFunction& function) {
+        std::vector<ValueId> replacement(function.values.size());
+        for (ValueId v = 0; v < replacement.size(); v++) {
+            replacement[v] = v;
+        }
+        const auto resolve = [&](ValueId value) {
+            while (replacement[value] != value) {
+                // halve the path on the way
+                replacement[value] = replacement[replacement[value]];
+                value = replacement[value];
+            }
+            return value;
+        };
+        for (IrValue& value : function.values) {
+            if (value.op == IrOp::copy) {
+                replacement[&value - function.values.data()] = value.args[0];
+            }
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const IrBlock& block : function.blocks) {
+                for (const ValueId v : block.values) {
+                    IrValue& value = function.values[v];
+                    if (value.op != IrOp::phi || resolve(v) != v) {
+                        continue;
+                    }
+                    ValueId same = no_value;
+                    bool trivial = true;
+                    for (const ValueId arg : value.args) {
+                        const ValueId resolved = resolve(arg);
+                        if (resolved == v || resolved == same) {
+                            continue;
+                        }
+                        if (same != no_value) {
+                            trivial = false;
+                            break;
+                        }
+                        same = resolved;
+                    }
+                    // a phi of only itself sits in a block that is never entered
+                    if (trivial && same != no_value) {
+                        replacement[v] = same;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        std::vector<bool> removed(function.values.size(), false);
+        for (IrBlock& block : function.blocks) {
+            for (const ValueId v : block.values) {
+                if (resolve(v) != v) {
+                    removed[v] = true;
+                    continue;
+                }
+                for (ValueId& arg : function.values[v].args) {
+                    arg = resolve(arg);
+                }
+            }
+            if (!block.dead && block.term.kind != IrTermKind::jmp) {
+                block.term.value = resolve(block.term.value);
+            }
+        }
+        sweep(function, removed);
+    }
+
+    // The result of an arithmetic op or comparison on constants, or nothing where it would trap at
+    // runtime
+    [[nodiscard]] inline std::optional<int64_t> fold(const IrOp op, const int64_t lhs, const int64_t rhs) {
+        const auto a = static_cast<uint64_t>(lhs);
+        const auto b = static_cast<uint64_t>(rhs);
+        switch (op) {
+            case IrOp::add:
+                return static_cast<int64_t>(a + b);
+            case IrOp::sub:
+                return static_cast<int64_t>(a - b);
+            case IrOp::mul:
+                return static_cast<int64_t>(a * b);
+            case IrOp::eq:
+                return lhs == rhs;
+            case IrOp::ne:
+                return lhs != rhs;
+            case IrOp::lt:
+                return lhs < rhs;
+            case IrOp::le:
+                return lhs <= rhs;
+            case IrOp::gt:
+                return lhs > rhs;
+            case IrOp::ge:
+                return lhs >= rhs;
+            default:
+                if (rhs == 0 || (lhs == INT64_MIN && rhs == -1)) {
+                    return {};
+                }
+                return lhs / rhs;
+        }
+    }
+
+    // Sparse conditional constant propagation (Wegman and Zadeck). Every value starts out unknown
+    // and is lowered to a constant or to varying as the blocks that define it are found to be
+    // reachable, following only the edges a branch can take given what is known about its
+    // condition. Afterwards constant values become literals, branches on constants become jumps,
+    // and blocks that were never reached are removed together with their edges.
+    inline void sccp(IrFunction& function) {
+        enum class Lattice : uint8_t { unknown, constant, varying };
+        std::vector<Lattice> lattice(function.values.size(), Lattice::unknown);
+        std::vector<int64_t> constants(function.values.size(), 0);
+        std::vector<bool> reached(function.blocks.size(), false);
+        // by block, whether the edge from each of its preds can be taken
+        std::vector<std::vector<bool>> edges(function.blocks.size());
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            edges[b].assign(function.blocks[b].preds.size(), false);
+        }
+        const std::vector<std::vector<ValueId>> users = value_users(function);
+        const std::vector<std::vector<BlockId>> branches = term_users(function);
+        std::vector<std::pair<BlockId, BlockId>> edge_work;
+        std::vector<ValueId> value_work;
+
+        const auto lower = [&](const ValueId v, const Lattice to, const int64_t constant) {
+            if (to <= lattice[v]) {
+                return;
+            }
+            lattice[v] = to;
+            constants[v] = constant;
+            value_work.push_back(v);
+        };
+
+        const auto visit_value = [&](const ValueId v) {
+            const IrValue& value = function.values[v];
+            switch (value.op) {
+                case IrOp::const_:
+                    lower(v, Lattice::constant, value.imm);
+                    return;
+                case IrOp::param:
+                case IrOp::call:
+                    lower(v, Lattice::varying, 0);
+                    return;
+                case IrOp::copy:
+                    lower(v, lattice[value.args[0]], constants[value.args[0]]);
+                    return;
+                case IrOp::phi: {
+                    const std::vector<bool>& taken = edges[value.block];
+                    for (size_t i = 0; i < value.args.size(); i++) {
+                        const ValueId arg = value.args[i];
+                        if (!taken[i] || lattice[arg] == Lattice::unknown) {
+                            continue;
+                        }
+                        if (lattice[arg] == Lattice::varying ||
+                            (lattice[v] == Lattice::constant && constants[v] != constants[arg])) {
+                            lower(v, Lattice::varying, 0);
+                            return;
+                        }
+                        lower(v, Lattice::constant, constants[arg]);
+                    }
+                    return;
+                }
+                default: {
+                    const Lattice lhs = lattice[value.args[0]];
+                    const Lattice rhs = lattice[value.args[1]];
+                    if (lhs == Lattice::unknown || rhs == Lattice::unknown) {
+                        return;
+                    }
+                    if (lhs == Lattice::constant && rhs == Lattice::constant) {
+                        if (const auto folded = fold(value.op, constants[value.args[0]], constants[value.args[1]])) {
+                            lower(v, Lattice::constant, folded.value());
+                            return;
+                        }
+                    }
+                    lower(v, Lattice::varying, 0);
+                }
+            }
+        };
+
+        const auto visit_term = [&](const BlockId b) {
+            const IrTerm& term = function.blocks[b].term;
+            if (term.kind == IrTermKind::jmp) {
+                edge_work.emplace_back(b, term.targets[0]);
+            } else if (term.kind == IrTermKind::br) {
+                if (lattice[term.value] == Lattice::varying) {
+                    edge_work.emplace_back(b, term.targets[0]);
+                    edge_work.emplace_back(b, term.targets[1]);
+                } else if (lattice[term.value] == Lattice::constant) {
+                    edge_work.emplace_back(b, term.targets[constants[term.value] == 0 ? 1 : 0]);
+                }
+            }
+        };
+
+        reached[0] = true;
+        for (const ValueId v : function.blocks[0].values) {
+            visit_value(v);
+        }
+        visit_term(0);
+        while (!edge_work.empty() || !value_work.empty()) {
+            if (!edge_work.empty()) {
+                const auto [from, to] = edge_work.back();
+                edge_work.pop_back();
+                const std::vector<BlockId>& preds = function.blocks[to].preds;
+                size_t i = 0;
+                while (preds[i] != from) {
+                    i++;
+                }
+                if (edges[to][i]) {
+                    continue;
+                }
+                edges[to][i] = true;
+                if (reached[to]) {
+                    // only the phis see the new edge
+                    for (const ValueId v : function.blocks[to].values) {
+                        if (function.values[v].op == IrOp::phi) {
+                            visit_value(v);
+                        }
+                    }
+                    continue;
+                }
+                reached[to] = true;
+                for (const ValueId v : function.blocks[to].values) {
+                    visit_value(v);
+                }
+                visit_term(to);
+                continue;
+            }
+            const ValueId v = value_work.back();
+            value_work.pop_back();
+            for (const ValueId user : users[v]) {
+                if (reached[function.values[user].block]) {
+                    visit_value(user);
+                }
+            }
+            for (const BlockId b : branches[v]) {
+                if (reached[b]) {
+                    visit_term(b);
+                }
+            }
+        }
+
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            IrBlock& block = function.blocks[b];
+            if (!reached[b]) {
+                block.dead = true;
+                block.values.clear();
+                block.preds.clear();
+                continue;
+            }
+            // drop the edges that are never taken along with their phi arguments
+            std::vector<BlockId> preds;
+            for (size_t i = 0; i < block.preds.size(); i++) {
+                if (edges[b][i]) {
+                    preds.push_back(block.preds[i]);
+                }
+            }
+            for (const ValueId v : block.values) {
+                IrValue& value = function.values[v];
+                if (lattice[v] == Lattice::constant && value.op != IrOp::const_) {
+                    value.op = IrOp::const_;
+                    value.imm = constants[v];
+                    value.args.clear();
+                } else if (value.op == IrOp::phi) {
+                    std::vector<ValueId> args;
+                    for (size_t i = 0; i < value.args.size(); i++) {
+                        if (edges[b][i]) {
+                            args.push_back(value.args[i]);
+                        }
+                    }
+                    value.args = std::move(args);
+                }
+            }
+            block.preds = std::move(preds);
+            if (block.term.kind == IrTermKind::br && lattice[block.term.value] == Lattice::constant) {
+                block.term = { .kind = IrTermKind::jmp, .targets = { block.term.targets[constants[block.term.value] == 0 ? 1 : 0], 0 } };
+            }
+        }
+        // constants moved out of the phis must not sit among them
+        for (IrBlock& block : function.blocks) {
+            std::stable_partition(block.values.begin(), block.values.end(), [&](const ValueId v) {
+                return function.values[v].op == IrOp::phi;
+            });
+        }
+    }
+
+    // Removes the values nothing needs: a value is live if a terminator uses it, if it may have
+    // an effect (a call or a division that can trap), or if a live value uses it
+    inline void dce(IrFunction& function) {
+        std::vector<bool> live(function.values.size(), false);
+        std::vector<ValueId> work;
+        const auto mark = [&](const ValueId v) {
+            if (!live[v]) {
+                live[v] = true;
+                work.push_back(v);
+            }
+        };
+        for (const IrBlock& block : function.blocks) {
+            if (block.dead) {
+                continue;
+            }
+            for (const ValueId v : block.values) {
+                if (function.has_side_effects(v)) {
+                    mark(v);
+                }
+            }
+            if (block.term.kind != IrTermKind::jmp) {
+                mark(block.term.value);
+            }
+        }
+        while (!work.empty()) {
+            const ValueId v = work.back();
+            work.pop_back();
+            for (const ValueId arg : function.values[v].args) {
+                mark(arg);
+            }
+        }
+        std::vector<bool> removed(live.size());
+        for (size_t v = 0; v < live.size(); v++) {
+            removed[v] = !live[v];
+        }
+        sweep(function, removed);
+    }
+
+}
+
+// Every pass, in the order they run. Copy propagation runs again after SCCP to clean up the
+// phis that lost all but one of their edges.
+inline constexpr std::array default_ir_passes = {
+    IrPass { .name = "copy_prop", .run = ir_passes::copy_prop },
+    IrPass { .name = "sccp", .run = ir_passes::sccp },
+    IrPass { .name = "copy_prop", .run = ir_passes::copy_prop },
+    IrPass { .name = "dce", .run = ir_passes::dce },
+};
+
+// Runs a table of passes over every function of the program, timing each as a phase of stats.
+// With print_after set, the program is printed to stderr after every run of the pass of that
+// name, or right after it is built for "build".
+class PassManager {
+public:
+    PassManager(CompileStats& stats, std::optional<std::string> print_after = {},
+                const std::span<const IrPass> passes = default_ir_passes)
+        : m_stats(stats),
+          m_print_after(std::move(print_after)),
+          m_passes(passes) {
+
+    }
+
+    [[nodiscard]] static bool is_pass(const std::string_view name, const std::span<const IrPass> passes = default_ir_passes) {
+        if (name == "build") {
+            return true;
+        }
+        return std::ranges::any_of(passes, [&](const IrPass& pass) { return pass.name == name; });
+    }
+
+    void run(IrProgram& program) {
+        m_stats.count("ssa.values_built", program.value_count());
+        print_after("build", program);
+        for (const IrPass& pass : m_passes) {
+            m_stats.time(std::string(pass.name), [&] {
+                for (IrFunction* function : program.all()) {
+                    pass.run(*function);
+                }
+            });
+            print_after(pass.name, program);
+        }
+        m_stats.count("ssa.values_after_passes", program.value_count());
+    }
+
+private:
+    void print_after(const std::string_view name, const IrProgram& program) const {
+        if (m_print_after.has_value() && m_print_after.value() == name) {
+            std::cerr << "; after " << name << "\n";
+            print_ir(std::cerr, program);
+        }
+    }
+
+    CompileStats& m_stats;
+    std::optional<std::string> m_print_after;
+    std::span<const IrPass> m_passes;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "./compile_error.hpp"
+
+// Holds code generated with Generator's jit option ready to be called in process. The code is
+// copied into an anonymous mapping that is flipped from writable to executable; run() returns
+// the value of the exit statement that ended it and may be called any number of times.
+class JitBuffer final {
+public:
+    explicit JitBuffer(const std::vector<uint8_t>& code)
+        : m_size(code.empty() ? 1 : code.size()) {
+        m_buffer = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m_buffer == MAP_FAILED) {
+            throw CompileError("Could not map memory for the jitted code");
+        }
+        std::memcpy(m_buffer, code.data(), code.size());
+        if (mprotect(m_buffer, m_size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(m_buffer, m_size);
+            throw CompileError("Could not make the jitted code executable");
+        }
+    }
+
+    JitBuffer(const JitBuffer&) = delete;
+    JitBuffer& operator=(const JitBuffer&) = delete;
+
+    [[nodiscard]] int64_t run() const {
+        return reinterpret_cast<int64_t (*)()>(m_buffer)();
+    }
+
+    ~JitBuffer() {
+        munmap(m_buffer, m_size);
+    }
+
+private:
+    size_t m_size;
+    void* m_buffer;
+};
+
+inline int64_t run_jit(const std::vector<uint8_t>& code) {
+    const JitBuffer buffer(code);
+    return buffer.run();
+}
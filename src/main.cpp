@@ -1,46 +1,360 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <optional>
 #include <vector>
+#include <algorithm>
+#include <filesystem>
 
+#include "./optimization.hpp"
+#include "./resolve.hpp"
 #include "./generation.hpp"
+#include "./ir_passes.hpp"
+#include "./ir_generation.hpp"
+#include "./peephole.hpp"
+#include "./assembler.hpp"
+#include "./elf.hpp"
+#include "./jit.hpp"
+#include "./interpreter.hpp"
+#include "./cache.hpp"
+#include "./thread_pool.hpp"
+#include "./stats.hpp"
+#include "./source.hpp"
 
-int main(int argc, char* argv[]) {
-
-    if (argc != 2) {
-        std::cerr << "Incorrect usage" << std::endl;
-        std::cerr << "Correct usage:\t./helium <file.he>" << std::endl;
-        return EXIT_FAILURE;
+// Counts the allocations of every thread for --time-passes (see HeapCounters)
+void* operator new(const std::size_t size) {
+    heap_counters.add(1, size);
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
     }
+    throw std::bad_alloc {};
+}
+
+// Not inlined, as GCC would then see the free of a pointer from operator new at the call site
+// and warn about a mismatched deallocation
+[[gnu::noinline]] void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+struct Options {
+    bool stack_machine = false;
+    bool optimize = true;
+    // generate native code through the SSA form
+    bool ssa = false;
+    // pass after which the SSA form is printed
+    std::optional<std::string> print_after{};
+    bool emit_asm = false;
+    bool run = false;
+    bool interpret = false;
+    bool use_cache = false;
+    bool cache_stats = false;
+    bool time_passes = false;
+    bool stats = false;
+    bool stats_json = false;
+    // threads a large input is tokenized on
+    size_t tokenize_threads = 1;
+};
 
-    std::string contents;
-    {
-        std::fstream input(argv[1], std::ios::in);
-        std::stringstream content_stream;
-        content_stream << input.rdbuf();
-        contents = content_stream.str();
+struct Job {
+    std::string input_path;
+    std::optional<std::string> output_path{};
+};
+
+static void print_cache_stats(const CompileCache::Stats& stats) {
+    std::cout << "cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.entries << " entries, "
+              << stats.bytes << " bytes" << std::endl;
+}
+
+// Compiles one input from source to executable. Everything it works with is local to the call,
+// so any number of them can run in parallel. Returns the exit status for the driver: the exit
+// value of the program for --run and --interpret, EXIT_SUCCESS otherwise.
+static int compile(const Job& job, const Options& options, CompileStats& stats) {
+    // the tokens and the AST point into the mapped source, so it stays mapped until the end
+    const SourceFile source = stats.time("read", [&] { return SourceFile(job.input_path); });
+    const std::string_view contents = source.contents();
+    stats.count("source_bytes", contents.size());
+
+    const std::filesystem::path exe_path = job.output_path.value();
+    const std::optional<std::filesystem::path> asm_path = options.emit_asm
+        ? std::optional<std::filesystem::path>(job.output_path.value() + ".asm") : std::nullopt;
+
+    // Only the executable (and assembly) written to disk is cached. Whether the assembly is
+    // wanted does not change the code, so it is not part of the key; an entry stored without
+    // it just misses for --emit-asm once.
+    std::optional<CompileCache> cache;
+    std::string cache_key;
+    if (options.use_cache && !options.run && !options.interpret) {
+        const bool hit = stats.time("cache", [&] {
+            cache.emplace(CompileCache::default_dir(), CompileCache::default_max_size());
+            cache_key = CompileCache::key(contents, std::string(options.optimize ? "-O1" : "-O0") + (options.stack_machine ? " --stack-machine" : "") + (options.ssa ? " --ssa" : ""));
+            return cache->fetch(cache_key, exe_path, asm_path);
+        });
+        stats.count("cache_hit", hit);
+        if (hit) {
+            return EXIT_SUCCESS;
+        }
     }
 
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
+    Tokenizer tokenizer(contents);
+    TokenList tokens = stats.time("tokenize", [&] { return tokenizer.tokenize(detect_scan_isa(), options.tokenize_threads); });
+    stats.count("tokens", tokens.size());
 
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
+    // Every thread keeps its arena from one input to the next, as the AST of the last one is
+    // dead by now. The first chunk is sized for a few nodes per token.
+    static thread_local ArenaAllocator arena(std::max(ArenaAllocator::default_first_chunk_bytes, tokens.size() * 64), true);
+    arena.reset();
+    Parser parser(std::move(tokens), arena);
+    std::optional<NodeProg> prog = stats.time("parse", [&] { return parser.parse_prog(); });
 
     if (!prog.has_value()) {
-        std::cerr << "Program invalid" << std::endl;
-        exit(EXIT_FAILURE);
+        throw CompileError("Program invalid");
     }
+    stats.count_ast(prog.value());
 
-    {
-        Generator generator(prog.value());
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+    if (options.optimize) {
+        stats.time("check", [&] {
+            Resolver checker(prog.value());
+            checker.check_prog();
+        });
+        // folding, propagation and branch pruning all happen in one walk, timed as opt.fold
+        Optimizer optimizer(prog.value(), arena, tokenizer.symbols(), &stats);
+        optimizer.optimize_prog();
     }
+    const ArenaAllocator::Stats arena_stats = arena.stats();
+    stats.count("arena_bytes_used", arena_stats.used);
+    stats.count("arena_bytes_reserved", arena_stats.reserved);
+    stats.count("arena_chunks", arena_stats.chunks);
+    stats.count("arena_destructors", arena_stats.destructors);
 
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
+    const FlatAst ast = stats.time("resolve", [&] {
+        Resolver resolver(prog.value());
+        return resolver.resolve_prog();
+    });
+    stats.count("flat_ast_bytes", ast.bytes());
 
+    if (options.interpret) {
+        // the bytecode interpreter needs neither assembler nor linker, and reports its exit
+        // value the way --run does
+        BcProgram bytecode = stats.time("generate", [&] {
+            BytecodeGenerator generator(ast);
+            return generator.gen_prog();
+        });
+        stats.count("bytecode_instructions", bytecode.code.size());
+        Interpreter interpreter(std::move(bytecode));
+        return stats.time("interpret", [&] { return static_cast<int>(interpreter.run() & 0xFF); });
+    }
+
+    std::vector<Instr> instrs;
+    if (options.ssa) {
+        IrProgram ir = stats.time("ssa_build", [&] {
+            IrBuilder builder(ast);
+            return builder.build();
+        });
+        // without the optimizer the SSA form goes to the backend as built
+        PassManager pass_manager(stats, options.print_after, options.optimize ? std::span<const IrPass>(default_ir_passes) : std::span<const IrPass>());
+        pass_manager.run(ir);
+        instrs = stats.time("generate", [&] {
+            IrGenerator generator(ir, options.run);
+            return generator.gen_prog();
+        });
+    } else {
+        instrs = stats.time("generate", [&] {
+            Generator generator(ast, options.stack_machine, options.run);
+            return generator.gen_prog();
+        });
+    }
+    stats.count("instructions", instrs.size());
+    if (options.optimize) {
+        Peephole peephole;
+        instrs = stats.time("peephole", [&] { return peephole.run(instrs); });
+        for (size_t i = 0; i < peephole.rules().size(); i++) {
+            stats.count("peephole." + std::string(peephole.rules()[i].name), peephole.hits()[i]);
+        }
+        stats.count("instructions_after_peephole", instrs.size());
+    }
+
+    // The executable is assembled and linked in process; --emit-asm additionally writes the
+    // equivalent nasm source for inspection
+    if (asm_path.has_value()) {
+        const size_t asm_bytes = stats.time("emit_asm", [&] {
+            FileSink file(asm_path.value().string());
+            write_nasm(file, instrs);
+            file.flush();
+            return file.bytes();
+        });
+        stats.count("asm_bytes", asm_bytes);
+    }
+
+    const std::vector<uint8_t> code = stats.time("assemble", [&] {
+        Assembler assembler(instrs);
+        return assembler.assemble();
+    });
+    stats.count("code_bytes", code.size());
+    if (options.run) {
+        // like the executable would, report the exit value as our own exit status
+        return stats.time("run", [&] { return static_cast<int>(run_jit(code) & 0xFF); });
+    }
+    stats.time("link", [&] { write_elf(exe_path, code); });
+
+    if (cache.has_value()) {
+        stats.time("cache_store", [&] { cache->store(cache_key, exe_path, asm_path); });
+    }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+// Compiles one input and reports an error in it against its path. The other inputs of a batch
+// are compiled all the same; the driver fails once every one of them is done.
+static int compile_or_report(const Job& job, const Options& options, CompileStats& stats) {
+    try {
+        return compile(job, options, stats);
+    } catch (const CompileError& error) {
+        // in one piece, as other workers may be reporting at the same time
+        std::cerr << job.input_path + ": " + error.what() + "\n" << std::flush;
+        return EXIT_FAILURE;
+    }
+}
+
+static void print_usage() {
+    std::cerr << "Incorrect usage" << std::endl;
+    std::cerr << "Correct usage:\t./helium [-O0|-O1] [--stack-machine|--ssa [--print-after=<pass>]] [--emit-asm] [--run|--interpret] [--cache] [--cache-stats] "
+                 "[--time-passes] [--stats] [--stats-format=text|json] "
+                 "<file.he> [-o <output>] [<file.he> [-o <output>]]..." << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+
+    Options options;
+    std::vector<Job> jobs;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--stack-machine") {
+            options.stack_machine = true;
+        }
+        else if (arg == "--ssa") {
+            options.ssa = true;
+        }
+        else if (arg.starts_with("--print-after=")) {
+            options.print_after = arg.substr(std::string_view("--print-after=").size());
+            if (!PassManager::is_pass(options.print_after.value())) {
+                std::cerr << "Unknown pass " << options.print_after.value() << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--run") {
+            options.run = true;
+        }
+        else if (arg == "--interpret") {
+            options.interpret = true;
+        }
+        else if (arg == "--cache") {
+            options.use_cache = true;
+        }
+        else if (arg == "--cache-stats") {
+            options.use_cache = true;
+            options.cache_stats = true;
+        }
+        else if (arg == "--time-passes") {
+            options.time_passes = true;
+        }
+        else if (arg == "--stats") {
+            options.stats = true;
+        }
+        else if (arg == "--stats-format=text" || arg == "--stats-format=json") {
+            options.stats_json = arg.ends_with("json");
+        }
+        else if (arg == "--emit-asm") {
+            options.emit_asm = true;
+        }
+        else if (arg == "-O0" || arg == "-O1") {
+            options.optimize = arg == "-O1";
+        }
+        // -o names the output of the input before it
+        else if (arg == "-o" && i + 1 < argc && !jobs.empty() && !jobs.back().output_path.has_value()) {
+            jobs.back().output_path = argv[++i];
+        }
+        else if (!arg.starts_with("-")) {
+            jobs.push_back({ .input_path = arg });
+        }
+        else {
+            jobs.clear();
+            break;
+        }
+    }
+
+    if (jobs.empty() || (jobs.size() > 1 && (options.run || options.interpret)) ||
+        (options.ssa && (options.stack_machine || options.interpret)) || (options.print_after.has_value() && !options.ssa)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    // A lone input is written to out as it always has been; in a batch every input without an
+    // -o is named after its source file
+    std::vector<std::string> outputs;
+    for (Job& job : jobs) {
+        if (!job.output_path.has_value()) {
+            job.output_path = jobs.size() == 1 ? "out" : std::filesystem::path(job.input_path).stem().string();
+        }
+        if (std::ranges::find(outputs, job.output_path.value()) != outputs.end()) {
+            std::cerr << "More than one input would be written to " << job.output_path.value() << std::endl;
+            return EXIT_FAILURE;
+        }
+        outputs.push_back(job.output_path.value());
+    }
+
+    std::vector<CompileStats> stats;
+    for (const Job& job : jobs) {
+        stats.emplace_back(job.input_path);
+    }
+
+    int status = EXIT_SUCCESS;
+    if (jobs.size() == 1) {
+        // a batch already keeps every core busy with one input each
+        options.tokenize_threads = std::thread::hardware_concurrency();
+        status = compile_or_report(jobs.front(), options, stats.front());
+    } else {
+        // every job owns its tokens, arena and generator and writes only its own result and
+        // stats slot
+        std::vector<int> results(jobs.size(), EXIT_SUCCESS);
+        {
+            ThreadPool pool;
+            for (size_t i = 0; i < jobs.size(); i++) {
+                pool.submit([&, i] { results[i] = compile_or_report(jobs[i], options, stats[i]); });
+            }
+            pool.wait();
+        }
+        for (const int result : results) {
+            if (result != EXIT_SUCCESS) {
+                status = result;
+                break;
+            }
+        }
+    }
+
+    // statistics go to stderr so they do not mix with the output of --cache-stats
+    if (options.time_passes || options.stats) {
+        if (options.stats_json) {
+            std::cerr << "[";
+            for (size_t i = 0; i < stats.size(); i++) {
+                std::cerr << (i == 0 ? "" : ",\n ");
+                stats[i].print_json(std::cerr, options.time_passes, options.stats);
+            }
+            std::cerr << "]" << std::endl;
+        } else {
+            for (const CompileStats& file_stats : stats) {
+                file_stats.print_text(std::cerr, options.time_passes, options.stats);
+            }
+        }
+    }
+
+    if (options.cache_stats) {
+        try {
+            print_cache_stats(CompileCache(CompileCache::default_dir()).stats());
+        } catch (const CompileError& error) {
+            std::cerr << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,1655 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <variant>
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include "./parser.hpp"
+#include "./stats.hpp"
+
+// AST level optimizations that run between Parser::parse_prog and Generator::gen_prog: inlining
+// of functions, constant folding and propagation, pruning of branches with constant conditions,
+// removal of code that can never be reached behind an exit or return, and for while loops
+// strength reduction of induction variables, hoisting of invariant expressions and partial
+// unrolling. Values are 64 bit two's complement integers, with the wrapping arithmetic and
+// truncating division of the generated code. The names of the program are checked before (see
+// Resolver::check_prog), as the code with an error in it may be removed here.
+class Optimizer {
+public:
+    // Names the optimizer makes up are interned into symbols along with the ones of the source.
+    // With stats set, every pass is timed as a phase of it.
+    Optimizer(NodeProg& prog, ArenaAllocator& allocator, Interner& symbols, CompileStats* stats = nullptr)
+        : m_prog(prog),
+          m_allocator(allocator),
+          m_symbols(symbols),
+          m_stats(stats) {
+
+    }
+
+    // What is known about the variable of a symbol at the current point of the walk
+    struct Binding {
+        bool visible = false;
+        std::optional<int64_t> value = {};
+
+        bool operator==(const Binding&) const = default;
+    };
+
+    // Folds operators with constant operands and replaces reads of variables whose value
+    // is known at that point with literals
+    std::optional<int64_t> fold_term(NodeTerm* term) {
+        struct TermVisitor {
+            Optimizer& opt;
+            NodeTerm* term;
+
+            std::optional<int64_t> operator()(const NodeTermIntLit* term_int_lit) const {
+                return int_lit_value(term_int_lit->int_lit);
+            }
+
+            std::optional<int64_t> operator()(const NodeTermIdent* term_ident) const {
+                const std::optional<int64_t> value = opt.binding(term_ident->ident.symbol).value;
+                if (!value.has_value()) {
+                    return {};
+                }
+                term->var = opt.make_int_lit(value.value(), term_ident->ident.line);
+                return value;
+            }
+
+            std::optional<int64_t> operator()(const NodeTermParen* term_paren) const {
+                return opt.fold_expr(term_paren->expr);
+            }
+
+            // the arguments are folded by fold_expr
+            std::optional<int64_t> operator()(const NodeTermCall*) const {
+                return {};
+            }
+        };
+
+        TermVisitor visitor { .opt = *this, .term = term };
+        return std::visit(visitor, term->var);
+    }
+
+    // Value of the operator applied to the values of its operands, if both are known, or if the
+    // left one alone decides a && or ||
+    static std::optional<int64_t> fold_bin_expr(const NodeBinExpr* bin_expr, const std::optional<int64_t> lhs,
+                                                const std::optional<int64_t> rhs) {
+        struct BinExprVisitor {
+            const int64_t lhs;
+            const int64_t rhs;
+
+            std::optional<int64_t> operator()(const NodeBinExprAdd*) const {
+                return static_cast<int64_t>(static_cast<uint64_t>(lhs) + rhs);
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprSub*) const {
+                return static_cast<int64_t>(static_cast<uint64_t>(lhs) - rhs);
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprMulti*) const {
+                return static_cast<int64_t>(static_cast<uint64_t>(lhs) * rhs);
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprDiv*) const {
+                // division by zero and the overflowing INT64_MIN / -1 are left for the program
+                // to trap on at runtime
+                if (rhs == 0 || (lhs == std::numeric_limits<int64_t>::min() && rhs == -1)) {
+                    return {};
+                }
+                return lhs / rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprEq*) const {
+                return lhs == rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprNe*) const {
+                return lhs != rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprLt*) const {
+                return lhs < rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprLe*) const {
+                return lhs <= rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprGt*) const {
+                return lhs > rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprGe*) const {
+                return lhs >= rhs;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprAnd*) const {
+                return lhs != 0 && rhs != 0;
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExprOr*) const {
+                return lhs != 0 || rhs != 0;
+            }
+        };
+
+        // the right operand is never evaluated then, so what it would do does not matter
+        if (lhs.has_value() && std::holds_alternative<NodeBinExprAnd*>(bin_expr->var) && lhs.value() == 0) {
+            return 0;
+        }
+        if (lhs.has_value() && std::holds_alternative<NodeBinExprOr*>(bin_expr->var) && lhs.value() != 0) {
+            return 1;
+        }
+        if (!lhs.has_value() || !rhs.has_value()) {
+            return {};
+        }
+        BinExprVisitor visitor { .lhs = lhs.value(), .rhs = rhs.value() };
+        return std::visit(visitor, bin_expr->var);
+    }
+
+    // Folds the operands left to right before the operator, keeping the operators whose operands
+    // are being folded on an explicit stack so deeply nested expressions do not exhaust the
+    // native stack. A folded operator is replaced by a literal. Calls are never folded; their
+    // arguments are folded as expressions of their own once expr is done.
+    std::optional<int64_t> fold_expr(NodeExpr* expr) {
+        struct Pending {
+            NodeExpr* expr;
+            NodeBinExpr* bin_expr;
+            bool lhs_done = false;
+            std::optional<int64_t> lhs{};
+        };
+        std::vector<Pending> pending;
+        std::vector<NodeExpr*> args;
+        std::optional<std::optional<int64_t>> result;
+        while (true) {
+            expr = skip_parens(expr);
+            if (const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+                pending.push_back({ .expr = expr, .bin_expr = *bin_expr });
+                expr = bin_expr_operands(*bin_expr).first;
+                continue;
+            }
+            NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (const auto call = std::get_if<NodeTermCall*>(&term->var)) {
+                args.insert(args.end(), (*call)->args.begin(), (*call)->args.end());
+            }
+            std::optional<int64_t> value = fold_term(term);
+            while (!pending.empty()) {
+                Pending& top = pending.back();
+                if (!top.lhs_done) {
+                    top.lhs_done = true;
+                    top.lhs = value;
+                    expr = bin_expr_operands(top.bin_expr).second;
+                    break;
+                }
+                value = fold_bin_expr(top.bin_expr, top.lhs, value);
+                if (value.has_value()) {
+                    top.expr->var = m_allocator.emplace<NodeTerm>(make_int_lit(value.value(), 0));
+                }
+                pending.pop_back();
+            }
+            if (!pending.empty()) {
+                continue;
+            }
+            if (!result.has_value()) {
+                result = value;
+            }
+            if (args.empty()) {
+                return result.value();
+            }
+            expr = args.back();
+            args.pop_back();
+        }
+    }
+
+    // How control leaves a statement
+    enum class Flow {
+        falls_through,
+        exits,
+        removed
+    };
+
+    // Optimizes the statements in place. Everything behind a statement that always exits is
+    // dropped, and nested scopes that declare no variables are spliced into the list.
+    // Returns whether control never falls out of the list.
+    //
+    // Scopes and if statements nested in the list are walked with an explicit stack of frames
+    // rather than recursively, so the nesting depth is only bounded by memory.
+    bool optimize_stmts(std::vector<NodeStmt*>& stmts) {
+        const size_t base = m_frames.size();
+        m_frames.push_back(StmtsFrame { .stmts = &stmts, .begin = m_kept.size() });
+        while (true) {
+            auto& list = std::get<StmtsFrame>(m_frames.back());
+            if (!list.exits && list.next < list.stmts->size()) {
+                NodeStmt* stmt = (*list.stmts)[list.next++];
+                // without a flow, the statement opened a frame that reports it once done
+                if (const auto flow = optimize_stmt(stmt)) {
+                    keep_stmt(list, stmt, flow.value());
+                }
+                continue;
+            }
+            const StmtsFrame done = list;
+            m_frames.pop_back();
+            if (done.scope) {
+                end_scope();
+            }
+            // The kept statements of a scope directly in a list are left where they are, after
+            // those of the enclosing list, if they declare no variables. This splices them into
+            // the enclosing list without copying them at every level of nesting.
+            const bool splice = done.scope && !done.declares && std::holds_alternative<StmtsFrame>(m_frames.back());
+            if (!splice) {
+                done.stmts->assign(m_kept.begin() + static_cast<std::ptrdiff_t>(done.begin), m_kept.end());
+                m_kept.resize(done.begin);
+            }
+            if (m_frames.size() == base) {
+                return done.exits;
+            }
+            std::optional<Flow> flow = done.exits ? Flow::exits : Flow::falls_through;
+            if (const auto if_frame = std::get_if<IfFrame>(&m_frames.back())) {
+                // an arm of the if on top is done
+                if (!done.exits) {
+                    add_outcome(*if_frame);
+                }
+                if_frame->exits = if_frame->exits && done.exits;
+                flow = optimize_if_pred();
+                if (!flow.has_value()) {
+                    continue;
+                }
+            } else if (const auto loop_frame = std::get_if<LoopFrame>(&m_frames.back())) {
+                // the body of the loop on top is done
+                loop_frame->body_exits = done.exits;
+                flow = finish_loop();
+            }
+            // the scope or if statement is done, so is the statement in the list it belongs to
+            auto& parent = std::get<StmtsFrame>(m_frames.back());
+            if (splice) {
+                parent.exits = done.exits;
+            } else {
+                keep_stmt(parent, (*parent.stmts)[parent.next - 1], flow.value());
+            }
+        }
+    }
+
+    // Opens a frame for the statements of the scope; optimize_stmts reports whether the scope
+    // exits to the frame below it
+    void optimize_scope(NodeScope* scope) {
+        begin_scope();
+        m_frames.push_back(StmtsFrame { .stmts = &scope->stmts, .begin = m_kept.size(), .scope = true });
+    }
+
+    // Continues the elif/else chain of the if on top of the frames once an arm is done. Each arm
+    // starts from the bindings before the if; afterwards only the values all arms that fall
+    // through (and the path taking no arm if there is no else) agree on are kept.
+    // Returns how control leaves the if once it is done, nothing if another arm has been opened.
+    std::optional<Flow> optimize_if_pred() {
+        auto& frame = std::get<IfFrame>(m_frames.back());
+        if (frame.pred == nullptr) {
+            return finish_if();
+        }
+        std::optional<NodeIfPred*>& pred = *frame.pred;
+        // Arms whose condition folds to zero are never taken, and one that folds to a non-zero
+        // value is always taken once reached, so it becomes the else
+        while (pred.has_value()) {
+            const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var);
+            if (elif == nullptr) {
+                break;
+            }
+            undo(frame.mark);
+            const auto cond = fold_expr((*elif)->expr);
+            if (!cond.has_value()) {
+                break;
+            }
+            if (cond.value() != 0) {
+                pred = m_allocator.emplace<NodeIfPred>(m_allocator.emplace<NodeIfPredElse>((*elif)->scope));
+            } else {
+                pred = (*elif)->pred;
+            }
+        }
+        if (!pred.has_value()) {
+            // the path taking no arm changes nothing
+            undo(frame.mark);
+            add_outcome(frame);
+            frame.exits = false;
+            return finish_if();
+        }
+
+        undo(frame.mark);
+        if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+            // the condition has already been folded above
+            frame.pred = &(*elif)->pred;
+            optimize_scope((*elif)->scope);
+        } else {
+            frame.pred = nullptr;
+            optimize_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+        }
+        return {};
+    }
+
+    // Optimizes a statement that has no statements nested in it right away and returns how
+    // control leaves it. Otherwise it opens a frame for the nested statements and returns
+    // nothing; optimize_stmts picks up from there.
+    std::optional<Flow> optimize_stmt(NodeStmt* stmt) {
+        struct StmtVisitor {
+            Optimizer& opt;
+            NodeStmt* stmt;
+
+            std::optional<Flow> operator()(NodeStmtExit* stmt_exit) const {
+                opt.fold_expr(stmt_exit->expr);
+                return Flow::exits;
+            }
+
+            std::optional<Flow> operator()(NodeStmtVar* stmt_var) const {
+                const auto value = opt.fold_expr(stmt_var->expr);
+                opt.declare(stmt_var->ident.symbol, value);
+                return Flow::falls_through;
+            }
+
+            std::optional<Flow> operator()(NodeStmtAssign* stmt_assign) const {
+                const auto value = opt.fold_expr(stmt_assign->expr);
+                if (opt.binding(stmt_assign->ident.symbol).visible) {
+                    opt.set_binding(stmt_assign->ident.symbol, { .visible = true, .value = value });
+                }
+                return Flow::falls_through;
+            }
+
+            std::optional<Flow> operator()(NodeScope* scope) const {
+                opt.optimize_scope(scope);
+                return {};
+            }
+
+            std::optional<Flow> operator()(NodeStmtIf* stmt_if) const {
+                // Leading arms with a constant condition are resolved here: a zero condition drops
+                // the arm, a non-zero one turns the whole statement into a plain scope
+                while (const auto cond = opt.fold_expr(stmt_if->expr)) {
+                    if (cond.value() != 0) {
+                        stmt->var = stmt_if->scope;
+                        return (*this)(stmt_if->scope);
+                    }
+                    if (!stmt_if->pred.has_value()) {
+                        return Flow::removed;
+                    }
+                    if (const auto else_ = std::get_if<NodeIfPredElse*>(&stmt_if->pred.value()->var)) {
+                        stmt->var = (*else_)->scope;
+                        return (*this)((*else_)->scope);
+                    }
+                    const auto elif = std::get<NodeIfPredElif*>(stmt_if->pred.value()->var);
+                    stmt_if->expr = elif->expr;
+                    stmt_if->scope = elif->scope;
+                    stmt_if->pred = elif->pred;
+                }
+
+                opt.m_frames.push_back(IfFrame { .mark = opt.open_mark(), .pred = &stmt_if->pred });
+                opt.optimize_scope(stmt_if->scope);
+                return {};
+            }
+
+            std::optional<Flow> operator()(NodeStmtWhile* stmt_while) const {
+                // Variables the body assigns have no known value in the condition or the body, and
+                // none after the loop either, however often it ran
+                const size_t entry = opt.open_mark();
+                opt.forget_assigned(scan_loop(stmt_while->scope));
+                const auto cond = opt.fold_expr(stmt_while->expr);
+                if (cond.has_value() && cond.value() == 0) {
+                    opt.undo(entry);
+                    opt.close_mark();
+                    return Flow::removed;
+                }
+                // the body goes back to the bindings with the assigned variables forgotten
+                opt.m_frames.push_back(LoopFrame { .mark = opt.m_trail.size(), .stmt = stmt, .forever = cond.has_value() });
+                opt.optimize_scope(stmt_while->scope);
+                return {};
+            }
+
+            std::optional<Flow> operator()(NodeStmtReturn* stmt_return) const {
+                opt.fold_expr(stmt_return->expr);
+                return Flow::exits;
+            }
+        };
+
+        StmtVisitor visitor { .opt = *this, .stmt = stmt };
+        return std::visit(visitor, stmt->var);
+    }
+
+    // The loop passes run from within fold, whose time includes theirs
+    void optimize_prog() {
+        inline_calls();
+        timed("opt.fold", [&] {
+            begin_scope();
+            optimize_stmts(m_prog.stmts);
+            end_scope();
+            // nothing is known about the parameters of a function
+            for (NodeFunction* function : m_prog.functions) {
+                begin_scope();
+                for (const Token& param : function->params) {
+                    declare(param.symbol, {});
+                }
+                optimize_stmts(function->scope->stmts);
+                end_scope();
+            }
+        });
+    }
+
+private:
+
+    // Runs fn as the named phase of m_stats, if there is one
+    template <typename Fn>
+    std::invoke_result_t<Fn> timed(const char* name, Fn&& fn) {
+        if (m_stats == nullptr) {
+            return fn();
+        }
+        return m_stats->time(name, std::forward<Fn>(fn));
+    }
+
+    // A list of statements being optimized, of which next is the next one to look at. The
+    // statements it keeps are in m_kept from begin on. scope is set for the statements of a
+    // scope, which ends with the list.
+    struct StmtsFrame {
+        std::vector<NodeStmt*>* stmts;
+        size_t begin;
+        size_t next = 0;
+        bool exits = false;
+        // whether any of the kept statements declares a variable; spliced in ones never do
+        bool declares = false;
+        bool scope = false;
+    };
+
+    // An if statement whose arms are being optimized. Every arm starts from the bindings at mark
+    // in m_trail. changes are the bindings each arm that falls through changed, as they were at
+    // its end. pred is the rest of the elif/else chain once the current arm is done, null after
+    // the else.
+    struct IfFrame {
+        size_t mark;
+        std::vector<std::pair<Symbol, Binding>> changes{};
+        // the number of arms that fall through, and the path taking no arm if there is no else
+        size_t outcomes = 0;
+        // whether every arm so far exits
+        bool exits = true;
+        std::optional<NodeIfPred*>* pred;
+    };
+
+    // A while loop whose body is being optimized. The bindings at mark in m_trail, with the
+    // variables the body assigns forgotten, are also what is known after it.
+    struct LoopFrame {
+        size_t mark;
+        NodeStmt* stmt;
+        // whether the condition is a non-zero constant, so the loop is only left by an exit
+        bool forever;
+        bool body_exits = false;
+    };
+
+    using Frame = std::variant<StmtsFrame, IfFrame, LoopFrame>;
+
+    // What the statements of a loop body do to variables, see scan_loop
+    struct LoopScan {
+        // assigned variables with the number of assignments to each
+        std::vector<std::pair<std::string_view, size_t>> assigned{};
+        // their symbols, for forget_assigned
+        std::vector<Symbol> assigned_symbols{};
+        std::vector<std::string_view> declared{};
+        size_t stmts = 0;
+        bool nested_loop = false;
+        // false if the body has more than max_loop_stmts statements, which were not all looked at
+        bool complete = true;
+
+        [[nodiscard]] size_t assignments(const std::string_view name) const {
+            const auto it = std::ranges::find_if(assigned, [&](const auto& entry) { return entry.first == name; });
+            return it == assigned.end() ? 0 : it->second;
+        }
+
+        [[nodiscard]] bool declares(const std::string_view name) const {
+            return std::ranges::find(declared, name) != declared.end();
+        }
+
+        // whether a read of the variable may see a different value in different iterations
+        [[nodiscard]] bool variant(const std::string_view name) const {
+            return assignments(name) > 0 || declares(name);
+        }
+    };
+
+    // Adds the statement to the statements kept in the list unless it was removed
+    void keep_stmt(StmtsFrame& list, NodeStmt* stmt, const Flow flow) {
+        if (flow == Flow::removed) {
+            return;
+        }
+        m_kept.push_back(stmt);
+        list.declares = list.declares || std::holds_alternative<NodeStmtVar*>(stmt->var);
+        if (flow == Flow::exits) {
+            list.exits = true;
+        }
+    }
+
+    // Records the bindings the arm that just ended changed as an outcome of the if
+    void add_outcome(IfFrame& frame) {
+        m_generation++;
+        for (size_t i = frame.mark; i < m_trail.size(); i++) {
+            const Symbol symbol = m_trail[i].first;
+            if (m_seen[symbol].first != m_generation) {
+                m_seen[symbol] = { m_generation, 0 };
+                frame.changes.emplace_back(symbol, m_bindings[symbol]);
+            }
+        }
+        frame.outcomes++;
+    }
+
+    // Merges the bindings of the arms of the if on top of the frames and pops it. Only a variable
+    // some arm changed can differ from before the if; it keeps the value all outcomes agree on,
+    // an arm that did not change it agreeing with the value before.
+    Flow finish_if() {
+        auto& frame = std::get<IfFrame>(m_frames.back());
+        undo(frame.mark);
+        close_mark();
+        // each symbol with the number of outcomes that changed it, and whether they disagree
+        std::vector<std::pair<Symbol, Binding>> merged;
+        std::vector<std::pair<size_t, bool>> counts;
+        m_generation++;
+        for (const auto& [symbol, changed] : frame.changes) {
+            auto& [generation, index] = m_seen[symbol];
+            if (generation != m_generation) {
+                generation = m_generation;
+                index = merged.size();
+                merged.emplace_back(symbol, changed);
+                counts.emplace_back(0, false);
+            }
+            counts[index].first++;
+            counts[index].second = counts[index].second || merged[index].second != changed;
+        }
+        for (size_t i = 0; i < merged.size(); i++) {
+            const auto& [symbol, changed] = merged[i];
+            const Binding& before = m_bindings[symbol];
+            const bool agree = !counts[i].second && (counts[i].first == frame.outcomes || changed == before);
+            if (agree && changed != before) {
+                set_binding(symbol, changed);
+            } else if (!agree && before.value.has_value()) {
+                set_binding(symbol, { .visible = before.visible });
+            }
+        }
+        const Flow flow = frame.exits ? Flow::exits : Flow::falls_through;
+        m_frames.pop_back();
+        return flow;
+    }
+
+    // Restores the bindings from before the loop on top of the frames once its body is done,
+    // optimizes the loop itself and pops it
+    Flow finish_loop() {
+        auto& frame = std::get<LoopFrame>(m_frames.back());
+        undo(frame.mark);
+        close_mark();
+        if (!frame.body_exits) {
+            optimize_loop(frame.stmt);
+        }
+        const Flow flow = frame.forever ? Flow::exits : Flow::falls_through;
+        m_frames.pop_back();
+        return flow;
+    }
+
+    // Loop optimizations on a while loop whose body has already been optimized: strength
+    // reduction, hoisting of invariant expressions and partial unrolling, in this order. The
+    // variables they introduce are declared in a scope that takes the place of the loop, in
+    // front of it.
+    void optimize_loop(NodeStmt* stmt) {
+        const auto loop = std::get<NodeStmtWhile*>(stmt->var);
+        LoopScan scan = scan_loop(loop->scope);
+        if (!scan.complete) {
+            return;
+        }
+        std::vector<NodeStmt*> before;
+        timed("opt.strength_reduce", [&] { reduce_induction_vars(loop, scan, before); });
+        timed("opt.hoist", [&] { hoist_invariants(loop, scan, before); });
+        NodeStmtWhile* unrolled = timed("opt.unroll", [&] { return unroll(loop, scan, before); });
+        if (before.empty() && unrolled == nullptr) {
+            return;
+        }
+        const auto scope = m_allocator.emplace<NodeScope>(std::move(before));
+        if (unrolled != nullptr) {
+            scope->stmts.push_back(m_allocator.emplace<NodeStmt>(unrolled));
+        }
+        scope->stmts.push_back(m_allocator.emplace<NodeStmt>(loop));
+        stmt->var = scope;
+    }
+
+    // A call somewhere in the program. owner is the function it is in, none for the main program.
+    // whole is set if the call is the entire expression of stmt, which is in list.
+    struct CallSite {
+        NodeExpr* expr;
+        NodeTermCall* call;
+        std::optional<size_t> owner;
+        std::vector<NodeStmt*>* list;
+        NodeStmt* stmt;
+        bool whole;
+    };
+
+    // Inlines functions before anything else is optimized, so the inlined code is optimized in
+    // its context: calls of small functions whose body is a single return into the expression
+    // they are in, then functions that are called from a single place, where the call is the whole
+    // expression of a var, assignment, exit or return, into the statement list around it. The
+    // functions the main program no longer reaches are dropped. Calls that do not match a
+    // function are left to the generators to report.
+    void inline_calls() {
+        for (size_t i = 0; i < m_prog.functions.size(); i++) {
+            if (find_function(m_prog, m_prog.functions[i]->ident.value) != i) {
+                return;
+            }
+        }
+        timed("opt.inline_small", [&] { inline_small_functions(); });
+        timed("opt.inline_single", [&] { inline_single_calls(); });
+        timed("opt.drop_functions", [&] { drop_unreachable_functions(); });
+    }
+
+    // Calls fn on every call in the program
+    template <typename Fn>
+    void for_each_call(Fn&& fn) {
+        std::vector<std::pair<std::vector<NodeStmt*>*, std::optional<size_t>>> lists { { &m_prog.stmts, std::nullopt } };
+        for (size_t i = 0; i < m_prog.functions.size(); i++) {
+            lists.emplace_back(&m_prog.functions[i]->scope->stmts, i);
+        }
+        std::vector<NodeScope*> scopes;
+        while (!lists.empty()) {
+            const auto [list, owner] = lists.back();
+            lists.pop_back();
+            for (NodeStmt* stmt : *list) {
+                for_each_expr(stmt, [&](NodeExpr* root) {
+                    const bool whole_stmt = !std::holds_alternative<NodeStmtIf*>(stmt->var) &&
+                                            !std::holds_alternative<NodeStmtWhile*>(stmt->var);
+                    for_each_node(root, [&](NodeExpr* node) {
+                        const auto term = std::get_if<NodeTerm*>(&node->var);
+                        const auto call = term == nullptr ? nullptr : std::get_if<NodeTermCall*>(&(*term)->var);
+                        if (call == nullptr) {
+                            return true;
+                        }
+                        return fn(CallSite { .expr = node, .call = *call, .owner = owner, .list = list, .stmt = stmt,
+                                             .whole = whole_stmt && call_term(root) == *call });
+                    });
+                });
+                push_nested_scopes(stmt, scopes);
+            }
+            for (NodeScope* scope : scopes) {
+                lists.emplace_back(&scope->stmts, owner);
+            }
+            scopes.clear();
+        }
+    }
+
+    // The function a call refers to if it exists and takes that many arguments
+    [[nodiscard]] std::optional<size_t> callee(const NodeTermCall* call) const {
+        const auto index = find_function(m_prog, call->ident.value);
+        if (!index.has_value() || m_prog.functions[index.value()]->params.size() != call->args.size()) {
+            return {};
+        }
+        return index;
+    }
+
+    // Replaces calls of functions whose body is return E, with E of at most max_inline_nodes nodes
+    // that reads only parameters and calls nothing, by a copy of E with the arguments in place of the parameters. The
+    // arguments must not call or trap, so it makes no difference whether and how often they are
+    // evaluated; one read more than once must be a variable or literal. Copies are not looked into
+    // again, so this terminates on recursive functions.
+    void inline_small_functions() {
+        // the body, with the number of reads of each parameter in it
+        std::vector<std::optional<std::pair<const NodeExpr*, std::vector<size_t>>>> small(m_prog.functions.size());
+        for (size_t i = 0; i < m_prog.functions.size(); i++) {
+            const NodeFunction* function = m_prog.functions[i];
+            if (function->scope->stmts.size() != 1 || !std::holds_alternative<NodeStmtReturn*>(function->scope->stmts[0]->var)) {
+                continue;
+            }
+            NodeExpr* body = std::get<NodeStmtReturn*>(function->scope->stmts[0]->var)->expr;
+            std::vector<size_t> reads(function->params.size());
+            size_t nodes = 0;
+            bool inlinable = true;
+            for_each_node(body, [&](const NodeExpr* node) {
+                if (++nodes > max_inline_nodes || call_term(node) != nullptr) {
+                    inlinable = false;
+                } else if (const std::string_view* name = ident_name(node)) {
+                    const auto param = std::ranges::find(function->params, *name, [](const Token& token) { return token.value; });
+                    if (param == function->params.end()) {
+                        inlinable = false;
+                    } else {
+                        reads[param - function->params.begin()]++;
+                    }
+                }
+                return inlinable;
+            });
+            if (inlinable) {
+                small[i] = std::pair { body, std::move(reads) };
+            }
+        }
+
+        for_each_call([&](const CallSite& site) {
+            const auto index = callee(site.call);
+            if (!index.has_value() || !small[index.value()].has_value()) {
+                return true;
+            }
+            const auto& [body, reads] = small[index.value()].value();
+            for (size_t i = 0; i < reads.size(); i++) {
+                if (!pure(site.call->args[i]) || (reads[i] > 1 && ident_name(site.call->args[i]) == nullptr &&
+                                                  !const_value(site.call->args[i]).has_value())) {
+                    return true;
+                }
+            }
+            const NodeFunction* function = m_prog.functions[index.value()];
+            site.expr->var = clone_expr(body, [&](const std::string_view name) {
+                const auto param = std::ranges::find(function->params, name, [](const Token& token) { return token.value; });
+                return site.call->args[param - function->params.begin()];
+            })->var;
+            return false;
+        });
+    }
+
+    // Moves the body of every function that is called from a single place, where the call is the
+    // whole expression of a var, assignment, exit or return statement, and that only returns at
+    // its end, into a scope in place of the statement. The parameters become variables of the
+    // scope, and all variables of the body are renamed so they cannot clash with the ones around.
+    void inline_single_calls() {
+        std::vector<std::vector<CallSite>> sites(m_prog.functions.size());
+        for_each_call([&](const CallSite& site) {
+            if (const auto index = callee(site.call)) {
+                sites[index.value()].push_back(site);
+            }
+            return true;
+        });
+        for (size_t i = 0; i < m_prog.functions.size(); i++) {
+            if (sites[i].size() != 1 || !sites[i][0].whole || sites[i][0].owner == i) {
+                continue;
+            }
+            const CallSite site = sites[i][0];
+            if (!inline_call(site, m_prog.functions[i])) {
+                continue;
+            }
+            // the calls in the body now belong to where it went
+            for (std::vector<CallSite>& other : sites) {
+                for (CallSite& other_site : other) {
+                    if (other_site.owner == i) {
+                        other_site.owner = site.owner;
+                    }
+                }
+            }
+        }
+    }
+
+    // See inline_single_calls. Returns false if the function does not qualify.
+    bool inline_call(const CallSite& site, NodeFunction* function) {
+        std::vector<std::string_view> names;
+        for (const Token& param : function->params) {
+            names.push_back(param.value);
+        }
+        size_t stmts = 0;
+        size_t returns = 0;
+        for_each_stmt(function->scope, [&](NodeStmt* stmt) {
+            stmts++;
+            if (const auto stmt_var = std::get_if<NodeStmtVar*>(&stmt->var)) {
+                names.push_back((*stmt_var)->ident.value);
+            } else if (std::holds_alternative<NodeStmtReturn*>(stmt->var)) {
+                returns++;
+            }
+            return stmts <= max_inline_stmts;
+        });
+        const std::vector<NodeStmt*>& body = function->scope->stmts;
+        if (stmts > max_inline_stmts ||
+            (returns > 0 && (returns > 1 || !std::holds_alternative<NodeStmtReturn*>(body.back()->var)))) {
+            return false;
+        }
+        // every name the body uses must be its own
+        const auto own = [&](const std::string_view name) { return std::ranges::find(names, name) != names.end(); };
+        bool closed = true;
+        for_each_stmt(function->scope, [&](NodeStmt* stmt) {
+            if (const auto assign = std::get_if<NodeStmtAssign*>(&stmt->var)) {
+                closed = closed && own((*assign)->ident.value);
+            }
+            for_each_expr(stmt, [&](NodeExpr* root) {
+                for_each_node(root, [&](const NodeExpr* node) {
+                    if (const std::string_view* name = ident_name(node); name != nullptr && !own(*name)) {
+                        closed = false;
+                    }
+                    return closed;
+                });
+            });
+            return closed;
+        });
+        // var x = f(... x ...) must keep failing on the undeclared x
+        const auto stmt_var = std::get_if<NodeStmtVar*>(&site.stmt->var);
+        if (stmt_var != nullptr) {
+            for (NodeExpr* arg : site.call->args) {
+                for_each_node(arg, [&](const NodeExpr* node) {
+                    if (const std::string_view* name = ident_name(node); name != nullptr && *name == (*stmt_var)->ident.value) {
+                        closed = false;
+                    }
+                    return closed;
+                });
+            }
+        }
+        if (!closed) {
+            return false;
+        }
+
+        const std::string prefix = ".inline" + std::to_string(m_inline_count++) + ".";
+        for_each_stmt(function->scope, [&](NodeStmt* stmt) {
+            if (const auto var = std::get_if<NodeStmtVar*>(&stmt->var)) {
+                rename((*var)->ident, prefix);
+            } else if (const auto assign = std::get_if<NodeStmtAssign*>(&stmt->var)) {
+                rename((*assign)->ident, prefix);
+            }
+            for_each_expr(stmt, [&](NodeExpr* root) {
+                for_each_node(root, [&](NodeExpr* node) {
+                    if (const auto term = std::get_if<NodeTerm*>(&node->var)) {
+                        if (const auto ident = std::get_if<NodeTermIdent*>(&(*term)->var)) {
+                            rename((*ident)->ident, prefix);
+                        }
+                    }
+                    return true;
+                });
+            });
+            return true;
+        });
+
+        NodeExpr* result = make_lit(0);
+        std::vector<NodeStmt*> stmts_out;
+        for (size_t i = 0; i < function->params.size(); i++) {
+            stmts_out.push_back(make_var(store(prefix + std::string(function->params[i].value)), site.call->args[i]));
+        }
+        stmts_out.insert(stmts_out.end(), body.begin(), body.end());
+        if (returns > 0) {
+            result = std::get<NodeStmtReturn*>(stmts_out.back()->var)->expr;
+            stmts_out.pop_back();
+        }
+        NodeScope* scope = function->scope;
+        if (const auto stmt_exit = std::get_if<NodeStmtExit*>(&site.stmt->var)) {
+            stmts_out.push_back(m_allocator.emplace<NodeStmt>(m_allocator.emplace<NodeStmtExit>(result)));
+        } else if (std::holds_alternative<NodeStmtReturn*>(site.stmt->var)) {
+            stmts_out.push_back(m_allocator.emplace<NodeStmt>(m_allocator.emplace<NodeStmtReturn>(result)));
+        } else if (const auto assign = std::get_if<NodeStmtAssign*>(&site.stmt->var)) {
+            stmts_out.push_back(make_assign((*assign)->ident.value, result));
+        } else {
+            stmts_out.push_back(make_assign((*stmt_var)->ident.value, result));
+        }
+        scope->stmts = std::move(stmts_out);
+        if (stmt_var != nullptr) {
+            // var x = 0; { ... x = E; }
+            (*stmt_var)->expr = make_lit(0);
+            const auto it = std::ranges::find(*site.list, site.stmt);
+            site.list->insert(std::next(it), m_allocator.emplace<NodeStmt>(scope));
+        } else {
+            site.stmt->var = scope;
+        }
+        return true;
+    }
+
+    // Drops the functions that cannot be reached from the main program through calls
+    void drop_unreachable_functions() {
+        // callees of the main program, then of each function
+        std::vector<std::vector<size_t>> callees(m_prog.functions.size() + 1);
+        for_each_call([&](const CallSite& site) {
+            if (const auto index = callee(site.call)) {
+                callees[site.owner.has_value() ? site.owner.value() + 1 : 0].push_back(index.value());
+            }
+            return true;
+        });
+        std::vector<bool> reached(m_prog.functions.size(), false);
+        std::vector<size_t> pending = callees[0];
+        while (!pending.empty()) {
+            const size_t index = pending.back();
+            pending.pop_back();
+            if (!reached[index]) {
+                reached[index] = true;
+                pending.insert(pending.end(), callees[index + 1].begin(), callees[index + 1].end());
+            }
+        }
+        std::vector<NodeFunction*> kept;
+        for (size_t i = 0; i < m_prog.functions.size(); i++) {
+            if (reached[i]) {
+                kept.push_back(m_prog.functions[i]);
+            }
+        }
+        m_prog.functions = std::move(kept);
+    }
+
+    // Whether evaluating expr can neither call nor trap
+    [[nodiscard]] static bool pure(NodeExpr* expr) {
+        bool result = true;
+        for_each_node(expr, [&](const NodeExpr* node) {
+            if (call_term(node) != nullptr) {
+                result = false;
+            } else if (const auto bin_expr = std::get_if<NodeBinExpr*>(&node->var); bin_expr != nullptr && may_trap(*bin_expr)) {
+                result = false;
+            }
+            return result;
+        });
+        return result;
+    }
+
+    // Copy of expr with the variables substitute returns an expression for replaced by copies of
+    // that expression, with an explicit stack of the nodes left to copy
+    template <typename Substitute>
+    NodeExpr* clone_expr(const NodeExpr* expr, Substitute&& substitute) {
+        struct Pending {
+            const NodeExpr* from;
+            NodeExpr* to;
+            // false inside a substituted expression
+            bool substitute;
+        };
+        NodeExpr* root = m_allocator.emplace<NodeExpr>();
+        std::vector<Pending> pending { { .from = expr, .to = root, .substitute = true } };
+        while (!pending.empty()) {
+            const Pending next = pending.back();
+            pending.pop_back();
+            if (const auto bin_expr = std::get_if<NodeBinExpr*>(&next.from->var)) {
+                const auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+                NodeExpr* lhs_copy = m_allocator.emplace<NodeExpr>();
+                NodeExpr* rhs_copy = m_allocator.emplace<NodeExpr>();
+                next.to->var = std::visit([&](const auto* op) {
+                    using BinExpr = std::remove_cvref_t<decltype(*op)>;
+                    return m_allocator.emplace<NodeBinExpr>(m_allocator.emplace<BinExpr>(lhs_copy, rhs_copy));
+                }, (*bin_expr)->var);
+                pending.push_back({ .from = lhs, .to = lhs_copy, .substitute = next.substitute });
+                pending.push_back({ .from = rhs, .to = rhs_copy, .substitute = next.substitute });
+                continue;
+            }
+            const NodeTerm* term = std::get<NodeTerm*>(next.from->var);
+            if (const auto int_lit = std::get_if<NodeTermIntLit*>(&term->var)) {
+                next.to->var = m_allocator.emplace<NodeTerm>(m_allocator.emplace<NodeTermIntLit>(**int_lit));
+            } else if (const auto ident = std::get_if<NodeTermIdent*>(&term->var)) {
+                if (next.substitute) {
+                    pending.push_back({ .from = substitute((*ident)->ident.value), .to = next.to, .substitute = false });
+                } else {
+                    next.to->var = m_allocator.emplace<NodeTerm>(m_allocator.emplace<NodeTermIdent>(**ident));
+                }
+            } else if (const auto paren = std::get_if<NodeTermParen*>(&term->var)) {
+                NodeExpr* copy = m_allocator.emplace<NodeExpr>();
+                next.to->var = m_allocator.emplace<NodeTerm>(m_allocator.emplace<NodeTermParen>(copy));
+                pending.push_back({ .from = (*paren)->expr, .to = copy, .substitute = next.substitute });
+            } else {
+                const NodeTermCall* call = std::get<NodeTermCall*>(term->var);
+                auto copy = m_allocator.emplace<NodeTermCall>(call->ident);
+                for (const NodeExpr* arg : call->args) {
+                    copy->args.push_back(m_allocator.emplace<NodeExpr>());
+                    pending.push_back({ .from = arg, .to = copy->args.back(), .substitute = next.substitute });
+                }
+                next.to->var = m_allocator.emplace<NodeTerm>(copy);
+            }
+        }
+        return root;
+    }
+
+    // Replaces products i * k of a basic induction variable i, one whose only assignment in the
+    // loop is i = i + c or i = i - c directly in the body, by a new variable that is kept equal to
+    // i * k: declared as i * k in front of the loop and stepped by c * k right after i is.
+    void reduce_induction_vars(NodeStmtWhile* loop, LoopScan& scan, std::vector<NodeStmt*>& before) {
+        struct Induction {
+            std::string_view name;
+            int64_t step;
+            // of the update in the body
+            size_t index;
+        };
+        struct Derived {
+            const Induction* induction;
+            int64_t factor;
+            std::string_view name;
+        };
+
+        std::vector<NodeStmt*>& stmts = loop->scope->stmts;
+        std::vector<Induction> inductions;
+        for (size_t i = 0; i < stmts.size(); i++) {
+            if (const auto step = induction_step(stmts[i]); step.has_value() && scan.assignments(step->first) == 1 &&
+                !scan.declares(step->first)) {
+                inductions.push_back({ .name = step->first, .step = step->second, .index = i });
+            }
+        }
+        if (inductions.empty()) {
+            return;
+        }
+
+        std::vector<Derived> derived;
+        const auto reduce = [&](NodeExpr* expr) {
+            const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var);
+            if (bin_expr == nullptr || !std::holds_alternative<NodeBinExprMulti*>((*bin_expr)->var)) {
+                return true;
+            }
+            auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+            if (ident_name(lhs) == nullptr) {
+                std::swap(lhs, rhs);
+            }
+            const std::string_view* name = ident_name(lhs);
+            const auto factor = const_value(rhs);
+            if (name == nullptr || !factor.has_value() || factor.value() == 0 || factor.value() == 1) {
+                return true;
+            }
+            const auto induction = std::ranges::find_if(inductions, [&](const Induction& iv) { return iv.name == *name; });
+            if (induction == inductions.end()) {
+                return true;
+            }
+            auto it = std::ranges::find_if(derived, [&](const Derived& d) {
+                return d.induction == &*induction && d.factor == factor.value();
+            });
+            if (it == derived.end()) {
+                if (derived.size() == max_derived_vars) {
+                    return true;
+                }
+                derived.push_back({ .induction = &*induction, .factor = factor.value(), .name = loop_var_name() });
+                it = std::prev(derived.end());
+            }
+            expr->var = make_ident(it->name)->var;
+            return false;
+        };
+        for_each_stmt(loop->scope, [&](NodeStmt* stmt) {
+            for_each_expr(stmt, [&](NodeExpr* root) { for_each_node(root, reduce); });
+            return true;
+        });
+        if (derived.empty()) {
+            return;
+        }
+
+        std::vector<NodeStmt*> stepped;
+        for (size_t i = 0; i < stmts.size(); i++) {
+            stepped.push_back(stmts[i]);
+            for (const Derived& d : derived) {
+                if (d.induction->index != i) {
+                    continue;
+                }
+                const auto step = static_cast<int64_t>(static_cast<uint64_t>(d.induction->step) * d.factor);
+                stepped.push_back(make_assign(d.name, make_bin_expr<NodeBinExprAdd>(make_ident(d.name), make_lit(step))));
+                scan.assigned.emplace_back(d.name, 1);
+                scan.stmts++;
+            }
+        }
+        stmts = std::move(stepped);
+        for (const Derived& d : derived) {
+            before.push_back(make_var(d.name, make_bin_expr<NodeBinExprMulti>(make_ident(d.induction->name), make_lit(d.factor))));
+        }
+    }
+
+    // Moves the largest subexpressions of the condition and the body that read no variable the
+    // loop changes into variables declared in front of it. Only operators that cannot trap are
+    // moved, as the loop may never evaluate them.
+    void hoist_invariants(NodeStmtWhile* loop, const LoopScan& scan, std::vector<NodeStmt*>& before) {
+        size_t hoisted = 0;
+        const auto hoist = [&](NodeExpr* expr) {
+            if (hoisted == max_hoisted_exprs) {
+                return;
+            }
+            hoisted++;
+            const std::string_view name = loop_var_name();
+            before.push_back(make_var(name, m_allocator.emplace<NodeExpr>(*expr)));
+            expr->var = make_ident(name)->var;
+        };
+        hoist_invariant_subexprs(loop->expr, scan, hoist);
+        for_each_stmt(loop->scope, [&](NodeStmt* stmt) {
+            for_each_expr(stmt, [&](NodeExpr* root) { hoist_invariant_subexprs(root, scan, hoist); });
+            return true;
+        });
+    }
+
+    // Calls hoist on the largest invariant operators of expr, see hoist_invariants. The operands are
+    // looked at before the operators on an explicit stack. A call is never moved, as it may not
+    // return, but its arguments are looked at as expressions of their own.
+    template <typename Hoist>
+    static void hoist_invariant_subexprs(NodeExpr* expr, const LoopScan& scan, Hoist&& hoist) {
+        struct Pending {
+            NodeExpr* expr;
+            NodeBinExpr* bin_expr;
+            bool lhs_done = false;
+            NodeExpr* lhs{};
+            bool lhs_invariant = false;
+        };
+        const auto hoistable = [](const NodeExpr* operand) {
+            return std::holds_alternative<NodeBinExpr*>(operand->var);
+        };
+        std::vector<Pending> pending;
+        std::vector<NodeExpr*> args;
+        while (true) {
+            expr = skip_parens(expr);
+            if (const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+                pending.push_back({ .expr = expr, .bin_expr = *bin_expr });
+                expr = bin_expr_operands(*bin_expr).first;
+                continue;
+            }
+            bool invariant = true;
+            if (const std::string_view* name = ident_name(expr)) {
+                invariant = !scan.variant(*name);
+            } else if (const NodeTermCall* call = call_term(expr)) {
+                invariant = false;
+                args.insert(args.end(), call->args.begin(), call->args.end());
+            }
+            while (!pending.empty()) {
+                Pending& top = pending.back();
+                if (!top.lhs_done) {
+                    top.lhs_done = true;
+                    top.lhs = expr;
+                    top.lhs_invariant = invariant;
+                    expr = bin_expr_operands(top.bin_expr).second;
+                    break;
+                }
+                const bool whole = top.lhs_invariant && invariant && !may_trap(top.bin_expr);
+                if (!whole) {
+                    if (top.lhs_invariant && hoistable(top.lhs)) {
+                        hoist(top.lhs);
+                    }
+                    if (invariant && hoistable(expr)) {
+                        hoist(expr);
+                    }
+                }
+                invariant = whole;
+                expr = top.expr;
+                pending.pop_back();
+            }
+            if (pending.empty()) {
+                if (invariant && hoistable(expr)) {
+                    hoist(expr);
+                }
+                if (args.empty()) {
+                    return;
+                }
+                expr = args.back();
+                args.pop_back();
+            }
+        }
+    }
+
+    // Partially unrolls a small innermost counted loop, one whose condition E stays true for
+    // the next N iterations whenever a guard G holds (see unroll_guard): while (E) B becomes
+    // while (G) { B ... B } while (E) B with N copies of B, the second loop doing the iterations
+    // that are left. Returns the first loop; the copies of the body share its nodes.
+    NodeStmtWhile* unroll(NodeStmtWhile* loop, const LoopScan& scan, std::vector<NodeStmt*>& before) {
+        if (scan.nested_loop || scan.stmts > max_unroll_stmts) {
+            return nullptr;
+        }
+        NodeExpr* guard = unroll_guard(loop, scan, before);
+        if (guard == nullptr) {
+            return nullptr;
+        }
+        const std::vector<NodeStmt*>& stmts = loop->scope->stmts;
+        const bool declares = std::ranges::any_of(stmts, [](const NodeStmt* stmt) {
+            return std::holds_alternative<NodeStmtVar*>(stmt->var);
+        });
+        const auto body = m_allocator.emplace<NodeScope>();
+        for (size_t i = 0; i < unroll_factor; i++) {
+            if (declares) {
+                body->stmts.push_back(m_allocator.emplace<NodeStmt>(loop->scope));
+            } else {
+                body->stmts.insert(body->stmts.end(), stmts.begin(), stmts.end());
+            }
+        }
+        return m_allocator.emplace<NodeStmtWhile>(guard, body);
+    }
+
+    // Guard of the unrolled loop, for a condition that moves by a constant step s per iteration:
+    // - E, an induction variable i plus or minus an invariant x, or i != x read as i - x:
+    //   E / (N * |s|). |E| >= N * |s| keeps E non-zero for the next N iterations.
+    // - i < x or i <= x with s > 0: b < x && i < b (or i <= b) for var b = x - (N - 1) * s in
+    //   front of the loop, where b < x fails only if computing b wrapped. i > x and i >= x with
+    //   s < 0 mirror it with b = x + (N - 1) * |s|, and x compared to i is read as i compared
+    //   to x the other way round. A literal x leaves just the comparison with a literal b.
+    NodeExpr* unroll_guard(NodeStmtWhile* loop, const LoopScan& scan, std::vector<NodeStmt*>& before) {
+        NodeExpr* cond = loop->expr;
+        if (const auto bin_expr = std::get_if<NodeBinExpr*>(&skip_parens(cond)->var)) {
+            const auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+            const bool lt = std::holds_alternative<NodeBinExprLt*>((*bin_expr)->var);
+            const bool le = std::holds_alternative<NodeBinExprLe*>((*bin_expr)->var);
+            const bool gt = std::holds_alternative<NodeBinExprGt*>((*bin_expr)->var);
+            const bool ge = std::holds_alternative<NodeBinExprGe*>((*bin_expr)->var);
+            if (std::holds_alternative<NodeBinExprNe*>((*bin_expr)->var)) {
+                cond = make_bin_expr<NodeBinExprSub>(lhs, rhs);
+            } else if (lt || le || gt || ge) {
+                return compare_guard(loop, scan, before, lhs, rhs, lt || le, lt || gt);
+            }
+        }
+        const auto step = cond_step(cond, loop, scan);
+        if (!step.has_value()) {
+            return nullptr;
+        }
+        const uint64_t magnitude = step.value() < 0 ? -static_cast<uint64_t>(step.value()) : step.value();
+        if (magnitude > max_unroll_step) {
+            return nullptr;
+        }
+        const auto divisor = static_cast<int64_t>(unroll_factor * magnitude);
+        return make_bin_expr<NodeBinExprDiv>(cond, make_lit(divisor));
+    }
+
+    // Guard for lhs < rhs (or <= if not strict) if less, else for lhs > rhs (or >=), where one
+    // side is an induction variable and the other invariant
+    NodeExpr* compare_guard(const NodeStmtWhile* loop, const LoopScan& scan, std::vector<NodeStmt*>& before,
+                            NodeExpr* lhs, NodeExpr* rhs, const bool less, const bool strict) {
+        // as i op x, with the induction variable on the left
+        const bool flip = ident_name(lhs) == nullptr || !invariant(rhs, scan);
+        NodeExpr* var = flip ? rhs : lhs;
+        NodeExpr* bound = flip ? lhs : rhs;
+        const std::string_view* name = ident_name(var);
+        if (name == nullptr || !invariant(bound, scan)) {
+            return nullptr;
+        }
+        // whether i stays below the bound while the loop runs
+        const bool below = less != flip;
+        const auto step = var_step(*name, loop, scan);
+        if (!step.has_value() || (step.value() > 0) != below) {
+            return nullptr;
+        }
+        const uint64_t magnitude = step.value() < 0 ? -static_cast<uint64_t>(step.value()) : step.value();
+        if (magnitude > max_unroll_step) {
+            return nullptr;
+        }
+        const auto reach = static_cast<int64_t>((unroll_factor - 1) * magnitude);
+        // a literal bound gives b right away, and no guard at all if it wraps
+        if (const auto value = const_value(bound)) {
+            const int64_t limit = below ? std::numeric_limits<int64_t>::min() + reach : std::numeric_limits<int64_t>::max() - reach;
+            if (below ? value.value() < limit : value.value() > limit) {
+                return nullptr;
+            }
+            NodeExpr* last = make_lit(below ? value.value() - reach : value.value() + reach);
+            if (below) {
+                return strict ? make_bin_expr<NodeBinExprLt>(var, last) : make_bin_expr<NodeBinExprLe>(var, last);
+            }
+            return strict ? make_bin_expr<NodeBinExprGt>(var, last) : make_bin_expr<NodeBinExprGe>(var, last);
+        }
+        const std::string_view last = loop_var_name();
+        if (below) {
+            before.push_back(make_var(last, make_bin_expr<NodeBinExprSub>(bound, make_lit(reach))));
+            NodeExpr* fits = make_bin_expr<NodeBinExprLt>(make_ident(last), bound);
+            NodeExpr* compare = strict ? make_bin_expr<NodeBinExprLt>(var, make_ident(last)) : make_bin_expr<NodeBinExprLe>(var, make_ident(last));
+            return make_bin_expr<NodeBinExprAnd>(fits, compare);
+        }
+        before.push_back(make_var(last, make_bin_expr<NodeBinExprAdd>(bound, make_lit(reach))));
+        NodeExpr* fits = make_bin_expr<NodeBinExprGt>(make_ident(last), bound);
+        NodeExpr* compare = strict ? make_bin_expr<NodeBinExprGt>(var, make_ident(last)) : make_bin_expr<NodeBinExprGe>(var, make_ident(last));
+        return make_bin_expr<NodeBinExprAnd>(fits, compare);
+    }
+
+    // Change of the loop condition cond per iteration, if it is i, i + x, x + i, i - x or x - i
+    // for an induction variable i (see reduce_induction_vars) and an invariant x
+    [[nodiscard]] static std::optional<int64_t> cond_step(const NodeExpr* cond, const NodeStmtWhile* loop, const LoopScan& scan) {
+        cond = skip_parens(cond);
+        const std::string_view* name = ident_name(cond);
+        bool negated = false;
+        if (const auto bin_expr = std::get_if<NodeBinExpr*>(&cond->var); bin_expr != nullptr && name == nullptr) {
+            const auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+            const bool add = std::holds_alternative<NodeBinExprAdd*>((*bin_expr)->var);
+            const bool sub = std::holds_alternative<NodeBinExprSub*>((*bin_expr)->var);
+            if ((add || sub) && ident_name(lhs) != nullptr && invariant(rhs, scan)) {
+                name = ident_name(lhs);
+            } else if ((add || sub) && ident_name(rhs) != nullptr && invariant(lhs, scan)) {
+                name = ident_name(rhs);
+                negated = sub;
+            }
+        }
+        if (name == nullptr) {
+            return {};
+        }
+        const auto step = var_step(*name, loop, scan);
+        if (!step.has_value()) {
+            return {};
+        }
+        return negated ? static_cast<int64_t>(-static_cast<uint64_t>(step.value())) : step.value();
+    }
+
+    // Step of the variable per iteration if it is an induction variable of the loop: assigned
+    // once, by an update with a constant step directly in the body, and not declared there
+    [[nodiscard]] static std::optional<int64_t> var_step(const std::string_view name, const NodeStmtWhile* loop, const LoopScan& scan) {
+        if (scan.assignments(name) != 1 || scan.declares(name)) {
+            return {};
+        }
+        for (const NodeStmt* stmt : loop->scope->stmts) {
+            if (const auto step = induction_step(stmt); step.has_value() && step->first == name) {
+                return step->second;
+            }
+        }
+        return {};
+    }
+
+    // Name and step c of an update i = i + c, i = c + i or i = i - c with a constant c
+    [[nodiscard]] static std::optional<std::pair<std::string_view, int64_t>> induction_step(const NodeStmt* stmt) {
+        const auto assign = std::get_if<NodeStmtAssign*>(&stmt->var);
+        if (assign == nullptr) {
+            return {};
+        }
+        const std::string_view name = (*assign)->ident.value;
+        const auto bin_expr = std::get_if<NodeBinExpr*>(&skip_parens((*assign)->expr)->var);
+        if (bin_expr == nullptr) {
+            return {};
+        }
+        const auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+        const auto is_name = [&](const NodeExpr* operand) {
+            const std::string_view* operand_name = ident_name(operand);
+            return operand_name != nullptr && *operand_name == name;
+        };
+        std::optional<int64_t> step;
+        if (std::holds_alternative<NodeBinExprAdd*>((*bin_expr)->var)) {
+            step = is_name(lhs) ? const_value(rhs) : is_name(rhs) ? const_value(lhs) : std::nullopt;
+        } else if (std::holds_alternative<NodeBinExprSub*>((*bin_expr)->var) && is_name(lhs)) {
+            if (const auto value = const_value(rhs)) {
+                step = static_cast<int64_t>(-static_cast<uint64_t>(value.value()));
+            }
+        }
+        if (!step.has_value() || step.value() == 0) {
+            return {};
+        }
+        return std::pair { name, step.value() };
+    }
+
+    // Whether expr reads no variable the loop changes and calls nothing
+    [[nodiscard]] static bool invariant(const NodeExpr* expr, const LoopScan& scan) {
+        bool result = true;
+        for_each_node(const_cast<NodeExpr*>(expr), [&](const NodeExpr* node) {
+            if (const std::string_view* name = ident_name(node); name != nullptr && scan.variant(*name)) {
+                result = false;
+            }
+            if (call_term(node) != nullptr) {
+                result = false;
+            }
+            return result;
+        });
+        return result;
+    }
+
+    // Whether evaluating the operator may raise SIGFPE: a division by anything but a constant
+    // other than 0 and -1
+    [[nodiscard]] static bool may_trap(const NodeBinExpr* bin_expr) {
+        const auto div = std::get_if<NodeBinExprDiv*>(&bin_expr->var);
+        if (div == nullptr) {
+            return false;
+        }
+        const auto divisor = const_value((*div)->rhs);
+        return !divisor.has_value() || divisor.value() == 0 || divisor.value() == -1;
+    }
+
+    // Looks at the statements of a loop body, nested ones included, up to max_loop_stmts of them
+    static LoopScan scan_loop(NodeScope* body) {
+        LoopScan scan;
+        for_each_stmt(body, [&](NodeStmt* stmt) {
+            if (++scan.stmts > max_loop_stmts) {
+                scan.complete = false;
+                return false;
+            }
+            if (const auto stmt_var = std::get_if<NodeStmtVar*>(&stmt->var)) {
+                scan.declared.push_back((*stmt_var)->ident.value);
+            } else if (const auto assign = std::get_if<NodeStmtAssign*>(&stmt->var)) {
+                const std::string_view name = (*assign)->ident.value;
+                const auto it = std::ranges::find_if(scan.assigned, [&](const auto& entry) { return entry.first == name; });
+                if (it == scan.assigned.end()) {
+                    scan.assigned.emplace_back(name, 1);
+                    scan.assigned_symbols.push_back((*assign)->ident.symbol);
+                } else {
+                    it->second++;
+                }
+            } else if (std::holds_alternative<NodeStmtWhile*>(stmt->var)) {
+                scan.nested_loop = true;
+            }
+            return true;
+        });
+        return scan;
+    }
+
+    // Forgets the values of the variables the loop assigns, or of all of them if the loop is too
+    // large to have been scanned completely
+    void forget_assigned(const LoopScan& scan) {
+        const auto forget = [&](const Symbol symbol) {
+            if (binding(symbol).value.has_value()) {
+                set_binding(symbol, { .visible = true });
+            }
+        };
+        if (!scan.complete) {
+            for (const auto& [symbol, hidden] : m_declared) {
+                forget(symbol);
+            }
+            return;
+        }
+        for (const Symbol symbol : scan.assigned_symbols) {
+            forget(symbol);
+        }
+    }
+
+    // Calls fn on every statement in scope and the scopes, if arms and loops nested in it, with
+    // an explicit stack of the scopes left to visit. Stops once fn returns false.
+    template <typename Fn>
+    static void for_each_stmt(NodeScope* scope, Fn&& fn) {
+        std::vector<NodeScope*> pending { scope };
+        while (!pending.empty()) {
+            const NodeScope* next = pending.back();
+            pending.pop_back();
+            for (NodeStmt* stmt : next->stmts) {
+                if (!fn(stmt)) {
+                    return;
+                }
+                push_nested_scopes(stmt, pending);
+            }
+        }
+    }
+
+    // Adds the scopes directly nested in the statement: the scope itself, the arms of an if or
+    // the body of a loop
+    static void push_nested_scopes(NodeStmt* stmt, std::vector<NodeScope*>& scopes) {
+        if (const auto nested = std::get_if<NodeScope*>(&stmt->var)) {
+            scopes.push_back(*nested);
+        } else if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+            scopes.push_back((*stmt_if)->scope);
+            for (auto pred = (*stmt_if)->pred; pred.has_value();) {
+                if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                    scopes.push_back((*elif)->scope);
+                    pred = (*elif)->pred;
+                } else {
+                    scopes.push_back(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                    pred.reset();
+                }
+            }
+        } else if (const auto stmt_while = std::get_if<NodeStmtWhile*>(&stmt->var)) {
+            scopes.push_back((*stmt_while)->scope);
+        }
+    }
+
+    // Calls fn on the expressions the statement itself evaluates, which for an if are the
+    // conditions of all of its arms
+    template <typename Fn>
+    static void for_each_expr(NodeStmt* stmt, Fn&& fn) {
+        if (const auto stmt_exit = std::get_if<NodeStmtExit*>(&stmt->var)) {
+            fn((*stmt_exit)->expr);
+        } else if (const auto stmt_var = std::get_if<NodeStmtVar*>(&stmt->var)) {
+            fn((*stmt_var)->expr);
+        } else if (const auto assign = std::get_if<NodeStmtAssign*>(&stmt->var)) {
+            fn((*assign)->expr);
+        } else if (const auto stmt_while = std::get_if<NodeStmtWhile*>(&stmt->var)) {
+            fn((*stmt_while)->expr);
+        } else if (const auto stmt_return = std::get_if<NodeStmtReturn*>(&stmt->var)) {
+            fn((*stmt_return)->expr);
+        } else if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+            fn((*stmt_if)->expr);
+            for (auto pred = (*stmt_if)->pred; pred.has_value();) {
+                const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var);
+                if (elif == nullptr) {
+                    break;
+                }
+                fn((*elif)->expr);
+                pred = (*elif)->pred;
+            }
+        }
+    }
+
+    // Calls fn on expr and, unless it returns false, on the operands and arguments nested in it,
+    // with an explicit stack
+    template <typename Fn>
+    static void for_each_node(NodeExpr* expr, Fn&& fn) {
+        std::vector<NodeExpr*> pending { expr };
+        while (!pending.empty()) {
+            NodeExpr* node = pending.back();
+            pending.pop_back();
+            if (!fn(node)) {
+                continue;
+            }
+            if (const auto bin_expr = std::get_if<NodeBinExpr*>(&node->var)) {
+                const auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+                pending.push_back(rhs);
+                pending.push_back(lhs);
+            } else if (const auto paren = std::get_if<NodeTermParen*>(&std::get<NodeTerm*>(node->var)->var)) {
+                pending.push_back((*paren)->expr);
+            } else if (const auto call = std::get_if<NodeTermCall*>(&std::get<NodeTerm*>(node->var)->var)) {
+                pending.insert(pending.end(), (*call)->args.rbegin(), (*call)->args.rend());
+            }
+        }
+    }
+
+    // Name of the variable expr reads if it is one, looking through parentheses
+    [[nodiscard]] static const std::string_view* ident_name(const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&skip_parens(expr)->var);
+        if (term == nullptr) {
+            return nullptr;
+        }
+        const auto ident = std::get_if<NodeTermIdent*>(&(*term)->var);
+        return ident == nullptr ? nullptr : &(*ident)->ident.value;
+    }
+
+    // Value of expr if it is an integer literal, looking through parentheses
+    [[nodiscard]] static std::optional<int64_t> const_value(const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&skip_parens(expr)->var);
+        if (term == nullptr) {
+            return {};
+        }
+        if (const auto int_lit = std::get_if<NodeTermIntLit*>(&(*term)->var)) {
+            return int_lit_value((*int_lit)->int_lit);
+        }
+        return {};
+    }
+
+    // Names of the variables the loop optimizations introduce. Identifiers in the source cannot
+    // contain a '.', so these never clash with them.
+    std::string_view loop_var_name() {
+        return store(".loop" + std::to_string(m_loop_var_count++));
+    }
+
+    // Copies the text of a token the optimizer makes up into the arena, which the AST that
+    // refers to it lives in
+    std::string_view store(const std::string& text) {
+        char* chars = m_allocator.alloc_array<char>(text.size());
+        std::ranges::copy(text, chars);
+        return { chars, text.size() };
+    }
+
+    // Prefixes the name of a variable of an inlined body
+    void rename(Token& ident, const std::string& prefix) {
+        ident.value = store(prefix + std::string(ident.value));
+        ident.symbol = m_symbols.intern(ident.value);
+    }
+
+    [[nodiscard]] Token ident_token(const std::string_view name) {
+        return { TokenType::ident, 0, name, m_symbols.intern(name) };
+    }
+
+    NodeExpr* make_ident(const std::string_view name) {
+        const auto ident = m_allocator.emplace<NodeTermIdent>(ident_token(name));
+        return m_allocator.emplace<NodeExpr>(m_allocator.emplace<NodeTerm>(ident));
+    }
+
+    NodeExpr* make_lit(const int64_t value) {
+        return m_allocator.emplace<NodeExpr>(m_allocator.emplace<NodeTerm>(make_int_lit(value, 0)));
+    }
+
+    template <typename BinExpr>
+    NodeExpr* make_bin_expr(NodeExpr* lhs, NodeExpr* rhs) {
+        const auto bin_expr = m_allocator.emplace<NodeBinExpr>(m_allocator.emplace<BinExpr>(lhs, rhs));
+        return m_allocator.emplace<NodeExpr>(bin_expr);
+    }
+
+    NodeStmt* make_var(const std::string_view name, NodeExpr* expr) {
+        const auto stmt_var = m_allocator.emplace<NodeStmtVar>(ident_token(name), expr);
+        return m_allocator.emplace<NodeStmt>(stmt_var);
+    }
+
+    NodeStmt* make_assign(const std::string_view name, NodeExpr* expr) {
+        const auto assign = m_allocator.emplace<NodeStmtAssign>(ident_token(name), expr);
+        return m_allocator.emplace<NodeStmt>(assign);
+    }
+
+    NodeTermIntLit* make_int_lit(const int64_t value, const int line) {
+        return m_allocator.emplace<NodeTermIntLit>(Token { TokenType::int_lit, line, store(std::to_string(value)) });
+    }
+
+    // The tables are indexed by symbol and grow as larger symbols show up
+    Binding& binding(const Symbol symbol) {
+        if (symbol >= m_bindings.size()) {
+            m_bindings.resize(symbol + 1);
+            m_seen.resize(symbol + 1);
+        }
+        return m_bindings[symbol];
+    }
+
+    // Changes a binding, logging what it was while an if or loop may have to go back to it
+    void set_binding(const Symbol symbol, const Binding binding) {
+        Binding& current = this->binding(symbol);
+        if (m_open_marks > 0) {
+            m_trail.emplace_back(symbol, current);
+        }
+        current = binding;
+    }
+
+    void declare(const Symbol symbol, const std::optional<int64_t> value) {
+        m_declared.emplace_back(symbol, binding(symbol));
+        set_binding(symbol, { .visible = true, .value = value });
+    }
+
+    void begin_scope() {
+        m_scopes.push_back(m_declared.size());
+    }
+
+    // Hides the variables declared in the scope again
+    void end_scope() {
+        while (m_declared.size() > m_scopes.back()) {
+            const auto [symbol, hidden] = m_declared.back();
+            m_declared.pop_back();
+            set_binding(symbol, hidden);
+        }
+        m_scopes.pop_back();
+    }
+
+    // Starts logging the changes to the bindings for an if or loop and returns the point in the
+    // log to go back to
+    size_t open_mark() {
+        m_open_marks++;
+        return m_trail.size();
+    }
+
+    void close_mark() {
+        if (--m_open_marks == 0) {
+            m_trail.clear();
+        }
+    }
+
+    // Restores the bindings to what they were at mark in m_trail
+    void undo(const size_t mark) {
+        while (m_trail.size() > mark) {
+            const auto [symbol, binding] = m_trail.back();
+            m_trail.pop_back();
+            m_bindings[symbol] = binding;
+        }
+    }
+
+    // Loop bodies with more statements than this, nested ones included, are not optimized as
+    // loops, and the values of all variables are forgotten on entering them. This bounds the
+    // time spent on deeply nested loops.
+    static constexpr size_t max_loop_stmts = 256;
+    static constexpr size_t max_derived_vars = 4;
+    // each hoisted expression keeps a register busy for the whole loop
+    static constexpr size_t max_hoisted_exprs = 4;
+    static constexpr size_t unroll_factor = 4;
+    static constexpr size_t max_unroll_stmts = 8;
+    static constexpr uint64_t max_unroll_step = 1 << 20;
+    static constexpr size_t max_inline_nodes = 16;
+    static constexpr size_t max_inline_stmts = 64;
+
+    NodeProg& m_prog;
+    ArenaAllocator& m_allocator;
+    Interner& m_symbols;
+    CompileStats* m_stats;
+    // what is known about the variable of each symbol
+    std::vector<Binding> m_bindings{};
+    // the symbols declared in the open scopes, with the binding each hides, innermost last
+    std::vector<std::pair<Symbol, Binding>> m_declared{};
+    std::vector<size_t> m_scopes{};
+    // the changes to m_bindings while an if or loop is open, with the binding each replaced
+    std::vector<std::pair<Symbol, Binding>> m_trail{};
+    size_t m_open_marks = 0;
+    // per symbol, the generation of add_outcome or finish_if that last saw it and its index there
+    std::vector<std::pair<size_t, size_t>> m_seen{};
+    size_t m_generation = 0;
+    std::vector<Frame> m_frames{};
+    // statements kept by the open lists, innermost last
+    std::vector<NodeStmt*> m_kept{};
+    size_t m_loop_var_count = 0;
+    size_t m_inline_count = 0;
+};
@@ -1,17 +1,43 @@
 #pragma once
 
+#include <charconv>
+#include <cstdint>
+#include <string_view>
 #include <vector>
 #include <optional>
+#include <utility>
 #include <variant>
+#include <string>
 
 #include "./arena.hpp"
 #include "./tokenization.hpp"
 #include "./color.hpp"
+#include "./compile_error.hpp"
 
 struct NodeTermIntLit {
     Token int_lit;
 };
 
+// Values are 64 bit two's complement integers. Literals above INT64_MAX wrap around like they
+// do in the assembler; ones that do not fit 64 bits at all have no value
+inline std::optional<int64_t> int_lit_value(const Token& int_lit) {
+    const std::string_view str = int_lit.value;
+    if (str.starts_with("-")) {
+        int64_t value = 0;
+        const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+        if (ec != std::errc() || ptr != str.data() + str.size()) {
+            return {};
+        }
+        return value;
+    }
+    uint64_t value = 0;
+    const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (ec != std::errc() || ptr != str.data() + str.size()) {
+        return {};
+    }
+    return static_cast<int64_t>(value);
+}
+
 struct NodeTermIdent {
     Token ident;
 };
@@ -42,18 +68,88 @@ struct NodeBinExprSub {
     NodeExpr* rhs;
 };
 
+// The comparisons are 1 if they hold and 0 otherwise
+struct NodeBinExprEq {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprNe {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprLt {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprLe {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprGt {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprGe {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+// && and || are 1 or 0 as well, and only evaluate rhs if lhs does not decide the result
+struct NodeBinExprAnd {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprOr {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
 struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprDiv*, NodeBinExprSub*> var;
+    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprDiv*, NodeBinExprSub*, NodeBinExprEq*, NodeBinExprNe*,
+                 NodeBinExprLt*, NodeBinExprLe*, NodeBinExprGt*, NodeBinExprGe*, NodeBinExprAnd*, NodeBinExprOr*> var;
+};
+
+// Call of a function, the arguments are evaluated from left to right
+struct NodeTermCall {
+    Token ident;
+    std::vector<NodeExpr*> args{};
 };
 
 struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
+    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*, NodeTermCall*> var;
 };
 
 struct NodeExpr {
     std::variant<NodeTerm*, NodeBinExpr*> var;
 };
 
+// The expression inside any number of parentheses around expr
+inline NodeExpr* skip_parens(NodeExpr* expr) {
+    while (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+        const auto paren = std::get_if<NodeTermParen*>(&(*term)->var);
+        if (paren == nullptr) {
+            break;
+        }
+        expr = (*paren)->expr;
+    }
+    return expr;
+}
+
+inline const NodeExpr* skip_parens(const NodeExpr* expr) {
+    return skip_parens(const_cast<NodeExpr*>(expr));
+}
+
+// Left and right operand of any binary expression
+inline std::pair<NodeExpr*, NodeExpr*> bin_expr_operands(const NodeBinExpr* bin_expr) {
+    return std::visit([](const auto* op) { return std::pair { op->lhs, op->rhs }; }, bin_expr->var);
+}
+
 struct NodeStmtExit {
     NodeExpr* expr;
 };
@@ -95,155 +191,320 @@ struct NodeStmtAssign {
     NodeExpr* expr{};
 };
 
+struct NodeStmtWhile {
+    NodeExpr* expr{};
+    NodeScope* scope{};
+};
+
+// Only valid in the body of a function
+struct NodeStmtReturn {
+    NodeExpr* expr{};
+};
+
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtVar*, NodeScope*, NodeStmtIf*, NodeStmtAssign*> var;
+    std::variant<NodeStmtExit*, NodeStmtVar*, NodeScope*, NodeStmtIf*, NodeStmtAssign*, NodeStmtWhile*,
+                 NodeStmtReturn*> var;
+};
+
+// The body sees only the parameters and its own variables. Falling off its end returns 0.
+struct NodeFunction {
+    Token ident;
+    std::vector<Token> params;
+    NodeScope* scope{};
 };
 
+// Parameters are passed in registers, see Generator
+constexpr size_t max_params = 6;
+
 struct NodeProg {
     std::vector<NodeStmt*> stmts;
+    std::vector<NodeFunction*> functions;
 };
 
+// Index of the function called name in prog.functions
+inline std::optional<size_t> find_function(const NodeProg& prog, const std::string_view name) {
+    for (size_t i = 0; i < prog.functions.size(); i++) {
+        if (prog.functions[i]->ident.value == name) {
+            return i;
+        }
+    }
+    return {};
+}
+
+// The call in expr, if expr is nothing but a call
+inline NodeTermCall* call_term(const NodeExpr* expr) {
+    const auto term = std::get_if<NodeTerm*>(&skip_parens(expr)->var);
+    if (term == nullptr) {
+        return nullptr;
+    }
+    const auto call = std::get_if<NodeTermCall*>(&(*term)->var);
+    return call == nullptr ? nullptr : *call;
+}
+
 class Parser {
 public:
-    explicit Parser(std::vector<Token> tokens)
+    // The nodes are allocated in allocator, which the caller owns so it can reset and reuse it
+    // once it is done with the AST
+    Parser(TokenList tokens, ArenaAllocator& allocator)
             : m_tokens(std::move(tokens)),
-              m_allocator(1024 * 1024 * 4) { // 4 megebytes allocated
+              m_allocator(allocator) {
 
     }
 
     void error_expected(const std::string& msg) const {
-        std::cerr << RED <<"[Parse Error] " << YELLOW "Expected " << CYAN << msg << YELLOW << " on line " << CYAN << peek(-1).value().line << RESET << std::endl;
-        exit(EXIT_FAILURE);
+        const Token* last = peek(-1);
+        throw CompileError(RED "[Parse Error] " YELLOW "Expected " CYAN + msg + YELLOW " on line " CYAN + std::to_string(last == nullptr ? 1 : last->line) + RESET);
     }
 
+    // Integer literal or identifier; parenthesised expressions are handled by parse_expr
     std::optional<NodeTerm*> parse_term() {
         if (auto int_lit = try_consume(TokenType::int_lit)) {
-            auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(int_lit.value());
+            auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(*int_lit);
             auto term = m_allocator.emplace<NodeTerm>(term_int_lit);
             return term;
         }
         if (auto ident = try_consume(TokenType::ident)) {
-            auto expr_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
+            auto expr_ident = m_allocator.emplace<NodeTermIdent>(*ident);
             auto term = m_allocator.emplace<NodeTerm>(expr_ident);
             return term;
         }
-        if (const auto open_paren = try_consume(TokenType::l_paren)) {
-            auto expr = parse_expr();
-            if (!expr.has_value()) {
-                error_expected("';'");
-            }
-            try_consume_err(TokenType::r_paren);
-            auto term_paren = m_allocator.emplace<NodeTermParen>(expr.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_paren);
-            return term;
-        }
         return {};
     }
 
-    std::optional<NodeExpr*> parse_expr(const int min_prec = 0) {
-        std::optional<NodeTerm*> term_lhs = parse_term();
-        if (!term_lhs.has_value()) {
-            return {};
-        }
-        auto expr_lhs = m_allocator.emplace<NodeExpr>(term_lhs.value());
-
+    // Operator precedence parsing with explicit operand and operator stacks instead of recursing
+    // per precedence level, parenthesis and call, so the nesting depth of an expression is only
+    // bounded by memory. Operators of equal precedence associate to the left. An open call is an
+    // ident on the operator stack; its arguments are the operands above the base in m_calls. A
+    // prefix ! is pushed like an operator that binds tighter than any binary one.
+    std::optional<NodeExpr*> parse_expr() {
+        [[maybe_unused]] const size_t operands_base = m_operands.size();
+        const size_t operators_base = m_operators.size();
+        size_t open_parens = 0;
         while (true) {
-            std::optional<Token> curr_tok = peek();
-            std::optional<int> prec;
-            if (curr_tok.has_value()) {
-                prec = bin_prec(curr_tok->type);
-                if (!prec.has_value() || prec < min_prec) {
-                    break;
+            // an operand: any number of opening parentheses and calls, then a term
+            std::optional<NodeExpr*> operand;
+            while (!operand.has_value()) {
+                if (try_consume(TokenType::bang)) {
+                    m_operators.push_back(TokenType::bang);
+                    continue;
                 }
+                if (try_consume(TokenType::l_paren)) {
+                    m_operators.push_back(TokenType::l_paren);
+                    open_parens++;
+                    continue;
+                }
+                if (peek() != nullptr && peek()->type == TokenType::ident && peek(1) != nullptr &&
+                    peek(1)->type == TokenType::l_paren) {
+                    const Token ident = consume();
+                    consume();
+                    if (try_consume(TokenType::r_paren)) {
+                        operand = make_call(ident, {});
+                        break;
+                    }
+                    m_operators.push_back(TokenType::ident);
+                    m_calls.push_back({ .ident = ident, .operands_base = m_operands.size() });
+                    open_parens++;
+                    continue;
+                }
+                const std::optional<NodeTerm*> term = parse_term();
+                if (!term.has_value()) {
+                    if (m_operators.size() == operators_base) {
+                        return {};
+                    }
+                    if (m_operators.back() == TokenType::l_paren) {
+                        error_expected("';'");
+                    }
+                    error_expected("legal expression");
+                }
+                operand = m_allocator.emplace<NodeExpr>(term.value());
             }
-            else {
+            m_operands.push_back(operand.value());
+
+            // then closing parentheses and argument separators until a binary operator or the end
+            // of the expression
+            bool next_arg = false;
+            while (open_parens > 0) {
+                if (try_consume(TokenType::r_paren)) {
+                    close_group();
+                    open_parens--;
+                    continue;
+                }
+                if (peek() != nullptr && peek()->type == TokenType::comma) {
+                    while (!is_group(m_operators.back())) {
+                        reduce_bin_expr();
+                    }
+                    if (m_operators.back() != TokenType::ident) {
+                        error_expected(to_string(TokenType::r_paren));
+                    }
+                    consume();
+                    next_arg = true;
+                }
                 break;
             }
-
-            const auto [type, line, value] = consume();
-            const int next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(next_min_prec);
-            if (!expr_rhs.has_value()) {
-                error_expected("legal expression");
-                exit(EXIT_FAILURE);
-            }
-            auto expr = m_allocator.emplace<NodeBinExpr>();
-            auto expr_lhs2 = m_allocator.emplace<NodeExpr>();
-            if (type == TokenType::plus) {
-                expr_lhs2->var = expr_lhs->var;
-                auto add = m_allocator.emplace<NodeBinExprAdd>(expr_lhs2, expr_rhs.value());
-                expr->var = add;
-            }
-            else if (type == TokenType::star) {
-                expr_lhs2->var = expr_lhs->var;
-                auto multi = m_allocator.emplace<NodeBinExprMulti>(expr_lhs2, expr_rhs.value());
-                expr->var = multi;
+            if (next_arg) {
+                continue;
             }
-            else if (type == TokenType::minus) {
-                expr_lhs2->var = expr_lhs->var;
-                auto sub = m_allocator.emplace<NodeBinExprSub>(expr_lhs2, expr_rhs.value());
-                expr->var = sub;
-            }
-            else if (type == TokenType::fslash) {
-                expr_lhs2->var = expr_lhs->var;
-                auto div = m_allocator.emplace<NodeBinExprDiv>(expr_lhs2, expr_rhs.value());
-                expr->var = div;
+            const Token* curr_tok = peek();
+            const std::optional<int> prec = curr_tok != nullptr ? bin_prec(curr_tok->type) : std::nullopt;
+            if (!prec.has_value()) {
+                break;
             }
-            else {
-                assert(false); // unreachable
+            while (m_operators.size() > operators_base && !is_group(m_operators.back()) &&
+                   stack_prec(m_operators.back()) >= prec.value()) {
+                reduce_bin_expr();
             }
-            expr_lhs->var = expr;
+            m_operators.push_back(consume().type);
+        }
+        if (open_parens > 0) {
+            try_consume_err(TokenType::r_paren);
         }
-        return expr_lhs;
+        while (m_operators.size() > operators_base) {
+            reduce_bin_expr();
+        }
+        assert(m_operands.size() == operands_base + 1);
+        NodeExpr* expr = m_operands.back();
+        m_operands.pop_back();
+        return expr;
     }
 
+    // Parses a scope including everything nested in it, see parse_nested
     std::optional<NodeScope*> parse_scope() {
-        if (!try_consume(TokenType::l_curly).has_value()) {
+        if (!try_consume(TokenType::l_curly)) {
             return {};
         }
         auto scope = m_allocator.emplace<NodeScope>();
-        while (auto stmt = parse_stmt()) {
-            scope->stmts.push_back(stmt.value());
-        }
-        try_consume_err(TokenType::r_curly);
+        std::vector<OpenScope> open { { .scope = scope } };
+        parse_nested(open);
         return scope;
     }
 
+    // Parses the elif/else chain of an if statement including everything nested in it
     std::optional<NodeIfPred*> parse_if_pred() {
+        std::optional<NodeIfPred*> pred;
+        std::vector<OpenScope> open;
+        open_if_pred(pred, open);
+        parse_nested(open);
+        return pred;
+    }
+
+    // Parses a statement including everything nested in it, see parse_nested
+    std::optional<NodeStmt*> parse_stmt() {
+        std::vector<OpenScope> open;
+        const std::optional<NodeStmt*> stmt = parse_stmt_head(open);
+        parse_nested(open);
+        return stmt;
+    }
+
+    // fn name(param, ...) { ... }, only at the top level of the program
+    std::optional<NodeFunction*> parse_function() {
+        if (!try_consume(TokenType::fn)) {
+            return {};
+        }
+        auto function = m_allocator.emplace<NodeFunction>();
+        function->ident = try_consume_err(TokenType::ident);
+        try_consume_err(TokenType::l_paren);
+        if (!try_consume(TokenType::r_paren)) {
+            do {
+                if (function->params.size() == max_params) {
+                    error_expected("at most " + std::to_string(max_params) + " parameters");
+                }
+                function->params.push_back(try_consume_err(TokenType::ident));
+            } while (try_consume(TokenType::comma));
+            try_consume_err(TokenType::r_paren);
+        }
+        if (!try_consume(TokenType::l_curly)) {
+            error_expected("valid SCOPE {scope}");
+        }
+        function->scope = m_allocator.emplace<NodeScope>();
+        std::vector<OpenScope> open { { .scope = function->scope } };
+        m_in_function = true;
+        parse_nested(open);
+        m_in_function = false;
+        return function;
+    }
+
+    std::optional<NodeProg> parse_prog() {
+        NodeProg prog;
+        while (peek() != nullptr) {
+            if (auto function = parse_function()) {
+                prog.functions.push_back(function.value());
+            }
+            else if (auto stmt = parse_stmt()) {
+                prog.stmts.push_back(stmt.value());
+            }
+            else {
+                error_expected("valid statement");
+            }
+        }
+        return prog;
+    }
+
+private:
+
+    // A scope whose closing brace has not been reached yet. pred is the link to fill with the
+    // elif/else chain that may follow the scope, if it is the body of an if or elif.
+    struct OpenScope {
+        NodeScope* scope;
+        std::optional<NodeIfPred*>* pred = nullptr;
+    };
+
+    // Fills the open scopes, innermost first, until all of them are closed. Nested scopes are
+    // pushed onto open rather than parsed recursively, so the nesting depth is only bounded by
+    // memory.
+    void parse_nested(std::vector<OpenScope>& open) {
+        while (!open.empty()) {
+            if (try_consume(TokenType::r_curly)) {
+                std::optional<NodeIfPred*>* pred = open.back().pred;
+                open.pop_back();
+                if (pred != nullptr) {
+                    open_if_pred(*pred, open);
+                }
+                continue;
+            }
+            NodeScope* scope = open.back().scope;
+            const std::optional<NodeStmt*> stmt = parse_stmt_head(open);
+            if (!stmt.has_value()) {
+                try_consume_err(TokenType::r_curly);
+            }
+            scope->stmts.push_back(stmt.value());
+        }
+    }
+
+    // Parses the head of an elif or else arm, if there is one, into pred and opens its scope
+    void open_if_pred(std::optional<NodeIfPred*>& pred, std::vector<OpenScope>& open) {
         if (try_consume(TokenType::elif)) {
             try_consume_err(TokenType::l_paren);
-            const auto elif = m_allocator.alloc<NodeIfPredElif>();
+            const auto elif = m_allocator.emplace<NodeIfPredElif>();
             if (const auto expr = parse_expr()) {
                 elif->expr = expr.value();
             } else {
                 error_expected("expression in PAREN (expr)");
             }
             try_consume_err(TokenType::r_paren);
-            if (const auto scope = parse_scope()) {
-                elif->scope = scope.value();
-            } else {
+            if (!try_consume(TokenType::l_curly)) {
                 error_expected("SCOPE {scope}");
             }
-            elif->pred = parse_if_pred();
-            auto pred = m_allocator.emplace<NodeIfPred>(elif);
-            return pred;
+            elif->scope = m_allocator.emplace<NodeScope>();
+            pred = m_allocator.emplace<NodeIfPred>(elif);
+            open.push_back({ .scope = elif->scope, .pred = &elif->pred });
+            return;
         }
         if (try_consume(TokenType::else_)) {
-            auto else_ = m_allocator.alloc<NodeIfPredElse>();
-            if (const auto scope = parse_scope()) {
-                else_->scope = scope.value();
-            } else {
+            auto else_ = m_allocator.emplace<NodeIfPredElse>();
+            if (!try_consume(TokenType::l_curly)) {
                 error_expected("SCOPE {scope}");
             }
-            auto pred = m_allocator.emplace<NodeIfPred>(else_);
-            return pred;
+            else_->scope = m_allocator.emplace<NodeScope>();
+            pred = m_allocator.emplace<NodeIfPred>(else_);
+            open.push_back({ .scope = else_->scope });
         }
-        return {};
     }
 
-    std::optional<NodeStmt*> parse_stmt() {
-        if ( (peek().has_value()) && (peek().value().type == TokenType::exit) && (peek(1).has_value()) &&
-            (peek(1).value().type == TokenType::l_paren)) {
+    // Parses one statement. A scope it opens is pushed onto open with no statements in it yet,
+    // for parse_nested to fill.
+    std::optional<NodeStmt*> parse_stmt_head(std::vector<OpenScope>& open) {
+        if ( (peek() != nullptr) && (peek()->type == TokenType::exit) && (peek(1) != nullptr) &&
+            (peek(1)->type == TokenType::l_paren)) {
             consume();
             consume();
             auto stmt_exit = m_allocator.emplace<NodeStmtExit>();
@@ -260,9 +521,9 @@ public:
             stmt->var = stmt_exit;
             return stmt;
         }
-        if ((peek().has_value() && peek().value().type == TokenType::var) && // var
-            (peek(1).has_value() && peek(1).value().type == TokenType::ident) && // var 'abc'
-            (peek(2).has_value() && peek(2).value().type == TokenType::eq)) { // var 'abc =
+        if ((peek() != nullptr && peek()->type == TokenType::var) && // var
+            (peek(1) != nullptr && peek(1)->type == TokenType::ident) && // var 'abc'
+            (peek(2) != nullptr && peek(2)->type == TokenType::eq)) { // var 'abc =
             consume();
             auto stmt_var = m_allocator.emplace<NodeStmtVar>();
             stmt_var->ident = consume();
@@ -279,9 +540,9 @@ public:
             stmt->var = stmt_var;
             return stmt;
         }
-        if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value() &&
-            peek(1).value().type == TokenType::eq) {
-            const auto assign = m_allocator.alloc<NodeStmtAssign>();
+        if (peek() != nullptr && peek()->type == TokenType::ident && peek(1) != nullptr &&
+            peek(1)->type == TokenType::eq) {
+            const auto assign = m_allocator.emplace<NodeStmtAssign>();
             assign->ident = consume();
             consume();
             if (const auto expr = parse_expr()) {
@@ -293,14 +554,13 @@ public:
             auto stmt = m_allocator.emplace<NodeStmt>(assign);
             return stmt;
         }
-        if (peek().has_value() && peek().value().type == TokenType::l_curly) {
-            if (auto scope = parse_scope()) {
-                auto stmt = m_allocator.emplace<NodeStmt>(scope.value());
-                return stmt;
-            }
-            error_expected("valid SCOPE {scope}");
+        if (try_consume(TokenType::l_curly)) {
+            auto scope = m_allocator.emplace<NodeScope>();
+            open.push_back({ .scope = scope });
+            auto stmt = m_allocator.emplace<NodeStmt>(scope);
+            return stmt;
         }
-        if (auto if_ = try_consume(TokenType::if_)) {
+        if (try_consume(TokenType::if_)) {
             try_consume_err(TokenType::l_paren);
             auto stmt_if = m_allocator.emplace<NodeStmtIf>();
             if (const auto expr = parse_expr()) {
@@ -309,61 +569,177 @@ public:
                 error_expected("valid expression");
             }
             try_consume_err(TokenType::r_paren);
-            if (const auto scope = parse_scope()) {
-                stmt_if->scope = scope.value();
-            } else {
+            if (!try_consume(TokenType::l_curly)) {
                 error_expected("valid SCOPE {scope}");
             }
-            stmt_if->pred = parse_if_pred();
+            stmt_if->scope = m_allocator.emplace<NodeScope>();
+            // the elif/else chain follows once the scope is closed
+            open.push_back({ .scope = stmt_if->scope, .pred = &stmt_if->pred });
             auto stmt = m_allocator.emplace<NodeStmt>(stmt_if);
             return stmt;
         }
+        if (try_consume(TokenType::while_)) {
+            try_consume_err(TokenType::l_paren);
+            auto stmt_while = m_allocator.emplace<NodeStmtWhile>();
+            if (const auto expr = parse_expr()) {
+                stmt_while->expr = expr.value();
+            } else {
+                error_expected("valid expression");
+            }
+            try_consume_err(TokenType::r_paren);
+            if (!try_consume(TokenType::l_curly)) {
+                error_expected("valid SCOPE {scope}");
+            }
+            stmt_while->scope = m_allocator.emplace<NodeScope>();
+            open.push_back({ .scope = stmt_while->scope });
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_while);
+            return stmt;
+        }
+        if (m_in_function && try_consume(TokenType::return_)) {
+            auto stmt_return = m_allocator.emplace<NodeStmtReturn>();
+            if (const auto expr = parse_expr()) {
+                stmt_return->expr = expr.value();
+            } else {
+                error_expected("valid expression");
+            }
+            try_consume_err(TokenType::semi);
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_return);
+            return stmt;
+        }
         return {};
     }
 
-    std::optional<NodeProg> parse_prog() {
-        NodeProg prog;
-        while (peek().has_value()) {
-            if (auto stmt = parse_stmt()) {
-                prog.stmts.push_back(stmt.value());
-            }
-            else {
-                error_expected("valid statement");
-            }
+    // Opening parenthesis or call on the operator stack of parse_expr
+    static bool is_group(const TokenType type) {
+        return type == TokenType::l_paren || type == TokenType::ident;
+    }
+
+    // Precedence of an operator on the stack of parse_expr; the prefix ! binds tightest
+    static int stack_prec(const TokenType type) {
+        return type == TokenType::bang ? bin_prec(TokenType::star).value() + 1 : bin_prec(type).value();
+    }
+
+    // Reduces the innermost parenthesis or call on the operator stack into a single operand
+    void close_group() {
+        while (!is_group(m_operators.back())) {
+            reduce_bin_expr();
         }
-        return prog;
+        const TokenType type = m_operators.back();
+        m_operators.pop_back();
+        if (type == TokenType::l_paren) {
+            auto term_paren = m_allocator.emplace<NodeTermParen>(m_operands.back());
+            m_operands.back() = m_allocator.emplace<NodeExpr>(m_allocator.emplace<NodeTerm>(term_paren));
+            return;
+        }
+        const OpenCall call = m_calls.back();
+        m_calls.pop_back();
+        std::vector<NodeExpr*> args(m_operands.begin() + static_cast<std::ptrdiff_t>(call.operands_base), m_operands.end());
+        m_operands.resize(call.operands_base);
+        m_operands.push_back(make_call(call.ident, std::move(args)));
     }
 
-private:
+    NodeExpr* make_call(const Token& ident, std::vector<NodeExpr*> args) {
+        auto term_call = m_allocator.emplace<NodeTermCall>(ident, std::move(args));
+        return m_allocator.emplace<NodeExpr>(m_allocator.emplace<NodeTerm>(term_call));
+    }
+
+    // Pops the top two operands and replaces them with the top operator applied to them. A !
+    // applies to the top operand alone: !e is e == 0.
+    void reduce_bin_expr() {
+        const TokenType type = m_operators.back();
+        m_operators.pop_back();
+        auto expr = m_allocator.emplace<NodeBinExpr>();
+        if (type == TokenType::bang) {
+            const Token zero { TokenType::int_lit, peek(-1)->line, "0" };
+            NodeExpr* rhs = m_allocator.emplace<NodeExpr>(m_allocator.emplace<NodeTerm>(m_allocator.emplace<NodeTermIntLit>(zero)));
+            expr->var = m_allocator.emplace<NodeBinExprEq>(m_operands.back(), rhs);
+            m_operands.back() = m_allocator.emplace<NodeExpr>(expr);
+            return;
+        }
+        NodeExpr* rhs = m_operands.back();
+        m_operands.pop_back();
+        NodeExpr* lhs = m_operands.back();
+        if (type == TokenType::plus) {
+            expr->var = m_allocator.emplace<NodeBinExprAdd>(lhs, rhs);
+        }
+        else if (type == TokenType::star) {
+            expr->var = m_allocator.emplace<NodeBinExprMulti>(lhs, rhs);
+        }
+        else if (type == TokenType::minus) {
+            expr->var = m_allocator.emplace<NodeBinExprSub>(lhs, rhs);
+        }
+        else if (type == TokenType::fslash) {
+            expr->var = m_allocator.emplace<NodeBinExprDiv>(lhs, rhs);
+        }
+        else if (type == TokenType::eq_eq) {
+            expr->var = m_allocator.emplace<NodeBinExprEq>(lhs, rhs);
+        }
+        else if (type == TokenType::bang_eq) {
+            expr->var = m_allocator.emplace<NodeBinExprNe>(lhs, rhs);
+        }
+        else if (type == TokenType::lt) {
+            expr->var = m_allocator.emplace<NodeBinExprLt>(lhs, rhs);
+        }
+        else if (type == TokenType::lt_eq) {
+            expr->var = m_allocator.emplace<NodeBinExprLe>(lhs, rhs);
+        }
+        else if (type == TokenType::gt) {
+            expr->var = m_allocator.emplace<NodeBinExprGt>(lhs, rhs);
+        }
+        else if (type == TokenType::gt_eq) {
+            expr->var = m_allocator.emplace<NodeBinExprGe>(lhs, rhs);
+        }
+        else if (type == TokenType::and_and) {
+            expr->var = m_allocator.emplace<NodeBinExprAnd>(lhs, rhs);
+        }
+        else if (type == TokenType::or_or) {
+            expr->var = m_allocator.emplace<NodeBinExprOr>(lhs, rhs);
+        }
+        else {
+            assert(false); // unreachable
+        }
+        m_operands.back() = m_allocator.emplace<NodeExpr>(expr);
+    }
 
-    [[nodiscard]] std::optional<Token> peek(const int offset = 0) const {
+    // Lookahead hands out pointers into m_tokens, which does not change while parsing
+    [[nodiscard]] const Token* peek(const int offset = 0) const {
         if (m_index + offset >= m_tokens.size()) {
-            return {};
+            return nullptr;
         }
-        return m_tokens.at(m_index + offset);
+        return &m_tokens[m_index + offset];
     }
 
-    Token consume() {
-        return m_tokens.at(m_index++);
+    const Token& consume() {
+        return m_tokens[m_index++];
     }
 
-    Token try_consume_err(const TokenType type) {
-        if (peek().has_value() && peek().value().type == type) {
+    const Token& try_consume_err(const TokenType type) {
+        if (peek() != nullptr && peek()->type == type) {
             return consume();
         }
         error_expected(to_string(type));
-        return {};
+        return m_tokens[m_index];
     }
 
-    std::optional<Token> try_consume(const TokenType type) {
-        if (peek().has_value() && peek().value().type == type) {
-            return consume();
+    const Token* try_consume(const TokenType type) {
+        if (peek() != nullptr && peek()->type == type) {
+            return &consume();
         }
-        return {};
+        return nullptr;
     }
 
-    const std::vector<Token> m_tokens;
+    const TokenList m_tokens;
     size_t m_index = 0;
-
-    ArenaAllocator m_allocator;
+    // the stacks of parse_expr, kept across calls to reuse their storage
+    std::vector<NodeExpr*> m_operands{};
+    std::vector<TokenType> m_operators{};
+    // a call that parse_expr has not seen the closing parenthesis of
+    struct OpenCall {
+        Token ident;
+        size_t operands_base;
+    };
+    std::vector<OpenCall> m_calls{};
+    bool m_in_function = false;
+
+    ArenaAllocator& m_allocator;
 };
\ No newline at end of file
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "./assembly.hpp"
+
+// A rewrite of a few adjacent instructions. rewrite looks at the last size instructions of the
+// output and, if they match, returns whether it applied and leaves the replacement in out.
+// Labels are instructions too, so a window never matches across a jump target.
+struct PeepholeRule {
+    std::string_view name;
+    size_t size;
+    bool (*rewrite)(std::span<const Instr> window, std::vector<Instr>& out);
+};
+
+namespace peephole_rules {
+
+    [[nodiscard]] inline bool is_reg(const Operand& operand, const Reg reg) {
+        const auto operand_reg = std::get_if<Reg>(&operand);
+        return operand_reg != nullptr && *operand_reg == reg;
+    }
+
+    [[nodiscard]] inline bool is_imm(const Operand& operand, const int64_t value) {
+        const auto imm = std::get_if<int64_t>(&operand);
+        return imm != nullptr && *imm == value;
+    }
+
+    // push r; pop r
+    inline bool push_pop_same(const std::span<const Instr> window, std::vector<Instr>&) {
+        return window[0].op == Op::push && window[1].op == Op::pop && is_reg(window[0].dst, std::get<Reg>(window[1].dst));
+    }
+
+    // push x; pop r -> mov r, x. An rsp based x is read before the push moves rsp, and the pop
+    // moves it back, so the address stays the same.
+    inline bool push_pop_move(const std::span<const Instr> window, std::vector<Instr>& out) {
+        if (window[0].op != Op::push || window[1].op != Op::pop) {
+            return false;
+        }
+        out.push_back({ .op = Op::mov, .dst = window[1].dst, .src = window[0].dst });
+        return true;
+    }
+
+    // add/sub rsp, 0. The flags of an rsp adjustment are never read: every jcc and setcc tests
+    // the flags of a test, cmp or arithmetic op on a value, so dropping it is safe.
+    inline bool add_zero(const std::span<const Instr> window, std::vector<Instr>&) {
+        return (window[0].op == Op::add || window[0].op == Op::sub) && is_reg(window[0].dst, Reg::rsp) && is_imm(window[0].src, 0);
+    }
+
+    // add rsp, a; add rsp, b -> add rsp, a + b
+    inline bool add_rsp_fold(const std::span<const Instr> window, std::vector<Instr>& out) {
+        for (const Instr& instr : window) {
+            if (instr.op != Op::add || !is_reg(instr.dst, Reg::rsp) || !std::holds_alternative<int64_t>(instr.src)) {
+                return false;
+            }
+        }
+        const int64_t sum = std::get<int64_t>(window[0].src) + std::get<int64_t>(window[1].src);
+        if (sum > std::numeric_limits<int32_t>::max()) {
+            return false;
+        }
+        out.push_back({ .op = Op::add, .dst = Reg::rsp, .src = sum });
+        return true;
+    }
+
+    // mov r, r
+    inline bool mov_self(const std::span<const Instr> window, std::vector<Instr>&) {
+        const auto dst = std::get_if<Reg>(&window[0].dst);
+        return window[0].op == Op::mov && dst != nullptr && is_reg(window[0].src, *dst);
+    }
+
+    // jmp l; l:
+    inline bool jmp_next(const std::span<const Instr> window, std::vector<Instr>& out) {
+        if (window[0].op != Op::jmp || window[1].op != Op::label ||
+            std::get<Label>(window[0].dst).id != std::get<Label>(window[1].dst).id) {
+            return false;
+        }
+        out.push_back(window[1]);
+        return true;
+    }
+
+}
+
+// Every rule, in the order they are tried
+inline constexpr std::array default_peephole_rules = {
+    PeepholeRule { .name = "push_pop_same", .size = 2, .rewrite = peephole_rules::push_pop_same },
+    PeepholeRule { .name = "push_pop_move", .size = 2, .rewrite = peephole_rules::push_pop_move },
+    PeepholeRule { .name = "add_zero", .size = 1, .rewrite = peephole_rules::add_zero },
+    PeepholeRule { .name = "add_rsp_fold", .size = 2, .rewrite = peephole_rules::add_rsp_fold },
+    PeepholeRule { .name = "mov_self", .size = 1, .rewrite = peephole_rules::mov_self },
+    PeepholeRule { .name = "jmp_next", .size = 2, .rewrite = peephole_rules::jmp_next },
+};
+
+// Rewrites the instruction list with a window sliding over it. Every instruction is appended to
+// the output, then the rules are tried on the end of the output until none applies, so the
+// result of a rewrite is looked at again together with what precedes it: push a; push b; pop b;
+// pop a goes away completely in one pass.
+class Peephole {
+public:
+    explicit Peephole(const std::span<const PeepholeRule> rules = default_peephole_rules)
+        : m_rules(rules),
+          m_hits(rules.size(), 0) {
+
+    }
+
+    [[nodiscard]] std::vector<Instr> run(const std::vector<Instr>& instrs) {
+        std::vector<Instr> out;
+        out.reserve(instrs.size());
+        std::vector<Instr> replacement;
+        for (const Instr& instr : instrs) {
+            out.push_back(instr);
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (size_t i = 0; i < m_rules.size(); i++) {
+                    const PeepholeRule& rule = m_rules[i];
+                    if (out.size() < rule.size) {
+                        continue;
+                    }
+                    replacement.clear();
+                    const std::span<const Instr> window(out.end() - static_cast<std::ptrdiff_t>(rule.size), out.end());
+                    if (!rule.rewrite(window, replacement)) {
+                        continue;
+                    }
+                    out.resize(out.size() - rule.size);
+                    out.insert(out.end(), replacement.begin(), replacement.end());
+                    m_hits[i]++;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        return out;
+    }
+
+    [[nodiscard]] std::span<const PeepholeRule> rules() const {
+        return m_rules;
+    }
+
+    // How often each rule applied, by index in rules()
+    [[nodiscard]] const std::vector<size_t>& hits() const {
+        return m_hits;
+    }
+
+private:
+    std::span<const PeepholeRule> m_rules;
+    std::vector<size_t> m_hits;
+};
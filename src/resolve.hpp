@@ -0,0 +1,407 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <variant>
+#include <vector>
+#include <string>
+
+#include "./compile_error.hpp"
+#include "./parser.hpp"
+#include "./flat_ast.hpp"
+
+// Binds every name in the program and lowers it to the FlatAst the generators work on: variable
+// uses and assignments get the slot of their variable, calls the index of their function. Slots
+// number the variables visible at a point in declaration order, the way the generators stack
+// them up, so the generators find a variable by indexing instead of searching by name. All name
+// errors of the program, and literals out of range, are reported here.
+class Resolver {
+public:
+    explicit Resolver(const NodeProg& prog)
+        : m_prog(prog) {
+
+    }
+
+    [[nodiscard]] FlatAst resolve_prog() {
+        resolve_functions();
+        begin_scope();
+        m_ast.main = lower_stmts(m_prog.stmts);
+        end_scope();
+        // a function sees only its parameters and its own variables
+        for (const NodeFunction* function : m_prog.functions) {
+            begin_scope();
+            for (const Token& param : function->params) {
+                declare(param);
+            }
+            const ListRef body = lower_stmts(function->scope->stmts);
+            end_scope();
+            m_ast.functions.push_back({ .param_count = static_cast<uint32_t>(function->params.size()), .body = body });
+        }
+        return std::move(m_ast);
+    }
+
+    // Reports the errors resolve_prog would and drops the lowered program. The driver runs this
+    // before the optimizer, which may remove the code an error is in, so that whether a program
+    // compiles does not depend on -O. A Resolver resolves a program once.
+    void check_prog() {
+        static_cast<void>(resolve_prog());
+    }
+
+private:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    // Where the ref of a node goes once the node has been added: an element of one of the
+    // columns of m_ast, which may grow in the meantime
+    struct Link {
+        std::vector<uint32_t>* column;
+        size_t index;
+    };
+
+    struct StmtWork {
+        const NodeStmt* stmt;
+        Link link;
+    };
+
+    struct ScopeWork {
+        const NodeScope* scope;
+        Link link;
+    };
+
+    struct ExprWork {
+        const NodeExpr* expr;
+        Link link;
+    };
+
+    struct PredWork {
+        const NodeIfPred* pred;
+        Link link;
+    };
+
+    // Declares the variable once its initializer has been resolved
+    struct DeclareWork {
+        const Token* ident;
+    };
+
+    struct EndScopeWork {};
+
+    using Work = std::variant<StmtWork, ScopeWork, ExprWork, PredWork, DeclareWork, EndScopeWork>;
+
+    // Exits if two functions have the same name
+    void resolve_functions() {
+        for (size_t i = 0; i < m_prog.functions.size(); i++) {
+            const Token& ident = m_prog.functions[i]->ident;
+            uint32_t& function = entry(m_functions, ident.symbol);
+            if (function != none) {
+                throw CompileError("Function already declared: " + std::string(ident.value));
+            }
+            function = static_cast<uint32_t>(i);
+        }
+    }
+
+    // Lowers the statements and everything nested in them, in the order the generators visit
+    // them. Like the other walks over the AST this uses an explicit stack, not recursion.
+    ListRef lower_stmts(const std::vector<NodeStmt*>& stmts) {
+        const ListRef list = push_stmts(stmts);
+        while (!m_work.empty()) {
+            const Work work = m_work.back();
+            m_work.pop_back();
+            if (const auto stmt_work = std::get_if<StmtWork>(&work)) {
+                lower_stmt_head(*stmt_work);
+            } else if (const auto scope_work = std::get_if<ScopeWork>(&work)) {
+                lower_scope(*scope_work);
+            } else if (const auto expr_work = std::get_if<ExprWork>(&work)) {
+                lower_expr_head(*expr_work);
+            } else if (const auto pred_work = std::get_if<PredWork>(&work)) {
+                lower_pred_head(*pred_work);
+            } else if (const auto declare_work = std::get_if<DeclareWork>(&work)) {
+                declare(*declare_work->ident);
+            } else {
+                end_scope();
+            }
+        }
+        return list;
+    }
+
+    // Adds a list of count refs to be filled in later
+    ListRef add_list(const size_t count) {
+        const auto list = static_cast<ListRef>(m_ast.lists.size());
+        m_ast.lists.push_back(static_cast<uint32_t>(count));
+        m_ast.lists.resize(m_ast.lists.size() + count, no_node);
+        return list;
+    }
+
+    // Adds a list for the statements and queues them to fill it in; the work stack runs them
+    // front to back
+    ListRef push_stmts(const std::vector<NodeStmt*>& stmts) {
+        const ListRef list = add_list(stmts.size());
+        for (size_t i = stmts.size(); i-- > 0;) {
+            m_work.emplace_back(StmtWork { .stmt = stmts[i], .link = { .column = &m_ast.lists, .index = list + 1 + i } });
+        }
+        return list;
+    }
+
+    void lower_scope(const ScopeWork& work) {
+        begin_scope();
+        m_work.emplace_back(EndScopeWork {});
+        set(work.link, push_stmts(work.scope->stmts));
+    }
+
+    StmtRef add_stmt(const StmtKind kind, const Link link, const uint32_t b = 0) {
+        const auto stmt = static_cast<StmtRef>(m_ast.stmt_kinds.size());
+        m_ast.stmt_kinds.push_back(kind);
+        m_ast.stmt_a.push_back(no_node);
+        m_ast.stmt_b.push_back(b);
+        m_ast.stmt_c.push_back(no_node);
+        set(link, stmt);
+        return stmt;
+    }
+
+    ExprRef add_expr(const ExprKind kind, const Link link, const uint32_t a = no_node, const uint32_t b = no_node) {
+        const auto expr = static_cast<ExprRef>(m_ast.expr_kinds.size());
+        m_ast.expr_kinds.push_back(kind);
+        m_ast.expr_a.push_back(a);
+        m_ast.expr_b.push_back(b);
+        set(link, expr);
+        return expr;
+    }
+
+    static void set(const Link link, const uint32_t ref) {
+        (*link.column)[link.index] = ref;
+    }
+
+    // Queues expr to be lowered into column a of stmt
+    void push_stmt_expr(const NodeExpr* expr, const StmtRef stmt) {
+        m_work.emplace_back(ExprWork { .expr = expr, .link = { .column = &m_ast.stmt_a, .index = stmt } });
+    }
+
+    void push_if(const NodeExpr* expr, const NodeScope* scope, const std::optional<NodeIfPred*> pred, const StmtRef stmt) {
+        if (pred.has_value()) {
+            m_work.emplace_back(PredWork { .pred = pred.value(), .link = { .column = &m_ast.stmt_c, .index = stmt } });
+        }
+        m_work.emplace_back(ScopeWork { .scope = scope, .link = { .column = &m_ast.stmt_b, .index = stmt } });
+        push_stmt_expr(expr, stmt);
+    }
+
+    void lower_stmt_head(const StmtWork& work) {
+        struct StmtVisitor {
+            Resolver& resolver;
+            Link link;
+
+            void operator()(const NodeStmtExit* stmt_exit) const {
+                resolver.push_stmt_expr(stmt_exit->expr, resolver.add_stmt(StmtKind::exit, link));
+            }
+
+            // the initializer does not see the variable yet
+            void operator()(const NodeStmtVar* stmt_var) const {
+                const StmtRef stmt = resolver.add_stmt(StmtKind::var, link);
+                resolver.m_work.emplace_back(DeclareWork { .ident = &stmt_var->ident });
+                resolver.push_stmt_expr(stmt_var->expr, stmt);
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const {
+                const uint32_t slot = resolver.lookup(stmt_assign->ident);
+                if (slot == none) {
+                    throw CompileError("Undeclared identifier " + std::string(source_name(stmt_assign->ident.value)) + " found");
+                }
+                resolver.push_stmt_expr(stmt_assign->expr, resolver.add_stmt(StmtKind::assign, link, slot));
+            }
+
+            void operator()(const NodeScope* scope) const {
+                const StmtRef stmt = resolver.add_stmt(StmtKind::scope, link);
+                resolver.lower_scope({ .scope = scope, .link = { .column = &resolver.m_ast.stmt_b, .index = stmt } });
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const {
+                const StmtRef stmt = resolver.add_stmt(StmtKind::if_, link);
+                resolver.push_if(stmt_if->expr, stmt_if->scope, stmt_if->pred, stmt);
+            }
+
+            // the body is generated before the condition, see Generator
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                const StmtRef stmt = resolver.add_stmt(StmtKind::while_, link);
+                resolver.push_stmt_expr(stmt_while->expr, stmt);
+                resolver.m_work.emplace_back(ScopeWork { .scope = stmt_while->scope, .link = { .column = &resolver.m_ast.stmt_b, .index = stmt } });
+            }
+
+            void operator()(const NodeStmtReturn* stmt_return) const {
+                resolver.push_stmt_expr(stmt_return->expr, resolver.add_stmt(StmtKind::return_, link));
+            }
+        };
+
+        StmtVisitor visitor { .resolver = *this, .link = work.link };
+        std::visit(visitor, work.stmt->var);
+    }
+
+    // An elif becomes an if in the else position of the one before, an else a scope
+    void lower_pred_head(const PredWork& work) {
+        if (const auto elif = std::get_if<NodeIfPredElif*>(&work.pred->var)) {
+            const StmtRef stmt = add_stmt(StmtKind::if_, work.link);
+            push_if((*elif)->expr, (*elif)->scope, (*elif)->pred, stmt);
+            return;
+        }
+        const StmtRef stmt = add_stmt(StmtKind::scope, work.link);
+        m_work.emplace_back(ScopeWork {
+            .scope = std::get<NodeIfPredElse*>(work.pred->var)->scope,
+            .link = { .column = &m_ast.stmt_b, .index = stmt } });
+    }
+
+    // Operands are queued right to left so they are lowered left to right. Parentheses only
+    // group, so they are dropped.
+    void lower_expr_head(const ExprWork& work) {
+        if (const auto bin_expr = std::get_if<NodeBinExpr*>(&work.expr->var)) {
+            const auto [lhs, rhs] = bin_expr_operands(*bin_expr);
+            const ExprRef expr = add_expr(bin_kind(*bin_expr), work.link);
+            m_work.emplace_back(ExprWork { .expr = rhs, .link = { .column = &m_ast.expr_b, .index = expr } });
+            m_work.emplace_back(ExprWork { .expr = lhs, .link = { .column = &m_ast.expr_a, .index = expr } });
+            return;
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(work.expr->var);
+        if (const auto int_lit = std::get_if<NodeTermIntLit*>(&term->var)) {
+            const Token& token = (*int_lit)->int_lit;
+            const auto value = int_lit_value(token);
+            if (!value.has_value()) {
+                throw CompileError("Integer literal out of range on line " + std::to_string(token.line) + ": " + std::string(token.value));
+            }
+            const auto bits = static_cast<uint64_t>(value.value());
+            add_expr(ExprKind::int_lit, work.link, static_cast<uint32_t>(bits), static_cast<uint32_t>(bits >> 32));
+        } else if (const auto ident = std::get_if<NodeTermIdent*>(&term->var)) {
+            const uint32_t slot = lookup((*ident)->ident);
+            if (slot == none) {
+                throw CompileError("Undeclared identifier: " + std::string(source_name((*ident)->ident.value)));
+            }
+            add_expr(ExprKind::ident, work.link, slot);
+        } else if (const auto paren = std::get_if<NodeTermParen*>(&term->var)) {
+            m_work.emplace_back(ExprWork { .expr = (*paren)->expr, .link = work.link });
+        } else {
+            const NodeTermCall* call = std::get<NodeTermCall*>(term->var);
+            const uint32_t function = resolve_call(call);
+            const ListRef args = add_list(call->args.size());
+            add_expr(ExprKind::call, work.link, function, args);
+            for (size_t i = call->args.size(); i-- > 0;) {
+                m_work.emplace_back(ExprWork { .expr = call->args[i], .link = { .column = &m_ast.lists, .index = args + 1 + i } });
+            }
+        }
+    }
+
+    static ExprKind bin_kind(const NodeBinExpr* bin_expr) {
+        struct BinExprVisitor {
+            ExprKind operator()(const NodeBinExprAdd*) const {
+                return ExprKind::add;
+            }
+
+            ExprKind operator()(const NodeBinExprSub*) const {
+                return ExprKind::sub;
+            }
+
+            ExprKind operator()(const NodeBinExprMulti*) const {
+                return ExprKind::mul;
+            }
+
+            ExprKind operator()(const NodeBinExprDiv*) const {
+                return ExprKind::div;
+            }
+
+            ExprKind operator()(const NodeBinExprEq*) const {
+                return ExprKind::eq;
+            }
+
+            ExprKind operator()(const NodeBinExprNe*) const {
+                return ExprKind::ne;
+            }
+
+            ExprKind operator()(const NodeBinExprLt*) const {
+                return ExprKind::lt;
+            }
+
+            ExprKind operator()(const NodeBinExprLe*) const {
+                return ExprKind::le;
+            }
+
+            ExprKind operator()(const NodeBinExprGt*) const {
+                return ExprKind::gt;
+            }
+
+            ExprKind operator()(const NodeBinExprGe*) const {
+                return ExprKind::ge;
+            }
+
+            ExprKind operator()(const NodeBinExprAnd*) const {
+                return ExprKind::and_;
+            }
+
+            ExprKind operator()(const NodeBinExprOr*) const {
+                return ExprKind::or_;
+            }
+        };
+
+        return std::visit(BinExprVisitor {}, bin_expr->var);
+    }
+
+    // Index of the function called. Exits if there is no such function or the number of
+    // arguments does not match.
+    uint32_t resolve_call(const NodeTermCall* call) {
+        const uint32_t function = entry(m_functions, call->ident.symbol);
+        if (function == none) {
+            throw CompileError("Undeclared function: " + std::string(call->ident.value));
+        }
+        const size_t params = m_prog.functions[function]->params.size();
+        if (params != call->args.size()) {
+            throw CompileError("Function " + std::string(call->ident.value) + " takes " + std::to_string(params) + " arguments, " +
+                               std::to_string(call->args.size()) + " given");
+        }
+        return function;
+    }
+
+    // The name a variable has in the source. The optimizer renames the variables of a function
+    // body it inlines to .inline<n>.<name>, possibly more than once, while the source names
+    // cannot contain a dot.
+    [[nodiscard]] static std::string_view source_name(const std::string_view name) {
+        return name.substr(name.rfind('.') + 1);
+    }
+
+    // Names cannot be shadowed, so a symbol stands for at most one visible variable and the
+    // slot table needs one entry per symbol
+    void declare(const Token& ident) {
+        uint32_t& slot = entry(m_slots, ident.symbol);
+        if (slot != none) {
+            throw CompileError("Identifier already declared: " + std::string(source_name(ident.value)));
+        }
+        slot = static_cast<uint32_t>(m_declared.size());
+        m_declared.push_back(ident.symbol);
+    }
+
+    [[nodiscard]] uint32_t lookup(const Token& ident) {
+        return entry(m_slots, ident.symbol);
+    }
+
+    void begin_scope() {
+        m_scopes.push_back(m_declared.size());
+    }
+
+    void end_scope() {
+        for (size_t i = m_scopes.back(); i < m_declared.size(); i++) {
+            m_slots[m_declared[i]] = none;
+        }
+        m_declared.resize(m_scopes.back());
+        m_scopes.pop_back();
+    }
+
+    // The tables are indexed by symbol and grow as larger symbols show up
+    static uint32_t& entry(std::vector<uint32_t>& table, const Symbol symbol) {
+        if (symbol >= table.size()) {
+            table.resize(symbol + 1, none);
+        }
+        return table[symbol];
+    }
+
+    const NodeProg& m_prog;
+    FlatAst m_ast{};
+    std::vector<Work> m_work{};
+    // slot of the visible variable of each symbol, or none
+    std::vector<uint32_t> m_slots{};
+    // function of each symbol, or none
+    std::vector<uint32_t> m_functions{};
+    // symbols of the visible variables, by slot
+    std::vector<Symbol> m_declared{};
+    std::vector<size_t> m_scopes{};
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Incremental SHA-256 (FIPS 180-4), used to key the compilation cache
+class Sha256 {
+public:
+    void update(const std::string_view data) {
+        for (const char c : data) {
+            m_block[m_block_size++] = static_cast<uint8_t>(c);
+            if (m_block_size == m_block.size()) {
+                compress();
+                m_block_size = 0;
+            }
+        }
+        m_length += data.size();
+    }
+
+    // Lowercase hex digest; the object must not be updated afterwards
+    [[nodiscard]] std::string hex_digest() {
+        const uint64_t bit_length = m_length * 8;
+        update(std::string_view("\x80", 1));
+        while (m_block_size != 56) {
+            update(std::string_view("\0", 1));
+        }
+        for (int i = 7; i >= 0; i--) {
+            m_block[m_block_size++] = static_cast<uint8_t>(bit_length >> (8 * i));
+        }
+        compress();
+
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (const uint32_t word : m_state) {
+            for (int i = 28; i >= 0; i -= 4) {
+                hex += digits[(word >> i) & 0xF];
+            }
+        }
+        return hex;
+    }
+
+private:
+    void compress() {
+        static constexpr std::array<uint32_t, 64> k = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        std::array<uint32_t, 64> w{};
+        for (size_t i = 0; i < 16; i++) {
+            w[i] = static_cast<uint32_t>(m_block[i * 4]) << 24 | static_cast<uint32_t>(m_block[i * 4 + 1]) << 16 |
+                   static_cast<uint32_t>(m_block[i * 4 + 2]) << 8 | static_cast<uint32_t>(m_block[i * 4 + 3]);
+        }
+        for (size_t i = 16; i < 64; i++) {
+            const uint32_t s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        auto [a, b, c, d, e, f, g, h] = m_state;
+        for (size_t i = 0; i < 64; i++) {
+            const uint32_t s1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+            const uint32_t ch = (e & f) ^ (~e & g);
+            const uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            const uint32_t s0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+            const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            const uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+        m_state[4] += e;
+        m_state[5] += f;
+        m_state[6] += g;
+        m_state[7] += h;
+    }
+
+    std::array<uint32_t, 8> m_state {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::array<uint8_t, 64> m_block{};
+    size_t m_block_size = 0;
+    uint64_t m_length = 0;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "./compile_error.hpp"
+
+// The contents of a source file, mapped read only into memory. Tokens point into the mapping
+// instead of copying their text, so it has to outlive the tokens and the AST built from them.
+// Files that cannot be mapped, like pipes, are read into memory instead.
+class SourceFile {
+public:
+    explicit SourceFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw CompileError("Could not open " + path);
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                // the tokenizer reads it front to back once
+                madvise(mapping, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+                m_mapping = mapping;
+                m_size = static_cast<size_t>(st.st_size);
+                close(fd);
+                return;
+            }
+        }
+        char buffer[1 << 16];
+        ssize_t count = 0;
+        while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+            m_fallback.append(buffer, static_cast<size_t>(count));
+        }
+        close(fd);
+        if (count < 0) {
+            throw CompileError("Could not read " + path);
+        }
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    ~SourceFile() {
+        if (m_mapping != nullptr) {
+            munmap(m_mapping, m_size);
+        }
+    }
+
+    [[nodiscard]] std::string_view contents() const {
+        if (m_mapping != nullptr) {
+            return { static_cast<const char*>(m_mapping), m_size };
+        }
+        return m_fallback;
+    }
+
+private:
+    void* m_mapping = nullptr;
+    size_t m_size = 0;
+    std::string m_fallback{};
+};
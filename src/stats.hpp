@@ -0,0 +1,278 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "./heap_counters.hpp"
+#include "./parser.hpp"
+
+// Compile time statistics of one input: wall time, heap use and peak RSS per phase
+// (--time-passes) and size counters of the things the phases produce (--stats).
+class CompileStats {
+public:
+    struct Phase {
+        std::string name;
+        double wall_ms = 0;
+        uint64_t allocations = 0;
+        uint64_t allocated_bytes = 0;
+        // process wide high water mark at the end of the phase
+        uint64_t peak_rss_kb = 0;
+    };
+
+    explicit CompileStats(std::string input_path)
+        : m_input_path(std::move(input_path)) {
+
+    }
+
+    // Runs fn as the named phase and returns what it returns. A phase run more than once, like a
+    // loop pass that runs for every loop, adds up into one entry. A phase run inside another one
+    // is also part of the outer one.
+    template <typename Fn>
+    decltype(auto) time(std::string name, Fn&& fn) {
+        const HeapCounters::Snapshot heap_before = heap_counters.snapshot();
+        const auto start = std::chrono::steady_clock::now();
+        struct Record {
+            CompileStats& stats;
+            std::string name;
+            HeapCounters::Snapshot heap_before;
+            std::chrono::steady_clock::time_point start;
+
+            ~Record() {
+                const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                const HeapCounters::Snapshot heap_after = heap_counters.snapshot();
+                const auto it = std::ranges::find_if(stats.m_phases, [&](const Phase& phase) { return phase.name == name; });
+                Phase& phase = it != stats.m_phases.end() ? *it : stats.m_phases.emplace_back(Phase { .name = std::move(name) });
+                phase.wall_ms += elapsed.count();
+                phase.allocations += heap_after.allocations - heap_before.allocations;
+                phase.allocated_bytes += heap_after.bytes - heap_before.bytes;
+                phase.peak_rss_kb = peak_rss_kb();
+            }
+        };
+        const Record record { .stats = *this, .name = std::move(name), .heap_before = heap_before, .start = start };
+        return fn();
+    }
+
+    void count(std::string name, const uint64_t value) {
+        m_counters.emplace_back(std::move(name), value);
+    }
+
+    // Counts the nodes of the AST by type
+    void count_ast(const NodeProg& prog) {
+        AstCounter counter;
+        counter.count_stmts(prog.stmts);
+        for (const NodeFunction* function : prog.functions) {
+            counter.bump("fn");
+            counter.count_stmts(function->scope->stmts);
+        }
+        for (const auto& [name, value] : counter.counts) {
+            count("nodes." + name, value);
+        }
+    }
+
+    [[nodiscard]] const std::vector<std::pair<std::string, uint64_t>>& counters() const {
+        return m_counters;
+    }
+
+    void print_text(std::ostream& out, const bool phases, const bool counters) const {
+        out << "=== " << m_input_path << " ===\n";
+        if (phases) {
+            char line[128];
+            std::snprintf(line, sizeof(line), "  %-20s %10s %10s %12s %10s\n", "phase", "wall ms", "allocs", "alloc bytes", "peak KiB");
+            out << line;
+            for (const Phase& phase : m_phases) {
+                std::snprintf(line, sizeof(line), "  %-20s %10.3f %10llu %12llu %10llu\n", phase.name.c_str(), phase.wall_ms,
+                              static_cast<unsigned long long>(phase.allocations),
+                              static_cast<unsigned long long>(phase.allocated_bytes),
+                              static_cast<unsigned long long>(phase.peak_rss_kb));
+                out << line;
+            }
+        }
+        if (counters) {
+            for (const auto& [name, value] : m_counters) {
+                out << "  " << name << ": " << value << "\n";
+            }
+        }
+    }
+
+    void print_json(std::ostream& out, const bool phases, const bool counters) const {
+        out << "{\"input\": \"" << json_escape(m_input_path) << "\"";
+        if (phases) {
+            out << ", \"phases\": [";
+            for (size_t i = 0; i < m_phases.size(); i++) {
+                const Phase& phase = m_phases[i];
+                out << (i == 0 ? "" : ", ") << "{\"name\": \"" << phase.name << "\", \"wall_ms\": " << phase.wall_ms
+                    << ", \"allocations\": " << phase.allocations << ", \"allocated_bytes\": " << phase.allocated_bytes
+                    << ", \"peak_rss_kb\": " << phase.peak_rss_kb << "}";
+            }
+            out << "]";
+        }
+        if (counters) {
+            out << ", \"counters\": {";
+            for (size_t i = 0; i < m_counters.size(); i++) {
+                out << (i == 0 ? "" : ", ") << "\"" << m_counters[i].first << "\": " << m_counters[i].second;
+            }
+            out << "}";
+        }
+        out << "}";
+    }
+
+private:
+
+    // Walks the AST with an explicit stack of the nodes left to visit, so deeply nested programs
+    // do not exhaust the native stack
+    struct AstCounter {
+        using Node = std::variant<const NodeStmt*, const NodeScope*, const NodeIfPred*, const NodeExpr*>;
+
+        std::vector<std::pair<std::string, uint64_t>> counts {
+            { "exit", 0 }, { "var", 0 }, { "assign", 0 }, { "scope", 0 }, { "if", 0 }, { "elif", 0 }, { "else", 0 }, { "while", 0 },
+            { "fn", 0 }, { "call", 0 }, { "return", 0 },
+            { "add", 0 }, { "sub", 0 }, { "mul", 0 }, { "div", 0 }, { "eq", 0 }, { "ne", 0 }, { "lt", 0 }, { "le", 0 },
+            { "gt", 0 }, { "ge", 0 }, { "and", 0 }, { "or", 0 }, { "int_lit", 0 }, { "ident", 0 }, { "paren", 0 }
+        };
+        std::vector<Node> pending{};
+
+        void bump(const std::string& name) {
+            for (auto& [count_name, value] : counts) {
+                if (count_name == name) {
+                    value++;
+                    return;
+                }
+            }
+        }
+
+        void count_stmts(const std::vector<NodeStmt*>& stmts) {
+            pending.assign(stmts.begin(), stmts.end());
+            while (!pending.empty()) {
+                const Node node = pending.back();
+                pending.pop_back();
+                std::visit([&](const auto* n) { count(n); }, node);
+            }
+        }
+
+        void count(const NodeExpr* expr) {
+            struct ExprVisitor {
+                AstCounter& counter;
+
+                void operator()(const NodeTerm* term) const {
+                    if (std::holds_alternative<NodeTermIntLit*>(term->var)) {
+                        counter.bump("int_lit");
+                    } else if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+                        counter.bump("ident");
+                    } else if (const auto call = std::get_if<NodeTermCall*>(&term->var)) {
+                        counter.bump("call");
+                        counter.pending.insert(counter.pending.end(), (*call)->args.begin(), (*call)->args.end());
+                    } else {
+                        counter.bump("paren");
+                        counter.pending.emplace_back(std::get<NodeTermParen*>(term->var)->expr);
+                    }
+                }
+
+                void operator()(const NodeBinExpr* bin_expr) const {
+                    static constexpr const char* names[] = { "add", "mul", "div", "sub", "eq", "ne", "lt", "le", "gt", "ge", "and", "or" };
+                    counter.bump(names[bin_expr->var.index()]);
+                    const auto [lhs, rhs] = bin_expr_operands(bin_expr);
+                    counter.pending.emplace_back(lhs);
+                    counter.pending.emplace_back(rhs);
+                }
+            };
+
+            std::visit(ExprVisitor { .counter = *this }, expr->var);
+        }
+
+        void count(const NodeScope* scope) {
+            bump("scope");
+            pending.insert(pending.end(), scope->stmts.begin(), scope->stmts.end());
+        }
+
+        void count(const NodeIfPred* pred) {
+            if (const auto elif = std::get_if<NodeIfPredElif*>(&pred->var)) {
+                bump("elif");
+                pending.emplace_back((*elif)->expr);
+                pending.emplace_back((*elif)->scope);
+                if ((*elif)->pred.has_value()) {
+                    pending.emplace_back((*elif)->pred.value());
+                }
+            } else {
+                bump("else");
+                pending.emplace_back(std::get<NodeIfPredElse*>(pred->var)->scope);
+            }
+        }
+
+        void count(const NodeStmt* stmt) {
+            struct StmtVisitor {
+                AstCounter& counter;
+
+                void operator()(const NodeStmtExit* stmt_exit) const {
+                    counter.bump("exit");
+                    counter.pending.emplace_back(stmt_exit->expr);
+                }
+
+                void operator()(const NodeStmtVar* stmt_var) const {
+                    counter.bump("var");
+                    counter.pending.emplace_back(stmt_var->expr);
+                }
+
+                void operator()(const NodeStmtAssign* stmt_assign) const {
+                    counter.bump("assign");
+                    counter.pending.emplace_back(stmt_assign->expr);
+                }
+
+                void operator()(const NodeScope* scope) const {
+                    counter.pending.emplace_back(scope);
+                }
+
+                void operator()(const NodeStmtIf* stmt_if) const {
+                    counter.bump("if");
+                    counter.pending.emplace_back(stmt_if->expr);
+                    counter.pending.emplace_back(stmt_if->scope);
+                    if (stmt_if->pred.has_value()) {
+                        counter.pending.emplace_back(stmt_if->pred.value());
+                    }
+                }
+
+                void operator()(const NodeStmtWhile* stmt_while) const {
+                    counter.bump("while");
+                    counter.pending.emplace_back(stmt_while->expr);
+                    counter.pending.emplace_back(stmt_while->scope);
+                }
+
+                void operator()(const NodeStmtReturn* stmt_return) const {
+                    counter.bump("return");
+                    counter.pending.emplace_back(stmt_return->expr);
+                }
+            };
+
+            std::visit(StmtVisitor { .counter = *this }, stmt->var);
+        }
+    };
+
+    static uint64_t peak_rss_kb() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<uint64_t>(usage.ru_maxrss);
+    }
+
+    static std::string json_escape(const std::string& str) {
+        std::string escaped;
+        for (const char c : str) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    std::string m_input_path;
+    std::vector<Phase> m_phases{};
+    std::vector<std::pair<std::string, uint64_t>> m_counters{};
+};
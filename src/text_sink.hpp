@@ -0,0 +1,139 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "./compile_error.hpp"
+
+// Destinations for generated text, like the nasm source of write_nasm. Every sink takes strings,
+// single characters and integers; integers are formatted with std::to_chars, not through
+// iostreams.
+
+// Characters of the longest int64_t, -9223372036854775808
+inline constexpr std::size_t max_int_chars = 20;
+
+// Collects the text in a string
+class StringSink {
+public:
+    void append(const std::string_view text) {
+        m_text.append(text);
+    }
+
+    void append(const char c) {
+        m_text.push_back(c);
+    }
+
+    void append_int(const int64_t value) {
+        char digits[max_int_chars];
+        const auto result = std::to_chars(digits, digits + max_int_chars, value);
+        m_text.append(digits, result.ptr);
+    }
+
+    [[nodiscard]] std::string take() {
+        return std::move(m_text);
+    }
+
+private:
+    std::string m_text{};
+};
+
+// Writes the text to a file through a buffer allocated once up front, which is handed to the
+// kernel whenever it fills up, so the memory used stays the same however much text goes through.
+class FileSink {
+public:
+    static constexpr std::size_t default_buffer_bytes = 64 * 1024;
+
+    explicit FileSink(std::string path, const std::size_t buffer_bytes = default_buffer_bytes)
+        : m_path(std::move(path)),
+          m_capacity(std::max(buffer_bytes, max_int_chars)),
+          m_buffer(std::make_unique_for_overwrite<char[]>(m_capacity)) {
+        m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            throw CompileError("Could not open " + m_path + " for writing");
+        }
+    }
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    // A destructor cannot report a failed write, so call flush() first to learn whether the
+    // last of the text made it to the file
+    ~FileSink() {
+        try {
+            flush();
+        } catch (const CompileError&) {
+        }
+        close(m_fd);
+    }
+
+    void append(const std::string_view text) {
+        if (text.size() > m_capacity - m_size) {
+            flush();
+            // too large to buffer at all
+            if (text.size() > m_capacity) {
+                write_all(text);
+                return;
+            }
+        }
+        std::memcpy(m_buffer.get() + m_size, text.data(), text.size());
+        m_size += text.size();
+    }
+
+    void append(const char c) {
+        if (m_size == m_capacity) {
+            flush();
+        }
+        m_buffer[m_size++] = c;
+    }
+
+    // Formats straight into the buffer
+    void append_int(const int64_t value) {
+        if (m_capacity - m_size < max_int_chars) {
+            flush();
+        }
+        const auto result = std::to_chars(m_buffer.get() + m_size, m_buffer.get() + m_capacity, value);
+        m_size = static_cast<std::size_t>(result.ptr - m_buffer.get());
+    }
+
+    void flush() {
+        write_all({ m_buffer.get(), m_size });
+        m_size = 0;
+    }
+
+    // Bytes appended so far, buffered or not
+    [[nodiscard]] std::size_t bytes() const {
+        return m_written + m_size;
+    }
+
+private:
+    void write_all(std::string_view text) {
+        while (!text.empty()) {
+            const ssize_t count = write(m_fd, text.data(), text.size());
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                throw CompileError("Could not write " + m_path);
+            }
+            text.remove_prefix(static_cast<std::size_t>(count));
+            m_written += static_cast<std::size_t>(count);
+        }
+    }
+
+    std::string m_path;
+    int m_fd = -1;
+    std::size_t m_capacity;
+    std::unique_ptr<char[]> m_buffer;
+    std::size_t m_size = 0;
+    std::size_t m_written = 0;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "./heap_counters.hpp"
+
+// Work stealing thread pool. Every worker owns a deque: it takes its own work from the back
+// and, once that runs dry, steals from the front of the others' deques, so a worker stuck on
+// one large input does not hold up the jobs queued behind it. What a job allocates is added to
+// the heap counters of the thread that submitted it, which has to outlive the job.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count = std::thread::hardware_concurrency()) {
+        thread_count = std::max<size_t>(thread_count, 1);
+        for (size_t i = 0; i < thread_count; i++) {
+            m_queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < thread_count; i++) {
+            m_workers.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopping = true;
+        }
+        m_work_available.notify_all();
+        for (std::thread& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    // Jobs are dealt out to the workers round robin
+    void submit(std::function<void()> job) {
+        Queue& queue = *m_queues[m_next_queue++ % m_queues.size()];
+        {
+            std::lock_guard lock(queue.mutex);
+            queue.jobs.push_back({ .run = std::move(job), .submitter = &heap_counters });
+        }
+        {
+            std::lock_guard lock(m_mutex);
+            m_pending++;
+            m_queued++;
+        }
+        m_work_available.notify_one();
+    }
+
+    // Blocks until every submitted job has finished
+    void wait() {
+        std::unique_lock lock(m_mutex);
+        m_all_done.wait(lock, [this] { return m_pending == 0; });
+    }
+
+    [[nodiscard]] size_t size() const {
+        return m_workers.size();
+    }
+
+private:
+    struct Job {
+        std::function<void()> run;
+        HeapCounters* submitter;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    // A job from the back of the worker's own deque, else from the front of another one
+    std::optional<Job> take(const size_t self) {
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            Queue& queue = *m_queues[(self + i) % m_queues.size()];
+            std::lock_guard lock(queue.mutex);
+            if (queue.jobs.empty()) {
+                continue;
+            }
+            std::optional<Job> job;
+            if (i == 0) {
+                job = std::move(queue.jobs.back());
+                queue.jobs.pop_back();
+            } else {
+                job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+            }
+            std::lock_guard count_lock(m_mutex);
+            m_queued--;
+            return job;
+        }
+        return {};
+    }
+
+    void work(const size_t self) {
+        while (true) {
+            if (std::optional<Job> job = take(self)) {
+                const HeapCounters::Snapshot heap_before = heap_counters.snapshot();
+                job->run();
+                const HeapCounters::Snapshot heap_after = heap_counters.snapshot();
+                job->submitter->add(heap_after.allocations - heap_before.allocations, heap_after.bytes - heap_before.bytes);
+                std::lock_guard lock(m_mutex);
+                if (--m_pending == 0) {
+                    m_all_done.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock lock(m_mutex);
+            m_work_available.wait(lock, [this] { return m_stopping || m_queued > 0; });
+            // queued jobs are still run when the pool is being destroyed
+            if (m_stopping && m_queued == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> m_queues{};
+    std::vector<std::thread> m_workers{};
+    std::atomic<size_t> m_next_queue = 0;
+    std::mutex m_mutex{};
+    std::condition_variable m_work_available{};
+    std::condition_variable m_all_done{};
+    // submitted jobs that have not finished, and those of them still sitting in a deque
+    size_t m_pending = 0;
+    size_t m_queued = 0;
+    bool m_stopping = false;
+};
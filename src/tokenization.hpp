@@ -1,9 +1,22 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "./compile_error.hpp"
+#include "./char_scan.hpp"
+#include "./interner.hpp"
+#include "./thread_pool.hpp"
 
 enum class TokenType {
     exit,
@@ -22,7 +35,20 @@ enum class TokenType {
     r_curly,
     if_,
     elif,
-    else_
+    else_,
+    while_,
+    fn,
+    return_,
+    comma,
+    eq_eq,
+    bang_eq,
+    lt,
+    lt_eq,
+    gt,
+    gt_eq,
+    and_and,
+    or_or,
+    bang
 };
 
 inline std::string to_string(const TokenType type) {
@@ -61,174 +87,392 @@ inline std::string to_string(const TokenType type) {
             return "'elif'";
         case TokenType::else_:
             return "'else'";
+        case TokenType::while_:
+            return "'while'";
+        case TokenType::fn:
+            return "'fn'";
+        case TokenType::return_:
+            return "'return'";
+        case TokenType::comma:
+            return "','";
+        case TokenType::eq_eq:
+            return "'=='";
+        case TokenType::bang_eq:
+            return "'!='";
+        case TokenType::lt:
+            return "'<'";
+        case TokenType::lt_eq:
+            return "'<='";
+        case TokenType::gt:
+            return "'>'";
+        case TokenType::gt_eq:
+            return "'>='";
+        case TokenType::and_and:
+            return "'&&'";
+        case TokenType::or_or:
+            return "'||'";
+        case TokenType::bang:
+            return "'!'";
     }
     assert(false);
+    return "";
 }
 
 inline std::optional<int> bin_prec(const TokenType type) {
     switch (type) {
+        case TokenType::or_or:
+            return 0;
+        case TokenType::and_and:
+            return 1;
+        case TokenType::eq_eq:
+        case TokenType::bang_eq:
+            return 2;
+        case TokenType::lt:
+        case TokenType::lt_eq:
+        case TokenType::gt:
+        case TokenType::gt_eq:
+            return 3;
         case TokenType::plus:
         case TokenType::minus:
-            return 0;
+            return 4;
         case TokenType::star:
         case TokenType::fslash:
-            return 1;
+            return 5;
         default:
             return {};
     }
 }
 
+// Identifiers and literals carry their text as a view into the source (or, for names the
+// optimizer makes up, into its arena), so tokens are trivially copyable and never allocate.
+// Identifiers are also interned at lex time. Tokens without a text, like { type, line }, get an
+// empty value and symbol 0.
 struct Token {
     TokenType type;
     int line;
-    std::optional<std::string> value{};
+    std::string_view value = {};
+    Symbol symbol = 0;
 };
 
+// Leaves trivially copyable elements it constructs without arguments uninitialised, so that
+// resizing a vector of tokens does not write (and fault in) the memory before the parallel
+// tokenizer fills it. Tokens are aggregates, which are implicit lifetime types: allocating their
+// storage is enough to create them.
+template <typename T>
+struct UninitializedAllocator : std::allocator<T> {
+    template <typename U>
+    struct rebind {
+        using other = UninitializedAllocator<U>;
+    };
+
+    UninitializedAllocator() = default;
+
+    template <typename U>
+    explicit UninitializedAllocator(const UninitializedAllocator<U>&) noexcept {
+
+    }
+
+    template <typename U>
+    void construct(U* pointer) noexcept(std::is_nothrow_default_constructible_v<U>) {
+        if constexpr (!std::is_trivially_copyable_v<U>) {
+            ::new (static_cast<void*>(pointer)) U;
+        }
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* pointer, Args&&... args) {
+        ::new (static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+    }
+};
+
+using TokenList = std::vector<Token, UninitializedAllocator<Token>>;
+
+// Perfect hash of the keywords: no two of them hash to the same slot, so a word is a keyword
+// if and only if it equals the one in its slot
+struct Keyword {
+    std::string_view word;
+    TokenType type;
+};
+
+[[nodiscard]] constexpr size_t keyword_hash(const std::string_view word) {
+    return (word.size() * 4 + static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back())) & 15;
+}
+
+inline constexpr std::array<Keyword, 16> keyword_table = [] {
+    constexpr Keyword keywords[] = {
+        { "exit", TokenType::exit }, { "var", TokenType::var }, { "if", TokenType::if_ }, { "elif", TokenType::elif },
+        { "else", TokenType::else_ }, { "while", TokenType::while_ }, { "fn", TokenType::fn }, { "return", TokenType::return_ }
+    };
+    std::array<Keyword, 16> table{};
+    for (const Keyword& keyword : keywords) {
+        if (!table[keyword_hash(keyword.word)].word.empty()) {
+            throw "keyword_hash has a collision";
+        }
+        table[keyword_hash(keyword.word)] = keyword;
+    }
+    return table;
+}();
+
+// Token types of the single character tokens other than ';', indexed by the character. '&' and
+// '|' only come in pairs (see punct_pairs).
+inline constexpr std::array<TokenType, 128> punct_types = [] {
+    std::array<TokenType, 128> types{};
+    types['('] = TokenType::l_paren;
+    types[')'] = TokenType::r_paren;
+    types[','] = TokenType::comma;
+    types['='] = TokenType::eq;
+    types['*'] = TokenType::star;
+    types['/'] = TokenType::fslash;
+    types['+'] = TokenType::plus;
+    types['-'] = TokenType::minus;
+    types['{'] = TokenType::l_curly;
+    types['}'] = TokenType::r_curly;
+    types['!'] = TokenType::bang;
+    types['<'] = TokenType::lt;
+    types['>'] = TokenType::gt;
+    return types;
+}();
+
+// The two character tokens, indexed by their first character
+struct PunctPair {
+    char second;
+    TokenType type;
+};
+
+inline constexpr std::array<PunctPair, 128> punct_pairs = [] {
+    std::array<PunctPair, 128> pairs{};
+    pairs['='] = { '=', TokenType::eq_eq };
+    pairs['!'] = { '=', TokenType::bang_eq };
+    pairs['<'] = { '=', TokenType::lt_eq };
+    pairs['>'] = { '=', TokenType::gt_eq };
+    pairs['&'] = { '&', TokenType::and_and };
+    pairs['|'] = { '|', TokenType::or_or };
+    return pairs;
+}();
+
+// Dispatches on a table of character classes instead of testing each kind of token in turn, and
+// skips runs of identifier characters, digits, whitespace and comment bodies with the widest
+// vector scanners the CPU supports (see char_scan.hpp).
+//
+// Large inputs can be split into chunks that are tokenized on several threads. Chunks start
+// after a newline, where no token or ;; comment can continue, but a ;* comment can. Every chunk
+// is first tokenized as if it started outside a comment; a chunk whose predecessor turns out to
+// end inside one is tokenized again once that is known. Line numbers within a chunk count from
+// its start and are moved by the newlines before it when the chunks are joined. Each chunk
+// interns its identifiers on its own; joining the chunks' interners in order hands out the same
+// symbols as interning in one piece, so the result is the same as tokenizing in one piece.
 class Tokenizer {
 public:
-    explicit Tokenizer(std::string src) : m_src(std::move(src)) {
+    // chunks of the parallel tokenizer are at least this large by default
+    static constexpr size_t default_min_chunk_bytes = 4 * 1024 * 1024;
+
+    // src is not copied; it has to outlive the tokens
+    explicit Tokenizer(const std::string_view src) : m_src(src) {
 
     }
 
-    std::vector<Token> tokenize() {
-        std::string buf;
-        std::vector<Token> tokens;
-        int line_count = 1;
+    TokenList tokenize() {
+        return tokenize(detect_scan_isa());
+    }
 
-        while (peek().has_value()) {
-            if (std::isalpha(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value())) {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit") {
-                    tokens.push_back({ TokenType::exit, line_count});
-                    buf.clear();
-                }
-                else if (buf == "var") {
-                    tokens.push_back({ TokenType::var, line_count});
-                    buf.clear();
-                }
-                else if (buf == "if") {
-                    tokens.push_back({ TokenType::if_, line_count});
-                    buf.clear();
-                }
-                else if (buf == "elif") {
-                    tokens.push_back({ TokenType::elif, line_count});
-                    buf.clear();
-                }
-                else if (buf == "else") {
-                    tokens.push_back({ TokenType::else_, line_count});
-                    buf.clear();
-                }
-                else {
-                    tokens.push_back({ TokenType::ident, line_count,  buf});
-                    buf.clear();
-                }
-            }
-            else if (std::isdigit(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(consume());
-                }
-                tokens.push_back({ TokenType::int_lit, line_count,  buf});
-                buf.clear();
-            }
-            else if (peek().value() == ';' && peek(1).has_value() && peek(1).value() == ';') {
-                consume();
-                consume();
-                while (peek().has_value() && peek().value() != '\n') {
-                    consume();
-                }
-            }
-            else if (peek().value() == ';' && peek(1).has_value() && peek(1).value() == '*') {
-                consume();
-                consume();
-                while (peek().has_value()) {
-                    if (peek().value() == '*' && peek(1).has_value() && peek(1).value() == ';') {
-                        break;
-                    }
-                    consume();
-                }
-                if (peek().has_value()) {
-                    consume();
-                }
+    // The symbols of the identifiers tokenize found, which the optimizer adds the names it makes
+    // up to
+    [[nodiscard]] Interner& symbols() {
+        return m_symbols;
+    }
 
-                if (peek().has_value()) {
-                    consume();
-                }
+    // With the scanners for isa, which the CPU has to support, on up to threads threads
+    TokenList tokenize(const ScanIsa isa, const size_t threads = 1, const size_t min_chunk_bytes = default_min_chunk_bytes) {
+        const size_t chunk_count = std::clamp<size_t>(m_src.size() / std::max<size_t>(min_chunk_bytes, 1), 1, std::max<size_t>(threads, 1));
+        std::vector<Chunk> chunks = split(chunk_count);
+        if (chunks.size() == 1) {
+            lex(isa, chunks.front());
+            check(chunks.front(), 0);
+            m_symbols = std::move(chunks.front().symbols);
+            return std::move(chunks.front().tokens);
+        }
 
+        ThreadPool pool(chunks.size());
+        for (Chunk& chunk : chunks) {
+            pool.submit([&] { lex(isa, chunk); });
+        }
+        pool.wait();
 
+        // the first chunk starts outside a comment; where the guess for a later one was wrong,
+        // it is tokenized again
+        int line_offset = 0;
+        size_t token_offset = 0;
+        std::vector<std::pair<int, size_t>> offsets;
+        std::vector<std::vector<Symbol>> symbols(chunks.size());
+        m_symbols = {};
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const bool in_comment = i > 0 && chunks[i - 1].ends_in_comment;
+            if (chunks[i].in_comment != in_comment) {
+                chunks[i] = { .begin = chunks[i].begin, .end = chunks[i].end, .in_comment = in_comment };
+                lex(isa, chunks[i]);
             }
-            else if (peek().value() == '(') {
-                consume();
-                tokens.push_back({ TokenType::l_paren, line_count});
-            }
-            else if (peek().value() == ')') {
-                consume();
-                tokens.push_back({ TokenType::r_paren, line_count});
-            }
-            else if (peek().value() == ';') {
-                consume();
-                tokens.push_back({ TokenType::semi, line_count});
-            }
-            else if (peek().value() == '=') {
-                consume();
-                tokens.push_back({ TokenType::eq, line_count});
-            }
-            else if (peek().value() == '*') {
-                consume();
-                tokens.push_back({ TokenType::star, line_count});
-            }
-            else if (peek().value() == '/') {
-                consume();
-                tokens.push_back({ TokenType::fslash, line_count});
-            }
-            else if (peek().value() == '+') {
-                consume();
-                tokens.push_back({ TokenType::plus, line_count});
-            }
-            else if (peek().value() == '-') {
-                consume();
-                tokens.push_back({ TokenType::minus, line_count});
-            }
-            else if (peek().value() == '{') {
-                consume();
-                tokens.push_back({ TokenType::l_curly, line_count});
-            }
-            else if (peek().value() == '}') {
-                consume();
-                tokens.push_back({ TokenType::r_curly, line_count});
-            }
-            else if (peek().value() == '\n') {
-                consume();
-                line_count++;
-            }
-            else if (std::isspace(peek().value())) {
-                consume();
-            }
-            else {
-                std::cerr << "Incorrect syntax on line " << line_count << std::endl;
-                exit(EXIT_FAILURE);
+            check(chunks[i], line_offset);
+            offsets.emplace_back(line_offset, token_offset);
+            line_offset += chunks[i].newlines;
+            token_offset += chunks[i].tokens.size();
+            for (Symbol symbol = 0; symbol < chunks[i].symbols.size(); symbol++) {
+                symbols[i].push_back(m_symbols.intern(chunks[i].symbols.name(symbol)));
             }
         }
-        m_index = 0;
+
+        TokenList tokens;
+        tokens.resize(token_offset);
+        for (size_t i = 0; i < chunks.size(); i++) {
+            pool.submit([&, i] {
+                const auto [lines, first] = offsets[i];
+                Token* out = tokens.data() + first;
+                for (const Token& token : chunks[i].tokens) {
+                    const Symbol symbol = token.type == TokenType::ident ? symbols[i][token.symbol] : 0;
+                    *out++ = { token.type, token.line + lines, token.value, symbol };
+                }
+                chunks[i].tokens = {};
+            });
+        }
+        pool.wait();
         return tokens;
     }
 
 private:
 
-    [[nodiscard]] std::optional<char> peek(int offset = 0) const {
-        if (m_index + offset >= m_src.length()) {
-            return {};
+    struct Chunk {
+        const char* begin;
+        const char* end;
+        // whether it starts inside a ;* comment
+        bool in_comment = false;
+        TokenList tokens{};
+        Interner symbols{};
+        int newlines = 0;
+        bool ends_in_comment = false;
+        // line of the first character that does not start a token, which ends the chunk early
+        std::optional<int> error_line{};
+    };
+
+    // Splits the source after the first newline following each of count - 1 evenly spaced points
+    [[nodiscard]] std::vector<Chunk> split(const size_t count) const {
+        std::vector<Chunk> chunks;
+        const char* begin = m_src.data();
+        const char* const end = m_src.data() + m_src.size();
+        for (size_t i = 1; i < count; i++) {
+            const char* target = std::max(begin, m_src.data() + m_src.size() * i / count);
+            const void* newline = std::memchr(target, '\n', static_cast<size_t>(end - target));
+            if (newline == nullptr) {
+                break;
+            }
+            const char* split = static_cast<const char*>(newline) + 1;
+            chunks.push_back({ .begin = begin, .end = split });
+            begin = split;
+        }
+        chunks.push_back({ .begin = begin, .end = end });
+        return chunks;
+    }
+
+    static void check(const Chunk& chunk, const int line_offset) {
+        if (chunk.error_line.has_value()) {
+            throw CompileError("Incorrect syntax on line " + std::to_string(chunk.error_line.value() + line_offset));
         }
-        return m_src.at(m_index + offset);
     }
 
-    char consume() {
-        return m_src.at(m_index++);
+    void lex(const ScanIsa isa, Chunk& chunk) const {
+        switch (isa) {
+#if defined(__x86_64__)
+            case ScanIsa::avx2:
+                lex_avx2(chunk);
+                break;
+            case ScanIsa::sse2:
+                lex_with<Sse2Scan>(chunk);
+                break;
+#endif
+            default:
+                lex_with<ScalarScan>(chunk);
+                break;
+        }
+    }
+
+#if defined(__x86_64__)
+    // the scanners only inline into code compiled for AVX2
+    [[gnu::target("avx2")]] void lex_avx2(Chunk& chunk) const {
+        lex_with<Avx2Scan>(chunk);
+    }
+#endif
+
+    template <typename Scan>
+    [[gnu::always_inline]] void lex_with(Chunk& chunk) const {
+        TokenList& tokens = chunk.tokens;
+        // a token every four bytes is dense for real code; the capacity that is not used costs
+        // address space but no memory, as its pages are never touched
+        tokens.reserve(static_cast<size_t>(chunk.end - chunk.begin) / 4);
+        int line_count = 1;
+        const char* p = chunk.begin;
+        const char* const end = chunk.end;
+
+        if (chunk.in_comment) {
+            p = Scan::block_comment_end(p, end, line_count);
+            chunk.ends_in_comment = p == end;
+            p = std::min(p + 2, end);
+        }
+        while (p < end) {
+            switch (char_class(*p)) {
+                case CharClass::blank:
+                    p = Scan::blank_end(p, end, line_count);
+                    break;
+                case CharClass::alpha: {
+                    const char* start = p;
+                    p = Scan::ident_end(p + 1, end);
+                    const std::string_view word(start, p - start);
+                    const Keyword& keyword = keyword_table[keyword_hash(word)];
+                    if (keyword.word == word) {
+                        tokens.push_back({ keyword.type, line_count });
+                    } else {
+                        tokens.push_back({ TokenType::ident, line_count, word, chunk.symbols.intern(word) });
+                    }
+                    break;
+                }
+                case CharClass::digit: {
+                    const char* start = p;
+                    p = Scan::digits_end(p + 1, end);
+                    tokens.push_back({ TokenType::int_lit, line_count, std::string_view(start, p - start) });
+                    break;
+                }
+                case CharClass::semi:
+                    if (p + 1 < end && p[1] == ';') {
+                        p = Scan::line_end(p + 2, end);
+                    } else if (p + 1 < end && p[1] == '*') {
+                        // an unterminated comment runs to the end of the input
+                        p = Scan::block_comment_end(p + 2, end, line_count);
+                        chunk.ends_in_comment = p == end;
+                        p = std::min(p + 2, end);
+                    } else {
+                        tokens.push_back({ TokenType::semi, line_count });
+                        p++;
+                    }
+                    break;
+                case CharClass::punct: {
+                    const unsigned char c = *p;
+                    if (punct_pairs[c].second != '\0' && p + 1 < end && p[1] == punct_pairs[c].second) {
+                        tokens.push_back({ punct_pairs[c].type, line_count });
+                        p += 2;
+                    } else if (c == '&' || c == '|') {
+                        chunk.error_line = line_count;
+                        return;
+                    } else {
+                        tokens.push_back({ punct_types[c], line_count });
+                        p++;
+                    }
+                    break;
+                }
+                case CharClass::invalid:
+                    chunk.error_line = line_count;
+                    return;
+            }
+        }
+        chunk.newlines = line_count - 1;
     }
 
-    const std::string m_src;
-    size_t m_index = 0;
-};
\ No newline at end of file
+    const std::string_view m_src;
+    Interner m_symbols{};
+};